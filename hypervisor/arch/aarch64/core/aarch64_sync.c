@@ -26,6 +26,7 @@
 #include <asm/svccc.h>
 #include <asm/vtimer.h>
 #include <minos/vdev.h>
+#include <asm/insn.h>
 
 extern unsigned char __sync_desc_start;
 extern unsigned char __sync_desc_end;
@@ -216,8 +217,37 @@ static int access_system_reg_handler(gp_regs *reg, uint32_t esr_value)
 	return ret;
 }
 
+static inline unsigned long get_faulting_ipa(unsigned long vaddr)
+{
+	uint64_t hpfar = read_sysreg(HPFAR_EL2);
+	unsigned long ipa;
+
+	ipa = (hpfar & HPFAR_MASK) << (12 - 4);
+	ipa |= vaddr & (~(~PAGE_MASK));
+
+	return ipa;
+}
+
 static int insabort_tfl_handler(gp_regs *reg, uint32_t esr_value)
 {
+	unsigned long ipa;
+	struct esr_iabt *iabt = (struct esr_iabt *)&esr_value;
+	int ifsc = iabt->ifsc & ~FSC_LL_MASK;
+
+	/*
+	 * guest may execute code in the memory which has
+	 * not been populated yet for lazy memory vm, or which
+	 * access flag is cleared by the memory reclaim
+	 */
+	if ((ifsc != FSC_FLT_TRANS) && (ifsc != FSC_FLT_ACCESS))
+		return 0;
+
+	ipa = get_faulting_ipa(read_sysreg(FAR_EL2));
+	if (vm_memory_fault(current_vcpu->vm, ipa,
+				(ifsc == FSC_FLT_TRANS) ? VM_FAULT_TRANS :
+				VM_FAULT_ACCESS, 0) == -ENOMEM)
+		inject_virtual_abort();
+
 	return 0;
 }
 
@@ -231,17 +261,6 @@ static int misaligned_pc_handler(gp_regs *reg, uint32_t esr_value)
 	return 0;
 }
 
-static inline unsigned long get_faulting_ipa(unsigned long vaddr)
-{
-	uint64_t hpfar = read_sysreg(HPFAR_EL2);
-	unsigned long ipa;
-
-	ipa = (hpfar & HPFAR_MASK) << (12 - 4);
-	ipa |= vaddr & (~(~PAGE_MASK));
-
-	return ipa;
-}
-
 static int dataabort_tfl_handler(gp_regs *regs, uint32_t esr_value)
 {
 	int ret;
@@ -252,19 +271,52 @@ static int dataabort_tfl_handler(gp_regs *regs, uint32_t esr_value)
 	int dfsc = dabt->dfsc & ~FSC_LL_MASK;
 
 	vaddr = read_sysreg(FAR_EL2);
-	if (dabt->s1ptw || (dfsc == FSC_FLT_TRANS))
+	if (dabt->s1ptw || (dfsc == FSC_FLT_TRANS) || (dfsc == FSC_FLT_ACCESS))
 		paddr = get_faulting_ipa(vaddr);
 	else
 		paddr = guest_va_to_ipa(vaddr, 1);
 
 	/*
 	 * dfsc contain the fault type of the dataabort
-	 * now only handle translation fault
 	 */
 	switch (dfsc) {
-	case FSC_FLT_PERM:
-	case FSC_FLT_ACCESS:
 	case FSC_FLT_TRANS:
+	case FSC_FLT_ACCESS:
+	case FSC_FLT_PERM:
+		/*
+		 * translation fault may caused by the guest ram
+		 * which is not populated or compressed, access
+		 * fault may caused by the ram which access flag is
+		 * cleared, and permission fault may caused by
+		 * writing the ram which shared with other vm, if
+		 * it is not a ram address then go to the mmio
+		 * emulation
+		 */
+		ret = vm_memory_fault(current_vcpu->vm, paddr,
+				(dfsc == FSC_FLT_TRANS) ? VM_FAULT_TRANS :
+				(dfsc == FSC_FLT_ACCESS) ? VM_FAULT_ACCESS :
+				VM_FAULT_PERM, dabt->write);
+		if (ret == 0)
+			break;
+		else if (ret != -ENOENT) {
+			inject_virtual_abort();
+			break;
+		}
+
+		/*
+		 * no syndrome for ldp/stp and the writeback forms,
+		 * decode the instruction to emulate the access
+		 */
+		if (!dabt->valid) {
+			ret = mmio_insn_emulation(regs, vaddr, paddr);
+			if (ret) {
+				pr_warn("emulate mmio insn fail 0x%x vmid:%d\n",
+						paddr, get_vmid(current_vcpu));
+				inject_virtual_abort();
+			}
+			break;
+		}
+
 		if (dabt->write)
 			value = get_reg_value(regs, dabt->reg);
 
@@ -371,6 +371,7 @@ static void aarch64_system_state_restore(struct vcpu *vcpu, void *c)
 static int aarch64_system_init(struct vmodule *vmodule)
 {
 	vmodule->context_size = sizeof(struct aarch64_system_context);
+	vmodule->dump_size = sizeof(struct aarch64_system_context);
 	vmodule->pdata = NULL;
 	vmodule->state_init = aarch64_system_state_init;
 	vmodule->state_save = aarch64_system_state_save;
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <minos/minos.h>
+#include <minos/vcpu.h>
+#include <minos/vmodule.h>
+#include <minos/sched.h>
+#include <minos/vdev.h>
+#include <minos/vmm.h>
+#include <asm/insn.h>
+
+#define INSN_CACHE_SIZE		8
+
+#define SPSR_MODE_32BIT		(1 << 4)
+#define SPSR_MODE_MASK		0xf
+#define SPSR_MODE_EL1H		0x5
+
+struct insn_cache_entry {
+	unsigned long pc;
+	unsigned long pa;
+	struct ldst_insn li;
+};
+
+/*
+ * the decode result of the recent mmio instructions of
+ * the vcpu, the pa of the pc is part of the key since the
+ * same va may be mapped to other code in another process
+ * of the guest. the guest is not expected to rewrite the
+ * code of a mmio accessor in place
+ */
+struct insn_cache {
+	int nr;
+	int next;
+	struct insn_cache_entry entry[INSN_CACHE_SIZE];
+};
+
+static int insn_vmodule_id = INVAILD_MODULE_ID;
+
+static unsigned long insn_get_reg(gp_regs *regs, int index)
+{
+	/* xzr for rt and rt2 */
+	if (index == 31)
+		return 0;
+
+	return get_reg_value(regs, index);
+}
+
+static void insn_set_reg(gp_regs *regs, int index, unsigned long value)
+{
+	if (index != 31)
+		set_reg_value(regs, index, value);
+}
+
+static inline int insn_use_sp_el1(gp_regs *regs)
+{
+	return ((regs->spsr_elx & SPSR_MODE_MASK) == SPSR_MODE_EL1H);
+}
+
+static unsigned long insn_get_base(gp_regs *regs, int index)
+{
+	if (index != 31)
+		return get_reg_value(regs, index);
+
+	if (insn_use_sp_el1(regs))
+		return read_sysreg(SP_EL1);
+	else
+		return read_sysreg(SP_EL0);
+}
+
+static void insn_set_base(gp_regs *regs, int index, unsigned long value)
+{
+	if (index != 31)
+		set_reg_value(regs, index, value);
+	else if (insn_use_sp_el1(regs))
+		write_sysreg(value, SP_EL1);
+	else
+		write_sysreg(value, SP_EL0);
+}
+
+static unsigned long insn_extend(struct ldst_insn *li, unsigned long value)
+{
+	int shift = 64 - li->size * 8;
+
+	if (li->sign)
+		value = (unsigned long)((long)(value << shift) >> shift);
+	else
+		value = (value << shift) >> shift;
+
+	if (!li->sf)
+		value &= 0xffffffff;
+
+	return value;
+}
+
+static int mmio_insn_fetch(unsigned long pc, struct ldst_insn *li)
+{
+	struct insn_cache *cache;
+	struct insn_cache_entry *entry;
+	unsigned long pa;
+	uint32_t insn;
+	int i, ret;
+
+	cache = (struct insn_cache *)get_vmodule_data_by_id(current_vcpu,
+			insn_vmodule_id);
+
+	/* the pc may be unmapped by another vcpu of the guest */
+	if (guest_va_translate(pc, 1, &pa))
+		return -EFAULT;
+
+	for (i = 0; i < cache->nr; i++) {
+		entry = &cache->entry[i];
+		if ((entry->pc == pc) && (entry->pa == pa)) {
+			*li = entry->li;
+			return 0;
+		}
+	}
+
+	ret = copy_from_guest(&insn, pc, sizeof(uint32_t));
+	if (ret)
+		return ret;
+
+	ret = decode_ldst_insn(insn, li);
+	if (ret) {
+		pr_warn("unsupported mmio insn 0x%x at 0x%p\n", insn, pc);
+		return ret;
+	}
+
+	entry = &cache->entry[cache->next];
+	entry->pc = pc;
+	entry->pa = pa;
+	entry->li = *li;
+	cache->next = (cache->next + 1) % INSN_CACHE_SIZE;
+	if (cache->nr < INSN_CACHE_SIZE)
+		cache->nr++;
+
+	return 0;
+}
+
+/*
+ * emulate the mmio access by decoding the instruction, the
+ * elr_elx has already been moved to the next instruction
+ */
+int mmio_insn_emulation(gp_regs *regs, unsigned long vaddr,
+		unsigned long paddr)
+{
+	struct ldst_insn li;
+	unsigned long base, addr, value;
+	int i, ret, rt;
+
+	if (regs->spsr_elx & SPSR_MODE_32BIT)
+		return -EINVAL;
+
+	ret = mmio_insn_fetch(regs->elr_elx - 4, &li);
+	if (ret)
+		return ret;
+
+	base = insn_get_base(regs, li.rn);
+
+	/*
+	 * the fault address may be the second register of
+	 * the pair, start from the address of the first one
+	 */
+	if (li.pair) {
+		addr = li.post ? base : base + li.offset;
+		if ((vaddr - addr) >= (2 * li.size))
+			return -EINVAL;
+		paddr -= vaddr - addr;
+	}
+
+	for (i = 0; i <= li.pair; i++) {
+		rt = i ? li.rt2 : li.rt;
+		if (!li.load) {
+			value = insn_get_reg(regs, rt);
+			value = (value << (64 - li.size * 8)) >>
+					(64 - li.size * 8);
+		}
+
+		ret = vdev_mmio_emulation(regs, !li.load,
+				paddr + i * li.size, &value);
+		if (ret)
+			return ret;
+
+		if (li.load)
+			insn_set_reg(regs, rt, insn_extend(&li, value));
+	}
+
+	if (li.wback)
+		insn_set_base(regs, li.rn, base + li.offset);
+
+	return 0;
+}
+
+static void insn_state_init(struct vcpu *vcpu, void *context)
+{
+	memset(context, 0, sizeof(struct insn_cache));
+}
+
+static int insn_vmodule_init(struct vmodule *vmodule)
+{
+	vmodule->context_size	= sizeof(struct insn_cache);
+	vmodule->pdata		= NULL;
+	vmodule->state_init	= insn_state_init;
+	vmodule->state_reset	= insn_state_init;
+	insn_vmodule_id		= vmodule->id;
+
+	return 0;
+}
+
+MINOS_MODULE_DECLARE(mmio_insn, "mmio-insn", (void *)insn_vmodule_init);
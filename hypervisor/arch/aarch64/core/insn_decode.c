@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <minos/types.h>
+#include <minos/string.h>
+#include <minos/errno.h>
+#include <asm/ldst_insn.h>
+
+/*
+ * the decoder does not depend on the vcpu, so it can also
+ * be built by the host test in hypervisor/tests
+ */
+
+static inline int64_t sign_extend(uint32_t value, int bits)
+{
+	return ((int64_t)value << (64 - bits)) >> (64 - bits);
+}
+
+static int decode_ldst_pair(uint32_t insn, struct ldst_insn *li)
+{
+	uint32_t opc = insn >> 30;
+	uint32_t idx = (insn >> 23) & 0x3;
+
+	li->pair = 1;
+	li->load = (insn >> 22) & 0x1;
+	li->rt2 = (insn >> 10) & 0x1f;
+
+	/* stgp and the reserved ldnpsw are not supported */
+	if ((opc == 3) || ((opc == 1) && (!li->load || idx == 0)))
+		return -EINVAL;
+
+	if (li->load && (li->rt == li->rt2))
+		return -EINVAL;
+
+	li->size = (opc == 2) ? 8 : 4;
+	li->sf = (opc != 0);
+	li->sign = (opc == 1);
+	li->offset = sign_extend((insn >> 15) & 0x7f, 7) * li->size;
+
+	/* 0 - no allocate, 1 - post index, 2 - offset, 3 - pre index */
+	li->wback = idx & 0x1;
+	li->post = (idx == 1);
+
+	return 0;
+}
+
+static int decode_ldst_single(uint32_t insn, struct ldst_insn *li)
+{
+	uint32_t size = insn >> 30;
+	uint32_t opc = (insn >> 22) & 0x3;
+
+	if ((insn & 0x3f000000) == 0x39000000) {
+		/* unsigned immediate offset */
+		li->offset = (int64_t)((insn >> 10) & 0xfff) << size;
+	} else if (insn & (1 << 21)) {
+		/*
+		 * register offset, the address is not needed since
+		 * there is no writeback, other encodings here are the
+		 * atomic memory operations
+		 */
+		if ((((insn >> 10) & 0x3) != 2) || !(insn & (1 << 14)))
+			return -EINVAL;
+	} else {
+		/* 0 - ldur, 1 - post index, 2 - ldtr, 3 - pre index */
+		li->offset = sign_extend((insn >> 12) & 0x1ff, 9);
+		switch ((insn >> 10) & 0x3) {
+		case 1:
+			li->post = 1;
+			/* fall through */
+		case 3:
+			li->wback = 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	switch (opc) {
+	case 0:
+	case 1:
+		li->load = opc;
+		li->sf = (size == 3);
+		break;
+	case 2:
+		/* prfm */
+		if (size == 3)
+			return -EINVAL;
+		li->load = 1;
+		li->sign = 1;
+		li->sf = 1;
+		break;
+	default:
+		if (size >= 2)
+			return -EINVAL;
+		li->load = 1;
+		li->sign = 1;
+		break;
+	}
+
+	li->size = 1 << size;
+
+	return 0;
+}
+
+int decode_ldst_insn(uint32_t insn, struct ldst_insn *li)
+{
+	int ret;
+
+	memset(li, 0, sizeof(struct ldst_insn));
+	li->rt = insn & 0x1f;
+	li->rn = (insn >> 5) & 0x1f;
+
+	/* only the general purpose register forms, V is 0 */
+	if ((insn & 0x3e000000) == 0x28000000)
+		ret = decode_ldst_pair(insn, li);
+	else if ((insn & 0x3e000000) == 0x38000000)
+		ret = decode_ldst_single(insn, li);
+	else
+		ret = -EINVAL;
+
+	if (ret)
+		return ret;
+
+	/* the writeback to a loaded register is unpredictable */
+	if (li->wback && li->load && (li->rn != 31) &&
+			((li->rn == li->rt) || (li->pair && li->rn == li->rt2)))
+		return -EINVAL;
+
+	return 0;
+}
@@ -90,6 +90,7 @@ static void vfp_state_restore(struct vcpu *vcpu, void *context)
 static int vfp_vmodule_init(struct vmodule *vmodule)
 {
 	vmodule->context_size	= sizeof(struct vfp_context);
+	vmodule->dump_size	= sizeof(struct vfp_context);
 	vmodule->pdata		= NULL;
 	vmodule->state_init	= vfp_state_init;
 	vmodule->state_save	= vfp_state_save;
@@ -179,14 +179,34 @@ static void vmsa_state_resume(struct vcpu *vcpu, void *context)
 	vmsa_state_init(vcpu, context);
 }
 
+static void vmsa_state_dump(struct vcpu *vcpu, void *context, void *buf)
+{
+	memcpy(buf, context, sizeof(struct vmsa_context));
+}
+
+static void vmsa_state_load(struct vcpu *vcpu, void *context, void *buf)
+{
+	struct vmsa_context *c = (struct vmsa_context *)context;
+	uint64_t vtcr_el2 = c->vtcr_el2;
+	uint64_t vttbr_el2 = c->vttbr_el2;
+
+	/* vtcr and vttbr belong to the stage-2 table of this vm */
+	memcpy(c, buf, sizeof(struct vmsa_context));
+	c->vtcr_el2 = vtcr_el2;
+	c->vttbr_el2 = vttbr_el2;
+}
+
 static int vmsa_vmodule_init(struct vmodule *vmodule)
 {
 	vmodule->context_size = sizeof(struct vmsa_context);
+	vmodule->dump_size = sizeof(struct vmsa_context);
 	vmodule->pdata = NULL;
 	vmodule->state_init = vmsa_state_init;
 	vmodule->state_save = vmsa_state_save;
 	vmodule->state_restore = vmsa_state_restore;
 	vmodule->state_resume = vmsa_state_resume;
+	vmodule->state_dump = vmsa_state_dump;
+	vmodule->state_load = vmsa_state_load;
 
 	return 0;
 }
@@ -263,15 +263,69 @@ static inline int vtimer_phy_mem_handler(gp_regs *regs, int read,
 	return 0;
 }
 
+/*
+ * the timer_list and the vcpu pointer can not be exported
+ * only the register value and the virtual count are saved
+ */
+struct vtimer_state {
+	uint32_t phy_ctl;
+	uint32_t phy_cval;
+	uint32_t virt_ctl;
+	uint32_t virt_cval;
+	uint64_t vcount;
+};
+
+static void vtimer_state_dump(struct vcpu *vcpu, void *context, void *buf)
+{
+	struct vtimer_context *c = (struct vtimer_context *)context;
+	struct vtimer_state *s = (struct vtimer_state *)buf;
+
+	s->phy_ctl = c->phy_timer.cnt_ctl;
+	s->phy_cval = c->phy_timer.cnt_cval;
+	s->virt_ctl = c->virt_timer.cnt_ctl;
+	s->virt_cval = c->virt_timer.cnt_cval;
+	s->vcount = get_sys_ticks() - c->offset;
+}
+
+static void vtimer_state_load(struct vcpu *vcpu, void *context, void *buf)
+{
+	struct vtimer_context *c = (struct vtimer_context *)context;
+	struct vtimer_state *s = (struct vtimer_state *)buf;
+	struct vtimer *vtimer = &c->phy_timer;
+
+	/*
+	 * all the vcpus share the same offset, vcpu0 is
+	 * loaded first and update the offset of the vm so
+	 * the guest will see the counter continue from
+	 * where the snapshot is taken
+	 */
+	if (get_vcpu_id(vcpu) == 0)
+		vcpu->vm->time_offset = get_sys_ticks() - s->vcount;
+	c->offset = vcpu->vm->time_offset;
+
+	c->virt_timer.cnt_ctl = s->virt_ctl;
+	c->virt_timer.cnt_cval = s->virt_cval;
+
+	vtimer->cnt_ctl = s->phy_ctl;
+	vtimer->cnt_cval = s->phy_cval;
+	if ((vtimer->cnt_ctl & CNT_CTL_ENABLE) &&
+			!(vtimer->cnt_ctl & CNT_CTL_IMASK))
+		mod_timer(&vtimer->timer,
+			ticks_to_ns(vtimer->cnt_cval + c->offset));
+}
+
 static int vtimer_vmodule_init(struct vmodule *vmodule)
 {
 	vmodule->context_size = sizeof(struct vtimer_context);
+	vmodule->dump_size = sizeof(struct vtimer_state);
 	vmodule->pdata = NULL;
 	vmodule->state_init = vtimer_state_init;
 	vmodule->state_save = vtimer_state_save;
 	vmodule->state_restore = vtimer_state_restore;
 	vmodule->state_deinit = vtimer_state_deinit;
 	vmodule->state_reset = vtimer_state_deinit;
+	vmodule->state_dump = vtimer_state_dump;
+	vmodule->state_load = vtimer_state_load;
 	vtimer_vmodule_id = vmodule->id;
 
 	return 0;
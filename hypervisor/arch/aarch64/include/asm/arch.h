@@ -4,6 +4,7 @@
 #include <minos/types.h>
 #include <asm/aarch64_helper.h>
 #include <config/config.h>
+#include <minos/errno.h>
 
 struct vcpu;
 struct vm;
@@ -260,6 +261,31 @@ static inline unsigned long guest_va_to_pa(unsigned long va, int read)
 	return pa;
 }
 
+/*
+ * same as guest_va_to_pa but check PAR_EL1.F, return -EFAULT
+ * if the stage 1 or the stage 2 translation of the va faults
+ */
+static inline int guest_va_translate(unsigned long va,
+		int read, unsigned long *pa)
+{
+	uint64_t par, tmp = read_sysreg64(PAR_EL1);
+
+	if (read)
+		asm volatile ("at s12e1r, %0;" : : "r" (va));
+	else
+		asm volatile ("at s12e1w, %0;" : : "r" (va));
+	isb();
+	par = read_sysreg64(PAR_EL1);
+	write_sysreg64(tmp, PAR_EL1);
+
+	if (par & 0x1)
+		return -EFAULT;
+
+	*pa = (par & 0x0000fffffffff000) | (va & PAGE_MASK);
+
+	return 0;
+}
+
 static inline unsigned long guest_va_to_ipa(unsigned long va, int read)
 {
 	uint64_t pa, tmp = read_sysreg64(PAR_EL1);
@@ -293,6 +319,7 @@ static inline void flush_icache_all(void)
 
 void flush_dcache_range(unsigned long addr, size_t size);
 void inv_dcache_range(unsigned long addr, size_t size);
+void zero_dcache_range(unsigned long addr, size_t size);
 void flush_cache_all(void);
 void flush_dcache_all(void);
 void inv_dcache_all(void);
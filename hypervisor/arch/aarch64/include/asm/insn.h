@@ -0,0 +1,11 @@
+#ifndef _MINOS_ASM_INSN_H_
+#define _MINOS_ASM_INSN_H_
+
+#include <minos/types.h>
+#include <asm/arch.h>
+#include <asm/ldst_insn.h>
+
+int mmio_insn_emulation(gp_regs *regs, unsigned long vaddr,
+		unsigned long paddr);
+
+#endif
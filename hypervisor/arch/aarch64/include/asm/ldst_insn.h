@@ -0,0 +1,27 @@
+#ifndef _MINOS_ASM_LDST_INSN_H_
+#define _MINOS_ASM_LDST_INSN_H_
+
+#include <minos/types.h>
+
+/*
+ * decoded A64 integer load/store instruction, used to
+ * emulate the mmio access when the ESR_EL2.ISV is not
+ * set, for example ldp/stp or the writeback forms
+ */
+struct ldst_insn {
+	uint8_t rt;
+	uint8_t rt2;
+	uint8_t rn;
+	uint8_t size;		/* access size in bytes */
+	uint8_t load;
+	uint8_t sign;		/* sign extend the loaded value */
+	uint8_t sf;		/* the destination is a X register */
+	uint8_t pair;
+	uint8_t wback;
+	uint8_t post;		/* post index, address is rn */
+	int64_t offset;		/* immediate offset in bytes */
+};
+
+int decode_ldst_insn(uint32_t insn, struct ldst_insn *li);
+
+#endif
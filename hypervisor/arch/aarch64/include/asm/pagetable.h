@@ -25,6 +25,8 @@
 #define __GVM_PGD_PAGE_ALIGN		(2)
 
 #define __PAGETABLE_ATTR_MASK		(0x0000ffffffe00000UL)
+#define __PAGETABLE_PAGE_MASK		(0x0000fffffffff000UL)
+#define __PAGETABLE_ATTR_AF		(TT_S2_ATTR_AF)
 
 #define __VM_DESC_HOST_TABLE	(TT_S1_ATTR_TABLE)
 #define __VM_DESC_HOST_BLOCK	\
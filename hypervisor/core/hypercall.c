@@ -22,6 +22,10 @@
 #include <minos/virq.h>
 #include <minos/virtio.h>
 #include <minos/vmcs.h>
+#include <minos/mem_merge.h>
+#include <minos/mem_reclaim.h>
+#include <minos/mem_wss.h>
+#include <minos/trace.h>
 
 static int vcpu_hvc_handler(gp_regs *c, uint32_t id, uint64_t *args)
 {
@@ -45,6 +49,22 @@ static int vm_hvc_handler(gp_regs *c, uint32_t id, uint64_t *args)
 		HVC_RET1(c, 0);
 		break;
 
+	case HVC_VM_VMCS_ACK:
+		vmid = vcpu_vmcs_ack(vm, (int)args[1]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_MMIO_COALESCE:
+		vmid = vm_mmio_coalesce(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_DESTROY_STATE:
+		/* 1 means the vm is still being released */
+		vmid = vm_release_pending((int)args[0]);
+		HVC_RET1(c, vmid);
+		break;
+
 	case HVC_VM_RESTART:
 		vmid = vm_reset((int)args[0], (void *)c);
 		HVC_RET1(c, vmid);
@@ -90,6 +110,97 @@ static int vm_hvc_handler(gp_regs *c, uint32_t id, uint64_t *args)
 		vmid = vm_create_vmcs_irq(vm, (int)args[1]);
 		HVC_RET1(c, vmid);
 		break;
+
+	case HVC_VM_RELEASE_MEMORY:
+		if (!vm)
+			HVC_RET1(c, -ENOENT);
+		vmid = vm_release_memory(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_POPULATE_MEMORY:
+		if (!vm)
+			HVC_RET1(c, -ENOENT);
+		vmid = vm_populate_memory(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_DIRTY_LOG:
+		if (!vm)
+			HVC_RET1(c, -ENOENT);
+		if (args[1])
+			vmid = vm_dirty_log_start(vm);
+		else
+			vmid = vm_dirty_log_stop(vm);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_GET_DIRTY_LOG:
+		if (!vm)
+			HVC_RET1(c, -ENOENT);
+		vmid = vm_get_dirty_log(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_GET_MEM_MAP:
+		if (!vm)
+			HVC_RET1(c, -ENOENT);
+		vmid = vm_get_mem_map(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_READ_BLOCK:
+		if (!vm)
+			HVC_RET1(c, -ENOENT);
+		vmid = mem_reclaim_read_block(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_PAUSE:
+		vmid = vm_pause(vm);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_UNPAUSE:
+		vmid = vm_unpause(vm);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_SAVE_STATE:
+		vmid = vm_save_state(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_RESTORE_STATE:
+		vmid = vm_restore_state(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_CLONE:
+		vmid = vm_clone(vm, get_vm_by_id((int)args[1]));
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_MEM_LIMIT:
+		if (!vm)
+			HVC_RET1(c, -ENOENT);
+		vmid = mem_reclaim_set_limit(vm, args[1]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_WSS_CONFIG:
+		if (!vm)
+			HVC_RET1(c, -ENOENT);
+		vmid = mem_wss_config(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
+
+	case HVC_VM_GET_WSS:
+		if (!vm)
+			HVC_RET1(c, -ENOENT);
+		vmid = mem_wss_get_stat(vm, args[1], args[2]);
+		HVC_RET1(c, vmid);
+		break;
 	default:
 		pr_error("unsupport vm hypercall");
 		break;
@@ -107,6 +218,10 @@ static int misc_hvc_handler(gp_regs *c, uint32_t id, uint64_t *args)
 {
 	int ret;
 	unsigned long gbase = 0, hbase = 0;
+	size_t size;
+	struct mem_merge_stat stat;
+	struct mem_reclaim_stat rstat;
+	struct zero_pool_stat zstat;
 	struct vm *vm = get_vm_by_id((int)args[0]);
 
 	switch (id) {
@@ -122,6 +237,39 @@ static int misc_hvc_handler(gp_regs *c, uint32_t id, uint64_t *args)
 		ret = vm_create_host_vdev(vm);
 		HVC_RET1(c, ret);
 		break;
+	case HVC_MISC_MEM_MERGE_CONFIG:
+		ret = mem_merge_config((int)args[1], args[2], args[3]);
+		HVC_RET1(c, ret);
+		break;
+	case HVC_MISC_MEM_MERGE_STAT:
+		mem_merge_get_stat(&stat);
+		HVC_RET4(c, 0, stat.shared_blocks, stat.sharing_blocks -
+				stat.shared_blocks, stat.cow_breaks);
+		break;
+	case HVC_MISC_MEM_RECLAIM_STAT:
+		/* pool size, compress ratio in percent, fault time in us */
+		mem_reclaim_get_stat(&rstat);
+		HVC_RET4(c, 0, rstat.pool_size,
+			rstat.stored_size ? rstat.orig_size * 100 /
+			rstat.stored_size : 0, rstat.faults ?
+			rstat.fault_time / rstat.faults / 1000 : 0);
+		break;
+	case HVC_MISC_MEM_ZERO_STAT:
+		/* pool blocks, hits and misses */
+		zero_pool_get_stat(&zstat);
+		HVC_RET4(c, 0, zstat.nr_blocks, zstat.hits, zstat.misses);
+		break;
+	case HVC_MISC_VIRTIO_DOORBELL:
+		/* bind a hvm virq to the queue notify of the device */
+		ret = virtio_mmio_doorbell(vm, args[1],
+				(int)args[2], (int)args[3]);
+		HVC_RET1(c, ret);
+		break;
+	case HVC_MISC_TRACE:
+		/* enable or disable the trace, return the rings */
+		ret = trace_config((int)args[1], &hbase, &size);
+		HVC_RET3(c, ret, hbase, size);
+		break;
 	default:
 		break;
 	}
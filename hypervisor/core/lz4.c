@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <minos/types.h>
+#include <minos/errno.h>
+#include <minos/string.h>
+#include <minos/lz4.h>
+
+/*
+ * the block format of lz4, each sequence is a token, the
+ * literals and a match which copy from the decoded data
+ * by the offset, the last sequence only has literals
+ *
+ * the input is limited to 64K so the position can be
+ * saved in the hash table as 16 bit
+ */
+#define LZ4_MIN_MATCH		(4)
+#define LZ4_LAST_LITERALS	(5)
+#define LZ4_MFLIMIT		(12)
+#define LZ4_HASH_LOG		(10)
+#define LZ4_MAX_INPUT		(65535)
+#define LZ4_RUN_MASK		(15)
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t lz4_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *lz4_write_length(uint8_t *op, int len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+static uint8_t *lz4_write_literals(uint8_t *op, uint8_t *oend,
+		const uint8_t *anchor, int len)
+{
+	uint8_t *token = op;
+
+	if (op + 1 + len / 255 + 1 + len > oend)
+		return NULL;
+
+	op++;
+	if (len >= LZ4_RUN_MASK) {
+		*token = LZ4_RUN_MASK << 4;
+		op = lz4_write_length(op, len - LZ4_RUN_MASK);
+	} else
+		*token = len << 4;
+
+	memcpy(op, anchor, len);
+
+	return op + len;
+}
+
+/*
+ * return the size of the compressed data, 0 means the data
+ * can not be compressed into the dest buffer
+ */
+int lz4_compress(const void *source, int size, void *dest, int max)
+{
+	const uint8_t *src = source, *ip = src, *anchor = src, *ref;
+	const uint8_t *end = src + size;
+	const uint8_t *mflimit = end - LZ4_MFLIMIT;
+	const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+	uint8_t *op = dest, *oend = op + max, *token;
+	uint16_t table[1 << LZ4_HASH_LOG];
+	uint32_t h;
+	int len, lit, offset;
+
+	if ((size < 0) || (size > LZ4_MAX_INPUT))
+		return -EINVAL;
+
+	if (size < LZ4_MFLIMIT + 1)
+		goto last;
+
+	memset(table, 0, sizeof(table));
+	ip++;
+
+	while (ip < mflimit) {
+		h = lz4_hash(lz4_read32(ip));
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (lz4_read32(ref) != lz4_read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		/* the match may start before the current position */
+		while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+			ip--;
+			ref--;
+		}
+
+		len = LZ4_MIN_MATCH;
+		while ((ip + len < matchlimit) && (ip[len] == ref[len]))
+			len++;
+
+		lit = ip - anchor;
+		token = op;
+		op = lz4_write_literals(op, oend, anchor, lit);
+		if (!op || (op + 2 + 1 + len / 255 > oend))
+			return 0;
+
+		offset = ip - ref;
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+
+		len -= LZ4_MIN_MATCH;
+		if (len >= LZ4_RUN_MASK) {
+			*token |= LZ4_RUN_MASK;
+			op = lz4_write_length(op, len - LZ4_RUN_MASK);
+		} else
+			*token |= len;
+
+		ip += len + LZ4_MIN_MATCH;
+		anchor = ip;
+
+		if (ip < mflimit)
+			table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - src;
+	}
+
+last:
+	op = lz4_write_literals(op, oend, anchor, end - anchor);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *)dest;
+}
+
+static const uint8_t *lz4_read_length(const uint8_t *ip,
+		const uint8_t *iend, int *len)
+{
+	uint8_t c;
+
+	do {
+		if (ip >= iend)
+			return NULL;
+		c = *ip++;
+		*len += c;
+	} while (c == 255);
+
+	return ip;
+}
+
+/*
+ * return the size of the decompressed data or -EINVAL if
+ * the data is corrupted or bigger than the dest buffer
+ */
+int lz4_decompress(const void *source, int size, void *dest, int max)
+{
+	const uint8_t *ip = source, *iend = ip + size;
+	uint8_t *op = dest, *oend = op + max, *ref;
+	int len, token, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == LZ4_RUN_MASK) {
+			ip = lz4_read_length(ip, iend, &len);
+			if (!ip)
+				return -EINVAL;
+		}
+
+		if ((len > iend - ip) || (len > oend - op))
+			return -EINVAL;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* the last sequence does not have a match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EINVAL;
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((offset == 0) || (offset > op - (uint8_t *)dest))
+			return -EINVAL;
+
+		len = token & LZ4_RUN_MASK;
+		if (len == LZ4_RUN_MASK) {
+			ip = lz4_read_length(ip, iend, &len);
+			if (!ip)
+				return -EINVAL;
+		}
+
+		len += LZ4_MIN_MATCH;
+		if (len > oend - op)
+			return -EINVAL;
+
+		/* the match may overlap with the output */
+		ref = op - offset;
+		while (len--)
+			*op++ = *ref++;
+	}
+
+	return op - (uint8_t *)dest;
+}
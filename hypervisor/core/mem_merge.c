@@ -0,0 +1,747 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <minos/minos.h>
+#include <minos/vm.h>
+#include <minos/vmm.h>
+#include <minos/mm.h>
+#include <minos/bitops.h>
+#include <minos/time.h>
+#include <minos/mem_merge.h>
+
+/*
+ * merge the identical mem_block of the guest vms, the
+ * guest memory is mapped as 2M block in stage 2, so the
+ * merge is based on the mem_block, a block can be shared
+ * only when the whole 2M content is same
+ *
+ * the scanner run in the idle loop of the pcpu, the block
+ * will be hashed twice, if the hash value not changed, it
+ * will be compared with the shared block which has the
+ * same hash value, if no such block, the block will be
+ * recorded as a candidate, when another block has the same
+ * hash value with the candidate, both of them will be
+ * merged, the shared block is mapped as read only, when
+ * the vm write to it, the block will be copied to a new
+ * block for the vm
+ */
+
+#define MERGE_HASH_SIZE		(64)
+#define MERGE_HASH_MASK		(MERGE_HASH_SIZE - 1)
+#define MERGE_SAMPLE_WORDS	(16)
+#define MERGE_SCAN_INTERVAL	(100)
+#define MERGE_SCAN_BATCH	(4)
+
+struct merge_block {
+	uint32_t hash;
+	int refcount;
+	struct mem_block *block;
+	struct list_head list;
+};
+
+struct merge_candidate {
+	struct vm *vm;
+	int index;
+	uint32_t hash;
+};
+
+static struct list_head merge_table[MERGE_HASH_SIZE];
+static struct merge_candidate merge_candidates[MERGE_HASH_SIZE];
+static struct vm *merge_vms[CONFIG_MAX_VM];
+static struct mem_merge_stat merge_stat;
+static DEFINE_SPIN_LOCK(merge_lock);
+
+static int merge_enabled = 1;
+static uint32_t merge_scan_interval = MERGE_SCAN_INTERVAL;
+static uint32_t merge_scan_batch = MERGE_SCAN_BATCH;
+static uint64_t merge_next_scan;
+static unsigned long merge_scanning;
+static int merge_cursor_vm;
+static int merge_cursor_index;
+
+static inline unsigned long merge_block_ipa(struct vm *vm, int index)
+{
+	return vm->mm.mem_base + ((unsigned long)index << MEM_BLOCK_SHIFT);
+}
+
+/*
+ * only sample the head of each page in the block, the
+ * hash value is only used to find the block which may be
+ * same, the whole block will be compared before merge
+ */
+static uint32_t merge_hash_block(unsigned long pa)
+{
+	int i, j;
+	uint64_t *p;
+	uint32_t hash = 2166136261U;
+
+	create_host_mapping(pa, pa, MEM_BLOCK_SIZE, VM_NORMAL);
+
+	for (i = 0; i < MEM_BLOCK_SIZE; i += PAGE_SIZE) {
+		p = (uint64_t *)(pa + i);
+		for (j = 0; j < MERGE_SAMPLE_WORDS; j++) {
+			hash ^= (uint32_t)(p[j] ^ (p[j] >> 32));
+			hash *= 16777619U;
+		}
+	}
+
+	destroy_host_mapping(pa, MEM_BLOCK_SIZE);
+
+	return hash;
+}
+
+static int merge_same_block(unsigned long pa1, unsigned long pa2)
+{
+	int i, same = 1;
+	uint64_t *p1 = (uint64_t *)pa1;
+	uint64_t *p2 = (uint64_t *)pa2;
+
+	create_host_mapping(pa1, pa1, MEM_BLOCK_SIZE, VM_NORMAL);
+	create_host_mapping(pa2, pa2, MEM_BLOCK_SIZE, VM_NORMAL);
+
+	for (i = 0; i < (MEM_BLOCK_SIZE / sizeof(uint64_t)); i++) {
+		if (p1[i] != p2[i]) {
+			same = 0;
+			break;
+		}
+	}
+
+	destroy_host_mapping(pa1, MEM_BLOCK_SIZE);
+	destroy_host_mapping(pa2, MEM_BLOCK_SIZE);
+
+	return same;
+}
+
+static void merge_copy_block(unsigned long dst, unsigned long src)
+{
+	create_host_mapping(dst, dst, MEM_BLOCK_SIZE, VM_NORMAL);
+	create_host_mapping(src, src, MEM_BLOCK_SIZE, VM_NORMAL);
+
+	memcpy((void *)dst, (void *)src, MEM_BLOCK_SIZE);
+
+	destroy_host_mapping(dst, MEM_BLOCK_SIZE);
+	destroy_host_mapping(src, MEM_BLOCK_SIZE);
+}
+
+static struct merge_block *merge_find_block(uint32_t hash, unsigned long pa)
+{
+	struct merge_block *mb;
+
+	list_for_each_entry(mb, &merge_table[hash & MERGE_HASH_MASK], list) {
+		if (mb->block->phy_base == pa)
+			return mb;
+	}
+
+	return NULL;
+}
+
+static void merge_unpin_block(struct merge_block *mb)
+{
+	if (--mb->refcount > 0)
+		return;
+
+	list_del(&mb->list);
+	release_mem_block(mb->block);
+	free(mb);
+	merge_stat.shared_blocks--;
+}
+
+static void merge_put_block(struct merge_block *mb)
+{
+	merge_stat.sharing_blocks--;
+	merge_unpin_block(mb);
+}
+
+/*
+ * map the block of the vm to the shared block, the block
+ * of the vm will be write protected before compare, so the
+ * content will not be changed during the merge
+ */
+static int merge_to_block(struct vm *vm, int index,
+		unsigned long pa, struct merge_block *mb)
+{
+	struct mem_block *block;
+	struct mm_struct *mm = &vm->mm;
+	unsigned long ipa = merge_block_ipa(vm, index);
+	unsigned long new = mb->block->phy_base;
+
+	if (vm_remap_block(vm, ipa, pa, pa, VM_RO))
+		return -EAGAIN;
+
+	if (!merge_same_block(pa, new)) {
+		vm_remap_block(vm, ipa, pa, pa, 0);
+		return -EINVAL;
+	}
+
+	/* the block is releasing by the vm */
+	block = vm_detach_block(vm, pa);
+	if (!block)
+		return -EAGAIN;
+
+	if (vm_remap_block(vm, ipa, pa, new, VM_RO)) {
+		vm_attach_block(vm, block);
+		return -EAGAIN;
+	}
+
+	release_mem_block(block);
+	set_bit(index, mm->merge_bitmap);
+	mb->refcount++;
+	merge_stat.sharing_blocks++;
+	merge_stat.merged++;
+
+	return 0;
+}
+
+/*
+ * move the block of the candidate to the shared table, after
+ * this the block is owned by the table and mapped read only
+ */
+static struct merge_block *merge_promote_candidate(struct merge_candidate *mc)
+{
+	unsigned long pa, ipa;
+	struct mem_block *block;
+	struct merge_block *mb;
+	struct vm *vm = mc->vm;
+	struct mm_struct *mm = &vm->mm;
+
+	if (mm->dirty_bitmap || !test_bit(mc->index, mm->block_bitmap) ||
+			test_bit(mc->index, mm->merge_bitmap))
+		return NULL;
+
+	ipa = merge_block_ipa(vm, mc->index);
+	pa = get_vm_memblock_address(vm, ipa);
+	if (!pa)
+		return NULL;
+
+	mb = zalloc(sizeof(struct merge_block));
+	if (!mb)
+		return NULL;
+
+	if (vm_remap_block(vm, ipa, pa, pa, VM_RO))
+		goto out;
+
+	/* the content may changed after the candidate recorded */
+	if (merge_hash_block(pa) != mc->hash) {
+		vm_remap_block(vm, ipa, pa, pa, 0);
+		goto out;
+	}
+
+	block = vm_detach_block(vm, pa);
+	if (!block)
+		goto out;
+
+	mb->hash = mc->hash;
+	mb->refcount = 1;
+	mb->block = block;
+	list_add_tail(&merge_table[mb->hash & MERGE_HASH_MASK], &mb->list);
+
+	set_bit(mc->index, mm->merge_bitmap);
+	mm->merge_hash[mc->index] = mc->hash;
+	merge_stat.shared_blocks++;
+	merge_stat.sharing_blocks++;
+
+	return mb;
+out:
+	free(mb);
+	return NULL;
+}
+
+static void merge_scan_block(struct vm *vm, int index)
+{
+	uint32_t hash;
+	unsigned long pa;
+	struct merge_block *mb;
+	struct merge_candidate *mc;
+	struct mm_struct *mm = &vm->mm;
+
+	/* the dirty log need the page mapping of the vm */
+	if (mm->dirty_bitmap || !test_bit(index, mm->block_bitmap) ||
+			test_bit(index, mm->merge_bitmap))
+		return;
+
+	pa = get_vm_memblock_address(vm, merge_block_ipa(vm, index));
+	if (!pa)
+		return;
+
+	merge_stat.scanned++;
+	hash = merge_hash_block(pa);
+
+	/*
+	 * the block is changed since last scan, it may be
+	 * changed frequently, do not merge it this time
+	 */
+	if (hash != mm->merge_hash[index]) {
+		mm->merge_hash[index] = hash;
+		return;
+	}
+
+	list_for_each_entry(mb, &merge_table[hash & MERGE_HASH_MASK], list) {
+		if ((mb->hash == hash) && !merge_to_block(vm, index, pa, mb))
+			return;
+	}
+
+	mc = &merge_candidates[hash & MERGE_HASH_MASK];
+	if (mc->vm && (mc->hash == hash) &&
+			((mc->vm != vm) || (mc->index != index))) {
+		mb = merge_promote_candidate(mc);
+		mc->vm = NULL;
+		if (mb)
+			merge_to_block(vm, index, pa, mb);
+		return;
+	}
+
+	mc->vm = vm;
+	mc->index = index;
+	mc->hash = hash;
+}
+
+static struct vm *merge_next_block(int *index)
+{
+	int i;
+	struct vm *vm;
+
+	for (i = 0; i <= CONFIG_MAX_VM; i++) {
+		vm = merge_vms[merge_cursor_vm];
+		if (vm && (merge_cursor_index <
+				(vm->mm.mem_size >> MEM_BLOCK_SHIFT))) {
+			*index = merge_cursor_index++;
+			return vm;
+		}
+
+		merge_cursor_index = 0;
+		merge_cursor_vm = (merge_cursor_vm + 1) % CONFIG_MAX_VM;
+	}
+
+	return NULL;
+}
+
+/*
+ * called by the idle loop, each time only scan some of
+ * the blocks and the scan is limited by the interval
+ */
+void mem_merge_scan(void)
+{
+	int i, index;
+	struct vm *vm;
+
+	if (!merge_enabled || (NOW() < merge_next_scan))
+		return;
+
+	if (test_and_set_bit(0, &merge_scanning))
+		return;
+
+	spin_lock(&merge_lock);
+
+	for (i = 0; i < merge_scan_batch; i++) {
+		vm = merge_next_block(&index);
+		if (!vm)
+			break;
+
+		merge_scan_block(vm, index);
+	}
+
+	spin_unlock(&merge_lock);
+
+	merge_next_scan = NOW() + MILLISECS(merge_scan_interval);
+	clear_bit(0, &merge_scanning);
+}
+
+/*
+ * the vm is the last user of the shared block, make it
+ * writable again and give it back to the vm, no copy
+ */
+static int merge_take_block(struct vm *vm, int index,
+		unsigned long pa, struct merge_block *mb)
+{
+	struct mm_struct *mm = &vm->mm;
+	struct mem_block *block = mb->block;
+
+	if (vm_remap_block(vm, merge_block_ipa(vm, index), pa, pa, 0))
+		return 0;
+
+	list_del(&mb->list);
+	free(mb);
+	merge_stat.shared_blocks--;
+
+	vm_attach_block(vm, block);
+	clear_bit(index, mm->merge_bitmap);
+	merge_stat.sharing_blocks--;
+	merge_stat.cow_breaks++;
+
+	return 0;
+}
+
+/*
+ * map the private copy of the shared block to the vm, if the
+ * mapping is changed while copying the copy is dropped and
+ * the vm will fault again if it is still shared
+ */
+static int merge_break_block(struct vm *vm, int index,
+		unsigned long pa, struct merge_block *mb,
+		struct mem_block *block)
+{
+	struct mm_struct *mm = &vm->mm;
+	unsigned long ipa = merge_block_ipa(vm, index);
+
+	vm_attach_block(vm, block);
+	if (vm_remap_block(vm, ipa, pa, block->phy_base, 0)) {
+		vm_detach_block(vm, block->phy_base);
+		release_mem_block(block);
+		return 0;
+	}
+
+	merge_put_block(mb);
+	clear_bit(index, mm->merge_bitmap);
+	merge_stat.cow_breaks++;
+
+	return 0;
+}
+
+/*
+ * return -ENOENT if the block is not shared, the fault may
+ * caused by the dirty log or the scanner. the shared block is
+ * pinned during the allocation which is done without the
+ * merge lock. the copy is done with the merge lock held since
+ * the scanner maps and unmaps the same block in the host and
+ * the host mapping is not refcounted
+ */
+int mem_merge_fault(struct vm *vm, unsigned long ipa)
+{
+	int index, ret;
+	unsigned long pa;
+	struct merge_block *mb;
+	struct mem_block *block;
+	struct mm_struct *mm = &vm->mm;
+
+	spin_lock(&merge_lock);
+
+	index = (ipa - mm->mem_base) >> MEM_BLOCK_SHIFT;
+	if (!mm->merge_bitmap || !test_bit(index, mm->merge_bitmap)) {
+		spin_unlock(&merge_lock);
+		return -ENOENT;
+	}
+
+	pa = get_vm_memblock_address(vm, merge_block_ipa(vm, index));
+	mb = merge_find_block(mm->merge_hash[index], pa);
+	if (!mb) {
+		pr_error("shared block 0x%x of vm-%d not found\n",
+				ipa, vm->vmid);
+		spin_unlock(&merge_lock);
+		return -EFAULT;
+	}
+
+	if (mb->refcount == 1) {
+		ret = merge_take_block(vm, index, pa, mb);
+		spin_unlock(&merge_lock);
+		return ret;
+	}
+
+	mb->refcount++;
+	spin_unlock(&merge_lock);
+
+	block = alloc_mem_block_node(GFB_VM, mm->node);
+
+	spin_lock(&merge_lock);
+	if (block) {
+		merge_copy_block(block->phy_base, pa);
+		ret = merge_break_block(vm, index, pa, mb, block);
+	} else {
+		ret = -ENOMEM;
+	}
+	merge_unpin_block(mb);
+	spin_unlock(&merge_lock);
+
+	return ret;
+}
+
+int mem_merge_release_block(struct vm *vm, unsigned long ipa)
+{
+	int index, ret = 0;
+	unsigned long pa;
+	struct merge_block *mb;
+	struct mm_struct *mm = &vm->mm;
+
+	spin_lock(&merge_lock);
+
+	index = (ipa - mm->mem_base) >> MEM_BLOCK_SHIFT;
+	if (!mm->merge_bitmap || !test_bit(index, mm->merge_bitmap))
+		goto out;
+
+	pa = get_vm_memblock_address(vm, ipa);
+	mb = merge_find_block(mm->merge_hash[index], pa);
+	if (!mb || vm_remap_block(vm, ipa, pa, 0, 0))
+		goto out;
+
+	merge_put_block(mb);
+	clear_bit(index, mm->merge_bitmap);
+	clear_bit(index, mm->block_bitmap);
+
+	spin_lock(&mm->lock);
+	mm->mem_free += MEM_BLOCK_SIZE;
+	spin_unlock(&mm->lock);
+	ret = 1;
+out:
+	spin_unlock(&merge_lock);
+	return ret;
+}
+
+/*
+ * move a private block of the template to the shared table,
+ * the hash value is only used to find the block when other
+ * vm scan the same content
+ */
+static struct merge_block *merge_share_block(struct vm *vm,
+		int index, unsigned long pa)
+{
+	struct mem_block *block;
+	struct merge_block *mb;
+	struct mm_struct *mm = &vm->mm;
+	unsigned long ipa = merge_block_ipa(vm, index);
+
+	mb = zalloc(sizeof(struct merge_block));
+	if (!mb)
+		return NULL;
+
+	if (vm_remap_block(vm, ipa, pa, pa, VM_RO))
+		goto out;
+
+	block = vm_detach_block(vm, pa);
+	if (!block) {
+		vm_remap_block(vm, ipa, pa, pa, 0);
+		goto out;
+	}
+
+	mb->hash = merge_hash_block(pa);
+	mb->refcount = 1;
+	mb->block = block;
+	list_add_tail(&merge_table[mb->hash & MERGE_HASH_MASK], &mb->list);
+
+	set_bit(index, mm->merge_bitmap);
+	mm->merge_hash[index] = mb->hash;
+	merge_stat.shared_blocks++;
+	merge_stat.sharing_blocks++;
+
+	return mb;
+out:
+	free(mb);
+	return NULL;
+}
+
+static int merge_map_clone_block(struct vm *vm, int index,
+		struct merge_block *mb)
+{
+	int ret;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+	unsigned long pa = mb->block->phy_base;
+	unsigned long offset = (unsigned long)index << MEM_BLOCK_SHIFT;
+
+	/* the clone must not have any memory populated */
+	if (test_and_set_bit(index, mm->block_bitmap))
+		return -EEXIST;
+
+	ret = create_guest_mapping(vm, mm->mem_base + offset, pa,
+			MEM_BLOCK_SIZE, VM_NORMAL | VM_RO);
+	if (ret) {
+		clear_bit(index, mm->block_bitmap);
+		return ret;
+	}
+
+	vm_set_memblock(vm, mm->mem_base + offset, mb->block);
+
+	if (mm->hvm_mmaped)
+		create_guest_mapping(vm0, mm->hvm_mmap_base + offset, pa,
+				MEM_BLOCK_SIZE, VM_NORMAL | VM_RO);
+
+	mb->refcount++;
+	set_bit(index, mm->merge_bitmap);
+	mm->merge_hash[index] = mb->hash;
+	merge_stat.sharing_blocks++;
+
+	spin_lock(&mm->lock);
+	mm->mem_free -= MEM_BLOCK_SIZE;
+	spin_unlock(&mm->lock);
+
+	return 0;
+}
+
+/*
+ * map all the populated mem_block of a paused template vm
+ * to the clone as read only, the blocks of the template which
+ * are not shared yet are moved to the shared table, then the
+ * template and the clone copy the block when they write to it,
+ * return how many blocks are shared
+ */
+int mem_merge_clone_vm(struct vm *vm, struct vm *tmpl)
+{
+	int i, count, nr = 0, ret = 0;
+	unsigned long pa;
+	struct merge_block *mb;
+	struct mm_struct *mm = &vm->mm;
+	struct mm_struct *tmm = &tmpl->mm;
+
+	if (!mm->merge_bitmap || !tmm->merge_bitmap)
+		return -EINVAL;
+
+	/* the dirty log need the page mapping of the template */
+	if (tmm->dirty_bitmap)
+		return -EBUSY;
+
+	count = tmm->mem_size >> MEM_BLOCK_SHIFT;
+
+	spin_lock(&merge_lock);
+
+	for_each_set_bit(i, tmm->block_bitmap, count) {
+		pa = get_vm_memblock_address(tmpl, merge_block_ipa(tmpl, i));
+		if (!pa)
+			continue;
+
+		if (test_bit(i, tmm->merge_bitmap))
+			mb = merge_find_block(tmm->merge_hash[i], pa);
+		else
+			mb = merge_share_block(tmpl, i, pa);
+
+		if (!mb) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ret = merge_map_clone_block(vm, i, mb);
+		if (ret)
+			break;
+
+		nr++;
+	}
+
+	spin_unlock(&merge_lock);
+
+	return ret ? ret : nr;
+}
+
+int mem_merge_init_vm(struct vm *vm)
+{
+	int count;
+	struct mm_struct *mm = &vm->mm;
+
+	/* the colored vm is mapped by pages, do not merge it */
+	if (vm_is_hvm(vm) || vm_is_native(vm) || mm->colors)
+		return 0;
+
+	count = mm->mem_size >> MEM_BLOCK_SHIFT;
+	mm->merge_bitmap = zalloc(BITS_TO_LONGS(count) *
+			sizeof(unsigned long));
+	mm->merge_hash = zalloc(count * sizeof(uint32_t));
+	if (!mm->merge_bitmap || !mm->merge_hash)
+		goto out;
+
+	spin_lock(&merge_lock);
+	merge_vms[vm->vmid] = vm;
+	spin_unlock(&merge_lock);
+
+	return 0;
+out:
+	if (mm->merge_bitmap)
+		free(mm->merge_bitmap);
+	if (mm->merge_hash)
+		free(mm->merge_hash);
+
+	mm->merge_bitmap = NULL;
+	mm->merge_hash = NULL;
+
+	return -ENOMEM;
+}
+
+void mem_merge_release_vm(struct vm *vm)
+{
+	int i, count;
+	unsigned long pa;
+	struct merge_block *mb;
+	struct mm_struct *mm = &vm->mm;
+
+	if (!mm->merge_bitmap)
+		return;
+
+	count = mm->mem_size >> MEM_BLOCK_SHIFT;
+
+	spin_lock(&merge_lock);
+
+	for_each_set_bit(i, mm->merge_bitmap, count) {
+		pa = get_vm_memblock_address(vm, merge_block_ipa(vm, i));
+		mb = merge_find_block(mm->merge_hash[i], pa);
+		if (mb)
+			merge_put_block(mb);
+	}
+
+	for (i = 0; i < MERGE_HASH_SIZE; i++) {
+		if (merge_candidates[i].vm == vm)
+			merge_candidates[i].vm = NULL;
+	}
+
+	merge_vms[vm->vmid] = NULL;
+	free(mm->merge_bitmap);
+	free(mm->merge_hash);
+	mm->merge_bitmap = NULL;
+	mm->merge_hash = NULL;
+
+	spin_unlock(&merge_lock);
+}
+
+/*
+ * wait the running scan finish, after this the scanner will
+ * see the changes made to the vm before calling this
+ */
+void mem_merge_quiesce(void)
+{
+	dsb();
+	spin_lock(&merge_lock);
+	spin_unlock(&merge_lock);
+}
+
+int mem_merge_config(int enable, uint32_t interval, uint32_t batch)
+{
+	spin_lock(&merge_lock);
+	merge_enabled = enable;
+	if (interval)
+		merge_scan_interval = interval;
+	if (batch)
+		merge_scan_batch = batch;
+	spin_unlock(&merge_lock);
+
+	pr_info("mem merge %s interval %dms batch %d\n",
+			enable ? "enabled" : "disabled",
+			merge_scan_interval, merge_scan_batch);
+
+	return 0;
+}
+
+void mem_merge_get_stat(struct mem_merge_stat *stat)
+{
+	spin_lock(&merge_lock);
+	memcpy(stat, &merge_stat, sizeof(struct mem_merge_stat));
+	spin_unlock(&merge_lock);
+}
+
+static int mem_merge_init(void)
+{
+	int i;
+
+	for (i = 0; i < MERGE_HASH_SIZE; i++)
+		init_list(&merge_table[i]);
+
+	return 0;
+}
+
+subsys_initcall(mem_merge_init);
@@ -0,0 +1,747 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <minos/minos.h>
+#include <minos/vm.h>
+#include <minos/vmm.h>
+#include <minos/mm.h>
+#include <minos/bitops.h>
+#include <minos/time.h>
+#include <minos/lz4.h>
+#include <minos/mem_reclaim.h>
+#include <minos/mem_wss.h>
+
+/*
+ * compress the cold mem_block of a vm into a pool when the
+ * memory of the vm is over its limit, the block is unmapped
+ * from stage 2 and returned to the allocator, when the vm
+ * touch it again, a new block is allocated and the content
+ * is decompressed into it
+ *
+ * the cold block is found by the access flag of the stage 2
+ * block mapping, the flag is cleared when the block is
+ * scanned, and set again by the access fault, the block
+ * which flag is still cleared at the next scan is cold
+ *
+ * each page of the block is compressed by lz4 and saved in
+ * the pool, the pool is made of mem_block which is divided
+ * into 64 bytes units, the zero page does not use the pool
+ */
+
+#define RECLAIM_UNIT_SHIFT	(6)
+#define RECLAIM_UNIT_SIZE	(1 << RECLAIM_UNIT_SHIFT)
+#define RECLAIM_POOL_UNITS	(MEM_BLOCK_SIZE >> RECLAIM_UNIT_SHIFT)
+#define RECLAIM_MAX_SIZE	(MEM_BLOCK_SIZE * 3 / 4)
+#define RECLAIM_WMARK		(MEM_BLOCK_SIZE * 2)
+#define RECLAIM_SCAN_INTERVAL	(50)
+#define RECLAIM_SCAN_BATCH	(2)
+
+struct reclaim_pool_block {
+	int free;
+	unsigned long *bitmap;
+	struct mem_block *block;
+	struct list_head list;
+};
+
+/*
+ * the address in the pool of each page, 0 means it is a
+ * zero page, the data in the pool has a 16 bit length in
+ * the head, PAGE_SIZE means the page is not compressed
+ */
+struct reclaim_block {
+	unsigned long size;
+	unsigned long pages[PAGES_IN_BLOCK];
+};
+
+static LIST_HEAD(reclaim_pool);
+static struct vm *reclaim_vms[CONFIG_MAX_VM];
+static struct mem_reclaim_stat reclaim_stat;
+static DEFINE_SPIN_LOCK(reclaim_lock);
+static DEFINE_SPIN_LOCK(pool_lock);
+
+static uint64_t reclaim_next_scan;
+static unsigned long reclaim_scanning;
+
+static inline unsigned long reclaim_block_ipa(struct vm *vm, int index)
+{
+	return vm->mm.mem_base + ((unsigned long)index << MEM_BLOCK_SHIFT);
+}
+
+static inline int reclaim_units(int size)
+{
+	return (size + sizeof(uint16_t) + RECLAIM_UNIT_SIZE - 1) >>
+			RECLAIM_UNIT_SHIFT;
+}
+
+static inline size_t vm_resident_memory(struct mm_struct *mm)
+{
+	return mm->mem_size - mm->mem_free;
+}
+
+static struct reclaim_pool_block *reclaim_pool_grow(void)
+{
+	struct reclaim_pool_block *pb;
+
+	pb = zalloc(sizeof(struct reclaim_pool_block));
+	if (!pb)
+		return NULL;
+
+	pb->bitmap = zalloc(BITS_TO_LONGS(RECLAIM_POOL_UNITS) *
+			sizeof(unsigned long));
+	pb->block = alloc_mem_block(GFB_VM);
+	if (!pb->bitmap || !pb->block)
+		goto out;
+
+	if (create_host_mapping(pb->block->phy_base, pb->block->phy_base,
+			MEM_BLOCK_SIZE, VM_NORMAL))
+		goto out;
+
+	pb->free = RECLAIM_POOL_UNITS;
+	list_add_tail(&reclaim_pool, &pb->list);
+	reclaim_stat.pool_size += MEM_BLOCK_SIZE;
+
+	return pb;
+out:
+	if (pb->block)
+		release_mem_block(pb->block);
+	if (pb->bitmap)
+		free(pb->bitmap);
+	free(pb);
+	return NULL;
+}
+
+static void reclaim_pool_shrink(struct reclaim_pool_block *pb)
+{
+	list_del(&pb->list);
+	destroy_host_mapping(pb->block->phy_base, MEM_BLOCK_SIZE);
+	release_mem_block(pb->block);
+	free(pb->bitmap);
+	free(pb);
+	reclaim_stat.pool_size -= MEM_BLOCK_SIZE;
+}
+
+static unsigned long reclaim_pool_alloc(int size)
+{
+	unsigned long index, addr = 0;
+	int units = reclaim_units(size);
+	struct reclaim_pool_block *pb;
+
+	spin_lock(&pool_lock);
+
+	list_for_each_entry(pb, &reclaim_pool, list) {
+		if (pb->free < units)
+			continue;
+
+		index = bitmap_find_next_zero_area(pb->bitmap,
+				RECLAIM_POOL_UNITS, 0, units, 0);
+		if (index < RECLAIM_POOL_UNITS)
+			goto found;
+	}
+
+	pb = reclaim_pool_grow();
+	if (!pb)
+		goto out;
+
+	index = 0;
+found:
+	bitmap_set(pb->bitmap, index, units);
+	pb->free -= units;
+	addr = pb->block->phy_base + (index << RECLAIM_UNIT_SHIFT);
+	*(uint16_t *)addr = size;
+	reclaim_stat.stored_size += units << RECLAIM_UNIT_SHIFT;
+out:
+	spin_unlock(&pool_lock);
+
+	return addr;
+}
+
+static void reclaim_pool_free(unsigned long addr)
+{
+	int units = reclaim_units(*(uint16_t *)addr);
+	unsigned long base = ALIGN(addr, MEM_BLOCK_SIZE);
+	struct reclaim_pool_block *pb;
+
+	spin_lock(&pool_lock);
+
+	list_for_each_entry(pb, &reclaim_pool, list) {
+		if (pb->block->phy_base != base)
+			continue;
+
+		bitmap_clear(pb->bitmap, (addr - base) >> RECLAIM_UNIT_SHIFT,
+				units);
+		pb->free += units;
+		reclaim_stat.stored_size -= units << RECLAIM_UNIT_SHIFT;
+
+		if (pb->free == RECLAIM_POOL_UNITS)
+			reclaim_pool_shrink(pb);
+		break;
+	}
+
+	spin_unlock(&pool_lock);
+}
+
+static void reclaim_free_block(struct reclaim_block *rb)
+{
+	int i;
+
+	for (i = 0; i < PAGES_IN_BLOCK; i++) {
+		if (rb->pages[i])
+			reclaim_pool_free(rb->pages[i]);
+	}
+
+	free(rb);
+}
+
+static int reclaim_page_is_zero(unsigned long *page)
+{
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++) {
+		if (page[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+static int reclaim_compress(struct reclaim_block *rb,
+		unsigned long pa, uint8_t *buf)
+{
+	int i, size;
+	void *src, *data;
+	unsigned long addr;
+
+	for (i = 0; i < PAGES_IN_BLOCK; i++) {
+		src = (void *)(pa + ((unsigned long)i << PAGE_SHIFT));
+		if (reclaim_page_is_zero(src))
+			continue;
+
+		/* save the page as it is if it can not be compressed */
+		size = lz4_compress(src, PAGE_SIZE, buf,
+				PAGE_SIZE - RECLAIM_UNIT_SIZE);
+		if (size > 0) {
+			data = buf;
+		} else {
+			data = src;
+			size = PAGE_SIZE;
+		}
+
+		addr = reclaim_pool_alloc(size);
+		if (!addr)
+			return -ENOMEM;
+
+		memcpy((void *)addr + sizeof(uint16_t), data, size);
+		rb->pages[i] = addr;
+		rb->size += reclaim_units(size) << RECLAIM_UNIT_SHIFT;
+
+		if (rb->size > RECLAIM_MAX_SIZE)
+			return -E2BIG;
+	}
+
+	return 0;
+}
+
+static int reclaim_decompress_page(struct reclaim_block *rb,
+		int i, void *dst)
+{
+	int size;
+	void *src;
+
+	if (!rb->pages[i]) {
+		memset(dst, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	size = *(uint16_t *)rb->pages[i];
+	src = (void *)rb->pages[i] + sizeof(uint16_t);
+	if (size == PAGE_SIZE)
+		memcpy(dst, src, PAGE_SIZE);
+	else if (lz4_decompress(src, size, dst, PAGE_SIZE) != PAGE_SIZE)
+		return -EFAULT;
+
+	return 0;
+}
+
+static int reclaim_decompress(struct reclaim_block *rb, unsigned long pa)
+{
+	int i, ret;
+
+	for (i = 0; i < PAGES_IN_BLOCK; i++) {
+		ret = reclaim_decompress_page(rb, i,
+				(void *)(pa + ((unsigned long)i << PAGE_SHIFT)));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * unmap the block from the vm and compress it, the guest
+ * which touch the block during this will wait in the fault
+ * since the bit in the block_bitmap is still set
+ */
+static int reclaim_block(struct vm *vm, int index)
+{
+	int ret;
+	void *buf;
+	unsigned long pa;
+	struct mem_block *block;
+	struct reclaim_block *rb;
+	struct mm_struct *mm = &vm->mm;
+	unsigned long ipa = reclaim_block_ipa(vm, index);
+
+	pa = get_vm_memblock_address(vm, ipa);
+	if (!pa)
+		return -ENOENT;
+
+	rb = zalloc(sizeof(struct reclaim_block));
+	buf = get_free_page();
+	if (!rb || !buf) {
+		ret = -ENOMEM;
+		goto free_buf;
+	}
+
+	if (vm_remap_block(vm, ipa, pa, 0, 0)) {
+		ret = -EAGAIN;
+		goto free_buf;
+	}
+
+	/* the block is releasing by the vm */
+	block = vm_detach_block(vm, pa);
+	if (!block) {
+		vm_remap_block(vm, ipa, 0, pa, 0);
+		ret = -EAGAIN;
+		goto free_buf;
+	}
+
+	create_host_mapping(pa, pa, MEM_BLOCK_SIZE, VM_NORMAL);
+	ret = reclaim_compress(rb, pa, buf);
+	destroy_host_mapping(pa, MEM_BLOCK_SIZE);
+
+	if (ret) {
+		vm_attach_block(vm, block);
+		vm_remap_block(vm, ipa, 0, pa, 0);
+		goto free_block;
+	}
+
+	release_mem_block(block);
+
+	spin_lock(&mm->lock);
+	mm->mem_free += MEM_BLOCK_SIZE;
+	spin_unlock(&mm->lock);
+
+	spin_lock(&pool_lock);
+	reclaim_stat.reclaimed++;
+	reclaim_stat.orig_size += MEM_BLOCK_SIZE;
+	spin_unlock(&pool_lock);
+
+	/* the fault handler find the block after the bit cleared */
+	mm->reclaim_table[index] = rb;
+	dsb();
+	clear_bit(index, mm->block_bitmap);
+	free_pages(buf);
+
+	return 0;
+
+free_block:
+	if (ret == -E2BIG) {
+		spin_lock(&pool_lock);
+		reclaim_stat.rejected++;
+		spin_unlock(&pool_lock);
+	}
+
+	reclaim_free_block(rb);
+	rb = NULL;
+free_buf:
+	if (rb)
+		free(rb);
+	if (buf)
+		free_pages(buf);
+	return ret;
+}
+
+static inline int vm_block_is_merged(struct mm_struct *mm, int index)
+{
+	return (mm->merge_bitmap && test_bit(index, mm->merge_bitmap));
+}
+
+/*
+ * run the clock of the vm to find the cold block, the block
+ * which is accessed since last time get a second chance, the
+ * tlb is flushed after each round so the access flag will
+ * be set again if the guest still use the block
+ */
+static int reclaim_vm(struct vm *vm, int nr)
+{
+	int i, round, young, age, index, count, done = 0;
+	struct mm_struct *mm = &vm->mm;
+
+	/* the dirty log need the page mapping of the vm */
+	if (!mm->reclaim_table || mm->dirty_bitmap)
+		return 0;
+
+	count = mm->mem_size >> MEM_BLOCK_SHIFT;
+
+	for (round = 0; (round < 2) && (done < nr); round++) {
+		for (i = 0; (i < count) && (done < nr); i++) {
+			index = mm->reclaim_cursor;
+			mm->reclaim_cursor = (index + 1) % count;
+
+			if (!test_bit(index, mm->block_bitmap) ||
+					vm_block_is_merged(mm, index))
+				continue;
+
+			/*
+			 * when the working set tracking is enabled the
+			 * access flag is owned by its scan, only read it
+			 * and skip the block used in its last pass
+			 */
+			age = mem_wss_block_age(vm, index);
+			young = vm_test_block_young(vm,
+					reclaim_block_ipa(vm, index), age < 0);
+			if (young || !age)
+				continue;
+
+			if (!reclaim_block(vm, index))
+				done++;
+		}
+
+		flush_all_tlbis_guest();
+	}
+
+	return done;
+}
+
+/*
+ * called before a new block populated for the vm, reclaim
+ * the cold block if the vm will be over its limit
+ */
+void mem_reclaim_make_room(struct vm *vm)
+{
+	struct mm_struct *mm = &vm->mm;
+
+	if (!mm->mem_limit ||
+			(vm_resident_memory(mm) + MEM_BLOCK_SIZE <= mm->mem_limit))
+		return;
+
+	reclaim_vm(vm, 1);
+}
+
+static int reclaim_fault_in(struct vm *vm, int index, int room)
+{
+	int ret;
+	uint64_t start, time;
+	struct mem_block *block;
+	struct reclaim_block *rb;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+	unsigned long offset = (unsigned long)index << MEM_BLOCK_SHIFT;
+
+	/* other pcpu is decompressing the block */
+	if (test_and_set_bit(index, mm->block_bitmap))
+		return 0;
+
+	/* the block is released by the balloon */
+	rb = mm->reclaim_table[index];
+	if (!rb) {
+		clear_bit(index, mm->block_bitmap);
+		return -ENOENT;
+	}
+
+	start = NOW();
+	if (room)
+		mem_reclaim_make_room(vm);
+
+	block = alloc_mem_block_node(GFB_VM, mm->node);
+	if (!block) {
+		pr_error("no memory to decompress 0x%x for vm-%d\n",
+				mm->mem_base + offset, vm->vmid);
+		clear_bit(index, mm->block_bitmap);
+		return -ENOMEM;
+	}
+
+	create_host_mapping(block->phy_base, block->phy_base,
+			MEM_BLOCK_SIZE, VM_NORMAL);
+	ret = reclaim_decompress(rb, block->phy_base);
+	dsb();
+	destroy_host_mapping(block->phy_base, MEM_BLOCK_SIZE);
+
+	if (ret) {
+		pr_error("decompress 0x%x for vm-%d failed\n",
+				mm->mem_base + offset, vm->vmid);
+		release_mem_block(block);
+		clear_bit(index, mm->block_bitmap);
+		return ret;
+	}
+
+	mm->reclaim_table[index] = NULL;
+	reclaim_free_block(rb);
+
+	block->vmid = vm->vmid;
+	spin_lock(&mm->lock);
+	list_add_tail(&mm->block_list, &block->list);
+	mm->mem_free -= MEM_BLOCK_SIZE;
+	spin_unlock(&mm->lock);
+
+	ret = create_guest_mapping(vm, mm->mem_base + offset,
+			block->phy_base, MEM_BLOCK_SIZE, VM_NORMAL);
+	if (!ret)
+		vm_set_memblock(vm, mm->mem_base + offset, block);
+	if (!ret && mm->hvm_mmaped)
+		ret = create_guest_mapping(vm0, mm->hvm_mmap_base + offset,
+				block->phy_base, MEM_BLOCK_SIZE, VM_NORMAL);
+
+	time = NOW() - start;
+
+	spin_lock(&pool_lock);
+	reclaim_stat.faults++;
+	reclaim_stat.orig_size -= MEM_BLOCK_SIZE;
+	reclaim_stat.fault_time += time;
+	if (time > reclaim_stat.fault_max)
+		reclaim_stat.fault_max = time;
+	spin_unlock(&pool_lock);
+
+	return ret;
+}
+
+/*
+ * return -ENOENT if the block is not reclaimed, otherwise
+ * decompress it and map it to the vm again
+ */
+int mem_reclaim_fault(struct vm *vm, unsigned long ipa)
+{
+	int index;
+	struct mm_struct *mm = &vm->mm;
+
+	index = (ipa - mm->mem_base) >> MEM_BLOCK_SHIFT;
+	if (!mm->reclaim_table || !mm->reclaim_table[index])
+		return -ENOENT;
+
+	return reclaim_fault_in(vm, index, 1);
+}
+
+/*
+ * decompress all the reclaimed block of the vm, the memory
+ * limit is not checked here
+ */
+int mem_reclaim_restore_vm(struct vm *vm)
+{
+	int i, count, ret;
+	struct mm_struct *mm = &vm->mm;
+
+	if (!mm->reclaim_table)
+		return 0;
+
+	count = mm->mem_size >> MEM_BLOCK_SHIFT;
+	for (i = 0; i < count; i++) {
+		if (!mm->reclaim_table[i])
+			continue;
+
+		ret = reclaim_fault_in(vm, i, 0);
+		if (ret && (ret != -ENOENT))
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * copy the content of a compressed block to the buffer of
+ * vm0, the block stays compressed for the vm, return -ENOENT
+ * if the block is not compressed
+ */
+int mem_reclaim_read_block(struct vm *vm, unsigned long ipa,
+		unsigned long buf)
+{
+	int i, index, ret = 0;
+	void *page;
+	struct reclaim_block *rb;
+	struct mm_struct *mm = &vm->mm;
+
+	if ((ipa < mm->mem_base) || (ipa >= mm->mem_base + mm->mem_size))
+		return -EINVAL;
+
+	index = (ipa - mm->mem_base) >> MEM_BLOCK_SHIFT;
+	if (!mm->reclaim_table || !mm->reclaim_table[index])
+		return -ENOENT;
+
+	page = get_free_page();
+	if (!page)
+		return -ENOMEM;
+
+	/* the fault of the vm waits until the block is read */
+	if (test_and_set_bit(index, mm->block_bitmap)) {
+		free_pages(page);
+		return -ENOENT;
+	}
+
+	rb = mm->reclaim_table[index];
+	if (!rb) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	for (i = 0; i < PAGES_IN_BLOCK; i++) {
+		ret = reclaim_decompress_page(rb, i, page);
+		if (!ret)
+			ret = copy_to_guest(buf + ((unsigned long)i <<
+					PAGE_SHIFT), page, PAGE_SIZE);
+		if (ret)
+			break;
+	}
+out:
+	clear_bit(index, mm->block_bitmap);
+	free_pages(page);
+
+	return ret;
+}
+
+int mem_reclaim_release_block(struct vm *vm, unsigned long ipa)
+{
+	int index;
+	struct reclaim_block *rb;
+	struct mm_struct *mm = &vm->mm;
+
+	index = (ipa - mm->mem_base) >> MEM_BLOCK_SHIFT;
+	if (!mm->reclaim_table || !mm->reclaim_table[index])
+		return 0;
+
+	if (test_and_set_bit(index, mm->block_bitmap))
+		return 0;
+
+	rb = mm->reclaim_table[index];
+	mm->reclaim_table[index] = NULL;
+	clear_bit(index, mm->block_bitmap);
+	if (!rb)
+		return 0;
+
+	reclaim_free_block(rb);
+
+	spin_lock(&pool_lock);
+	reclaim_stat.orig_size -= MEM_BLOCK_SIZE;
+	spin_unlock(&pool_lock);
+
+	return 1;
+}
+
+void mem_reclaim_release_vm(struct vm *vm)
+{
+	int i, count;
+	struct mm_struct *mm = &vm->mm;
+
+	if (!mm->reclaim_table)
+		return;
+
+	spin_lock(&reclaim_lock);
+	reclaim_vms[vm->vmid] = NULL;
+	spin_unlock(&reclaim_lock);
+
+	count = mm->mem_size >> MEM_BLOCK_SHIFT;
+	for (i = 0; i < count; i++) {
+		if (!mm->reclaim_table[i])
+			continue;
+
+		reclaim_free_block(mm->reclaim_table[i]);
+		spin_lock(&pool_lock);
+		reclaim_stat.orig_size -= MEM_BLOCK_SIZE;
+		spin_unlock(&pool_lock);
+	}
+
+	free(mm->reclaim_table);
+	mm->reclaim_table = NULL;
+	mm->mem_limit = 0;
+}
+
+/*
+ * set the memory limit of the vm, 0 means no limit, the
+ * blocks over the limit are reclaimed in the idle loop
+ */
+int mem_reclaim_set_limit(struct vm *vm, size_t limit)
+{
+	int count;
+	struct mm_struct *mm = &vm->mm;
+
+	if (vm_is_hvm(vm) || vm_is_native(vm) ||
+			!mm->block_bitmap || mm->colors)
+		return -EINVAL;
+
+	limit = BALIGN(limit, MEM_BLOCK_SIZE);
+	if (limit && (limit < RECLAIM_WMARK * 2))
+		return -EINVAL;
+
+	if (!mm->reclaim_table) {
+		count = mm->mem_size >> MEM_BLOCK_SHIFT;
+		mm->reclaim_table = zalloc(count *
+				sizeof(struct reclaim_block *));
+		if (!mm->reclaim_table)
+			return -ENOMEM;
+	}
+
+	spin_lock(&reclaim_lock);
+	mm->mem_limit = limit;
+	reclaim_vms[vm->vmid] = vm;
+	spin_unlock(&reclaim_lock);
+
+	pr_info("vm-%d memory limit %dMB\n", vm->vmid, (int)(limit >> 20));
+
+	return 0;
+}
+
+/*
+ * called by the idle loop, keep the memory of the vms a
+ * little below the limit, so the fault does not need to
+ * compress a block before it can get a new one
+ */
+void mem_reclaim_scan(void)
+{
+	int i;
+	struct vm *vm;
+	struct mm_struct *mm;
+
+	if (NOW() < reclaim_next_scan)
+		return;
+
+	if (test_and_set_bit(0, &reclaim_scanning))
+		return;
+
+	spin_lock(&reclaim_lock);
+
+	for (i = 0; i < CONFIG_MAX_VM; i++) {
+		vm = reclaim_vms[i];
+		if (!vm)
+			continue;
+
+		mm = &vm->mm;
+		if (!mm->mem_limit || (vm_resident_memory(mm) +
+				RECLAIM_WMARK <= mm->mem_limit))
+			continue;
+
+		reclaim_vm(vm, RECLAIM_SCAN_BATCH);
+	}
+
+	spin_unlock(&reclaim_lock);
+
+	reclaim_next_scan = NOW() + MILLISECS(RECLAIM_SCAN_INTERVAL);
+	clear_bit(0, &reclaim_scanning);
+}
+
+void mem_reclaim_get_stat(struct mem_reclaim_stat *stat)
+{
+	spin_lock(&pool_lock);
+	memcpy(stat, &reclaim_stat, sizeof(struct mem_reclaim_stat));
+	spin_unlock(&pool_lock);
+}
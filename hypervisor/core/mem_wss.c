@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <minos/minos.h>
+#include <minos/vm.h>
+#include <minos/vmm.h>
+#include <minos/mm.h>
+#include <minos/bitops.h>
+#include <minos/time.h>
+#include <minos/mem_wss.h>
+
+/*
+ * estimate the working set of a vm by the access flag of the
+ * stage 2 mapping, each pass walks all the mem_block of the
+ * vm and clear the access flag, the guest get an access fault
+ * when it touch the block again and the flag is set, so the
+ * block whose flag is still cleared at the next pass is idle
+ * for one more pass, the idle age of each block is kept and
+ * built into a histogram when the pass is finished
+ *
+ * a pass is started every interval, the blocks are scanned
+ * in the idle loop and the scan of each vm is limited by the
+ * rate in blocks per second, so the cost of the tlb flush and
+ * the access fault is bounded
+ */
+
+#define WSS_MIN_INTERVAL	(100)
+#define WSS_DEFAULT_RATE	(512)
+#define WSS_SCAN_INTERVAL	(10)
+#define WSS_SCAN_BATCH		(64)
+#define WSS_MAX_AGE		(255)
+
+/*
+ * interval : the time in ms between the start of two pass
+ * rate : the max blocks scanned in one second
+ * cursor : the next block to scan in this pass
+ * idle : the histogram of the last finished pass
+ * work : the histogram of the current pass
+ * age : the number of pass each block is not accessed
+ */
+struct mem_wss {
+	uint32_t interval;
+	uint32_t rate;
+	int count;
+	int cursor;
+	int in_pass;
+	uint64_t pass_start;
+	uint64_t last_scan;
+	unsigned long passes;
+	unsigned long scanned;
+	uint64_t idle[VM_WSS_BUCKETS];
+	uint64_t work[VM_WSS_BUCKETS];
+	uint8_t age[0];
+};
+
+static struct vm *wss_vms[CONFIG_MAX_VM];
+static DEFINE_SPIN_LOCK(wss_lock);
+
+static uint64_t wss_next_scan;
+static unsigned long wss_scanning;
+
+static inline int wss_bucket(int age)
+{
+	return min(fls(age), VM_WSS_BUCKETS - 1);
+}
+
+static void wss_scan_vm(struct vm *vm, uint64_t now)
+{
+	int i, nr, young, index;
+	uint64_t budget;
+	struct mm_struct *mm = &vm->mm;
+	struct mem_wss *wss = mm->wss;
+
+	if (!wss->in_pass) {
+		if (now < wss->pass_start + MILLISECS(wss->interval))
+			return;
+
+		memset(wss->work, 0, sizeof(wss->work));
+		wss->pass_start = now;
+		wss->last_scan = now;
+		wss->in_pass = 1;
+		return;
+	}
+
+	/* how many blocks can be scanned since last time */
+	budget = (now - wss->last_scan) * wss->rate / SECONDS(1);
+	if (!budget)
+		return;
+
+	wss->last_scan = now;
+	nr = budget < WSS_SCAN_BATCH ? (int)budget : WSS_SCAN_BATCH;
+
+	for (i = 0; (i < nr) && (wss->cursor < wss->count); i++) {
+		index = wss->cursor++;
+		wss->scanned++;
+
+		young = vm_test_block_young(vm, mm->mem_base +
+				((unsigned long)index << MEM_BLOCK_SHIFT), 1);
+		if (young < 0) {
+			wss->age[index] = 0;
+			continue;
+		}
+
+		if (young)
+			wss->age[index] = 0;
+		else if (wss->age[index] < WSS_MAX_AGE)
+			wss->age[index]++;
+
+		wss->work[wss_bucket(wss->age[index])] += MEM_BLOCK_SIZE;
+	}
+
+	flush_all_tlbis_guest();
+
+	if (wss->cursor < wss->count)
+		return;
+
+	memcpy(wss->idle, wss->work, sizeof(wss->idle));
+	wss->passes++;
+	wss->cursor = 0;
+	wss->in_pass = 0;
+}
+
+/*
+ * the idle age of the block, the access flag is owned by the
+ * working set scan when it is enabled, return -ENOENT if
+ * it is not enabled
+ */
+int mem_wss_block_age(struct vm *vm, int index)
+{
+	struct mem_wss *wss = vm->mm.wss;
+
+	if (!wss || !wss->interval)
+		return -ENOENT;
+
+	return wss->age[index];
+}
+
+int mem_wss_get_stat(struct vm *vm, unsigned long buf, size_t size)
+{
+	struct vm_wss_stat stat;
+	struct mm_struct *mm = &vm->mm;
+
+	if (size < sizeof(struct vm_wss_stat))
+		return -EINVAL;
+
+	spin_lock(&wss_lock);
+	if (!mm->wss) {
+		spin_unlock(&wss_lock);
+		return -ENOENT;
+	}
+
+	stat.interval = mm->wss->interval;
+	stat.rate = mm->wss->rate;
+	stat.passes = mm->wss->passes;
+	stat.access_faults = mm->access_faults;
+	stat.scanned = mm->wss->scanned;
+	stat.mem_size = mm->mem_size;
+	memcpy(stat.idle, mm->wss->idle, sizeof(stat.idle));
+	spin_unlock(&wss_lock);
+
+	return copy_to_guest(buf, &stat, sizeof(struct vm_wss_stat));
+}
+
+/*
+ * interval is in ms and 0 disable the tracking, rate is the
+ * max blocks scanned in one second, 0 means the default
+ */
+int mem_wss_config(struct vm *vm, unsigned long interval, unsigned long rate)
+{
+	int count;
+	struct mem_wss *wss;
+	struct mm_struct *mm = &vm->mm;
+
+	if (vm_is_hvm(vm) || !mm->mem_size)
+		return -EINVAL;
+
+	if (interval && (interval < WSS_MIN_INTERVAL))
+		return -EINVAL;
+
+	if (!mm->wss) {
+		if (!interval)
+			return 0;
+
+		count = mm->mem_size >> MEM_BLOCK_SHIFT;
+		wss = zalloc(sizeof(struct mem_wss) + count);
+		if (!wss)
+			return -ENOMEM;
+
+		wss->count = count;
+		mm->wss = wss;
+	}
+
+	spin_lock(&wss_lock);
+	wss = mm->wss;
+	wss->interval = interval;
+	wss->rate = rate ? rate : WSS_DEFAULT_RATE;
+	wss->cursor = 0;
+	wss->in_pass = 0;
+	wss->pass_start = 0;
+	wss_vms[vm->vmid] = interval ? vm : NULL;
+	spin_unlock(&wss_lock);
+
+	pr_info("vm-%d working set tracking %dms %d blocks/s\n",
+			vm->vmid, (int)interval, (int)wss->rate);
+
+	return 0;
+}
+
+void mem_wss_release_vm(struct vm *vm)
+{
+	struct mm_struct *mm = &vm->mm;
+
+	if (!mm->wss)
+		return;
+
+	spin_lock(&wss_lock);
+	wss_vms[vm->vmid] = NULL;
+	spin_unlock(&wss_lock);
+
+	free(mm->wss);
+	mm->wss = NULL;
+	mm->access_faults = 0;
+}
+
+void mem_wss_scan(void)
+{
+	int i;
+	uint64_t now = NOW();
+
+	if (now < wss_next_scan)
+		return;
+
+	if (test_and_set_bit(0, &wss_scanning))
+		return;
+
+	spin_lock(&wss_lock);
+
+	for (i = 0; i < CONFIG_MAX_VM; i++) {
+		if (wss_vms[i])
+			wss_scan_vm(wss_vms[i], now);
+	}
+
+	spin_unlock(&wss_lock);
+
+	wss_next_scan = NOW() + MILLISECS(WSS_SCAN_INTERVAL);
+	clear_bit(0, &wss_scanning);
+}
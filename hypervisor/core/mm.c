@@ -34,6 +34,7 @@ LIST_HEAD(mem_list);
 struct mem_section {
 	unsigned long phy_base;
 	int id;
+	int node;
 	size_t size;
 	size_t nr_blocks;
 	size_t free_blocks;
@@ -77,6 +78,41 @@ struct page_pool {
 	struct list_head block_list;
 };
 
+/*
+ * the free pages of the color blocks are linked in the
+ * list of its cache color, the vm which has its own colors
+ * only get the pages from these lists, so it will not
+ * share the cache sets with other vm
+ */
+struct color_pool {
+	spinlock_t lock;
+	uint32_t blocks;
+	uint32_t nr_free[NR_CACHE_COLORS];
+	struct page *free[NR_CACHE_COLORS];
+};
+
+/*
+ * the blocks in the zero pool are cleared by the idle pcpus
+ * and not mapped in host, the vm memory uses them first so
+ * the vm creation does not need to clear its memory. when
+ * the pool is below the low watermark the idle pcpus begin
+ * to refill it until it reaches the high watermark
+ */
+struct zero_pool {
+	spinlock_t lock;
+	struct list_head list;
+	int nr_blocks;
+	int low;
+	int high;
+	int filling;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long filled;
+};
+
+#define ZERO_POOL_HIGH		(CONFIG_ZERO_POOL_BLOCKS)
+#define ZERO_POOL_LOW		(ZERO_POOL_HIGH / 4)
+
 #define PAGE_METAS_IN_BLOCK	(254)
 #define BLOCK_BITMAP_SIZE	(64)
 #define PAGE_METAS_BITMAP_SIZE	(DIV_ROUND_UP(PAGE_METAS_IN_BLOCK, BITS_PER_BYTE))
@@ -84,12 +120,17 @@ struct page_pool {
 
 static int nr_sections;
 struct mem_section mem_sections[MAX_MEM_SECTIONS];
+static int cpu_nodes[NR_CPUS];
 static struct slab slab;
 static struct slab *pslab = &slab;
 static struct page_pool __page_pool;
 static struct page_pool __io_pool;
 static struct page_pool *io_pool = &__io_pool;
 static struct page_pool *page_pool = &__page_pool;
+static struct color_pool __color_pool;
+static struct color_pool *color_pool = &__color_pool;
+static struct zero_pool __zero_pool;
+static struct zero_pool *zero_pool = &__zero_pool;
 static size_t free_blocks;
 
 static void add_slab_mem(unsigned long base, size_t size);
@@ -151,7 +192,8 @@ static LIST_HEAD(host_list);
 #define FREE_POOL_OFFSET		(2)
 #define CACHE_POOL_OFFSET		(1)
 
-static int add_memory_section(unsigned long mem_base, size_t size)
+static int add_memory_section(unsigned long mem_base,
+		size_t size, int node)
 {
 	struct mem_section *ms;
 	unsigned long mem_end;
@@ -178,10 +220,12 @@ static int add_memory_section(unsigned long mem_base, size_t size)
 	ms->nr_blocks = real_size >> MEM_BLOCK_SHIFT;
 	ms->free_blocks = ms->nr_blocks;
 	ms->id = nr_sections;
+	ms->node = node;
 	free_blocks += ms->nr_blocks;
 
 	nr_sections++;
-	pr_info("MEM SECTION : start:0x%x size:0x%x\n", mem_base, size);
+	pr_info("MEM SECTION : start:0x%x size:0x%x node:%d\n",
+			mem_base, size, node);
 
 	size = size - real_size;
 	if (size > SLAB_MIN_SIZE)
@@ -203,7 +247,8 @@ static void parse_system_regions(void)
 		if (region->vmid != VMID_HOST)
 			continue;
 
-		add_memory_section(region->vir_base, region->size);
+		add_memory_section(region->vir_base,
+				region->size, region->node);
 	}
 }
 
@@ -370,11 +415,13 @@ static struct mem_section *addr_to_mem_section(unsigned long addr)
 	return section;
 }
 
-static struct mem_block *addr_to_mem_block(unsigned long addr)
+struct mem_block *addr_to_mem_block(unsigned long addr)
 {
 	struct mem_section *section = NULL;
 
 	section = addr_to_mem_section(addr);
+	if (!section)
+		return NULL;
 
 	return (&section->blocks[(addr - section->phy_base) >>
 			MEM_BLOCK_SHIFT]);
@@ -441,15 +488,72 @@ __alloc_mem_block(struct mem_section *section, unsigned long f)
 	return block;
 }
 
-struct mem_block *alloc_mem_block(unsigned long flags)
+void set_cpu_node(int cpu, int node)
+{
+	if ((cpu >= 0) && (cpu < NR_CPUS) && (node >= 0))
+		cpu_nodes[cpu] = node;
+}
+
+int cpu_to_node(int cpu)
+{
+	if ((cpu < 0) || (cpu >= NR_CPUS))
+		return 0;
+
+	return cpu_nodes[cpu];
+}
+
+int phy_addr_to_node(unsigned long addr)
+{
+	int i;
+	struct mem_section *section;
+
+	for (i = 0; i < nr_sections; i++) {
+		section = &mem_sections[i];
+		if ((addr >= section->phy_base) &&
+				(addr < section->phy_base + section->size))
+			return section->node;
+	}
+
+	return NUMA_NO_NODE;
+}
+
+static void map_mem_block(struct mem_block *block, unsigned long flags)
+{
+	unsigned long f = VM_RW;
+	struct mem_section *section;
+
+	if (flags & GFB_IO)
+		f |= VM_IO;
+	else
+		f |= VM_NORMAL;
+
+	/* section and normal memory skip mapping */
+	section = block_to_mem_section(block);
+	if ((section->id == 0) && (f & VM_NORMAL))
+		return;
+
+	create_host_mapping(block->phy_base, block->phy_base,
+			MEM_BLOCK_SIZE, f);
+}
+
+/*
+ * local is 1 : only the sections on the node
+ * local is 0 : only the sections not on the node
+ * NUMA_NO_NODE means all the sections
+ */
+static struct mem_block *
+__alloc_mem_block_node(unsigned long flags, int node, int local)
 {
 	int i;
-	unsigned long f = 0;
 	struct mem_block *block = NULL;
 	struct mem_section *section;
 
 	for (i = 0; i < nr_sections; i++) {
 		section = &mem_sections[i];
+		if ((node != NUMA_NO_NODE) &&
+				((section->node == node) != local))
+			continue;
+
 		block = __alloc_mem_block(section, flags);
 		if (block)
 			break;
@@ -459,24 +563,139 @@ struct mem_block *alloc_mem_block(unsigned long flags)
 	 * if the block is not for guest vm mapped it to host
 	 * memory space
 	 */
-	if (block && (!(flags & GFB_VM))) {
-		f |= VM_RW;
-		if (flags & GFB_IO)
-			f |= VM_IO;
-		else
-			f |= VM_NORMAL;
-
-		/* section and normal memory skip mapping */
-		if ((section->id == 0) && (f & VM_NORMAL))
+	if (block && (!(flags & GFB_VM)))
+		map_mem_block(block, flags);
+
+	return block;
+}
+
+void clear_mem_block(struct mem_block *block)
+{
+	unsigned long pa = block->phy_base;
+
+	create_host_mapping(pa, pa, MEM_BLOCK_SIZE, VM_NORMAL);
+	zero_dcache_range(pa, MEM_BLOCK_SIZE);
+	destroy_host_mapping(pa, MEM_BLOCK_SIZE);
+}
+
+/*
+ * get a cleared block on the node, NUMA_NO_NODE means
+ * any node, the block is flaged with GFB_ZERO so the
+ * caller knows it need not to clear it again
+ */
+static struct mem_block *zero_pool_get(unsigned long flags, int node)
+{
+	struct mem_block *block;
+
+	spin_lock(&zero_pool->lock);
+	list_for_each_entry(block, &zero_pool->list, list) {
+		if ((node != NUMA_NO_NODE) &&
+				(phy_addr_to_node(block->phy_base) != node))
+			continue;
+
+		list_del(&block->list);
+		zero_pool->nr_blocks--;
+		if (flags & GFB_VM)
+			zero_pool->hits++;
+		if (zero_pool->nr_blocks < zero_pool->low)
+			zero_pool->filling = 1;
+		spin_unlock(&zero_pool->lock);
+
+		block->flags = (flags & GFB_MASK) | GFB_ZERO;
+		if (!(flags & GFB_VM))
+			map_mem_block(block, flags);
+
+		return block;
+	}
+
+	spin_unlock(&zero_pool->lock);
+
+	return NULL;
+}
+
+/*
+ * called by the idle pcpu, clear one block of its own node
+ * each time, dc zva is used to clear the block so it will
+ * not pollute the cache much. keep enough free blocks in
+ * the sections for the other users
+ */
+void zero_pool_fill(void)
+{
+	int node;
+	struct mem_block *block;
+	static unsigned long filling_bit;
+
+	if (!zero_pool->filling || (free_blocks <= (size_t)zero_pool->high))
+		return;
+
+	if (test_and_set_bit(0, &filling_bit))
+		return;
+
+	node = cpu_to_node(smp_processor_id());
+	block = __alloc_mem_block_node(GFB_VM, node, 1);
+	if (!block)
+		goto out;
+
+	clear_mem_block(block);
+
+	spin_lock(&zero_pool->lock);
+	list_add_tail(&zero_pool->list, &block->list);
+	zero_pool->nr_blocks++;
+	zero_pool->filled++;
+	if (zero_pool->nr_blocks >= zero_pool->high)
+		zero_pool->filling = 0;
+	spin_unlock(&zero_pool->lock);
+out:
+	clear_bit(0, &filling_bit);
+}
+
+void zero_pool_get_stat(struct zero_pool_stat *stat)
+{
+	spin_lock(&zero_pool->lock);
+	stat->nr_blocks = zero_pool->nr_blocks;
+	stat->hits = zero_pool->hits;
+	stat->misses = zero_pool->misses;
+	stat->filled = zero_pool->filled;
+	spin_unlock(&zero_pool->lock);
+}
+
+/*
+ * get a block from the sections of the node first, if the
+ * node has no more free blocks, fall back to other nodes.
+ * the vm memory prefers the cleared block in the zero pool
+ * and the other users only use it when the sections are
+ * used up
+ */
+struct mem_block *alloc_mem_block_node(unsigned long flags, int node)
+{
+	struct mem_block *block;
+
+	if (flags & GFB_VM) {
+		block = zero_pool_get(flags, node);
+		if (block)
 			return block;
+	}
 
-		create_host_mapping(block->phy_base, block->phy_base,
-				MEM_BLOCK_SIZE, f);
+	block = __alloc_mem_block_node(flags, node, 1);
+	if (!block && (node != NUMA_NO_NODE))
+		block = __alloc_mem_block_node(flags, node, 0);
+	if (!block)
+		return zero_pool_get(flags, NUMA_NO_NODE);
+
+	if (flags & GFB_VM) {
+		spin_lock(&zero_pool->lock);
+		zero_pool->misses++;
+		spin_unlock(&zero_pool->lock);
 	}
 
 	return block;
 }
 
+struct mem_block *alloc_mem_block(unsigned long flags)
+{
+	return alloc_mem_block_node(flags, NUMA_NO_NODE);
+}
+
 static unsigned long *get_page_meta(struct page_pool *pool)
 {
 	int bit;
@@ -568,19 +787,17 @@ static struct page *alloc_pages_from_block(struct mem_block *block,
 	return page;
 }
 
-static struct page *__alloc_pages_internal(struct page_pool *pool,
-		int count, int align, unsigned long flags)
+static struct page *alloc_pages_from_pool(struct page_pool *pool,
+		int count, int align, int node)
 {
 	struct mem_block *block = NULL, *n = NULL;
-	unsigned long *page_meta = NULL;
 	struct page *page = NULL;
 
-	if (count <= 0)
-		return NULL;
-
-	spin_lock(&pool->lock);
-
 	list_for_each_entry_safe(block, n, &pool->block_list, list) {
+		if ((node != NUMA_NO_NODE) &&
+				(phy_addr_to_node(block->phy_base) != node))
+			continue;
+
 		page = alloc_pages_from_block(block, count, align);
 		if (page) {
 			/*
@@ -595,13 +812,40 @@ static struct page *__alloc_pages_internal(struct page_pool *pool,
 		}
 	}
 
+	return page;
+}
+
+static struct page *__alloc_pages_internal(struct page_pool *pool,
+		int count, int align, unsigned long flags, int node)
+{
+	struct mem_block *block = NULL;
+	unsigned long *page_meta = NULL;
+	struct page *page = NULL;
+
+	if (count <= 0)
+		return NULL;
+
+	spin_lock(&pool->lock);
+
+	page = alloc_pages_from_pool(pool, count, align, node);
 	if (page)
 		goto out;
 
 	/*
-	 * need new memory block from the section
+	 * need new memory block from the section, the pages
+	 * in the pool which are not on the node will only
+	 * be used when the node has no more free blocks
 	 */
-	block = alloc_mem_block(flags);
+	block = __alloc_mem_block_node(flags, node, 1);
+	if (!block && (node != NUMA_NO_NODE)) {
+		page = alloc_pages_from_pool(pool, count,
+				align, NUMA_NO_NODE);
+		if (page)
+			goto out;
+
+		block = __alloc_mem_block_node(flags, node, 0);
+	}
+
 	if (!block)
 		goto out;
 
@@ -621,34 +865,142 @@ out:
 	return page;
 }
 
+struct page *__alloc_pages_node(int pages, int align, int node)
+{
+	return __alloc_pages_internal(page_pool, pages,
+			align, GFB_PAGE, node);
+}
+
 struct page *__alloc_pages(int pages, int align)
 {
-	return __alloc_pages_internal(page_pool, pages, align, GFB_PAGE);
+	return __alloc_pages_node(pages, align, NUMA_NO_NODE);
 }
 
-void *__get_free_pages(int pages, int align)
+void *__get_free_pages_node(int pages, int align, int node)
 {
 	struct page *page = NULL;
 
-	page = __alloc_pages(pages, align);
+	page = __alloc_pages_node(pages, align, node);
 	if (page)
 		return (void *)(page->phy_base & __PAGE_MASK);
 
 	return NULL;
 }
 
+void *__get_free_pages(int pages, int align)
+{
+	return __get_free_pages_node(pages, align, NUMA_NO_NODE);
+}
+
 void *__get_io_pages(int pages, int align)
 {
 	struct page *page = NULL;
 
 	page = __alloc_pages_internal(io_pool, pages,
-			align, GFB_PAGE | GFB_IO);
+			align, GFB_PAGE | GFB_IO, NUMA_NO_NODE);
 	if (page)
 		return (void *)(page->phy_base & __PAGE_MASK);
 
 	return NULL;
 }
 
+/*
+ * split a new mem_block into pages and add them to the list
+ * of their colors, the block is mapped in host so the page
+ * can also be used for the page table of the vm, the color
+ * block is not returned to the section
+ */
+static int color_pool_grow(void)
+{
+	int i, color;
+	unsigned long *meta, addr;
+	struct mem_block *block;
+	struct page *page;
+
+	block = alloc_mem_block(GFB_PAGE | GFB_COLOR);
+	if (!block)
+		return -ENOMEM;
+
+	spin_lock(&page_pool->lock);
+	meta = get_page_meta(page_pool);
+	spin_unlock(&page_pool->lock);
+
+	if (!meta) {
+		block->flags = 0;
+		release_mem_block(block);
+		return -ENOMEM;
+	}
+
+	memset(meta, 0, PAGE_META_SIZE);
+	block->pages_bitmap = meta;
+	page = (struct page *)block_meta_base(block);
+
+	for (i = 0; i < PAGES_IN_BLOCK; i++, page++) {
+		addr = PAGE_ADDR(block->phy_base, i);
+		color = page_color(addr);
+		page->phy_base = addr | 1;
+		page->next = color_pool->free[color];
+		color_pool->free[color] = page;
+		color_pool->nr_free[color]++;
+	}
+
+	color_pool->blocks++;
+
+	return 0;
+}
+
+/*
+ * get a page whose color is in the colors, the colors are
+ * used in turn from the next one, so the pages of the vm
+ * spread over all its colors
+ */
+struct page *alloc_color_page(unsigned long colors, int *next)
+{
+	int i, color;
+	struct page *page = NULL;
+
+	colors &= CACHE_COLOR_MASK;
+	if (!colors)
+		return NULL;
+
+	spin_lock(&color_pool->lock);
+
+	do {
+		for (i = 0; i < NR_CACHE_COLORS; i++) {
+			color = (*next + i) & (NR_CACHE_COLORS - 1);
+			if (!(colors & (1UL << color)) ||
+					!color_pool->free[color])
+				continue;
+
+			page = color_pool->free[color];
+			color_pool->free[color] = page->next;
+			color_pool->nr_free[color]--;
+			page->next = NULL;
+			*next = color + 1;
+			goto out;
+		}
+	} while (!color_pool_grow());
+
+out:
+	spin_unlock(&color_pool->lock);
+	return page;
+}
+
+static void free_color_page(struct mem_block *block, unsigned long addr)
+{
+	int color = page_color(addr);
+	struct page *page;
+
+	page = (struct page *)block_meta_base(block);
+	page += offset_in_block_bitmap(addr, block);
+
+	spin_lock(&color_pool->lock);
+	page->next = color_pool->free[color];
+	color_pool->free[color] = page;
+	color_pool->nr_free[color]++;
+	spin_unlock(&color_pool->lock);
+}
+
 static size_t inline get_slab_alloc_size(size_t size)
 {
 	return BALIGN(size, SLAB_MIN_DATA_SIZE);
@@ -1032,12 +1384,13 @@ void release_mem_block(struct mem_block *block)
 		return;
 
 	if (block->free_pages < PAGES_IN_BLOCK)
-		goto out;
+		return;
 
 	section = block_to_mem_section(block);
 	spin_lock(&section->lock);
 	start = offset_in_section_bitmap(block->phy_base, section);
 	bitmap_clear(section->bitmap, start, 1);
+	section->free_blocks++;
 	free_blocks++;
 
 	/*
@@ -1067,6 +1420,11 @@ void free_pages(void *addr)
 	block = addr_to_mem_block((unsigned long)addr);
 	start = offset_in_block_bitmap((unsigned long)addr, block);
 
+	if (block->flags & GFB_COLOR) {
+		free_color_page(block, (unsigned long)addr);
+		return;
+	}
+
 	if (!(block->flags & BIT(GFB_PAGE_BIT))) {
 		pr_error("addr is not a page 0x%p\n", addr);
 		return;
@@ -1100,6 +1458,27 @@ void free_pages(void *addr)
 	spin_unlock(&pool->lock);
 }
 
+/*
+ * return the page meta of the address, NULL if the address
+ * is not a page allocated by the page or the color allocator
+ */
+struct page *addr_to_page(void *addr)
+{
+	struct mem_block *block;
+	struct page *page;
+
+	block = addr_to_mem_block((unsigned long)addr);
+	if (!block || !(block->flags & GFB_PAGE) || !block->pages_bitmap)
+		return NULL;
+
+	page = (struct page *)block_meta_base(block);
+	page += offset_in_block_bitmap((unsigned long)addr, block);
+	if ((page->phy_base & __PAGE_MASK) != (unsigned long)addr)
+		return NULL;
+
+	return page;
+}
+
 void release_pages(struct page *page)
 {
 	return free_pages((void *)(page->phy_base & __PAGE_MASK));
@@ -1157,14 +1536,25 @@ static void page_pool_init(void)
 	spin_lock_init(&io_pool->lock);
 	init_list(&io_pool->meta_list);
 	init_list(&io_pool->block_list);
+
+	memset(color_pool, 0, sizeof(struct color_pool));
+	spin_lock_init(&color_pool->lock);
+
+	memset(zero_pool, 0, sizeof(struct zero_pool));
+	spin_lock_init(&zero_pool->lock);
+	init_list(&zero_pool->list);
+	zero_pool->high = ZERO_POOL_HIGH;
+	zero_pool->low = ZERO_POOL_LOW;
+	zero_pool->filling = (zero_pool->high > 0);
 }
 
 int has_enough_memory(size_t size)
 {
-	return (free_blocks >= (size >> MEM_BLOCK_SHIFT));
+	return ((free_blocks + zero_pool->nr_blocks) >=
+			(size >> MEM_BLOCK_SHIFT));
 }
 
-int add_memory_region(uint64_t base, uint64_t size, int vmid)
+int add_memory_region(uint64_t base, uint64_t size, int vmid, int node)
 {
 	struct memory_region *region;
 
@@ -1180,9 +1570,10 @@ int add_memory_region(uint64_t base, uint64_t size, int vmid)
 	region->phy_base = base;
 	region->size = size;
 	region->vmid = vmid;
+	region->node = node;
 
-	pr_info("ADD MEM : 0x%x -> 0x%x 0x%x\n", region->vir_base,
-		region->phy_base, region->size);
+	pr_info("ADD MEM : 0x%x -> 0x%x 0x%x node-%d\n", region->vir_base,
+		region->phy_base, region->size, node);
 
 	init_list(&region->list);
 	list_add_tail(&mem_list, &region->list);
@@ -1230,6 +1621,7 @@ int split_memory_region(vir_addr_t base, size_t size, int vmid)
 			n->vir_base = n->phy_base = new_end;
 			n->size = end - new_end;
 			n->vmid = region->vmid;
+			n->node = region->node;
 			list_add_tail(&mem_list, &n->list);
 			region->size = base - start;
 		} else if ((base > start) && (end == new_end)) {
@@ -1248,12 +1640,13 @@ int split_memory_region(vir_addr_t base, size_t size, int vmid)
 		tmp->vir_base = tmp->phy_base = base;
 		tmp->size = size;
 		tmp->vmid = vmid;
+		tmp->node = region->node;
 		list_add_tail(&mem_list, &tmp->list);
 
 		return 0;
 	}
 
-	add_memory_region(base, size, vmid);
+	add_memory_region(base, size, vmid, 0);
 	return 0;
 }
 
@@ -107,8 +107,21 @@ static int get_map_type(struct mapping_struct *info)
 static unsigned long alloc_mapping_page(struct mm_struct *mm)
 {
 	struct page *page;
+	unsigned long addr;
+
+	/* reuse the table page released before */
+	if (mm->free_tables) {
+		addr = mm->free_tables;
+		mm->free_tables = *(unsigned long *)addr;
+		memset((void *)addr, 0, PAGE_SIZE);
+		return addr;
+	}
 
-	page = alloc_page();
+	/* the page table of a colored vm use its own colors */
+	if (mm->colors)
+		page = alloc_color_page(mm->colors, &mm->color_next);
+	else
+		page = alloc_page_node(mm->node);
 	if (!page)
 		return 0;
 
@@ -119,12 +132,115 @@ static unsigned long alloc_mapping_page(struct mm_struct *mm)
 	return (unsigned long)(page_to_addr(page));
 }
 
+/*
+ * the page is still on the page list of the mm and is freed
+ * with the mm, it is put on the free table list whose link is
+ * kept in the page itself, so the release does not need to
+ * walk the page list. the boot pages used by the early
+ * mapping are not allocated by the page allocator and are
+ * skipped. the caller need to make sure the page is not
+ * used by the tlb any more
+ */
+void release_mapping_page(struct mm_struct *mm, unsigned long addr)
+{
+	if (!addr_to_page((void *)addr))
+		return;
+
+	*(unsigned long *)addr = mm->free_tables;
+	mm->free_tables = addr;
+}
+
+static int table_entry_count(unsigned long *table)
+{
+	int i, count = 0;
+
+	for (i = 0; i < PAGE_MAPPING_COUNT; i++) {
+		if (table[i])
+			count++;
+	}
+
+	return count;
+}
+
+static void release_table_pages(struct mm_struct *mm,
+		unsigned long table, int lvl)
+{
+	int i;
+	unsigned long *entry = (unsigned long *)table;
+
+	if (lvl < PTE) {
+		for (i = 0; i < PAGE_MAPPING_COUNT; i++) {
+			if (get_mapping_type(lvl, entry[i]) != VM_DES_TABLE)
+				continue;
+
+			release_table_pages(mm, entry[i] &
+					PAGETABLE_PAGE_MASK, lvl + 1);
+		}
+	}
+
+	release_mapping_page(mm, table);
+}
+
+static void flush_mapping_tlb(unsigned long flags,
+		unsigned long vir, size_t size)
+{
+	if (flags & VM_HOST)
+		flush_tlb_va_host(vir, size);
+	else
+		flush_all_tlbis_guest();
+}
+
+/*
+ * if all the pages in the pte table map a contiguous and
+ * aligned memory with the same attribute, the table can be
+ * replaced by a block entry
+ */
+static int pte_table_contiguous(unsigned long *pte, unsigned long attr)
+{
+	int i;
+	unsigned long base = pte[0] & PAGETABLE_PAGE_MASK;
+
+	if (base & (PMD_MAP_SIZE - 1))
+		return 0;
+
+	for (i = 0; i < PAGE_MAPPING_COUNT; i++) {
+		if (pte[i] != (base | attr))
+			return 0;
+		base += PAGE_SIZE;
+	}
+
+	return 1;
+}
+
+static void collapse_table_entry(struct mm_struct *mm, unsigned long *entry,
+		struct mapping_struct *info, unsigned long vir)
+{
+	unsigned long pte = *entry & PAGETABLE_PAGE_MASK;
+
+	/* the pte tables of a colored vm are always kept */
+	if ((info->lvl != PTE) || (info->flags & VM_HOST) || mm->colors)
+		return;
+
+	if (!pte_table_contiguous((unsigned long *)pte,
+			page_table_description(info->flags | VM_DES_PAGE)))
+		return;
+
+	/* break before make when change the table to block */
+	*entry = 0;
+	flush_mapping_tlb(info->flags, ALIGN(vir, PMD_MAP_SIZE), PMD_MAP_SIZE);
+	*entry = (*(unsigned long *)pte & PAGETABLE_ATTR_MASK) |
+		page_table_description(info->flags | VM_DES_BLOCK);
+
+	release_mapping_page(mm, pte);
+}
+
 static int create_page_entry(struct mm_struct *mm,
 		struct mapping_struct *info)
 {
 	int i, map_type;
 	uint32_t offset, index;
 	uint64_t attr;
+	unsigned long old;
 	struct pagetable_attr *config = info->config;
 	unsigned long *tbase = (unsigned long *)info->table_base;
 
@@ -139,6 +255,20 @@ static int create_page_entry(struct mm_struct *mm,
 	index = (info->vir_base & config->offset_mask) >> offset;
 
 	for (i = 0; i < (info->size >> offset); i++) {
+		/*
+		 * the range was mapped by a lower level table,
+		 * free the table after the entry is invalid in tlb
+		 */
+		old = *(tbase + index);
+		if ((map_type == VM_DES_BLOCK) && (get_mapping_type(
+				info->lvl, old) == VM_DES_TABLE)) {
+			*(tbase + index) = 0;
+			flush_mapping_tlb(info->flags, info->vir_base,
+					config->map_size);
+			release_table_pages(mm, old & PAGETABLE_PAGE_MASK,
+					info->lvl + 1);
+		}
+
 		*(tbase + index) = attr | (info->phy_base &
 				DESC_MASK(config->des_offset));
 		info->vir_base += config->map_size;
@@ -202,11 +332,8 @@ static int create_table_entry(struct mm_struct *mm,
 		/*
 		 * get next level map entry type, if the entry
 		 * has been already maped then force it to a
-		 * Table description
-		 *
-		 * FIX ME: if the attribute of the page table entry
-		 * is changed, such as from TABLE to BLOCK, need to
-		 * free the page table page --- TBD
+		 * Table description, a TABLE entry which is changed
+		 * to BLOCK will free its table in create_page_entry
 		 */
 		map_type = get_map_type(&map_info);
 
@@ -214,15 +341,21 @@ static int create_table_entry(struct mm_struct *mm,
 			ret = create_table_entry(mm, &map_info);
 		else
 			ret = create_page_entry(mm, &map_info);
+
 		if (ret) {
 			if (new_page) {
-				free((void *)value);
+				*(tbase + offset) = 0;
+				release_mapping_page(mm, value);
 				new_page = 0;
 			}
 
 			return ret;
 		}
 
+		/* the range of the pte table may be fully populated */
+		collapse_table_entry(mm, tbase + offset,
+				&map_info, info->vir_base);
+
 		info->vir_base += map_size;
 		size -= map_size;
 		info->phy_base += map_size;
@@ -268,75 +401,111 @@ int create_mem_mapping(struct mm_struct *mm, vir_addr_t addr,
 	return ret;
 }
 
-static int __destroy_mem_mapping(struct mapping_struct *info)
+/*
+ * clear the entries of the range, the table which has no
+ * valid entry after that is removed from its upper table
+ * and added to the release list, it can only be freed
+ * after the tlb is flushed
+ */
+static void __destroy_mem_mapping(struct mm_struct *mm,
+		unsigned long *table, int lvl, unsigned long vir,
+		unsigned long end, struct page **release)
 {
-	int type;
-	int lvl = info->lvl;
-	unsigned long *table;
-	long size = (long)info->size;
-	unsigned long des, offset;
-	unsigned long vir = info->vir_base;
-	struct pagetable_attr *attr;
-
-	while (size > PAGE_SIZE) {
-		table = (unsigned long *)info->table_base;
-		attr = info->config;
-		do {
-			offset = (vir & attr->offset_mask) >> attr->range_offset;
-			des = *(table + offset);
-			if (des == 0) {
-				pr_error("mapping error on 0x%x\n", vir);
-				return -EINVAL;
-			}
+	struct pagetable_attr *attr = attrs[lvl];
+	unsigned long offset, des, next;
+	unsigned long *sub;
+	struct page *page;
 
-			type = get_mapping_type(lvl, des);
-			if (type == VM_DES_FAULT)
-				return -EINVAL;
-
-			if (type == VM_DES_TABLE) {
-				lvl++;
-				table = (unsigned long *)(des & ~PAGE_MASK);
-				attr = attr->next;
-				if ((lvl > PTE) || (attr == NULL)) {
-					pr_error("mapping error on 0x%x\n", vir);
-					return -EINVAL;
+	while (vir < end) {
+		next = (vir & ~(attr->map_size - 1)) + attr->map_size;
+		if ((next > end) || (next == 0))
+			next = end;
+
+		offset = (vir & attr->offset_mask) >> attr->range_offset;
+		des = *(table + offset);
+
+		if ((lvl < PTE) &&
+				(get_mapping_type(lvl, des) == VM_DES_TABLE)) {
+			sub = (unsigned long *)(des & PAGETABLE_PAGE_MASK);
+			__destroy_mem_mapping(mm, sub, lvl + 1,
+					vir, next, release);
+
+			if (!table_entry_count(sub)) {
+				page = unlink_mapping_page(mm,
+						(unsigned long)sub);
+				if (page) {
+					*(table + offset) = 0;
+					page->next = *release;
+					*release = page;
 				}
-			} else {
-				*(table + offset) = 0;
-				size -= attr->map_size;
-				vir += attr->map_size;
-				break;
 			}
-		} while (1);
-	}
+		} else {
+			*(table + offset) = 0;
+		}
 
-	return 0;
+		vir = next;
+	}
 }
 
 int destroy_mem_mapping(struct mm_struct *mm, unsigned long vir,
 		size_t size, unsigned long flags)
 {
-	struct mapping_struct map_info;
-
-	memset(&map_info, 0, sizeof(struct mapping_struct));
-	map_info.table_base = mm->pgd_base;
-	map_info.vir_base = vir;
-	map_info.lvl = PGD;
-	map_info.size = size;
-	map_info.config = attrs[PGD];
+	int lvl = (flags & VM_HOST) ? PGD : PUD;
+	struct page *release = NULL, *page;
 
 	spin_lock(&mm->lock);
-	__destroy_mem_mapping(&map_info);
+	__destroy_mem_mapping(mm, (unsigned long *)mm->pgd_base,
+			lvl, vir, vir + size, &release);
 	spin_unlock(&mm->lock);
 
 	if (flags & VM_HOST)
 		flush_tlb_va_host(vir, size);
+	else if (release)
+		flush_all_tlbis_guest();
 	else
 		flush_local_tlb_guest();
 
+	while (release) {
+		page = release;
+		release = page->next;
+		release_pages(page);
+	}
+
 	return 0;
 }
 
+/*
+ * free the pmd table of the guest ipa if it has no valid
+ * entry, used when a whole 1G range is unmapped
+ */
+void release_guest_pmd(struct mm_struct *mm, unsigned long ipa)
+{
+	unsigned long *pud, *pmd;
+	struct page *page = NULL;
+
+	spin_lock(&mm->lock);
+
+	pud = (unsigned long *)mm->pgd_base +
+		((ipa & PUD_ENTRY_OFFSET_MASK) >> PUD_RANGE_OFFSET);
+	if (get_mapping_type(PUD, *pud) != VM_DES_TABLE)
+		goto out;
+
+	pmd = (unsigned long *)(*pud & PAGETABLE_PAGE_MASK);
+	if (table_entry_count(pmd))
+		goto out;
+
+	page = unlink_mapping_page(mm, (unsigned long)pmd);
+	if (page)
+		*pud = 0;
+out:
+	spin_unlock(&mm->lock);
+
+	if (page) {
+		flush_all_tlbis_guest();
+		release_pages(page);
+	}
+}
+
 unsigned long get_mapping_entry(unsigned long tt,
 		unsigned long vir, int start, int end)
 {
@@ -18,6 +18,9 @@
 #include <asm/arch.h>
 #include <minos/sched.h>
 #include <minos/platform.h>
+#include <minos/mem_merge.h>
+#include <minos/mem_reclaim.h>
+#include <minos/mem_wss.h>
 
 void system_reboot(void)
 {
@@ -64,6 +67,18 @@ void cpu_idle(void)
 	while (1) {
 		sched();
 
+		/*
+		 * use the idle time to merge and reclaim the guest
+		 * memory, track its working set, release the
+		 * destroyed vms and clear the free blocks for the
+		 * zero pool
+		 */
+		vm_release_scan();
+		mem_merge_scan();
+		mem_reclaim_scan();
+		mem_wss_scan();
+		zero_pool_fill();
+
 		/*
 		 * need to check whether the pcpu can go to idle
 		 * state to avoid the interrupt happend before wfi
@@ -24,6 +24,7 @@
 #include <minos/time.h>
 #include <minos/virq.h>
 #include <minos/vmodule.h>
+#include <minos/trace.h>
 
 extern void sched_tick_disable(void);
 extern void sched_tick_enable(unsigned long exp);
@@ -57,6 +58,10 @@ void switch_to_vcpu(struct vcpu *current, struct vcpu *next)
 	struct pcpu *pcpu = get_cpu_var(pcpu);
 
 	if (current != next) {
+		trace_event(TRACE_VCPU_SWITCH, next, current->is_idle ?
+				TRACE_NO_VM : get_vmid(current),
+				get_vcpu_id(current));
+
 		if (!current->is_idle)
 			save_vcpu_state(current);
 
@@ -21,6 +21,8 @@
 #include <minos/softirq.h>
 #include <minos/time.h>
 #include <minos/arch.h>
+#include <minos/sched.h>
+#include <minos/trace.h>
 
 DEFINE_PER_CPU(struct timers, timers);
 
@@ -43,6 +45,9 @@ static void run_timer_softirq(struct softirq_action *h)
 			 * should aquire the spinlock ?
 			 * TBD
 			 */
+			trace_event(TRACE_TIMER, current_vcpu,
+					(unsigned long)timer->function,
+					timer->expires);
 			list_del(&timer->entry);
 			timer->entry.next = NULL;
 			timer->expires = (unsigned long)~0;
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <minos/minos.h>
+#include <minos/vcpu.h>
+#include <minos/sched.h>
+#include <minos/mm.h>
+#include <minos/vmm.h>
+#include <minos/percpu.h>
+#include <minos/time.h>
+#include <minos/trace.h>
+
+#define TRACE_SIZE	\
+	PAGE_BALIGN(CONFIG_NR_CPUS * sizeof(struct trace_ring))
+
+int trace_enabled;
+
+static DEFINE_SPIN_LOCK(trace_lock);
+static struct trace_ring *trace_rings;
+static unsigned long hvm_trace_rings;
+
+static DEFINE_PER_CPU(struct trace_ring *, trace_ring);
+
+void __trace_event(int event, struct vcpu *vcpu,
+		uint64_t arg0, uint64_t arg1)
+{
+	unsigned long flags;
+	struct trace_entry *entry;
+	struct trace_ring *ring = get_cpu_var(trace_ring);
+
+	/* the irq handler on this pcpu may also write the ring */
+	local_irq_save(flags);
+
+	entry = &ring->entry[ring->head & TRACE_RING_MASK];
+	entry->ts = get_sys_ticks();
+	entry->event = event;
+	if (!vcpu || vcpu->is_idle) {
+		entry->vmid = TRACE_NO_VM;
+		entry->vcpu_id = 0;
+	} else {
+		entry->vmid = get_vmid(vcpu);
+		entry->vcpu_id = get_vcpu_id(vcpu);
+	}
+	entry->arg0 = arg0;
+	entry->arg1 = arg1;
+
+	dsb();
+	ring->head++;
+
+	local_irq_restore(flags);
+}
+
+static int trace_exit_from_guest(void *item, void *data)
+{
+	gp_regs *regs = (gp_regs *)data;
+
+	if (regs)
+		trace_event(TRACE_GUEST_EXIT, (struct vcpu *)item,
+				regs->esr_elx, regs->elr_elx);
+	else
+		trace_event(TRACE_GUEST_EXIT, (struct vcpu *)item, 0, 0);
+
+	return 0;
+}
+
+static int trace_enter_to_guest(void *item, void *data)
+{
+	trace_event(TRACE_GUEST_ENTRY, (struct vcpu *)item, 0, 0);
+
+	return 0;
+}
+
+static int trace_alloc_rings(void)
+{
+	int i;
+	struct trace_ring *ring;
+
+	trace_rings = (struct trace_ring *)get_io_pages(PAGE_NR(TRACE_SIZE));
+	if (!trace_rings)
+		return -ENOMEM;
+
+	memset(trace_rings, 0, TRACE_SIZE);
+	for (i = 0; i < CONFIG_NR_CPUS; i++) {
+		ring = &trace_rings[i];
+		ring->cpu = i;
+		ring->nr_entries = TRACE_RING_ENTRIES;
+		ring->freq = (uint64_t)cpu_khz * 1000;
+		get_per_cpu(trace_ring, i) = ring;
+	}
+
+	hvm_trace_rings = create_hvm_iomem_map((unsigned long)trace_rings,
+			TRACE_SIZE);
+	if (!hvm_trace_rings) {
+		pr_error("mapping trace rings to hvm failed\n");
+		free(trace_rings);
+		trace_rings = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * the rings are allocated when the trace is enabled first
+ * time and kept since the hvm may still map them, return
+ * the hvm address of the rings
+ */
+int trace_config(int enable, unsigned long *base, size_t *size)
+{
+	int ret = 0;
+
+	spin_lock(&trace_lock);
+
+	if (enable && !trace_rings)
+		ret = trace_alloc_rings();
+
+	if (!ret) {
+		dsb();
+		trace_enabled = !!enable;
+	}
+
+	*base = hvm_trace_rings;
+	*size = trace_rings ? TRACE_SIZE : 0;
+
+	spin_unlock(&trace_lock);
+
+	pr_info("trace %s\n", trace_enabled ? "enabled" : "disabled");
+
+	return ret;
+}
+
+static int trace_init(void)
+{
+	register_hook(trace_exit_from_guest,
+			MINOS_HOOK_TYPE_EXIT_FROM_GUEST);
+	register_hook(trace_enter_to_guest,
+			MINOS_HOOK_TYPE_ENTER_TO_GUEST);
+
+	return 0;
+}
+subsys_initcall(trace_init);
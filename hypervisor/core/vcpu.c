@@ -27,6 +27,7 @@
 #include <minos/virq.h>
 #include <minos/vmm.h>
 #include <minos/vdev.h>
+#include <minos/time.h>
 
 extern unsigned char __vm_start;
 extern unsigned char __vm_end;
@@ -46,8 +47,10 @@ static int alloc_new_vmid(void)
 
 	spin_lock(&vms_lock);
 	vmid = find_next_zero_bit_loop(vmid_bitmap, CONFIG_MAX_VM, start);
-	if (vmid >= CONFIG_MAX_VM)
+	if (vmid >= CONFIG_MAX_VM) {
+		vmid = VMID_INVALID;
 		goto out;
+	}
 
 	set_bit(vmid, vmid_bitmap);
 out:
@@ -267,7 +270,7 @@ static void release_vcpu(struct vcpu *vcpu)
 	free(vcpu);
 }
 
-static struct vcpu *alloc_vcpu(size_t size)
+static struct vcpu *alloc_vcpu(size_t size, int node)
 {
 	struct vcpu *vcpu;
 	void *stack_base = NULL;
@@ -282,7 +285,7 @@ static struct vcpu *alloc_vcpu(size_t size)
 		goto free_vcpu;
 
 	if (size) {
-		stack_base = (void *)get_free_pages(PAGE_NR(size));
+		stack_base = get_free_pages_node(PAGE_NR(size), node);
 		if (!stack_base)
 			goto free_virq_struct;
 	}
@@ -307,7 +310,8 @@ static struct vcpu *create_vcpu(struct vm *vm, uint32_t vcpu_id)
 	char name[64];
 	struct vcpu *vcpu;
 
-	vcpu = alloc_vcpu(VCPU_DEFAULT_STACK_SIZE);
+	vcpu = alloc_vcpu(VCPU_DEFAULT_STACK_SIZE,
+			cpu_to_node(vm->vcpu_affinity[vcpu_id]));
 	if (!vcpu)
 		return NULL;
 
@@ -398,22 +402,27 @@ int vcpu_reset(struct vcpu *vcpu)
 	return 0;
 }
 
-void destroy_vm(struct vm *vm)
+/*
+ * the destroyed vm is released by the idle pcpus, its vmid
+ * is kept in the bitmap until all the resource is released
+ */
+static LIST_HEAD(vm_release_list);
+static DEFINE_SPIN_LOCK(vm_release_lock);
+static unsigned long vm_releasing;
+
+#define VM_RELEASE_BLOCKS	(64)
+
+static void release_vm_resource(struct vm *vm)
 {
 	int i;
 	struct vdev *vdev, *n;
 	struct vcpu *vcpu;
 
-	if (!vm)
-		return;
-
 	/*
 	 * 1 : release the vdev
 	 * 2 : do hooks for each modules
 	 * 3 : release the vcpu allocated to this vm
-	 * 4 : free the memory for this VM
-	 * 5 : update the vmid bitmap
-	 * 6 : do vmodule deinit
+	 * 4 : do vmodule deinit
 	 */
 	list_for_each_entry_safe(vdev, n, &vm->vdev_list, list) {
 		list_del(&vdev->list);
@@ -421,6 +430,8 @@ void destroy_vm(struct vm *vm)
 			vdev->deinit(vdev);
 	}
 
+	vdev_index_release(vm);
+
 	do_hooks((void *)vm, NULL, MINOS_HOOK_TYPE_DESTROY_VM);
 
 	if (vm->vcpus) {
@@ -441,19 +452,128 @@ void destroy_vm(struct vm *vm)
 	if (vm->vmcs)
 		free(vm->vmcs);
 
+	if (vm->coalesce)
+		free(vm->coalesce);
+
+	vm->vcpus = NULL;
 	vm->hvm_vmcs = NULL;
 	vm->vmcs = NULL;
+	vm->coalesce = NULL;
+}
+
+/*
+ * release the first vm in the list by one step, the vdevs
+ * and vcpus first, then the mem_blocks by batch so a large
+ * vm will not hold the idle pcpu too long, and the page
+ * tables at last. the caller need to own vm_releasing
+ */
+static void __vm_release_step(void)
+{
+	int vmid;
+	struct vm *vm = NULL;
+
+	spin_lock(&vm_release_lock);
+	if (!is_list_empty(&vm_release_list))
+		vm = list_first_entry(&vm_release_list,
+				struct vm, vm_list);
+	spin_unlock(&vm_release_lock);
+
+	if (!vm)
+		return;
+
+	if (vm->vcpus) {
+		release_vm_resource(vm);
+		return;
+	}
+
+	if (release_vm_blocks(vm, VM_RELEASE_BLOCKS))
+		return;
+
 	release_vm_memory(vm);
 
-	i = vm->vmid;
-	spin_lock(&vms_lock);
-	clear_bit(i, vmid_bitmap);
+	spin_lock(&vm_release_lock);
 	list_del(&vm->vm_list);
-	spin_unlock(&vms_lock);
+	spin_unlock(&vm_release_lock);
 
+	vmid = vm->vmid;
+	pr_info("vm-%d released in %dus\n", vmid,
+			(int)((NOW() - vm->release_time) / 1000));
 	free(vm);
-	vms[i] = NULL;
+
+	spin_lock(&vms_lock);
+	clear_bit(vmid, vmid_bitmap);
 	total_vms--;
+	spin_unlock(&vms_lock);
+}
+
+void vm_release_scan(void)
+{
+	if (is_list_empty(&vm_release_list))
+		return;
+
+	if (test_and_set_bit(0, &vm_releasing))
+		return;
+
+	__vm_release_step();
+	clear_bit(0, &vm_releasing);
+}
+
+/*
+ * release all the destroyed vms now, called when a new vm
+ * needs the vmid or the memory which is still held by them
+ */
+void vm_release_flush(void)
+{
+	while (!is_list_empty(&vm_release_list)) {
+		if (test_and_set_bit(0, &vm_releasing)) {
+			cpu_relax();
+			continue;
+		}
+
+		__vm_release_step();
+		clear_bit(0, &vm_releasing);
+	}
+}
+
+int vm_release_pending(int vmid)
+{
+	int pending = 0;
+	struct vm *vm;
+
+	spin_lock(&vm_release_lock);
+	list_for_each_entry(vm, &vm_release_list, vm_list) {
+		if (vm->vmid == vmid) {
+			pending = 1;
+			break;
+		}
+	}
+	spin_unlock(&vm_release_lock);
+
+	return pending;
+}
+
+/*
+ * the vm is stopped and removed from the vm list at once,
+ * then its vdevs, memory and page tables are released by
+ * the idle pcpus with vm_release_scan()
+ */
+void destroy_vm(struct vm *vm)
+{
+	if (!vm)
+		return;
+
+	if (vm->state != VM_STAT_OFFLINE)
+		vm_power_off(vm->vmid, (void *)vm);
+
+	spin_lock(&vms_lock);
+	list_del(&vm->vm_list);
+	vms[vm->vmid] = NULL;
+	spin_unlock(&vms_lock);
+
+	vm->release_time = NOW();
+	spin_lock(&vm_release_lock);
+	list_add_tail(&vm_release_list, &vm->vm_list);
+	spin_unlock(&vm_release_lock);
 }
 
 struct vcpu *create_idle_vcpu(void)
@@ -463,7 +583,7 @@ struct vcpu *create_idle_vcpu(void)
 	extern unsigned char __el2_stack_end;
 	void *el2_stack_base = (void *)&__el2_stack_end;
 
-	idle = alloc_vcpu(0);
+	idle = alloc_vcpu(0, cpu_to_node(cpu));
 	if (!idle)
 		panic("Can not create idle vcpu\n");
 
@@ -546,9 +666,16 @@ struct vm *create_vm(struct vmtag *vme)
 
 	if ((vme->vmid < 0) || (vme->vmid >= CONFIG_MAX_VM)) {
 		vme->vmid = alloc_new_vmid();
+		if (vme->vmid == VMID_INVALID) {
+			vm_release_flush();
+			vme->vmid = alloc_new_vmid();
+		}
 		if (vme->vmid == VMID_INVALID)
 			return NULL;
 	} else {
+		if (vm_release_pending(vme->vmid))
+			vm_release_flush();
+
 		spin_lock(&vms_lock);
 		if (test_bit(vme->vmid, vmid_bitmap)) {
 			spin_unlock(&vms_lock);
@@ -568,6 +695,11 @@ struct vm *create_vm(struct vmtag *vme)
 		vm->flags |= VM_FLAGS_NATIVE;
 
 	vm_mm_struct_init(vm);
+	pr_info("vm-%d memory node-%d\n", vm->vmid, vm->mm.node);
+	vm->mm.colors = vme->cache_colors & CACHE_COLOR_MASK;
+	if (vm->mm.colors)
+		pr_info("vm-%d using cache colors 0x%x\n",
+				vm->vmid, vm->mm.colors);
 
 	ret = create_vcpus(vm);
 	if (ret) {
@@ -16,9 +16,72 @@
 
 #include <minos/minos.h>
 #include <minos/vdev.h>
+#include <minos/vdev_index.h>
 #include <minos/virq.h>
 #include <minos/sched.h>
 
+/*
+ * the vdevs are only added before the vm is running and
+ * removed when it is released, so the index is rebuilt
+ * without lock, if there is no memory for the index the
+ * vdev list is used
+ */
+static void vdev_index_rebuild(struct vm *vm)
+{
+	int nr = 0;
+	struct vdev *vdev;
+	struct vdev_index *index;
+	struct vdev_index *old = vm->vdev_index;
+
+	list_for_each_entry(vdev, &vm->vdev_list, list)
+		nr++;
+
+	index = malloc(sizeof(struct vdev_index) +
+			nr * sizeof(struct vdev *));
+	if (index) {
+		index->nr = 0;
+		list_for_each_entry(vdev, &vm->vdev_list, list)
+			vdev_index_insert(index, vdev);
+	}
+
+	vm->vdev_index = index;
+	dsb();
+
+	if (old)
+		free(old);
+}
+
+void vdev_index_release(struct vm *vm)
+{
+	if (vm->vdev_index) {
+		free(vm->vdev_index);
+		vm->vdev_index = NULL;
+	}
+}
+
+static void vdev_add(struct vm *vm, struct vdev *vdev)
+{
+	list_add_tail(&vm->vdev_list, &vdev->list);
+	vdev_index_rebuild(vm);
+}
+
+static struct vdev *vdev_lookup(struct vm *vm, unsigned long address)
+{
+	struct vdev *vdev;
+	struct vdev_index *index = vm->vdev_index;
+
+	if (!index) {
+		list_for_each_entry(vdev, &vm->vdev_list, list) {
+			if (vdev_match(vdev, address))
+				return vdev;
+		}
+
+		return NULL;
+	}
+
+	return vdev_index_lookup(index, address);
+}
+
 void vdev_set_name(struct vdev *vdev, char *name)
 {
 	int len;
@@ -83,7 +146,7 @@ int iomem_vdev_init(struct vm *vm, struct vdev *vdev, uint32_t size)
 	vdev->deinit = vdev_deinit;
 	vdev->list.next = NULL;
 	vdev->host = 0;
-	list_add_tail(&vm->vdev_list, &vdev->list);
+	vdev_add(vm, vdev);
 
 	return 0;
 }
@@ -119,7 +182,7 @@ int host_vdev_init(struct vm *vm, struct vdev *vdev,
 	vdev->host = 1;
 	vdev->list.next = NULL;
 	vdev->deinit = vdev_deinit;
-	list_add_tail(&vm->vdev_list, &vdev->list);
+	vdev_add(vm, vdev);
 
 	return 0;
 }
@@ -164,17 +227,21 @@ unsigned long create_guest_vdev(struct vm *vm, uint32_t size)
 int vdev_mmio_emulation(gp_regs *regs, int write,
 		unsigned long address, unsigned long *value)
 {
-	struct vm *vm = current_vm;
-	struct vdev *vdev;
+	struct vcpu *vcpu = current_vcpu;
+	struct vm *vm = vcpu->vm;
+	struct vdev *vdev = vcpu->last_vdev;
+
+	/* the same vdev is often accessed again by the vcpu */
+	if (!vdev || !vdev_match(vdev, address)) {
+		vdev = vdev_lookup(vm, address);
+		vcpu->last_vdev = vdev;
+	}
 
-	list_for_each_entry(vdev, &vm->vdev_list, list) {
-		if ((address >= vdev->gvm_paddr) &&
-			(address < vdev->gvm_paddr + vdev->mem_size)) {
-			if (write)
-				return vdev->write(vdev, regs, address, value);
-			else
-				return vdev->read(vdev, regs, address, value);
-		}
+	if (vdev) {
+		if (write)
+			return vdev->write(vdev, regs, address, value);
+		else
+			return vdev->read(vdev, regs, address, value);
 	}
 
 	/*
@@ -19,6 +19,7 @@
 #include <minos/sched.h>
 #include <minos/virq.h>
 #include <minos/virq_chip.h>
+#include <minos/trace.h>
 
 static DEFINE_SPIN_LOCK(hvm_irq_lock);
 
@@ -53,11 +54,12 @@ static int inline __send_virq(struct vcpu *vcpu, struct virq_desc *desc)
 	 * if the virq is already at the pending state, do
 	 * nothing, other case need to send it to the vcpu
 	 * if the virq is in offline state, send it to vcpu
-	 * directly
+	 * directly, return 1 so the vcpu which has been
+	 * kicked for this virq is not kicked again
 	 */
 	if (virq_is_pending(desc)) {
 		spin_unlock_irqrestore(&virq_struct->lock, flags);
-		return 0;
+		return 1;
 	}
 
 	virq_set_pending(desc);
@@ -105,13 +107,15 @@ static int send_virq(struct vcpu *vcpu, struct virq_desc *desc)
 	}
 
 	ret = __send_virq(vcpu, desc);
-	if (ret) {
+	trace_event(TRACE_VIRQ_SEND, vcpu, desc->vno, ret);
+	if (ret < 0) {
 		pr_warn("send virq to vcpu-%d-%d failed\n",
 				get_vmid(vcpu), get_vcpu_id(vcpu));
 		return ret;
 	}
 
-	virq_kick_vcpu(vcpu, desc);
+	if (ret == 0)
+		virq_kick_vcpu(vcpu, desc);
 
 	return 0;
 }
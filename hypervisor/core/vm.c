@@ -113,12 +113,22 @@ static int vmtag_check_and_config(struct vmtag *tag)
 	if ((tag->mem_base + size) >= GVM_NORMAL_MEM_END)
 		return -EINVAL;;
 
-	if (!has_enough_memory(size))
-		return -EINVAL;
+	/*
+	 * memory of lazy vm is allocated when first touch, the
+	 * memory of the destroyed vms may be not released yet
+	 */
+	if (!(tag->flags & VM_FLAGS_LAZY_MEM) && !has_enough_memory(size)) {
+		vm_release_flush();
+		if (!has_enough_memory(size))
+			return -EINVAL;
+	}
 
 	if (tag->nr_vcpu > NR_CPUS)
 		return -EINVAL;
 
+	if (tag->cache_colors & ~CACHE_COLOR_MASK)
+		return -EINVAL;
+
 	/* for the dynamic need to get the affinity dynamicly */
 	if (tag->flags & VM_FLAGS_DYNAMIC_AFF)
 		get_vcpu_affinity(tag->vcpu_affinity, tag->nr_vcpu);
@@ -410,11 +420,37 @@ void set_vmtags_to(struct vmtag *tags, int count)
 	nr_static_vms = count;
 }
 
+/*
+ * the memory of a colored vm is not continuous, copy the
+ * setup data to a host mem_block and parse it there
+ */
+static int vm_create_color_host_vdev(struct vm *vm)
+{
+	int ret;
+	struct mem_block *block;
+
+	block = alloc_mem_block(0);
+	if (!block)
+		return -ENOMEM;
+
+	ret = vm_copy_color_memory(vm, (void *)block->phy_base,
+			(unsigned long)vm->setup_data, MEM_BLOCK_SIZE);
+	if (!ret)
+		ret = create_vm_resource_of(vm, (void *)block->phy_base);
+
+	release_mem_block(block);
+
+	return ret;
+}
+
 int vm_create_host_vdev(struct vm *vm)
 {
 	phy_addr_t addr;
 	int ret;
 
+	if (vm->mm.colors)
+		return vm_create_color_host_vdev(vm);
+
 	/*
 	 * map the memory of the vm's setup data to
 	 * the hypervisor's memory space, the setup
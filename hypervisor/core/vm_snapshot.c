@@ -0,0 +1,471 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <minos/minos.h>
+#include <minos/vm.h>
+#include <minos/vcpu.h>
+#include <minos/vmm.h>
+#include <minos/sched.h>
+#include <minos/virq.h>
+#include <minos/virq_chip.h>
+#include <minos/vmodule.h>
+#include <minos/bitops.h>
+#include <minos/mem_merge.h>
+#include <minos/mem_reclaim.h>
+
+/*
+ * the state of a paused vm which is exported to the host,
+ * the guest memory is not included, the host can read it
+ * from its own mapping of the vm memory
+ *
+ * | header | vcpu0 | vcpu1 | ... | vspi descs | virq chip |
+ *
+ * each vcpu contains the gp_regs, the local virq descs
+ * and the records of the vmodules, the virq chip part is
+ * the register state of the emulated distributor, the same
+ * layout is used when clone a vm from a template
+ */
+#define VM_STATE_MAGIC		(0x534d564d)
+#define VM_STATE_VERSION	(2)
+
+struct vm_state_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t nr_vcpu;
+	uint32_t vspi_nr;
+	uint32_t vcpu_size;
+	uint32_t chip_size;
+	uint32_t reserved;
+	uint64_t running;
+};
+
+static uint32_t vcpu_state_size(void)
+{
+	uint32_t size;
+
+	size = BALIGN(sizeof(gp_regs), sizeof(unsigned long));
+	size += sizeof(struct virq_desc) * VM_LOCAL_VIRQ_NR;
+	size = BALIGN(size, sizeof(unsigned long));
+
+	return size + vcpu_vmodules_dump_size();
+}
+
+static uint32_t virq_chip_state_size(struct vm *vm)
+{
+	struct virq_chip *vc = vm->virq_chip;
+
+	if (!vc || !vc->save_state)
+		return 0;
+
+	return BALIGN(vc->state_size, sizeof(unsigned long));
+}
+
+static uint32_t vm_state_size(struct vm *vm)
+{
+	return sizeof(struct vm_state_header) +
+		vm->vcpu_nr * vcpu_state_size() +
+		BALIGN(vm->vspi_nr * sizeof(struct virq_desc),
+				sizeof(unsigned long)) +
+		virq_chip_state_size(vm);
+}
+
+int vm_pause(struct vm *vm)
+{
+	int ret;
+	struct vcpu *vcpu;
+
+	if (!vm || vm_is_hvm(vm))
+		return -EPERM;
+
+	if (vm->state != VM_STAT_ONLINE)
+		return -EBUSY;
+
+	vm->state = VM_STAT_PAUSED;
+	vm->pause_mask = 0;
+
+	vm_for_each_vcpu(vm, vcpu) {
+		if (vcpu->state == VCPU_STAT_STOPPED)
+			continue;
+
+		set_bit(get_vcpu_id(vcpu), &vm->pause_mask);
+		ret = vcpu_power_off(vcpu, 1000);
+		if (ret)
+			pr_warn("pause vcpu-%d failed\n", get_vcpu_id(vcpu));
+
+		/*
+		 * the context of the vcpu is saved before it
+		 * is switched out, wait for it then the state
+		 * in the vmodule context is the latest one
+		 */
+		while (get_per_cpu(percpu_current_vcpu,
+					vcpu->affinity) == vcpu)
+			dsb();
+	}
+
+	pr_info("vm-%d paused 0x%lx\n", vm->vmid, vm->pause_mask);
+
+	return 0;
+}
+
+int vm_unpause(struct vm *vm)
+{
+	struct vcpu *vcpu;
+
+	if (!vm || (vm->state != VM_STAT_PAUSED))
+		return -EINVAL;
+
+	vm->state = VM_STAT_ONLINE;
+	dsb();
+
+	vm_for_each_vcpu(vm, vcpu) {
+		if (test_bit(get_vcpu_id(vcpu), &vm->pause_mask))
+			vcpu_online(vcpu);
+	}
+
+	pr_info("vm-%d unpaused 0x%lx\n", vm->vmid, vm->pause_mask);
+	vm->pause_mask = 0;
+
+	return 0;
+}
+
+static void *save_vcpu_state(struct vcpu *vcpu, void *buf)
+{
+	unsigned long flags;
+	uint32_t size = vcpu_vmodules_dump_size();
+	struct virq_struct *vs = vcpu->virq_struct;
+
+	memcpy(buf, stack_to_gp_regs(vcpu->stack_origin), sizeof(gp_regs));
+	buf += BALIGN(sizeof(gp_regs), sizeof(unsigned long));
+
+	/* the virq may still be sent to the vcpu by the host */
+	spin_lock_irqsave(&vs->lock, flags);
+	memcpy(buf, vs->local_desc,
+			sizeof(struct virq_desc) * VM_LOCAL_VIRQ_NR);
+	spin_unlock_irqrestore(&vs->lock, flags);
+	buf += BALIGN(sizeof(struct virq_desc) * VM_LOCAL_VIRQ_NR,
+			sizeof(unsigned long));
+
+	dump_vcpu_vmodule_state(vcpu, buf, size);
+
+	return buf + size;
+}
+
+static void __vm_save_state(struct vm *vm, void *base, uint32_t size)
+{
+	int i;
+	void *state;
+	struct vcpu *vcpu;
+	struct vm_state_header *header;
+
+	header = (struct vm_state_header *)base;
+	header->magic = VM_STATE_MAGIC;
+	header->version = VM_STATE_VERSION;
+	header->size = size;
+	header->nr_vcpu = vm->vcpu_nr;
+	header->vspi_nr = vm->vspi_nr;
+	header->vcpu_size = vcpu_state_size();
+	header->chip_size = virq_chip_state_size(vm);
+	header->reserved = 0;
+	header->running = vm->pause_mask;
+
+	state = base + sizeof(struct vm_state_header);
+	vm_for_each_vcpu(vm, vcpu)
+		state = save_vcpu_state(vcpu, state);
+
+	for (i = 0; i < vm->vspi_nr; i++)
+		memcpy(state + i * sizeof(struct virq_desc),
+				&vm->vspi_desc[i], sizeof(struct virq_desc));
+	state += BALIGN(vm->vspi_nr * sizeof(struct virq_desc),
+			sizeof(unsigned long));
+
+	if (header->chip_size)
+		vm->virq_chip->save_state(vm, state);
+}
+
+int vm_save_state(struct vm *vm, unsigned long buf, size_t size)
+{
+	int ret;
+	void *base;
+	uint32_t need;
+
+	if (!vm || vm_is_hvm(vm))
+		return -EPERM;
+
+	/* return the size which the host need to prepare */
+	need = vm_state_size(vm);
+	if (buf == 0)
+		return need;
+
+	if (size < need)
+		return -ENOSPC;
+
+	if (vm->state != VM_STAT_PAUSED)
+		return -EBUSY;
+
+	/* the buffer of the host may not be continuous in pa */
+	base = malloc(need);
+	if (!base)
+		return -ENOMEM;
+
+	__vm_save_state(vm, base, need);
+	ret = copy_to_guest(buf, base, need);
+	free(base);
+
+	return ret ? ret : need;
+}
+
+static void load_virq_desc(struct virq_desc *desc, struct virq_desc *s)
+{
+	/* hno and vmid belong to the new vm */
+	desc->id = s->id;
+	desc->state = s->state;
+	desc->pr = s->pr;
+	desc->src = s->src;
+	desc->vcpu_id = s->vcpu_id;
+	desc->flags = s->flags;
+	desc->list.next = NULL;
+}
+
+static void vcpu_attach_virq(struct vcpu *vcpu, struct virq_desc *desc)
+{
+	struct virq_struct *vs = vcpu->virq_struct;
+	struct virq_chip *vc = vcpu->vm->virq_chip;
+
+	/* the virq which has an id is already in the lr */
+	if (desc->id != VIRQ_INVALID_ID) {
+		list_add_tail(&vs->active_list, &desc->list);
+		if (vc)
+			set_bit(desc->id, vc->irq_bitmap);
+	} else if (virq_is_pending(desc))
+		list_add_tail(&vs->pending_list, &desc->list);
+	else
+		return;
+
+	vs->active_count++;
+}
+
+/*
+ * the list of the virq_struct can not be exported, rebuild
+ * them according to the state of each virq desc
+ */
+static void vcpu_rebuild_virq_struct(struct vcpu *vcpu)
+{
+	int i;
+	struct vm *vm = vcpu->vm;
+	struct virq_desc *desc;
+	struct virq_struct *vs = vcpu->virq_struct;
+
+	init_list(&vs->pending_list);
+	init_list(&vs->active_list);
+	vs->active_count = 0;
+
+	for (i = 0; i < VM_LOCAL_VIRQ_NR; i++)
+		vcpu_attach_virq(vcpu, &vs->local_desc[i]);
+
+	for (i = 0; i < vm->vspi_nr; i++) {
+		desc = &vm->vspi_desc[i];
+		if (desc->vcpu_id == get_vcpu_id(vcpu))
+			vcpu_attach_virq(vcpu, desc);
+	}
+}
+
+static int restore_vcpu_state(struct vcpu *vcpu, void *buf)
+{
+	int i;
+	struct virq_desc *desc;
+	struct virq_struct *vs = vcpu->virq_struct;
+
+	memcpy(stack_to_gp_regs(vcpu->stack_origin), buf, sizeof(gp_regs));
+	buf += BALIGN(sizeof(gp_regs), sizeof(unsigned long));
+
+	desc = (struct virq_desc *)buf;
+	for (i = 0; i < VM_LOCAL_VIRQ_NR; i++)
+		load_virq_desc(&vs->local_desc[i], &desc[i]);
+	buf += BALIGN(sizeof(struct virq_desc) * VM_LOCAL_VIRQ_NR,
+			sizeof(unsigned long));
+
+	return load_vcpu_vmodule_state(vcpu, buf,
+			vcpu_vmodules_dump_size());
+}
+
+static int __vm_restore_state(struct vm *vm, void *base, uint32_t size)
+{
+	int i, ret;
+	void *state;
+	struct vcpu *vcpu;
+	struct virq_desc *desc;
+	struct vm_state_header *header;
+
+	header = (struct vm_state_header *)base;
+	if ((header->magic != VM_STATE_MAGIC) ||
+			(header->version != VM_STATE_VERSION) ||
+			(header->size != size) ||
+			(header->nr_vcpu != vm->vcpu_nr) ||
+			(header->vspi_nr != vm->vspi_nr) ||
+			(header->vcpu_size != vcpu_state_size()) ||
+			(header->chip_size != virq_chip_state_size(vm))) {
+		pr_error("state does not match vm-%d\n", vm->vmid);
+		return -EINVAL;
+	}
+
+	/* same as vm_vcpus_init but do not online the vcpu */
+	vm_for_each_vcpu(vm, vcpu) {
+		pcpu_add_vcpu(vcpu->affinity, vcpu);
+		vcpu_vmodules_init(vcpu);
+		arch_init_vcpu(vcpu, vm->entry_point);
+
+		if (!vm_is_native(vm)) {
+			vcpu->vmcs->host_index = 0;
+			vcpu->vmcs->guest_index = 0;
+		}
+	}
+
+	/* the vcpus are initialized, do not power up them again */
+	vm->pause_mask = 0;
+	vm->state = VM_STAT_PAUSED;
+
+	state = base + sizeof(struct vm_state_header);
+	vm_for_each_vcpu(vm, vcpu) {
+		ret = restore_vcpu_state(vcpu, state);
+		if (ret)
+			return ret;
+
+		state += header->vcpu_size;
+	}
+
+	desc = (struct virq_desc *)state;
+	for (i = 0; i < vm->vspi_nr; i++)
+		load_virq_desc(&vm->vspi_desc[i], &desc[i]);
+	state += BALIGN(vm->vspi_nr * sizeof(struct virq_desc),
+			sizeof(unsigned long));
+
+	if (header->chip_size) {
+		ret = vm->virq_chip->restore_state(vm, state);
+		if (ret)
+			return ret;
+	}
+
+	vm_for_each_vcpu(vm, vcpu)
+		vcpu_rebuild_virq_struct(vcpu);
+
+	vm->pause_mask = header->running &
+		((1UL << vm->vcpu_nr) - 1);
+	dsb();
+
+	return 0;
+}
+
+/*
+ * restore the state to a vm which is created but not powered
+ * up, the vm is left in paused state so the host can restore
+ * its devices before unpause it
+ */
+int vm_restore_state(struct vm *vm, unsigned long buf, size_t size)
+{
+	int ret;
+	void *base;
+	uint32_t need;
+
+	if (!vm || vm_is_hvm(vm))
+		return -EPERM;
+
+	if (vm->state != VM_STAT_OFFLINE)
+		return -EBUSY;
+
+	need = vm_state_size(vm);
+	if (size < need)
+		return -EINVAL;
+
+	base = malloc(need);
+	if (!base)
+		return -ENOMEM;
+
+	ret = copy_from_guest(base, buf, need);
+	if (!ret)
+		ret = __vm_restore_state(vm, base, need);
+	if (!ret)
+		pr_info("vm-%d state restored 0x%lx\n",
+				vm->vmid, vm->pause_mask);
+
+	free(base);
+	return ret;
+}
+
+/*
+ * create the vm from a paused template, the memory of the
+ * template is shared with the clone and copied on write, the
+ * state of the vcpus is copied, the clone is left paused,
+ * return the number of the mem_block shared with the clone
+ */
+int vm_clone(struct vm *vm, struct vm *tmpl)
+{
+	int ret, nr;
+	void *buf;
+	uint32_t size;
+
+	if (!vm || !tmpl || (vm == tmpl) || vm_is_hvm(vm) ||
+			vm_is_hvm(tmpl) || vm_is_native(vm))
+		return -EPERM;
+
+	/* the clone share the mem_block of the template */
+	if (vm->mm.colors || tmpl->mm.colors)
+		return -EINVAL;
+
+	if (!vm_is_lazy_mem(vm))
+		return -EINVAL;
+
+	if ((vm->state != VM_STAT_OFFLINE) ||
+			(tmpl->state != VM_STAT_PAUSED))
+		return -EBUSY;
+
+	if ((vm->vcpu_nr != tmpl->vcpu_nr) ||
+			(vm->vspi_nr != tmpl->vspi_nr) ||
+			(vm->mm.mem_base != tmpl->mm.mem_base) ||
+			(vm->mm.mem_size != tmpl->mm.mem_size))
+		return -EINVAL;
+
+	/* the compressed block of the template can not be shared */
+	ret = mem_reclaim_restore_vm(tmpl);
+	if (ret)
+		return ret;
+
+	size = vm_state_size(tmpl);
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	__vm_save_state(tmpl, buf, size);
+
+	nr = mem_merge_clone_vm(vm, tmpl);
+	if (nr < 0) {
+		pr_error("share memory of vm-%d failed %d\n",
+				tmpl->vmid, nr);
+		ret = nr;
+		goto out;
+	}
+
+	ret = __vm_restore_state(vm, buf, size);
+	if (ret)
+		goto out;
+
+	pr_info("vm-%d cloned from vm-%d %d blocks shared\n",
+			vm->vmid, tmpl->vmid, nr);
+	ret = nr;
+out:
+	free(buf);
+	return ret;
+}
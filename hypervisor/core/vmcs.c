@@ -19,11 +19,166 @@
 #include <minos/sched.h>
 #include <minos/virq.h>
 #include <minos/irq.h>
+#include <minos/time.h>
+#include <minos/trace.h>
+
+#define VMCS_SPIN_TIME		MICROSECS(5)
+
+static inline int vmcs_acked(struct vmcs *vmcs, uint64_t index)
+{
+	return ((int64_t)(vmcs->guest_index - index) >= 0);
+}
+
+/*
+ * wait until mvm has handled the traps before the index,
+ * spin a short time first since mvm may be handling it,
+ * then suspend the vcpu until mvm kicks it by the ack
+ * hypercall, the interrupt context can only spin
+ */
+static void vmcs_wait(struct vcpu *vcpu, uint64_t index)
+{
+	unsigned long flags;
+	struct vmcs *vmcs = vcpu->vmcs;
+	uint64_t end = NOW() + VMCS_SPIN_TIME;
+
+	while (!vmcs_acked(vmcs, index)) {
+		if (in_interrupt || (NOW() < end)) {
+			cpu_relax();
+			continue;
+		}
+
+		/*
+		 * mvm checks waiting after update the guest_index
+		 * so one of them will see the change of the other
+		 */
+		spin_lock_irqsave(&vcpu->idle_lock, flags);
+		vmcs->waiting = 1;
+		dsb();
+		if (vmcs_acked(vmcs, index)) {
+			spin_unlock_irqrestore(&vcpu->idle_lock, flags);
+			break;
+		}
+
+		set_vcpu_suspend(vcpu);
+		spin_unlock_irqrestore(&vcpu->idle_lock, flags);
+		sched();
+	}
+
+	vmcs->waiting = 0;
+}
+
+/*
+ * called by mvm after it acks a trap which the vcpu is
+ * waiting for
+ */
+int vcpu_vmcs_ack(struct vm *vm, int vcpu_id)
+{
+	struct vcpu *vcpu = get_vcpu_in_vm(vm, vcpu_id);
+
+	if (!vcpu || !vcpu->vmcs)
+		return -ENOENT;
+
+	kick_vcpu(vcpu);
+
+	return 0;
+}
+
+/*
+ * append the mmio write to the coalesced ring if mvm has
+ * registered its address, the vcpu continues to run. mvm
+ * is only waked up by the first write after the ring is
+ * drained, it checks the ring again after update first.
+ * mvm drains the ring before it handles a trap, so if the
+ * vcpu has traps not acked yet the write is trapped, then
+ * it is handled after them
+ */
+static int vmcs_coalesce_write(struct vcpu *vcpu,
+		unsigned long addr, unsigned long *value)
+{
+	int i, empty;
+	unsigned long flags;
+	struct mmio_ring *ring;
+	struct mmio_ring_entry *entry;
+	struct mmio_coalesce *mc = vcpu->vm->coalesce;
+
+	if (!mc || !value)
+		return -ENOENT;
+
+	for (i = 0; i < mc->nr_ranges; i++) {
+		if ((addr >= mc->base[i]) &&
+				(addr < mc->base[i] + mc->size[i]))
+			break;
+	}
+
+	if (i == mc->nr_ranges)
+		return -ENOENT;
+
+	if (!vmcs_acked(vcpu->vmcs, vcpu->vmcs->host_index))
+		return -EBUSY;
+
+	ring = mc->ring;
+	spin_lock_irqsave(&mc->lock, flags);
+
+	/* full, the write is trapped after the ring is drained */
+	if (ring->last - ring->first >= MMIO_RING_SIZE) {
+		spin_unlock_irqrestore(&mc->lock, flags);
+		return -ENOSPC;
+	}
+
+	entry = &ring->ring[ring->last & MMIO_RING_MASK];
+	entry->addr = addr;
+	entry->value = *value;
+	dsb();
+	ring->last++;
+	dsb();
+	empty = (ring->first == ring->last - 1);
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	if (empty && !vcpu->vmcs->polling)
+		send_virq_to_vm(get_vm_by_id(0), vcpu->vmcs_irq);
+
+	return 0;
+}
+
+int vm_mmio_coalesce(struct vm *vm, unsigned long base, size_t size)
+{
+	struct mmio_coalesce *mc;
+
+	if (!vm || !vm->vmcs || (size == 0))
+		return -EINVAL;
+
+	mc = vm->coalesce;
+	if (!mc) {
+		mc = zalloc(sizeof(struct mmio_coalesce));
+		if (!mc)
+			return -ENOMEM;
+
+		spin_lock_init(&mc->lock);
+		mc->ring = vmcs_mmio_ring(vm->vmcs, vm->vcpu_nr);
+		vm->coalesce = mc;
+	}
+
+	if (mc->nr_ranges >= MMIO_COALESCE_RANGES)
+		return -ENOSPC;
+
+	/* the ranges are only added before the vm is running */
+	mc->base[mc->nr_ranges] = base;
+	mc->size[mc->nr_ranges] = size;
+	dsb();
+	mc->nr_ranges++;
+
+	pr_info("vm-%d coalesced mmio 0x%x 0x%x\n", vm->vmid, base, size);
+
+	return 0;
+}
 
 int __vcpu_trap(uint32_t type, uint32_t reason, unsigned long data,
 		unsigned long *result, int nonblock)
 {
+	int ret = 0;
+	uint64_t index;
 	unsigned long flags;
+	struct vmcs_entry *entry;
 	struct vcpu *vcpu = current_vcpu;
 	struct vmcs *vmcs = vcpu->vmcs;
 	struct vm *vm0 = get_vm_by_id(0);
@@ -37,6 +192,10 @@ int __vcpu_trap(uint32_t type, uint32_t reason, unsigned long data,
 			(reason >= VMTRAP_REASON_UNKNOWN))
 		return -EINVAL;
 
+	if ((type == VMTRAP_TYPE_MMIO) && (reason == VMTRAP_REASON_WRITE) &&
+			!vmcs_coalesce_write(vcpu, data, result))
+		return 0;
+
 	/*
 	 * enable the interrupt in case the vm0 shutdown
 	 * or reboot this vm when the vm is waitting for
@@ -45,40 +204,36 @@ int __vcpu_trap(uint32_t type, uint32_t reason, unsigned long data,
 	local_irq_save(flags);
 	local_irq_enable();
 
-	/*
-	 * wait for the last trap complete, if the gvm
-	 * has the same affinity pcpu with the vm0, need
-	 * to use sched() in case of dead lock
-	 */
-	while (vmcs->guest_index != vmcs->host_index) {
-		if (vcpu_affinity(vcpu) < vcpu_affinity(vm0->vcpus[0]))
-			sched();
-		else
-			cpu_relax();
-	}
+	/* wait for a free entry if the ring is full */
+	vmcs_wait(vcpu, vmcs->host_index - VMCS_RING_SIZE + 1);
 
-	vmcs->trap_type = type;
-	vmcs->trap_reason = reason;
-	vmcs->trap_data = data;
-	vmcs->trap_ret = 0;
+	index = vmcs->host_index;
+	entry = vmcs_entry(vmcs, index);
+	entry->trap_type = type;
+	entry->trap_reason = reason;
+	entry->trap_data = data;
+	entry->trap_ret = 0;
 	if (result)
-		vmcs->trap_result = *result;
+		entry->trap_result = *result;
 	else
-		vmcs->trap_result = 0;
+		entry->trap_result = 0;
 
 	/*
-	 * increase the host index of the vmcs, then send the
-	 * virq to the vcpu0 of the vm0
+	 * increase the host index of the vmcs after the entry
+	 * is visible, then send the virq to the vcpu0 of the
+	 * vm0, mvm handles all the entries posted for one virq.
+	 * if mvm is polling the ring the virq is not needed, mvm
+	 * checks the ring again after it clears polling
 	 */
-	vmcs->host_index++;
 	dsb();
+	vmcs->host_index = index + 1;
+	dsb();
+	trace_event(TRACE_VMCS_POST, vcpu, (type << 16) | reason, data);
 
-	if (send_virq_to_vm(vm0, vcpu->vmcs_irq)) {
+	if (!vmcs->polling && send_virq_to_vm(vm0, vcpu->vmcs_irq)) {
 		pr_error("vmcs failed to send virq for vm-%d\n",
 				vcpu->vm->vmid);
-		vmcs->host_index--;
-		vmcs->trap_ret = -EPERM;
-		vmcs->trap_result = 0;
+		local_irq_restore(flags);
 		return -EFAULT;
 	}
 
@@ -89,21 +244,12 @@ int __vcpu_trap(uint32_t type, uint32_t reason, unsigned long data,
 	if (vcpu_affinity(vcpu) == vcpu_affinity(vm0->vcpus[0]))
 		nonblock = 0;
 
-	/*
-	 * if gvm's vcpu is on the same pcpu which hvm
-	 * affnity, then need to call sched to sched the
-	 * hvm's vcpu in case of dead lock
-	 */
 	if (!nonblock) {
-		while (vmcs->guest_index != vmcs->host_index) {
-			if (vcpu_affinity(vcpu) < vm0->vcpu_nr)
-				sched();
-			else
-				cpu_relax();
-		}
-
+		vmcs_wait(vcpu, index + 1);
+		ret = entry->trap_ret;
+		trace_event(TRACE_VMCS_ACK, vcpu, index, ret);
 		if (result)
-			*result = vmcs->trap_result;
+			*result = entry->trap_result;
 	} else {
 		if (result)
 			*result = 0;
@@ -111,7 +257,7 @@ int __vcpu_trap(uint32_t type, uint32_t reason, unsigned long data,
 
 	local_irq_restore(flags);
 
-	return vmcs->trap_ret;
+	return ret;
 }
 
 int setup_vmcs_data(void *data, size_t size)
@@ -18,6 +18,10 @@
 #include <minos/vm.h>
 #include <minos/vcpu.h>
 #include <minos/mmu.h>
+#include <minos/time.h>
+#include <minos/mem_merge.h>
+#include <minos/mem_reclaim.h>
+#include <minos/mem_wss.h>
 
 extern unsigned char __el2_ttb0_pgd;
 extern unsigned char __el2_ttb0_pud;
@@ -32,7 +36,7 @@ static size_t hvm_normal_mmap_size = HVM_NORMAL_MMAP_SIZE;
 static unsigned long hvm_iomem_mmap_base = HVM_IO_MMAP_START;
 static size_t hvm_iomem_mmap_size = HVM_IO_MMAP_SIZE;
 
-static unsigned long alloc_pgd(void)
+static unsigned long alloc_pgd(int node)
 {
 	/*
 	 * return the table base address, this function
@@ -43,8 +47,8 @@ static unsigned long alloc_pgd(void)
 	 */
 	void *page;
 
-	page = __get_free_pages(GVM_PGD_PAGE_NR,
-			GVM_PGD_PAGE_ALIGN);
+	page = __get_free_pages_node(GVM_PGD_PAGE_NR,
+			GVM_PGD_PAGE_ALIGN, node);
 	if (!page)
 		panic("No memory to map vm memory\n");
 
@@ -129,8 +133,11 @@ static int __used destroy_guest_mapping(struct vm *vm,
 	return destroy_mem_mapping(&vm->mm, vir, size, 0);
 }
 
+static void vm_release_color_block(struct vm *vm, unsigned long offset);
+
 void release_vm_memory(struct vm *vm)
 {
+	int i;
 	struct mem_block *block, *n;
 	struct mm_struct *mm;
 	struct page *page, *tmp;
@@ -141,6 +148,11 @@ void release_vm_memory(struct vm *vm)
 	mm = &vm->mm;
 	page = mm->head;
 
+	/* drop the mem_block which shared with other vm */
+	mem_merge_release_vm(vm);
+	mem_reclaim_release_vm(vm);
+	mem_wss_release_vm(vm);
+
 	/*
 	 * - release the block list
 	 * - release the page table page and page table
@@ -151,16 +163,60 @@ void release_vm_memory(struct vm *vm)
 	list_for_each_entry_safe(block, n, &mm->block_list, list)
 		release_mem_block(block);
 
+	/* the pages of a colored vm are only recorded in stage 2 */
+	if (mm->colors && mm->block_bitmap) {
+		for (i = 0; i < (mm->mem_size >> MEM_BLOCK_SHIFT); i++) {
+			if (test_bit(i, mm->block_bitmap))
+				vm_release_color_block(vm,
+					(unsigned long)i << MEM_BLOCK_SHIFT);
+		}
+	}
+
 	while (page != NULL) {
 		tmp = page->next;
 		release_pages(page);
 		page = tmp;
 	}
 
+	if (mm->block_bitmap)
+		free(mm->block_bitmap);
+	if (mm->block_table)
+		free(mm->block_table);
+	if (mm->dirty_bitmap)
+		free(mm->dirty_bitmap);
+
 	free_pages((void *)mm->pgd_base);
 	memset(mm, 0, sizeof(struct mm_struct));
 }
 
+/*
+ * release at most nr mem_blocks of a destroyed vm, the page
+ * tables and the rest are released by release_vm_memory,
+ * return whether there are still blocks left
+ */
+int release_vm_blocks(struct vm *vm, int nr)
+{
+	struct mem_block *block;
+	struct mm_struct *mm = &vm->mm;
+
+	/* the mm_struct is already cleared */
+	if (!mm->block_list.next)
+		return 0;
+
+	mem_merge_release_vm(vm);
+	mem_reclaim_release_vm(vm);
+	mem_wss_release_vm(vm);
+
+	while ((nr-- > 0) && !is_list_empty(&mm->block_list)) {
+		block = list_first_entry(&mm->block_list,
+				struct mem_block, list);
+		list_del(&block->list);
+		release_mem_block(block);
+	}
+
+	return !is_list_empty(&mm->block_list);
+}
+
 unsigned long create_hvm_iomem_map(unsigned long phy, uint32_t size)
 {
 	unsigned long base = 0;
@@ -231,6 +287,87 @@ void unmap_vm_mem(unsigned long gva, size_t size)
 	destroy_host_mapping(pa, size);
 }
 
+/*
+ * copy between the hypervisor and a buffer of the current
+ * vm, the buffer is only contiguous in the guest va, so it
+ * is translated and mapped one page at a time
+ */
+static int copy_guest_mem(unsigned long gva, void *buf,
+		size_t size, int to_guest)
+{
+	size_t len;
+	unsigned long pa, page;
+
+	while (size > 0) {
+		len = PAGE_SIZE - (gva & PAGE_MASK);
+		if (len > size)
+			len = size;
+
+		if (guest_va_translate(gva, !to_guest, &pa))
+			return -EFAULT;
+
+		page = pa & ~PAGE_MASK;
+		if (create_host_mapping(page, page, PAGE_SIZE, 0))
+			return -ENOMEM;
+
+		if (to_guest)
+			memcpy((void *)pa, buf, len);
+		else
+			memcpy(buf, (void *)pa, len);
+
+		destroy_host_mapping(page, PAGE_SIZE);
+
+		gva += len;
+		buf += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+int copy_to_guest(unsigned long gva, void *src, size_t size)
+{
+	return copy_guest_mem(gva, src, size, 1);
+}
+
+int copy_from_guest(void *dst, unsigned long gva, size_t size)
+{
+	return copy_guest_mem(gva, dst, size, 0);
+}
+
+static unsigned long *get_guest_pmd_entry(struct mm_struct *mm,
+		unsigned long ipa)
+{
+	unsigned long *pmd;
+
+	pmd = (unsigned long *)get_mapping_pmd(mm->pgd_base, ipa, 0);
+	if (!pmd || mapping_error(pmd))
+		return NULL;
+
+	return pmd + pmd_idx(ipa);
+}
+
+static unsigned long
+get_guest_block_address(struct mm_struct *mm, unsigned long ipa)
+{
+	unsigned long *pmd;
+	unsigned long value;
+
+	pmd = (unsigned long *)get_mapping_pmd(mm->pgd_base, ipa, 0);
+	if (!pmd || mapping_error(pmd))
+		return 0;
+
+	value = *(pmd + pmd_idx(ipa));
+
+	/* the block is splited to pages by dirty log */
+	if (get_mapping_type(PMD, value) == VM_DES_TABLE)
+		value = *(unsigned long *)(value & PAGETABLE_PAGE_MASK);
+	else if (get_mapping_type(PMD, value) != VM_DES_BLOCK)
+		return 0;
+
+	return (value & PAGETABLE_ATTR_MASK);
+}
+
 int vm_mmap(struct vm *vm, unsigned long offset, unsigned long size)
 {
 	unsigned long vir, phy, value;
@@ -260,6 +397,12 @@ int vm_mmap(struct vm *vm, unsigned long offset, unsigned long size)
 
 	attr = page_table_description(VM_DES_BLOCK | VM_NORMAL);
 
+	/*
+	 * the blocks of a lazy memory vm which populated
+	 * after here will be mapped to vm0 by the vm itself
+	 */
+	mm->hvm_mmaped = 1;
+
 	while (left > 0) {
 		vm_pmd = (unsigned long *)get_mapping_pmd(mm->pgd_base, vir, 0);
 		if (mapping_error(vm_pmd))
@@ -270,9 +413,19 @@ int vm_mmap(struct vm *vm, unsigned long offset, unsigned long size)
 		count = count > left ? left : count;
 
 		for (i = 0; i < count; i++) {
-			value = *(vm_pmd + vir_off);
-			value &= PAGETABLE_ATTR_MASK;
-			value |= attr;
+			/*
+			 * the pmd table and the block of a lazy memory
+			 * vm may not be populated yet, keep the entry
+			 * empty and it will be mapped when first touch
+			 */
+			if (mm->colors) {
+				/* a colored vm share its pte table with vm0 */
+				value = vm_pmd ? *(vm_pmd + vir_off) : 0;
+			} else {
+				value = get_vm_memblock_address(vm, vir);
+				if (value)
+					value |= attr;
+			}
 
 			*(vm0_pmd + phy_off) = value;
 
@@ -324,21 +477,207 @@ void vm_unmmap(struct vm *vm)
 		memset((void *)(vm0_pmd + offset), 0,
 				count * sizeof(unsigned long));
 
-		if ((offset == 0) && (count == PAGE_MAPPING_COUNT)) {
-			/* here we can free this pmd page TBD */
-		}
+		/* the whole 1G only used by this vm, free the pmd */
+		if ((offset == 0) && (count == PAGE_MAPPING_COUNT))
+			release_guest_pmd(mm0, phy);
 
 		phy += count << PMD_RANGE_OFFSET;
 		left -= count;
 	}
 
+	mm->hvm_mmaped = 0;
 	flush_local_tlb_guest();
 }
 
+static void clear_guest_block_entry(struct mm_struct *mm, unsigned long ipa)
+{
+	unsigned long *pmd;
+
+	pmd = (unsigned long *)get_mapping_pmd(mm->pgd_base, ipa, 0);
+	if (!pmd || mapping_error(pmd))
+		return;
+
+	*(pmd + pmd_idx(ipa)) = 0;
+}
+
+/*
+ * vm0 access the memory of a colored vm by the same pte
+ * table, the pmd entry of the mmap window point to it
+ */
+static int vm_share_color_block(struct vm *vm, unsigned long offset)
+{
+	unsigned long *pmd, *vm0_pmd, value, ipa;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+
+	spin_lock(&mm->lock);
+	pmd = get_guest_pmd_entry(mm, mm->mem_base + offset);
+	value = pmd ? *pmd : 0;
+	spin_unlock(&mm->lock);
+
+	if (get_mapping_type(PMD, value) != VM_DES_TABLE)
+		return -ENOENT;
+
+	ipa = mm->hvm_mmap_base + offset;
+	vm0_pmd = (unsigned long *)alloc_guest_pmd(&vm0->mm, ipa);
+	if (!vm0_pmd)
+		return -ENOMEM;
+
+	spin_lock(&vm0->mm.lock);
+	*(vm0_pmd + pmd_idx(ipa)) = value;
+	spin_unlock(&vm0->mm.lock);
+
+	return 0;
+}
+
+/*
+ * unmap and free the pages of a mem_block of a colored vm,
+ * the pte table is kept and used again when the block is
+ * populated again
+ */
+static void vm_release_color_block(struct vm *vm, unsigned long offset)
+{
+	int i;
+	unsigned long *pmd, *pte, pa;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+
+	spin_lock(&mm->lock);
+	pmd = get_guest_pmd_entry(mm, mm->mem_base + offset);
+	if (!pmd || (get_mapping_type(PMD, *pmd) != VM_DES_TABLE)) {
+		spin_unlock(&mm->lock);
+		return;
+	}
+
+	pte = (unsigned long *)(*pmd & PAGETABLE_PAGE_MASK);
+	spin_unlock(&mm->lock);
+
+	if (mm->hvm_mmaped) {
+		spin_lock(&vm0->mm.lock);
+		clear_guest_block_entry(&vm0->mm, mm->hvm_mmap_base + offset);
+		spin_unlock(&vm0->mm.lock);
+	}
+
+	/*
+	 * invalid all the entries and flush the tlb once, then
+	 * the pages can be returned back to the color pool
+	 */
+	for (i = 0; i < PAGE_MAPPING_COUNT; i++)
+		pte[i] &= PAGETABLE_PAGE_MASK;
+
+	flush_all_tlbis_guest();
+
+	for (i = 0; i < PAGE_MAPPING_COUNT; i++) {
+		pa = pte[i];
+		pte[i] = 0;
+		if (pa)
+			free_pages((void *)pa);
+	}
+}
+
+/*
+ * the memory of a colored vm is mapped by pages, each page
+ * comes from one of the cache colors of the vm, so it will
+ * not evict the cache lines of the vm using other colors
+ */
+static int vm_populate_color_block(struct vm *vm, unsigned long offset)
+{
+	int i, ret = 0;
+	void *addr;
+	struct page *page;
+	struct mm_struct *mm = &vm->mm;
+	unsigned long ipa = mm->mem_base + offset;
+
+	for (i = 0; i < PAGES_IN_BLOCK; i++) {
+		page = alloc_color_page(mm->colors, &mm->color_next);
+		if (!page) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		addr = page_to_addr(page);
+		memset(addr, 0, PAGE_SIZE);
+		ret = create_guest_mapping(vm, ipa, (unsigned long)addr,
+				PAGE_SIZE, VM_NORMAL);
+		if (ret) {
+			free_pages(addr);
+			goto out;
+		}
+
+		ipa += PAGE_SIZE;
+	}
+
+	spin_lock(&mm->lock);
+	mm->mem_free -= MEM_BLOCK_SIZE;
+	spin_unlock(&mm->lock);
+
+	if (mm->hvm_mmaped)
+		ret = vm_share_color_block(vm, offset);
+
+	return ret;
+out:
+	pr_error("no color page to populate 0x%x for vm-%d\n",
+			mm->mem_base + offset, vm->vmid);
+	vm_release_color_block(vm, offset);
+
+	return ret;
+}
+
+/*
+ * copy the memory of a colored vm page by page, the color
+ * pages are always mapped in the host
+ */
+int vm_copy_color_memory(struct vm *vm, void *buf,
+		unsigned long ipa, size_t size)
+{
+	size_t copy;
+	unsigned long *pmd, *pte, pa;
+	struct mm_struct *mm = &vm->mm;
+
+	while (size > 0) {
+		pmd = get_guest_pmd_entry(mm, ipa);
+		if (!pmd || (get_mapping_type(PMD, *pmd) != VM_DES_TABLE))
+			return -EFAULT;
+
+		pte = (unsigned long *)(*pmd & PAGETABLE_PAGE_MASK);
+		pa = pte[ptd_idx(ipa)] & PAGETABLE_PAGE_MASK;
+		if (!pa)
+			return -EFAULT;
+
+		copy = PAGE_SIZE - (ipa & (PAGE_SIZE - 1));
+		copy = MIN(copy, size);
+		memcpy(buf, (void *)(pa + (ipa & (PAGE_SIZE - 1))), copy);
+
+		buf += copy;
+		ipa += copy;
+		size -= copy;
+	}
+
+	return 0;
+}
+
+static void vm_report_locality(struct vm *vm)
+{
+	int local = 0, remote = 0;
+	struct mem_block *block;
+	struct mm_struct *mm = &vm->mm;
+
+	list_for_each_entry(block, &mm->block_list, list) {
+		if (phy_addr_to_node(block->phy_base) == mm->node)
+			local++;
+		else
+			remote++;
+	}
+
+	pr_info("vm-%d memory on node-%d local:%d remote:%d blocks\n",
+			vm->vmid, mm->node, local, remote);
+}
+
 int alloc_vm_memory(struct vm *vm, unsigned long start, size_t size)
 {
-	int i, count;
+	int i, count, zeroed = 0;
 	unsigned long base;
+	uint64_t start_ns;
 	struct mm_struct *mm = &vm->mm;
 	struct mem_block *block;
 
@@ -351,15 +690,57 @@ int alloc_vm_memory(struct vm *vm, unsigned long start, size_t size)
 	mm->mem_free = size;
 	count = size >> MEM_BLOCK_SHIFT;
 
+	mm->block_bitmap = zalloc(BITS_TO_LONGS(count) *
+			sizeof(unsigned long));
+	mm->block_table = zalloc(count * sizeof(struct mem_block *));
+	if (!mm->block_bitmap || !mm->block_table) {
+		free(mm->block_bitmap);
+		free(mm->block_table);
+		mm->block_bitmap = NULL;
+		mm->block_table = NULL;
+		return -ENOMEM;
+	}
+
+	/*
+	 * for lazy memory vm, the mem_block will be allocated
+	 * and mapped when the guest first touch it, here only
+	 * need to allocate the bitmap to track them
+	 */
+	mem_merge_init_vm(vm);
+
+	if (vm_is_lazy_mem(vm)) {
+		pr_info("vm-%d memory will be populated on node-%d\n",
+				vm->vmid, mm->node);
+		return 0;
+	}
+
+	if (mm->colors) {
+		for (i = 0; i < count; i++) {
+			set_bit(i, mm->block_bitmap);
+			if (vm_populate_color_block(vm,
+					(unsigned long)i << MEM_BLOCK_SHIFT))
+				goto free_vm_memory;
+		}
+
+		return 0;
+	}
+
 	/*
 	 * here get all the memory block for the vm
 	 * TBD: get contiueous memory or not contiueous ?
 	 */
+	start_ns = NOW();
 	for (i = 0; i < count; i++) {
-		block = alloc_mem_block(GFB_VM);
+		block = alloc_mem_block_node(GFB_VM, mm->node);
 		if (!block)
 			goto free_vm_memory;
 
+		/* the blocks not from the zero pool need to clear */
+		if (block->flags & GFB_ZERO)
+			zeroed++;
+		else
+			clear_mem_block(block);
+
 		block->vmid = vm->vmid;
 		list_add_tail(&mm->block_list, &block->list);
 		mm->mem_free -= MEM_BLOCK_SIZE;
@@ -369,15 +750,22 @@ int alloc_vm_memory(struct vm *vm, unsigned long start, size_t size)
 	 * begin to map the memory for guest, actually
 	 * this is map the ipa to pa in stage 2
 	 */
+	i = 0;
 	list_for_each_entry(block, &mm->block_list, list) {
-		i = create_guest_mapping(vm, base, block->phy_base,
-				MEM_BLOCK_SIZE, VM_NORMAL);
-		if (i)
+		if (create_guest_mapping(vm, base, block->phy_base,
+				MEM_BLOCK_SIZE, VM_NORMAL))
 			goto free_vm_memory;
 
+		mm->block_table[i] = block;
+		set_bit(i++, mm->block_bitmap);
 		base += MEM_BLOCK_SIZE;
 	}
 
+	vm_report_locality(vm);
+	pr_info("vm-%d %d blocks %d pre-zeroed allocated in %dus\n",
+			vm->vmid, count, zeroed,
+			(int)((NOW() - start_ns) / 1000));
+
 	return 0;
 
 free_vm_memory:
@@ -386,25 +774,856 @@ free_vm_memory:
 	return -ENOMEM;
 }
 
-phy_addr_t get_vm_memblock_address(struct vm *vm, unsigned long a)
+/*
+ * record the mem_block mapped to the ipa, the caller need
+ * to hold the lock of the mm or own the ipa by block_bitmap
+ */
+void vm_set_memblock(struct vm *vm, unsigned long ipa,
+		struct mem_block *block)
 {
 	struct mm_struct *mm = &vm->mm;
+	unsigned long index = (ipa - mm->mem_base) >> MEM_BLOCK_SHIFT;
+
+	if (mm->block_table)
+		mm->block_table[index] = block;
+}
+
+phy_addr_t get_vm_memblock_address(struct vm *vm, unsigned long a)
+{
 	struct mem_block *block;
-	unsigned long base = 0;
-	unsigned long offset = a - mm->mem_base;
+	struct mm_struct *mm = &vm->mm;
 
 	if ((a < mm->mem_base) || (a >= mm->mem_base + mm->mem_size))
 		return 0;
 
-	list_for_each_entry(block, &mm->block_list, list) {
-		if (offset == base)
-			return block->phy_base;
-		base += MEM_BLOCK_SIZE;
+	/* the vm whose memory is not allocated by mem_block */
+	if (!mm->block_table)
+		return get_guest_block_address(mm, a);
+
+	block = mm->block_table[(a - mm->mem_base) >> MEM_BLOCK_SHIFT];
+
+	return block ? block->phy_base : 0;
+}
+
+static int vm_populate_block(struct vm *vm, unsigned long ipa)
+{
+	int ret;
+	unsigned long offset;
+	struct mem_block *block;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+
+	offset = ALIGN(ipa - mm->mem_base, MEM_BLOCK_SIZE);
+
+	/*
+	 * other vcpu is populating this block, just return
+	 * and the guest will fault again if it still not
+	 * mapped
+	 */
+	if (test_and_set_bit(offset >> MEM_BLOCK_SHIFT, mm->block_bitmap))
+		return 0;
+
+	if (mm->colors) {
+		ret = vm_populate_color_block(vm, offset);
+		if (ret)
+			clear_bit(offset >> MEM_BLOCK_SHIFT, mm->block_bitmap);
+		return ret;
+	}
+
+	/* compress a cold block if the vm reach its limit */
+	mem_reclaim_make_room(vm);
+
+	block = alloc_mem_block_node(GFB_VM, mm->node);
+	if (!block) {
+		pr_error("no memory to populate 0x%x for vm-%d\n",
+				ipa, vm->vmid);
+		clear_bit(offset >> MEM_BLOCK_SHIFT, mm->block_bitmap);
+		return -ENOMEM;
+	}
+
+	/*
+	 * the mem_block may be used by other vm before, clear it
+	 * before map it to the guest if it is not from the zero
+	 * pool, a restored vm also depends on this since the zero
+	 * blocks are not loaded
+	 */
+	if (!(block->flags & GFB_ZERO))
+		clear_mem_block(block);
+
+	block->vmid = vm->vmid;
+	spin_lock(&mm->lock);
+	list_add_tail(&mm->block_list, &block->list);
+	mm->mem_free -= MEM_BLOCK_SIZE;
+	spin_unlock(&mm->lock);
+
+	ret = create_guest_mapping(vm, mm->mem_base + offset,
+			block->phy_base, MEM_BLOCK_SIZE, VM_NORMAL);
+	if (ret)
+		return ret;
+
+	vm_set_memblock(vm, mm->mem_base + offset, block);
+
+	if (mm->hvm_mmaped)
+		ret = create_guest_mapping(vm0, mm->hvm_mmap_base + offset,
+			block->phy_base, MEM_BLOCK_SIZE, VM_NORMAL);
+
+	return ret;
+}
+
+static int vm_release_block(struct vm *vm, unsigned long ipa)
+{
+	unsigned long offset;
+	struct mem_block *block;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+
+	offset = ALIGN(ipa - mm->mem_base, MEM_BLOCK_SIZE);
+	if (!test_bit(offset >> MEM_BLOCK_SHIFT, mm->block_bitmap))
+		return mem_reclaim_release_block(vm, mm->mem_base + offset);
+
+	/* the block is shared with other vm, drop the reference */
+	if (mem_merge_release_block(vm, mm->mem_base + offset))
+		return 1;
+
+	if (mm->colors) {
+		vm_release_color_block(vm, offset);
+		spin_lock(&mm->lock);
+		mm->mem_free += MEM_BLOCK_SIZE;
+		spin_unlock(&mm->lock);
+		clear_bit(offset >> MEM_BLOCK_SHIFT, mm->block_bitmap);
+		return 1;
+	}
+
+	/* only the block owned by the vm can be released here */
+	spin_lock(&mm->lock);
+	block = mm->block_table[offset >> MEM_BLOCK_SHIFT];
+	if (block && (block->vmid == vm->vmid)) {
+		list_del(&block->list);
+		block->vmid = VMID_HOST;
+		mm->block_table[offset >> MEM_BLOCK_SHIFT] = NULL;
+		clear_guest_block_entry(mm, mm->mem_base + offset);
+		mm->mem_free += MEM_BLOCK_SIZE;
+		spin_unlock(&mm->lock);
+
+		if (mm->hvm_mmaped) {
+			spin_lock(&vm0->mm.lock);
+			clear_guest_block_entry(&vm0->mm,
+					mm->hvm_mmap_base + offset);
+			spin_unlock(&vm0->mm.lock);
+		}
+
+		/*
+		 * the block may still in the tlb of the vm and
+		 * vm0, flush all of them before the block return
+		 * back to the allocator
+		 */
+		flush_all_tlbis_guest();
+		release_mem_block(block);
+		clear_bit(offset >> MEM_BLOCK_SHIFT, mm->block_bitmap);
+
+		return 1;
+	}
+	spin_unlock(&mm->lock);
+
+	return 0;
+}
+
+/*
+ * a valid block entry can not be changed to another output
+ * address directly, clear it and flush the tlb first so no
+ * tlb entry of the old block is left when the new one is seen
+ */
+static void remap_block_entry(unsigned long *entry,
+		unsigned long old, unsigned long new, unsigned long value)
+{
+	if (old && new && (old != new)) {
+		*entry = 0;
+		flush_all_tlbis_guest();
+	}
+
+	*entry = value;
+}
+
+/*
+ * replace the mem_block which mapped to the ipa of the vm
+ * and of the vm0 mmap window, the entry only be updated when
+ * it still point to the old block, new is 0 means unmap it
+ */
+int vm_remap_block(struct vm *vm, unsigned long ipa,
+		unsigned long old, unsigned long new, unsigned long flags)
+{
+	unsigned long *pmd;
+	unsigned long offset, value = 0;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+
+	ipa = ALIGN(ipa, MEM_BLOCK_SIZE);
+	offset = ipa - mm->mem_base;
+	if (new)
+		value = new | page_table_description(VM_DES_BLOCK |
+				VM_NORMAL | flags);
+
+	spin_lock(&mm->lock);
+	pmd = (unsigned long *)get_mapping_pmd(mm->pgd_base, ipa, 0);
+	if (!pmd || mapping_error(pmd) ||
+			((*(pmd + pmd_idx(ipa)) & PAGETABLE_ATTR_MASK) != old)) {
+		spin_unlock(&mm->lock);
+		return -EAGAIN;
+	}
+
+	remap_block_entry(pmd + pmd_idx(ipa), old, new, value);
+	vm_set_memblock(vm, ipa, new ? addr_to_mem_block(new) : NULL);
+	spin_unlock(&mm->lock);
+
+	if (mm->hvm_mmaped) {
+		ipa = mm->hvm_mmap_base + offset;
+		spin_lock(&vm0->mm.lock);
+		pmd = (unsigned long *)get_mapping_pmd(vm0->mm.pgd_base, ipa, 0);
+		if (pmd && !mapping_error(pmd))
+			remap_block_entry(pmd + pmd_idx(ipa), old, new, value);
+		spin_unlock(&vm0->mm.lock);
+	}
+
+	flush_all_tlbis_guest();
+
+	return 0;
+}
+
+/*
+ * the block owned by the vm has the vmid of the vm, the
+ * block shared with other vm or released by the vm has
+ * VMID_HOST
+ */
+struct mem_block *vm_detach_block(struct vm *vm, unsigned long pa)
+{
+	struct mem_block *block;
+	struct mm_struct *mm = &vm->mm;
+
+	block = addr_to_mem_block(pa);
+	if (!block)
+		return NULL;
+
+	spin_lock(&mm->lock);
+	if (block->vmid != vm->vmid) {
+		spin_unlock(&mm->lock);
+		return NULL;
+	}
+
+	list_del(&block->list);
+	block->vmid = VMID_HOST;
+	spin_unlock(&mm->lock);
+
+	return block;
+}
+
+void vm_attach_block(struct vm *vm, struct mem_block *block)
+{
+	struct mm_struct *mm = &vm->mm;
+
+	spin_lock(&mm->lock);
+	block->vmid = vm->vmid;
+	list_add_tail(&mm->block_list, &block->list);
+	spin_unlock(&mm->lock);
+}
+
+/*
+ * test and clear the access flag of the block of the ipa,
+ * if the block is splited to pages, it is young when any
+ * page is young, return 1 if the block is accessed since
+ * last time, the caller need to flush the tlb after the
+ * flag cleared
+ */
+int vm_test_block_young(struct vm *vm, unsigned long ipa, int clear)
+{
+	int i, young = 0;
+	unsigned long *pmd, *pte;
+	struct mm_struct *mm = &vm->mm;
+
+	spin_lock(&mm->lock);
+	pmd = get_guest_pmd_entry(mm, ipa);
+	if (!pmd) {
+		young = -ENOENT;
+	} else if (get_mapping_type(PMD, *pmd) == VM_DES_BLOCK) {
+		young = !!(*pmd & PAGETABLE_ATTR_AF);
+		if (clear)
+			*pmd &= ~PAGETABLE_ATTR_AF;
+	} else if (get_mapping_type(PMD, *pmd) == VM_DES_TABLE) {
+		pte = (unsigned long *)(*pmd & PAGETABLE_PAGE_MASK);
+		for (i = 0; i < PAGE_MAPPING_COUNT; i++) {
+			if (pte[i] & PAGETABLE_ATTR_AF)
+				young = 1;
+			if (clear)
+				pte[i] &= ~PAGETABLE_ATTR_AF;
+		}
+	} else {
+		young = -ENOENT;
+	}
+	spin_unlock(&mm->lock);
+
+	return young;
+}
+
+/*
+ * the guest access the memory which access flag is cleared,
+ * the entry without access flag is not cached in the tlb, so
+ * only need to set the flag again
+ */
+static int vm_access_fault(struct vm *vm, unsigned long ipa)
+{
+	unsigned long *pmd, *pte;
+	struct mm_struct *mm = &vm->mm;
+
+	spin_lock(&mm->lock);
+	mm->access_faults++;
+	pmd = get_guest_pmd_entry(mm, ipa);
+	if (pmd && (get_mapping_type(PMD, *pmd) == VM_DES_BLOCK)) {
+		*pmd |= PAGETABLE_ATTR_AF;
+	} else if (pmd && (get_mapping_type(PMD, *pmd) == VM_DES_TABLE)) {
+		pte = (unsigned long *)(*pmd & PAGETABLE_PAGE_MASK);
+		pte[(ipa >> PAGE_SHIFT) & (PAGE_MAPPING_COUNT - 1)] |=
+				PAGETABLE_ATTR_AF;
+	}
+	spin_unlock(&mm->lock);
+
+	return 0;
+}
+
+/*
+ * split the block mapping of the ipa to page mapping, all
+ * the pages are mapped as read only, need to be called with
+ * the lock of the mm_struct held
+ */
+static int split_guest_block(struct mm_struct *mm, unsigned long ipa)
+{
+	int i;
+	struct page *page;
+	unsigned long *pmd, *pte;
+	unsigned long pa, attr;
+
+	pmd = get_guest_pmd_entry(mm, ipa);
+	if (!pmd || (get_mapping_type(PMD, *pmd) != VM_DES_BLOCK))
+		return 0;
+
+	page = alloc_page();
+	if (!page)
+		return -ENOMEM;
+
+	page->next = mm->head;
+	mm->head = page;
+	pte = (unsigned long *)page_to_addr(page);
+
+	pa = *pmd & PAGETABLE_ATTR_MASK;
+	attr = page_table_description(VM_DES_PAGE | VM_NORMAL | VM_RO);
+	for (i = 0; i < PAGE_MAPPING_COUNT; i++)
+		pte[i] = (pa + ((unsigned long)i << PAGE_SHIFT)) | attr;
+
+	/* break before make when change the block to table */
+	*pmd = 0;
+	flush_all_tlbis_guest();
+	*pmd = (unsigned long)pte | page_table_description(VM_DES_TABLE);
+
+	return 0;
+}
+
+/*
+ * merge the page mapping back to block mapping, the page
+ * table page is freed after the tlb flushed
+ */
+static void collapse_guest_block(struct mm_struct *mm, unsigned long ipa)
+{
+	unsigned long *pmd, *pte;
+
+	pmd = get_guest_pmd_entry(mm, ipa);
+	if (!pmd || (get_mapping_type(PMD, *pmd) != VM_DES_TABLE))
+		return;
+
+	pte = (unsigned long *)(*pmd & PAGETABLE_PAGE_MASK);
+
+	*pmd = 0;
+	flush_all_tlbis_guest();
+	*pmd = (*pte & PAGETABLE_ATTR_MASK) |
+		page_table_description(VM_DES_BLOCK | VM_NORMAL);
+
+	release_mapping_page(mm, (unsigned long)pte);
+}
+
+static void set_guest_page_attr(struct mm_struct *mm,
+		unsigned long ipa, unsigned long flags)
+{
+	unsigned long *pmd, *pte;
+
+	pmd = get_guest_pmd_entry(mm, ipa);
+	if (!pmd || (get_mapping_type(PMD, *pmd) != VM_DES_TABLE))
+		return;
+
+	pte = (unsigned long *)(*pmd & PAGETABLE_PAGE_MASK);
+	pte += (ipa >> PAGE_SHIFT) & (PAGE_MAPPING_COUNT - 1);
+	*pte = (*pte & PAGETABLE_PAGE_MASK) |
+		page_table_description(VM_DES_PAGE | VM_NORMAL | flags);
+}
+
+static inline int vm_block_is_merged(struct mm_struct *mm, int index)
+{
+	return (mm->merge_bitmap && test_bit(index, mm->merge_bitmap));
+}
+
+/*
+ * write protect all the pages of the block for the vm and
+ * the vm0 mmap window, if the block is still mapped as a
+ * block, it is populated or written after last time, all
+ * the pages in it are dirty
+ */
+static int vm_dirty_protect_block(struct vm *vm, int index)
+{
+	int ret;
+	unsigned long *pmd;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+	unsigned long offset = (unsigned long)index << MEM_BLOCK_SHIFT;
+
+	pmd = get_guest_pmd_entry(mm, mm->mem_base + offset);
+	if (!pmd || (get_mapping_type(PMD, *pmd) != VM_DES_BLOCK))
+		return 0;
+
+	bitmap_set(mm->dirty_bitmap, index * PAGES_IN_BLOCK, PAGES_IN_BLOCK);
+
+	ret = split_guest_block(mm, mm->mem_base + offset);
+	if (ret || !mm->hvm_mmaped)
+		return ret;
+
+	spin_lock(&vm0->mm.lock);
+	ret = split_guest_block(&vm0->mm, mm->hvm_mmap_base + offset);
+	spin_unlock(&vm0->mm.lock);
+
+	return ret;
+}
+
+int vm_dirty_log_start(struct vm *vm)
+{
+	int i, count, ret = 0;
+	unsigned long *bitmap;
+	struct mm_struct *mm = &vm->mm;
+
+	/* the dirty log only track the vm mapped by mem_block */
+	if (vm_is_hvm(vm) || !mm->block_bitmap || mm->colors)
+		return -EINVAL;
+
+	bitmap = zalloc(BITS_TO_LONGS(mm->mem_size >> PAGE_SHIFT) *
+			sizeof(unsigned long));
+	if (!bitmap)
+		return -ENOMEM;
+
+	spin_lock(&mm->lock);
+	if (mm->dirty_bitmap) {
+		spin_unlock(&mm->lock);
+		free(bitmap);
+		return -EBUSY;
+	}
+
+	mm->dirty_bitmap = bitmap;
+	spin_unlock(&mm->lock);
+
+	/* the merge scanner will skip the vm after here */
+	mem_merge_quiesce();
+
+	count = mm->mem_size >> MEM_BLOCK_SHIFT;
+
+	spin_lock(&mm->lock);
+	for (i = 0; i < count; i++) {
+		if (!test_bit(i, mm->block_bitmap) || vm_block_is_merged(mm, i))
+			continue;
+
+		ret = vm_dirty_protect_block(vm, i);
+		if (ret)
+			break;
 	}
 
+	/*
+	 * start with a clean bitmap, the caller need to copy
+	 * all the memory once after the dirty log started
+	 */
+	bitmap_clear(mm->dirty_bitmap, 0, mm->mem_size >> PAGE_SHIFT);
+	spin_unlock(&mm->lock);
+
+	flush_all_tlbis_guest();
+
+	if (ret)
+		vm_dirty_log_stop(vm);
+
+	return ret;
+}
+
+int vm_dirty_log_stop(struct vm *vm)
+{
+	int i, count;
+	unsigned long *bitmap;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+	unsigned long offset;
+
+	spin_lock(&mm->lock);
+	bitmap = mm->dirty_bitmap;
+	if (!bitmap) {
+		spin_unlock(&mm->lock);
+		return -ENOENT;
+	}
+
+	count = mm->mem_size >> MEM_BLOCK_SHIFT;
+	for (i = 0; i < count; i++) {
+		offset = (unsigned long)i << MEM_BLOCK_SHIFT;
+		collapse_guest_block(mm, mm->mem_base + offset);
+
+		if (mm->hvm_mmaped) {
+			spin_lock(&vm0->mm.lock);
+			collapse_guest_block(&vm0->mm, mm->hvm_mmap_base + offset);
+			spin_unlock(&vm0->mm.lock);
+		}
+	}
+
+	mm->dirty_bitmap = NULL;
+	spin_unlock(&mm->lock);
+
+	flush_all_tlbis_guest();
+	free(bitmap);
+
 	return 0;
 }
 
+/*
+ * copy the dirty bitmap to the buffer of vm0 and clear it,
+ * the dirty pages are write protected again, the content
+ * of them need to be read after this function return
+ */
+int vm_get_dirty_log(struct vm *vm, unsigned long buf, size_t size)
+{
+	int i, j, count, ret = 0;
+	unsigned long value, ipa;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+	int nr = BITS_TO_LONGS(mm->mem_size >> PAGE_SHIFT);
+
+	if (size < nr * sizeof(unsigned long))
+		return -EINVAL;
+
+	spin_lock(&mm->lock);
+	if (!mm->dirty_bitmap) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	count = mm->mem_size >> MEM_BLOCK_SHIFT;
+	for (i = 0; i < count; i++) {
+		if (!test_bit(i, mm->block_bitmap) || vm_block_is_merged(mm, i))
+			continue;
+
+		ret = vm_dirty_protect_block(vm, i);
+		if (ret)
+			goto out;
+	}
+
+	ret = copy_to_guest(buf, mm->dirty_bitmap, nr * sizeof(unsigned long));
+	if (ret)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		value = mm->dirty_bitmap[i];
+		mm->dirty_bitmap[i] = 0;
+
+		for (j = 0; value != 0; j++, value >>= 1) {
+			if (!(value & 1))
+				continue;
+
+			ipa = ((unsigned long)i * BITS_PER_LONG + j) << PAGE_SHIFT;
+			set_guest_page_attr(mm, mm->mem_base + ipa, VM_RO);
+
+			if (mm->hvm_mmaped) {
+				spin_lock(&vm0->mm.lock);
+				set_guest_page_attr(&vm0->mm,
+						mm->hvm_mmap_base + ipa, VM_RO);
+				spin_unlock(&vm0->mm.lock);
+			}
+		}
+	}
+out:
+	spin_unlock(&mm->lock);
+	flush_all_tlbis_guest();
+
+	return ret;
+}
+
+/*
+ * return the state of each mem_block of the vm in a byte,
+ * vm0 skips the block which is not populated and reads the
+ * compressed block without decompressing it for the vm
+ */
+int vm_get_mem_map(struct vm *vm, unsigned long buf, size_t size)
+{
+	int i, count, ret;
+	uint8_t *map;
+	struct mm_struct *mm = &vm->mm;
+
+	count = mm->mem_size >> MEM_BLOCK_SHIFT;
+	if (!mm->block_bitmap || (size < count))
+		return -EINVAL;
+
+	map = malloc(count);
+	if (!map)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		if (test_bit(i, mm->block_bitmap))
+			map[i] = VM_BLOCK_MAPPED;
+		else if (mm->reclaim_table && mm->reclaim_table[i])
+			map[i] = VM_BLOCK_RECLAIMED;
+		else
+			map[i] = VM_BLOCK_NONE;
+	}
+
+	ret = copy_to_guest(buf, map, count);
+	free(map);
+
+	return ret;
+}
+
+/*
+ * the guest or vm0 write to a write protected page when
+ * dirty log is enabled, record it and make it writeable
+ */
+static int vm_dirty_fault(struct vm *vm, unsigned long ipa)
+{
+	unsigned long offset;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+
+	spin_lock(&mm->lock);
+	if (!mm->dirty_bitmap) {
+		spin_unlock(&mm->lock);
+		return -ENOENT;
+	}
+
+	offset = PAGE_ALIGN(ipa - mm->mem_base);
+	if (!test_and_set_bit(offset >> PAGE_SHIFT, mm->dirty_bitmap)) {
+		set_guest_page_attr(mm, mm->mem_base + offset, VM_RW);
+
+		if (mm->hvm_mmaped) {
+			spin_lock(&vm0->mm.lock);
+			set_guest_page_attr(&vm0->mm,
+					mm->hvm_mmap_base + offset, VM_RW);
+			spin_unlock(&vm0->mm.lock);
+		}
+	}
+	spin_unlock(&mm->lock);
+
+	/* other pcpu will fault again and flush its own tlb */
+	flush_local_tlb_guest();
+
+	return 0;
+}
+
+int vm_populate_memory(struct vm *vm, unsigned long ipa, size_t size)
+{
+	int ret;
+	unsigned long end;
+	struct mm_struct *mm = &vm->mm;
+
+	ipa = ALIGN(ipa, MEM_BLOCK_SIZE);
+	end = BALIGN(ipa + size, MEM_BLOCK_SIZE);
+	if ((ipa < mm->mem_base) || (end > mm->mem_base + mm->mem_size))
+		return -EINVAL;
+
+	for (; ipa < end; ipa += MEM_BLOCK_SIZE) {
+		ret = vm_populate_block(vm, ipa);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int vm_release_memory(struct vm *vm, unsigned long ipa, size_t size)
+{
+	int count = 0;
+	unsigned long end;
+	struct mm_struct *mm = &vm->mm;
+
+	/* only the whole mem_block in the range can be released */
+	end = ALIGN(ipa + size, MEM_BLOCK_SIZE);
+	ipa = BALIGN(ipa, MEM_BLOCK_SIZE);
+	if ((ipa < mm->mem_base) || (end > mm->mem_base + mm->mem_size))
+		return -EINVAL;
+
+	for (; ipa < end; ipa += MEM_BLOCK_SIZE)
+		count += vm_release_block(vm, ipa);
+
+	pr_debug("release %d mem_block from vm-%d\n", count, vm->vmid);
+
+	return count;
+}
+
+static struct vm *hvm_mmap_to_vm(unsigned long ipa)
+{
+	struct vm *vm;
+
+	for_each_vm(vm) {
+		if (!vm->mm.hvm_mmaped)
+			continue;
+
+		if ((ipa >= vm->mm.hvm_mmap_base) && (ipa <
+				vm->mm.hvm_mmap_base + vm->mm.mem_size))
+			return vm;
+	}
+
+	return NULL;
+}
+
+static int hvm_mmap_fault(struct vm *vm, unsigned long ipa)
+{
+	int ret;
+	unsigned long offset, pa, *pmd;
+	struct mm_struct *mm = &vm->mm;
+	struct vm *vm0 = get_vm_by_id(0);
+
+	offset = ALIGN(ipa - mm->hvm_mmap_base, MEM_BLOCK_SIZE);
+
+	/*
+	 * the entry is being changed by other pcpu, for
+	 * example the dirty log is splitting the block, just
+	 * return and let vm0 try again
+	 */
+	pmd = get_guest_pmd_entry(&vm0->mm, mm->hvm_mmap_base + offset);
+	if ((pmd && *pmd) || (mm->dirty_bitmap &&
+			test_bit(offset >> MEM_BLOCK_SHIFT, mm->block_bitmap)))
+		return 0;
+
+	/* the block is compressed, decompress it for the vm */
+	ret = mem_reclaim_fault(vm, mm->mem_base + offset);
+	if (ret && (ret != -ENOENT))
+		return ret;
+
+	/*
+	 * vm0 touch the memory of a lazy memory vm which
+	 * not populated yet by vm_mmap, populate it for the
+	 * vm and then map it to vm0
+	 */
+	if (vm_is_lazy_mem(vm)) {
+		ret = vm_populate_block(vm, mm->mem_base + offset);
+		if (ret)
+			return ret;
+	}
+
+	if (mm->colors) {
+		if (!test_bit(offset >> MEM_BLOCK_SHIFT, mm->block_bitmap))
+			return -ENOENT;
+		return vm_share_color_block(vm, offset);
+	}
+
+	/* the block is being populated or compressed */
+	pa = get_vm_memblock_address(vm, mm->mem_base + offset);
+	if (!pa)
+		return test_bit(offset >> MEM_BLOCK_SHIFT,
+				mm->block_bitmap) ? 0 : -ENOENT;
+
+	return create_guest_mapping(vm0, mm->hvm_mmap_base + offset,
+			pa, MEM_BLOCK_SIZE, VM_NORMAL);
+}
+
+int vm_memory_fault(struct vm *vm, unsigned long ipa, int type, int write)
+{
+	int ret;
+	struct mm_struct *mm = &vm->mm;
+
+	/*
+	 * vm0 access the memory of other vm by the mmap
+	 * window, the fault is handled for the vm which
+	 * the memory belong to
+	 */
+	if (vm_is_hvm(vm)) {
+		if ((ipa < HVM_NORMAL_MMAP_START) || (ipa >=
+				HVM_NORMAL_MMAP_START + HVM_NORMAL_MMAP_SIZE))
+			return -ENOENT;
+
+		vm = hvm_mmap_to_vm(ipa);
+		if (!vm)
+			return -ENOENT;
+
+		if (type == VM_FAULT_TRANS)
+			return hvm_mmap_fault(vm, ipa);
+
+		mm = &vm->mm;
+		ipa = ipa - mm->hvm_mmap_base + mm->mem_base;
+	}
+
+	if (!mm->block_bitmap || (ipa < mm->mem_base) ||
+			(ipa >= mm->mem_base + mm->mem_size))
+		return -ENOENT;
+
+	switch (type) {
+	case VM_FAULT_TRANS:
+		/* the block is being remapped by other pcpu */
+		if (test_bit((ipa - mm->mem_base) >> MEM_BLOCK_SHIFT,
+					mm->block_bitmap))
+			return 0;
+
+		/* the block is compressed by the reclaim */
+		ret = mem_reclaim_fault(vm, ipa);
+		if (ret != -ENOENT)
+			return ret;
+
+		if (!vm_is_lazy_mem(vm))
+			return -ENOENT;
+
+		return vm_populate_block(vm, ipa);
+	case VM_FAULT_ACCESS:
+		return vm_access_fault(vm, ipa);
+	case VM_FAULT_PERM:
+		if (!write)
+			return -ENOENT;
+
+		/* write to a mem_block which shared with other vm */
+		ret = mem_merge_fault(vm, ipa);
+		if (ret != -ENOENT)
+			return ret;
+
+		ret = vm_dirty_fault(vm, ipa);
+		if (ret != -ENOENT)
+			return ret;
+
+		/*
+		 * the block is write protected by the merge
+		 * scanner for a while, try again
+		 */
+		return 0;
+	default:
+		break;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * the memory of the vm is allocated from the node which
+ * most of its vcpus are affinity to
+ */
+static int vm_memory_node(struct vm *vm)
+{
+	int i, node, best = 0;
+	int count[MAX_MEM_SECTIONS];
+
+	memset(count, 0, sizeof(count));
+
+	for (i = 0; i < vm->vcpu_nr; i++) {
+		node = cpu_to_node(vm->vcpu_affinity[i]);
+		if (node >= MAX_MEM_SECTIONS)
+			continue;
+
+		count[node]++;
+		if (count[node] > count[best])
+			best = node;
+	}
+
+	return best;
+}
+
 void vm_mm_struct_init(struct vm *vm)
 {
 	struct mm_struct *mm = &vm->mm;
@@ -412,10 +1631,12 @@ void vm_mm_struct_init(struct vm *vm)
 	init_list(&mm->mem_list);
 	init_list(&mm->block_list);
 	mm->head = NULL;
+	mm->free_tables = 0;
 	mm->pgd_base = 0;
 	spin_lock_init(&mm->lock);
 
-	mm->pgd_base = alloc_pgd();
+	mm->node = vm_memory_node(vm);
+	mm->pgd_base = alloc_pgd(mm->node);
 	if (mm->pgd_base == 0) {
 		pr_error("No memory for vm page table\n");
 		return;
@@ -461,6 +1682,7 @@ static int vmm_early_init(void)
 	memset(&host_mm, 0, sizeof(struct mm_struct));
 	spin_lock_init(&host_mm.lock);
 	host_mm.pgd_base = (unsigned long)&__el2_ttb0_pgd;
+	host_mm.node = NUMA_NO_NODE;
 
 	return 0;
 }
@@ -27,6 +27,14 @@ extern unsigned char __vmodule_end;
 static int vmodule_class_nr = 0;
 static LIST_HEAD(vmodule_list);
 
+#define VMODULE_CONTEXT_ALIGN	(16)
+
+struct vmodule_record {
+	char name[32];
+	uint32_t size;
+	uint32_t reserved;
+};
+
 static struct vmodule *create_vmodule(struct module_id *id)
 {
 	struct vmodule *vmodule;
@@ -93,38 +101,55 @@ void *get_vmodule_data_by_name(struct vcpu *vcpu, char *name)
 	return NULL;
 }
 
+/*
+ * the context data of all the vmodules and the pointer
+ * array are put in the same pages, which allocated from
+ * the node of the pcpu the vcpu affinity to
+ */
+static size_t vmodule_contexts_size(void)
+{
+	struct vmodule *vmodule;
+	size_t size;
+
+	size = BALIGN(vmodule_class_nr * sizeof(void *),
+			VMODULE_CONTEXT_ALIGN);
+	list_for_each_entry(vmodule, &vmodule_list, list)
+		size += BALIGN(vmodule->context_size, VMODULE_CONTEXT_ALIGN);
+
+	return size;
+}
+
 int vcpu_vmodules_init(struct vcpu *vcpu)
 {
-	struct list_head *list;
 	struct vmodule *vmodule;
 	void *data;
-	int size;
+	size_t size;
 
 	/*
-	 * firset allocate memory to store each vmodule
-	 * context's context data
+	 * for reboot if memory is areadly allocated
+	 * skip it and only init the context again
 	 */
-	size = vmodule_class_nr * sizeof(void *);
-	vcpu->vmodule_context = (void **)malloc(size);
-	if (!vcpu->vmodule_context)
-		panic("No more memory for vcpu vmodule cotnext\n");
+	size = vmodule_contexts_size();
+	if (!vcpu->vmodule_context) {
+		vcpu->vmodule_context = (void **)get_free_pages_node(
+				PAGE_NR(size), cpu_to_node(vcpu->affinity));
+		if (!vcpu->vmodule_context)
+			panic("No more memory for vcpu vmodule cotnext\n");
+	}
 
 	memset((char *)vcpu->vmodule_context, 0, size);
+	data = (void *)vcpu->vmodule_context + BALIGN(vmodule_class_nr *
+			sizeof(void *), VMODULE_CONTEXT_ALIGN);
 
-	list_for_each(&vmodule_list, list) {
-		vmodule = list_entry(list, struct vmodule, list);
-		if (vmodule->context_size) {
-			/* for reboot if memory is areadly allocated skip it */
-			data = vcpu->vmodule_context[vmodule->id];
-			if (!data) {
-				data = (void *)malloc(vmodule->context_size);
-				vcpu->vmodule_context[vmodule->id] = data;
-			}
-
-			memset((char *)data, 0, vmodule->context_size);
-			if (vmodule->state_init)
-				vmodule->state_init(vcpu, data);
-		}
+	list_for_each_entry(vmodule, &vmodule_list, list) {
+		if (!vmodule->context_size)
+			continue;
+
+		vcpu->vmodule_context[vmodule->id] = data;
+		if (vmodule->state_init)
+			vmodule->state_init(vcpu, data);
+
+		data += BALIGN(vmodule->context_size, VMODULE_CONTEXT_ALIGN);
 	}
 
 	return 0;
@@ -139,11 +164,11 @@ int vcpu_vmodules_deinit(struct vcpu *vcpu)
 		data = vcpu->vmodule_context[vmodule->id];
 		if (vmodule->state_deinit)
 			vmodule->state_deinit(vcpu, data);
-
-		if (data)
-			free(data);
 	}
 
+	free_pages(vcpu->vmodule_context);
+	vcpu->vmodule_context = NULL;
+
 	return 0;
 }
 
@@ -213,6 +238,100 @@ void resume_vcpu_vmodule_state(struct vcpu *vcpu)
 	}
 }
 
+uint32_t vcpu_vmodules_dump_size(void)
+{
+	uint32_t size = 0;
+	struct vmodule *vmodule;
+
+	list_for_each_entry(vmodule, &vmodule_list, list) {
+		if (vmodule->dump_size)
+			size += sizeof(struct vmodule_record) +
+				BALIGN(vmodule->dump_size, sizeof(unsigned long));
+	}
+
+	return size;
+}
+
+int dump_vcpu_vmodule_state(struct vcpu *vcpu, void *buf, uint32_t size)
+{
+	struct vmodule *vmodule;
+	struct vmodule_record *rec;
+	void *context;
+
+	if (size < vcpu_vmodules_dump_size())
+		return -EINVAL;
+
+	list_for_each_entry(vmodule, &vmodule_list, list) {
+		if (!vmodule->dump_size)
+			continue;
+
+		rec = (struct vmodule_record *)buf;
+		memset(rec, 0, sizeof(struct vmodule_record));
+		strncpy(rec->name, vmodule->name, 31);
+		rec->size = vmodule->dump_size;
+		buf += sizeof(struct vmodule_record);
+
+		context = get_vmodule_data_by_id(vcpu, vmodule->id);
+		if (vmodule->state_dump)
+			vmodule->state_dump(vcpu, context, buf);
+		else
+			memcpy(buf, context, vmodule->dump_size);
+
+		buf += BALIGN(vmodule->dump_size, sizeof(unsigned long));
+	}
+
+	return 0;
+}
+
+static struct vmodule *get_vmodule_by_name(char *name)
+{
+	struct vmodule *vmodule;
+
+	list_for_each_entry(vmodule, &vmodule_list, list) {
+		if (strcmp(vmodule->name, name) == 0)
+			return vmodule;
+	}
+
+	return NULL;
+}
+
+int load_vcpu_vmodule_state(struct vcpu *vcpu, void *buf, uint32_t size)
+{
+	struct vmodule *vmodule;
+	struct vmodule_record *rec;
+	void *context, *end = buf + size;
+
+	while (buf + sizeof(struct vmodule_record) <= end) {
+		rec = (struct vmodule_record *)buf;
+		buf += sizeof(struct vmodule_record);
+		rec->name[31] = 0;
+
+		/*
+		 * the record must match the vmodule of this
+		 * hypervisor, otherwise the snapshot is taken
+		 * by another version and can not be loaded
+		 */
+		vmodule = get_vmodule_by_name(rec->name);
+		if (!vmodule || (vmodule->dump_size != rec->size)) {
+			pr_error("vmodule %s can not be loaded\n", rec->name);
+			return -EINVAL;
+		}
+
+		if (buf + rec->size > end)
+			return -EINVAL;
+
+		context = get_vmodule_data_by_id(vcpu, vmodule->id);
+		if (vmodule->state_load)
+			vmodule->state_load(vcpu, context, buf);
+		else
+			memcpy(context, buf, vmodule->dump_size);
+
+		buf += BALIGN(rec->size, sizeof(unsigned long));
+	}
+
+	return 0;
+}
+
 int vmodules_init(void)
 {
 	int32_t i;
@@ -356,11 +356,46 @@ static int fdt_setup_memory(struct vm *vm)
 	return 0;
 }
 
+/*
+ * the proximity of the memory and the cpu is described
+ * by the numa-node-id property, the default node is 0
+ */
+static int fdt_get_numa_node(int node)
+{
+	fdt32_t *v;
+	int len;
+
+	v = (fdt32_t *)fdt_getprop(dtb, node, "numa-node-id", &len);
+	if (!v || (len < sizeof(fdt32_t)))
+		return 0;
+
+	return fdt32_to_cpu(*v);
+}
+
+static void fdt_parse_cpu_node(void)
+{
+	int offset, node, i;
+	char name[16];
+
+	offset = of_get_node_by_name(dtb, 0, "cpus");
+	if (offset <= 0)
+		return;
+
+	for (i = 0; i < CONFIG_NR_CPUS; i++) {
+		sprintf(name, "cpu@%d", i);
+		node = of_get_node_by_name(dtb, offset, name);
+		if (node <= 0)
+			continue;
+
+		set_cpu_node(i, fdt_get_numa_node(node));
+	}
+}
+
 static int __fdt_parse_memory_info(int node, char *attr)
 {
 	int len = 0;
 	uint64_t base, size;
-	int size_cell, address_cell;
+	int size_cell, address_cell, numa_node;
 	fdt32_t *v;
 
 	v = (fdt32_t *)fdt_getprop(dtb, node, attr, &len);
@@ -370,6 +405,7 @@ static int __fdt_parse_memory_info(int node, char *attr)
 	}
 
 	len = len / 4;
+	numa_node = fdt_get_numa_node(node);
 	size_cell = fdt_n_size_cells(dtb, node);
 	address_cell = fdt_n_addr_cells(dtb, node);
 	pr_info("memory node address_cells:%d size_cells:%d\n",
@@ -402,7 +438,7 @@ static int __fdt_parse_memory_info(int node, char *attr)
 		}
 
 		len -= size_cell + address_cell;
-		add_memory_region(base, size, VMID_HOST);
+		add_memory_region(base, size, VMID_HOST, numa_node);
 	}
 
 	return 0;
@@ -410,15 +446,25 @@ static int __fdt_parse_memory_info(int node, char *attr)
 
 int fdt_parse_memory_info(void)
 {
-	int node;
+	int node, len, found = 0;
+	const char *name;
+
+	/* each memory node may belong to a different node */
+	fdt_for_each_subnode(node, dtb, 0) {
+		name = fdt_get_name(dtb, node, &len);
+		if (!name || (len <= 0) || strncmp(name, "memory", 6))
+			continue;
+
+		__fdt_parse_memory_info(node, "reg");
+		found++;
+	}
 
-	node = of_get_node_by_name(dtb, 0, "memory");
-	if (node <= 0) {
+	if (!found) {
 		pr_warn("no memory node found in dtb\n");
 		return -ENOENT;
 	}
 
-	__fdt_parse_memory_info(node, "reg");
+	fdt_parse_cpu_node();
 
 	return 0;
 }
@@ -546,6 +592,8 @@ static int __fdt_parse_vm_info(int node, struct vmtag *vmtags)
 		__of_get_u64_array(dtb, child, "memory", array, 2);
 		tag->mem_base = array[0];
 		tag->mem_size = array[1];
+		__of_get_u64_array(dtb, child, "cache_colors",
+				(uint64_t *)&tag->cache_colors, 1);
 
 		if (__of_get_bool(dtb, child, "vm_32bit"))
 			tag->flags &= ~VM_FLAGS_64BIT;
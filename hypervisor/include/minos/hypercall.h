@@ -27,10 +27,33 @@
 #define HVC_VM_CREATE_VMCS		HVC_VM_FN(8)
 #define HVC_VM_CREATE_VMCS_IRQ		HVC_VM_FN(9)
 #define HVC_VM_REQUEST_VIRQ		HVC_VM_FN(10)
+#define HVC_VM_RELEASE_MEMORY		HVC_VM_FN(11)
+#define HVC_VM_POPULATE_MEMORY		HVC_VM_FN(12)
+#define HVC_VM_DIRTY_LOG		HVC_VM_FN(13)
+#define HVC_VM_GET_DIRTY_LOG		HVC_VM_FN(14)
+#define HVC_VM_PAUSE			HVC_VM_FN(15)
+#define HVC_VM_UNPAUSE			HVC_VM_FN(16)
+#define HVC_VM_SAVE_STATE		HVC_VM_FN(17)
+#define HVC_VM_RESTORE_STATE		HVC_VM_FN(18)
+#define HVC_VM_CLONE			HVC_VM_FN(19)
+#define HVC_VM_MEM_LIMIT		HVC_VM_FN(20)
+#define HVC_VM_WSS_CONFIG		HVC_VM_FN(21)
+#define HVC_VM_GET_WSS			HVC_VM_FN(22)
+#define HVC_VM_DESTROY_STATE		HVC_VM_FN(23)
+#define HVC_VM_VMCS_ACK			HVC_VM_FN(24)
+#define HVC_VM_MMIO_COALESCE		HVC_VM_FN(25)
+#define HVC_VM_GET_MEM_MAP		HVC_VM_FN(26)
+#define HVC_VM_READ_BLOCK		HVC_VM_FN(27)
 
 /* hypercall for virtio releate operation */
 #define HVC_MISC_VIRTIO_MMIO_INIT	HVC_MISC_FN(1)
 #define HVC_MISC_VIRTIO_MMIO_DEINIT	HVC_MISC_FN(2)
 #define HVC_MISC_CREATE_HOST_VDEV	HVC_MISC_FN(3)
+#define HVC_MISC_MEM_MERGE_CONFIG	HVC_MISC_FN(4)
+#define HVC_MISC_MEM_MERGE_STAT		HVC_MISC_FN(5)
+#define HVC_MISC_MEM_RECLAIM_STAT	HVC_MISC_FN(6)
+#define HVC_MISC_MEM_ZERO_STAT		HVC_MISC_FN(7)
+#define HVC_MISC_VIRTIO_DOORBELL	HVC_MISC_FN(8)
+#define HVC_MISC_TRACE			HVC_MISC_FN(9)
 
 #endif
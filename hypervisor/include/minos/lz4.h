@@ -0,0 +1,7 @@
+#ifndef __MINOS_LZ4_H__
+#define __MINOS_LZ4_H__
+
+int lz4_compress(const void *source, int size, void *dest, int max);
+int lz4_decompress(const void *source, int size, void *dest, int max);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef __MINOS_MEM_MERGE_H__
+#define __MINOS_MEM_MERGE_H__
+
+#include <minos/types.h>
+
+struct vm;
+
+/*
+ * scanned : the mem_block which have been hashed
+ * merged : how many times a mem_block merged to other
+ * cow_breaks : how many times the sharing broken by write
+ * shared_blocks : the mem_block which shared by vms
+ * sharing_blocks : the guest mem_block mapped to shared one
+ */
+struct mem_merge_stat {
+	unsigned long scanned;
+	unsigned long merged;
+	unsigned long cow_breaks;
+	unsigned long shared_blocks;
+	unsigned long sharing_blocks;
+};
+
+int mem_merge_init_vm(struct vm *vm);
+void mem_merge_release_vm(struct vm *vm);
+int mem_merge_release_block(struct vm *vm, unsigned long ipa);
+int mem_merge_fault(struct vm *vm, unsigned long ipa);
+void mem_merge_scan(void);
+void mem_merge_quiesce(void);
+int mem_merge_clone_vm(struct vm *vm, struct vm *tmpl);
+
+int mem_merge_config(int enable, uint32_t interval, uint32_t batch);
+void mem_merge_get_stat(struct mem_merge_stat *stat);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef __MINOS_MEM_RECLAIM_H__
+#define __MINOS_MEM_RECLAIM_H__
+
+#include <minos/types.h>
+
+struct vm;
+
+/*
+ * reclaimed : the mem_block compressed into the pool
+ * rejected : the mem_block can not be compressed enough
+ * faults : the mem_block decompressed when touched again
+ * pool_size : the memory used by the pool
+ * stored_size : the compressed data in the pool
+ * orig_size : the guest memory saved in the pool
+ * fault_time : the total time of the decompress fault
+ * fault_max : the max time of one decompress fault
+ */
+struct mem_reclaim_stat {
+	unsigned long reclaimed;
+	unsigned long rejected;
+	unsigned long faults;
+	unsigned long pool_size;
+	unsigned long stored_size;
+	unsigned long orig_size;
+	uint64_t fault_time;
+	uint64_t fault_max;
+};
+
+int mem_reclaim_set_limit(struct vm *vm, size_t limit);
+void mem_reclaim_release_vm(struct vm *vm);
+int mem_reclaim_release_block(struct vm *vm, unsigned long ipa);
+int mem_reclaim_fault(struct vm *vm, unsigned long ipa);
+int mem_reclaim_restore_vm(struct vm *vm);
+int mem_reclaim_read_block(struct vm *vm, unsigned long ipa,
+		unsigned long buf);
+void mem_reclaim_make_room(struct vm *vm);
+void mem_reclaim_scan(void);
+void mem_reclaim_get_stat(struct mem_reclaim_stat *stat);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __MINOS_MEM_WSS_H__
+#define __MINOS_MEM_WSS_H__
+
+#include <minos/types.h>
+
+struct vm;
+
+int mem_wss_config(struct vm *vm, unsigned long interval, unsigned long rate);
+int mem_wss_get_stat(struct vm *vm, unsigned long buf, size_t size);
+int mem_wss_block_age(struct vm *vm, int index);
+void mem_wss_release_vm(struct vm *vm);
+void mem_wss_scan(void);
+
+#endif
@@ -45,12 +45,16 @@
 #define GPF_PAGE_META		(1 << 2)
 #define GFB_VM			(1 << 3)
 #define GFB_IO			(1 << 4)
+#define GFB_COLOR		(1 << 5)
+#define GFB_ZERO		(1 << 6)
 
 #define GFB_SLAB_BIT		(0)
 #define GFB_PAGE_BIT		(1)
 #define GFB_PAGE_META_BIT	(2)
 #define GFB_VM_BIT		(3)
 #define GFB_IO_BIT		(4)
+#define GFB_COLOR_BIT		(5)
+#define GFB_ZERO_BIT		(6)
 
 #define GFB_MASK		(0xffff)
 
@@ -59,4 +63,15 @@
 #define MEM_BLOCK_SHIFT		(21)
 #define PAGES_IN_BLOCK		(MEM_BLOCK_SIZE >> PAGE_SHIFT)
 
+/*
+ * the pages which have the same address bits above the
+ * page offset and below the way size of the last level
+ * cache use the same cache sets, the number of the color
+ * is the way size / PAGE_SIZE, it must be power of 2
+ */
+#define NR_CACHE_COLORS		(CONFIG_LLC_COLORS)
+#define CACHE_COLOR_MASK	((NR_CACHE_COLORS >= BITS_PER_LONG) ? \
+		~0UL : ((1UL << NR_CACHE_COLORS) - 1))
+#define page_color(pa)		(((pa) >> PAGE_SHIFT) & (NR_CACHE_COLORS - 1))
+
 #endif
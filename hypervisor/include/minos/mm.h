@@ -31,15 +31,25 @@ struct page {
 	struct page *next;
 } __packed__;
 
+#define NUMA_NO_NODE	(-1)
+
+struct zero_pool_stat {
+	unsigned long nr_blocks;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long filled;
+};
+
 struct memory_region {
 	int vmid;
+	int node;
 	phy_addr_t phy_base;
 	vir_addr_t vir_base;
 	size_t size;
 	struct list_head list;
 };
 
-int add_memory_region(uint64_t base, uint64_t size, int vmid);
+int add_memory_region(uint64_t base, uint64_t size, int vmid, int node);
 int split_memory_region(vir_addr_t base, size_t size, int vmid);
 
 int mm_init(void);
@@ -49,6 +59,8 @@ void free(void *addr);
 void free_pages(void *addr);
 void *__get_free_pages(int pages, int align);
 struct page *__alloc_pages(int pages, int align);
+void *__get_free_pages_node(int pages, int align, int node);
+struct page *__alloc_pages_node(int pages, int align, int node);
 void release_pages(struct page *page);
 struct page *addr_to_page(void *addr);
 void *__get_io_pages(int pages, int align);
@@ -65,6 +77,16 @@ static inline void *get_free_pages(int pages)
 	return __get_free_pages(pages, 1);
 }
 
+static inline void *get_free_pages_node(int pages, int node)
+{
+	return __get_free_pages_node(pages, 1, node);
+}
+
+static inline struct page *alloc_page_node(int node)
+{
+	return __alloc_pages_node(1, 1, node);
+}
+
 static inline struct page *alloc_pages(int pages)
 {
 	return __alloc_pages(pages, 1);
@@ -85,10 +107,21 @@ static inline void *get_io_pages(int pages)
 	return __get_io_pages(pages, 1);
 }
 
+struct page *alloc_color_page(unsigned long colors, int *next);
+
 struct mem_block *alloc_mem_block(unsigned long flags);
+struct mem_block *alloc_mem_block_node(unsigned long flags, int node);
 void release_mem_block(struct mem_block *block);
+struct mem_block *addr_to_mem_block(unsigned long addr);
+void clear_mem_block(struct mem_block *block);
+void zero_pool_fill(void);
+void zero_pool_get_stat(struct zero_pool_stat *stat);
 int has_enough_memory(size_t size);
 
+void set_cpu_node(int cpu, int node);
+int cpu_to_node(int cpu);
+int phy_addr_to_node(unsigned long addr);
+
 void *alloc_boot_mem(size_t size);
 void *alloc_boot_pages(int pages);
 
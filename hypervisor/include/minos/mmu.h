@@ -28,6 +28,8 @@ typedef __pte_t pte_t;
 #define PTE_ENTRY_OFFSET_MASK	(__PTE_ENTRY_OFFSET_MASK)
 
 #define PAGETABLE_ATTR_MASK 	(__PAGETABLE_ATTR_MASK)
+#define PAGETABLE_PAGE_MASK	(__PAGETABLE_PAGE_MASK)
+#define PAGETABLE_ATTR_AF	(__PAGETABLE_ATTR_AF)
 
 #define PGD_MAP_SIZE		(1UL << PGD_RANGE_OFFSET)
 #define PUD_MAP_SIZE		(1UL << PUD_RANGE_OFFSET)
@@ -115,6 +117,9 @@ int create_mem_mapping(struct mm_struct *mm, unsigned long addr,
 int destroy_mem_mapping(struct mm_struct *mm, unsigned long vir,
 		size_t size, unsigned long flags);
 
+void release_mapping_page(struct mm_struct *mm, unsigned long addr);
+void release_guest_pmd(struct mm_struct *mm, unsigned long ipa);
+
 unsigned long get_mapping_entry(unsigned long tt,
 		unsigned long vir, int start, int end);
 
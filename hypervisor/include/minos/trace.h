@@ -0,0 +1,22 @@
+#ifndef __MINOS_TRACE_H_
+#define __MINOS_TRACE_H_
+
+#include <minos/types.h>
+#include <common/trace.h>
+
+struct vcpu;
+
+extern int trace_enabled;
+
+void __trace_event(int event, struct vcpu *vcpu,
+		uint64_t arg0, uint64_t arg1);
+int trace_config(int enable, unsigned long *base, size_t *size);
+
+static inline void trace_event(int event, struct vcpu *vcpu,
+		uint64_t arg0, uint64_t arg1)
+{
+	if (trace_enabled)
+		__trace_event(event, vcpu, arg0, arg1);
+}
+
+#endif
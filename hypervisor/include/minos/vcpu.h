@@ -76,6 +76,9 @@ struct vcpu {
 
 	struct vmcs *vmcs;
 	int vmcs_irq;
+
+	/* the vdev which handled the last mmio trap */
+	struct vdev *last_vdev;
 } __align_cache_line;
 
 #define VCPU_SCHED_REASON_HIRQ	0x0
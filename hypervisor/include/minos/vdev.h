@@ -40,6 +40,7 @@ int host_vdev_init(struct vm *vm, struct vdev *vdev,
 int vdev_mmio_emulation(gp_regs *regs, int write,
 		unsigned long address, unsigned long *value);
 void vdev_set_name(struct vdev *vdev, char *name);
+void vdev_index_release(struct vm *vm);
 
 unsigned long create_guest_vdev(struct vm *vm, uint32_t size);
 
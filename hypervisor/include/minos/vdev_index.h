@@ -0,0 +1,57 @@
+#ifndef __MINOS_VDEV_INDEX_H__
+#define __MINOS_VDEV_INDEX_H__
+
+/*
+ * the vdevs of the vm sorted by the guest address, used to
+ * find the vdev of the mmio trap by binary search. only the
+ * gvm_paddr and mem_size of the vdev are used here, so the
+ * host tests can build it with their own struct vdev
+ */
+struct vdev_index {
+	int nr;
+	struct vdev *vdevs[0];
+};
+
+static inline int vdev_match(struct vdev *vdev, unsigned long address)
+{
+	return ((address >= vdev->gvm_paddr) &&
+		(address < vdev->gvm_paddr + vdev->mem_size));
+}
+
+static inline void vdev_index_insert(struct vdev_index *index,
+		struct vdev *vdev)
+{
+	int i;
+
+	for (i = index->nr; i > 0; i--) {
+		if (index->vdevs[i - 1]->gvm_paddr <= vdev->gvm_paddr)
+			break;
+		index->vdevs[i] = index->vdevs[i - 1];
+	}
+
+	index->vdevs[i] = vdev;
+	index->nr++;
+}
+
+static inline struct vdev *vdev_index_lookup(struct vdev_index *index,
+		unsigned long address)
+{
+	int left = 0, right = index->nr - 1, mid;
+	struct vdev *vdev;
+
+	while (left <= right) {
+		mid = (left + right) / 2;
+		vdev = index->vdevs[mid];
+
+		if (address < vdev->gvm_paddr)
+			right = mid - 1;
+		else if (address >= vdev->gvm_paddr + vdev->mem_size)
+			left = mid + 1;
+		else
+			return vdev;
+	}
+
+	return NULL;
+}
+
+#endif
@@ -3,7 +3,9 @@
 
 #include <minos/types.h>
 
+struct vm;
 struct vcpu;
+struct device_node;
 
 #define VIRQCHIP_F_HW_VIRT	(1 << 0)
 
@@ -25,6 +27,15 @@ struct virq_chip {
 	DECLARE_BITMAP(irq_bitmap, MAX_NR_LRS);
 #endif
 
+	/*
+	 * the register state of the emulated distributor which
+	 * is saved and restored with the vm, state_size is 0 if
+	 * the chip has no such state
+	 */
+	uint32_t state_size;
+	void (*save_state)(struct vm *vm, void *buf);
+	int (*restore_state)(struct vm *vm, void *buf);
+
 	void *inc_pdata;
 	unsigned long flags;
 };
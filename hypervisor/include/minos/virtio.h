@@ -5,12 +5,17 @@
 
 struct vm;
 
+#define VIRTIO_MAX_DOORBELLS	(8)
+
 struct virtio_device {
 	struct vdev vdev;
+	int doorbells[VIRTIO_MAX_DOORBELLS];
 };
 
 int virtio_mmio_init(struct vm *vm, size_t size,
 		unsigned long *gbase, unsigned long *hbase);
 int virtio_mmio_deinit(struct vm *vm);
+int virtio_mmio_doorbell(struct vm *vm, unsigned long gbase,
+		int queue, int bind);
 
 #endif
@@ -21,6 +21,7 @@
 #define VM_STAT_ONLINE		(1)
 #define VM_STAT_SUSPEND		(2)
 #define VM_STAT_REBOOT		(3)
+#define VM_STAT_PAUSED		(4)
 
 struct vcpu;
 struct os;
@@ -29,6 +30,9 @@ struct virq_chip;
 extern struct list_head vm_list;
 extern struct list_head mem_list;
 
+struct vdev_index;
+struct mmio_coalesce;
+
 struct vm {
 	int vmid;
 	uint32_t vcpu_nr;
@@ -46,7 +50,14 @@ struct vm {
 
 	unsigned long time_offset;
 
+	/* when the vm is destroyed, used by the deferred release */
+	uint64_t release_time;
+
+	/* vcpus need to be onlined when the vm is unpaused */
+	unsigned long pause_mask;
+
 	struct list_head vdev_list;
+	struct vdev_index *vdev_index;
 
 	uint32_t vspi_nr;
 	int virq_same_page;
@@ -56,6 +67,7 @@ struct vm {
 
 	void *vmcs;
 	void *hvm_vmcs;
+	struct mmio_coalesce *coalesce;
 	void *resource;
 } __align(sizeof(unsigned long));
 
@@ -72,10 +84,18 @@ void vm_mm_struct_init(struct vm *vm);
 struct vm *create_vm(struct vmtag *vme);
 int create_new_vm(struct vmtag *tag);
 void destroy_vm(struct vm *vm);
+void vm_release_scan(void);
+void vm_release_flush(void);
+int vm_release_pending(int vmid);
 int vm_power_up(int vmid);
 int vm_reset(int vmid, void *args);
 int vm_power_off(int vmid, void *arg);
 int vm_suspend(int vmid);
+int vm_pause(struct vm *vm);
+int vm_unpause(struct vm *vm);
+int vm_save_state(struct vm *vm, unsigned long buf, size_t size);
+int vm_restore_state(struct vm *vm, unsigned long buf, size_t size);
+int vm_clone(struct vm *vm, struct vm *tmpl);
 
 static inline struct vm *get_vm_by_id(uint32_t vmid)
 {
@@ -105,6 +125,11 @@ static inline int vm_is_native(struct vm *vm)
 	return !!(vm->flags & VM_FLAGS_NATIVE);
 }
 
+static inline int vm_is_lazy_mem(struct vm *vm)
+{
+	return !!(vm->flags & VM_FLAGS_LAZY_MEM);
+}
+
 static inline int
 create_vm_mmap(int vmid,  unsigned long offset, unsigned long size)
 {
@@ -2,44 +2,25 @@
 #define __VMCS_H__
 
 #include <minos/types.h>
+#include <minos/spinlock.h>
+#include <common/vmcs.h>
 
-struct vmcs {
-	volatile uint32_t vcpu_id;
-	volatile uint32_t trap_type;
-	volatile uint32_t trap_reason;
-	volatile int32_t  trap_ret;
-	volatile unsigned long trap_data;
-	volatile unsigned long trap_result;
-	volatile uint64_t host_index;
-	volatile uint64_t guest_index;
-	volatile unsigned long data[0];
-} __align(1024);
+#define VMCS_SIZE(nr)	\
+	PAGE_BALIGN(nr * sizeof(struct vmcs) + sizeof(struct mmio_ring))
 
-#define VMCS_DATA_SIZE	(1024 - 48)
-#define VMCS_SIZE(nr) 	PAGE_BALIGN(nr * sizeof(struct vmcs))
-
-enum vm_trap_type {
-	VMTRAP_TYPE_MMIO = 0,
-	VMTRAP_TYPE_COMMON,
-	VMTRAP_TYPE_UNKNOWN,
-};
-
-enum vm_trap_reason {
-	VMTRAP_REASON_READ = 0,
-	VMTRAP_REASON_WRITE,
-	VMTRAP_REASON_CONFIG,
-	VMTRAP_REASON_REBOOT,
-	VMTRAP_REASON_SHUTDOWN,
-	VMTRAP_REASON_VM_SUSPEND,
-	VMTRAP_REASON_VM_RESUMED,
-	VMTRAP_REASON_WDT_TIMEOUT,
-	VMTRAP_REASON_GET_TIME,
-	VMTRAP_REASON_UNKNOWN,
+struct mmio_coalesce {
+	spinlock_t lock;
+	int nr_ranges;
+	unsigned long base[MMIO_COALESCE_RANGES];
+	unsigned long size[MMIO_COALESCE_RANGES];
+	struct mmio_ring *ring;
 };
 
 int vm_create_vmcs_irq(struct vm *vm, int vcpu_id);
 unsigned long vm_create_vmcs(struct vm *vm);
 int setup_vmcs_data(void *data, size_t size);
+int vcpu_vmcs_ack(struct vm *vm, int vcpu_id);
+int vm_mmio_coalesce(struct vm *vm, unsigned long base, size_t size);
 int __vcpu_trap(uint32_t type, uint32_t reason, unsigned long data,
 		unsigned long *ret, int nonblock);
 
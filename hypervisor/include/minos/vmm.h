@@ -7,12 +7,29 @@
 #include <minos/vm_mmap.h>
 
 struct vm;
+struct reclaim_block;
+struct mem_wss;
+
+#define VM_FAULT_TRANS		(0)
+#define VM_FAULT_ACCESS		(1)
+#define VM_FAULT_PERM		(2)
 
 /*
  * pgd_base : the lvl0 table base
  * mem_list : static config memory region for this vm
  * block_list : the mem_block allocated for this vm
  * head : the pages table allocated for this vm
+ * block_bitmap : the mem_block which populated for this vm
+ * block_table : the mem_block mapped to each 2M of the ipa
+ * merge_bitmap : the mem_block which shared with other vm
+ * merge_hash : the last hash value of each mem_block
+ * dirty_bitmap : the page written since last dirty log get
+ * mem_limit : the memory can be used before reclaim
+ * reclaim_table : the compressed data of each mem_block
+ * access_faults : the access flag faults of the vm
+ * wss : the working set tracking of the vm
+ * colors : the cache colors of the vm memory, 0 means
+ * the vm use the mem_block which has all the colors
  */
 struct mm_struct {
 	size_t mem_size;
@@ -28,7 +45,27 @@ struct mm_struct {
 	void *virtio_mmio_iomem;
 	size_t virtio_mmio_size;
 
+	unsigned long *block_bitmap;
+	struct mem_block **block_table;
+	unsigned long *merge_bitmap;
+	uint32_t *merge_hash;
+	unsigned long *dirty_bitmap;
+	int hvm_mmaped;
+
+	size_t mem_limit;
+	int reclaim_cursor;
+	struct reclaim_block **reclaim_table;
+
+	unsigned long access_faults;
+	struct mem_wss *wss;
+
+	unsigned long colors;
+	int color_next;
+
+	int node;
+
 	struct page *head;
+	unsigned long free_tables;
 	struct list_head mem_list;
 	struct list_head block_list;
 	spinlock_t lock;
@@ -44,6 +81,7 @@ int unmap_vm_memory(struct vm *vm, unsigned long vir_addr,
 
 int alloc_vm_memory(struct vm *vm, unsigned long start, size_t size);
 void release_vm_memory(struct vm *vm);
+int release_vm_blocks(struct vm *vm, int nr);
 
 int create_host_mapping(unsigned long vir, unsigned long phy,
 		size_t size, unsigned long flags);
@@ -75,7 +113,28 @@ int create_early_pmd_mapping(unsigned long vir, unsigned long phy);
 
 void *map_vm_mem(unsigned long gva, size_t size);
 void unmap_vm_mem(unsigned long gva, size_t size);
+int copy_to_guest(unsigned long gva, void *src, size_t size);
+int copy_from_guest(void *dst, unsigned long gva, size_t size);
 
 phy_addr_t get_vm_memblock_address(struct vm *vm, unsigned long a);
 
+int vm_memory_fault(struct vm *vm, unsigned long ipa, int type, int write);
+int vm_populate_memory(struct vm *vm, unsigned long ipa, size_t size);
+int vm_release_memory(struct vm *vm, unsigned long ipa, size_t size);
+
+int vm_remap_block(struct vm *vm, unsigned long ipa,
+		unsigned long old, unsigned long new, unsigned long flags);
+struct mem_block *vm_detach_block(struct vm *vm, unsigned long pa);
+void vm_set_memblock(struct vm *vm, unsigned long ipa,
+		struct mem_block *block);
+void vm_attach_block(struct vm *vm, struct mem_block *block);
+int vm_test_block_young(struct vm *vm, unsigned long ipa, int clear);
+int vm_copy_color_memory(struct vm *vm, void *buf,
+		unsigned long ipa, size_t size);
+
+int vm_dirty_log_start(struct vm *vm);
+int vm_dirty_log_stop(struct vm *vm);
+int vm_get_dirty_log(struct vm *vm, unsigned long buf, size_t size);
+int vm_get_mem_map(struct vm *vm, unsigned long buf, size_t size);
+
 #endif
@@ -14,6 +14,7 @@ struct vmodule {
 	int id;
 	struct list_head list;
 	uint32_t context_size;
+	uint32_t dump_size;
 	void *pdata;
 	void *context;
 	void (*state_save)(struct vcpu *vcpu, void *context);
@@ -23,6 +24,14 @@ struct vmodule {
 	void (*state_reset)(struct vcpu *vcpu, void *context);
 	void (*state_suspend)(struct vcpu *vcpu, void *context);
 	void (*state_resume)(struct vcpu *vcpu, void *context);
+
+	/*
+	 * export and import the context for vm snapshot, if
+	 * dump_size is set and no callback is provided the
+	 * context will be copied directly
+	 */
+	void (*state_dump)(struct vcpu *vcpu, void *context, void *buf);
+	void (*state_load)(struct vcpu *vcpu, void *context, void *buf);
 };
 
 typedef int (*vmodule_init_fn)(struct vmodule *);
@@ -36,6 +45,9 @@ void save_vcpu_vmodule_state(struct vcpu *vcpu);
 void restore_vcpu_vmodule_state(struct vcpu *vcpu);
 void suspend_vcpu_vmodule_state(struct vcpu *vcpu);
 void resume_vcpu_vmodule_state(struct vcpu *vcpu);
+uint32_t vcpu_vmodules_dump_size(void);
+int dump_vcpu_vmodule_state(struct vcpu *vcpu, void *buf, uint32_t size);
+int load_vcpu_vmodule_state(struct vcpu *vcpu, void *buf, uint32_t size);
 int vmodules_init(void);
 int register_vcpu_vmodule(char *name, vmodule_init_fn fn);
 
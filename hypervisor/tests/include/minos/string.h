@@ -0,0 +1,7 @@
+#ifndef _MINOS_TEST_STRING_H_
+#define _MINOS_TEST_STRING_H_
+
+/* the host tests use the string functions of the libc */
+#include <string.h>
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <minos/errno.h>
+#include <asm/ldst_insn.h>
+
+struct insn_test {
+	const char *name;
+	uint32_t insn;
+	int ret;
+	struct ldst_insn li;
+};
+
+#define DECODE(n, i, rt, rt2, rn, size, load, sign, sf, pair, wb, post, off) \
+	{ n, i, 0, { rt, rt2, rn, size, load, sign, sf, pair, wb, post, off } }
+#define REJECT(n, i)	{ n, i, -EINVAL }
+
+/*
+ * rt, rt2, rn, size, load, sign, sf, pair, wback, post, offset,
+ * the encodings are generated by llvm-mc
+ */
+static struct insn_test insn_tests[] = {
+	/* load/store pair */
+	DECODE("ldp x0, x1, [x2]", 0xa9400440,
+			0, 1, 2, 8, 1, 0, 1, 1, 0, 0, 0),
+	DECODE("ldp x0, x1, [x2, #16]", 0xa9410440,
+			0, 1, 2, 8, 1, 0, 1, 1, 0, 0, 16),
+	DECODE("stp x3, x4, [x5, #-16]!", 0xa9bf10a3,
+			3, 4, 5, 8, 0, 0, 1, 1, 1, 0, -16),
+	DECODE("ldp x6, x7, [x8], #32", 0xa8c21d06,
+			6, 7, 8, 8, 1, 0, 1, 1, 1, 1, 32),
+	DECODE("ldp w0, w1, [x2, #8]", 0x29410440,
+			0, 1, 2, 4, 1, 0, 0, 1, 0, 0, 8),
+	DECODE("stp w0, w1, [x2]", 0x29000440,
+			0, 1, 2, 4, 0, 0, 0, 1, 0, 0, 0),
+	DECODE("ldp w9, w10, [sp, #-8]!", 0x29ff2be9,
+			9, 10, 31, 4, 1, 0, 0, 1, 1, 0, -8),
+	DECODE("ldpsw x0, x1, [x2, #8]", 0x69410440,
+			0, 1, 2, 4, 1, 1, 1, 1, 0, 0, 8),
+	DECODE("ldnp x0, x1, [x2]", 0xa8400440,
+			0, 1, 2, 8, 1, 0, 1, 1, 0, 0, 0),
+	DECODE("stnp w3, w4, [x5, #4]", 0x280090a3,
+			3, 4, 5, 4, 0, 0, 0, 1, 0, 0, 4),
+	DECODE("stp xzr, xzr, [x0]", 0xa9007c1f,
+			31, 31, 0, 8, 0, 0, 1, 1, 0, 0, 0),
+
+	/* unsigned immediate offset */
+	DECODE("ldr x0, [x1]", 0xf9400020,
+			0, 0, 1, 8, 1, 0, 1, 0, 0, 0, 0),
+	DECODE("ldr w0, [x1, #4]", 0xb9400420,
+			0, 0, 1, 4, 1, 0, 0, 0, 0, 0, 4),
+	DECODE("strb w2, [x3, #1]", 0x39000462,
+			2, 0, 3, 1, 0, 0, 0, 0, 0, 0, 1),
+	DECODE("ldrh w4, [x5, #2]", 0x794004a4,
+			4, 0, 5, 2, 1, 0, 0, 0, 0, 0, 2),
+
+	/* pre/post index and unscaled */
+	DECODE("ldr x0, [x1, #8]!", 0xf8408c20,
+			0, 0, 1, 8, 1, 0, 1, 0, 1, 0, 8),
+	DECODE("str w2, [x3], #-4", 0xb81fc462,
+			2, 0, 3, 4, 0, 0, 0, 0, 1, 1, -4),
+	DECODE("ldr x0, [sp, #-16]!", 0xf85f0fe0,
+			0, 0, 31, 8, 1, 0, 1, 0, 1, 0, -16),
+	DECODE("ldur x0, [x1, #-8]", 0xf85f8020,
+			0, 0, 1, 8, 1, 0, 1, 0, 0, 0, -8),
+	DECODE("sturh w5, [x6, #3]", 0x780030c5,
+			5, 0, 6, 2, 0, 0, 0, 0, 0, 0, 3),
+	DECODE("ldtr x0, [x1, #8]", 0xf8408820,
+			0, 0, 1, 8, 1, 0, 1, 0, 0, 0, 8),
+
+	/* register offset */
+	DECODE("ldr x0, [x1, x2]", 0xf8626820,
+			0, 0, 1, 8, 1, 0, 1, 0, 0, 0, 0),
+	DECODE("ldr w0, [x1, x2, lsl #2]", 0xb8627820,
+			0, 0, 1, 4, 1, 0, 0, 0, 0, 0, 0),
+	DECODE("strb w3, [x4, w5, uxtw]", 0x38254883,
+			3, 0, 4, 1, 0, 0, 0, 0, 0, 0, 0),
+
+	/* sign extending loads */
+	DECODE("ldrsb x0, [x1]", 0x39800020,
+			0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0),
+	DECODE("ldrsb w0, [x1]", 0x39c00020,
+			0, 0, 1, 1, 1, 1, 0, 0, 0, 0, 0),
+	DECODE("ldrsh x2, [x3, #2]", 0x79800462,
+			2, 0, 3, 2, 1, 1, 1, 0, 0, 0, 2),
+	DECODE("ldrsh w2, [x3]", 0x79c00062,
+			2, 0, 3, 2, 1, 1, 0, 0, 0, 0, 0),
+	DECODE("ldrsw x4, [x5, #4]", 0xb98004a4,
+			4, 0, 5, 4, 1, 1, 1, 0, 0, 0, 4),
+	DECODE("ldrsw x4, [x5], #4", 0xb88044a4,
+			4, 0, 5, 4, 1, 1, 1, 0, 1, 1, 4),
+
+	/* rejected encodings */
+	REJECT("stgp x0, x1, [x2]", 0x69000440),
+	REJECT("ldpsw no allocate", 0x68400440),
+	REJECT("ldp x0, x0, [x1]", 0xa9400020),
+	REJECT("ldr x0, [x0, #8]!", 0xf8408c00),
+	REJECT("ldp x0, x1, [x1], #16", 0xa8c10420),
+	REJECT("prfm pldl1keep, [x0]", 0xf9800000),
+	REJECT("prfm pldl1keep, [x0, x1]", 0xf8a16800),
+	REJECT("prfum pldl1keep, [x0, #1]", 0xf8801000),
+	REJECT("ldadd x0, x1, [x2]", 0xf8200041),
+	REJECT("ldr q0, [x1]", 0x3dc00020),
+	REJECT("ldp q0, q1, [x2]", 0xad400440),
+	REJECT("add x0, x1, x2", 0x8b020020),
+};
+
+static int check_insn(struct insn_test *t)
+{
+	struct ldst_insn li;
+	struct ldst_insn *e = &t->li;
+	int ret;
+
+	ret = decode_ldst_insn(t->insn, &li);
+	if (ret != t->ret) {
+		printf("FAIL %-28s 0x%08x ret %d expect %d\n",
+				t->name, t->insn, ret, t->ret);
+		return 1;
+	}
+
+	if (ret)
+		return 0;
+
+	if ((li.rt != e->rt) || (li.rt2 != e->rt2) || (li.rn != e->rn) ||
+			(li.size != e->size) || (li.load != e->load) ||
+			(li.sign != e->sign) || (li.sf != e->sf) ||
+			(li.pair != e->pair) || (li.wback != e->wback) ||
+			(li.post != e->post) || (li.offset != e->offset)) {
+		printf("FAIL %-28s 0x%08x rt %d rt2 %d rn %d size %d "
+			"load %d sign %d sf %d pair %d wback %d post %d "
+			"offset %ld\n", t->name, t->insn, li.rt, li.rt2,
+			li.rn, li.size, li.load, li.sign, li.sf, li.pair,
+			li.wback, li.post, (long)li.offset);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	int i, failed = 0;
+	int nr = sizeof(insn_tests) / sizeof(insn_tests[0]);
+
+	for (i = 0; i < nr; i++)
+		failed += check_insn(&insn_tests[i]);
+
+	printf("insn_decode: %d tests, %d failed\n", nr, failed);
+
+	return failed ? 1 : 0;
+}
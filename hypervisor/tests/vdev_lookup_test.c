@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <minos/types.h>
+#include <minos/list.h>
+
+/*
+ * only the fields used by the lookup, the vdevs are 4K
+ * apart in the guest address space like the virtio mmio
+ * devices created by mvm, and added in a random order
+ */
+struct vdev {
+	uint32_t mem_size;
+	unsigned long gvm_paddr;
+	struct list_head list;
+};
+
+#include <minos/vdev_index.h>
+
+#define VDEV_BASE	(0x40000000UL)
+#define VDEV_SIZE	(0x200)
+#define VDEV_STRIDE	(0x1000)
+#define NR_ADDRS	(4096)
+#define NR_LOOKUPS	(1 << 22)
+
+static struct vdev *list_lookup(struct list_head *head,
+		unsigned long address)
+{
+	struct vdev *vdev;
+
+	list_for_each_entry(vdev, head, list) {
+		if (vdev_match(vdev, address))
+			return vdev;
+	}
+
+	return NULL;
+}
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int check_lookup(struct list_head *head,
+		struct vdev_index *index, unsigned long address,
+		struct vdev *expect)
+{
+	struct vdev *l = list_lookup(head, address);
+	struct vdev *i = vdev_index_lookup(index, address);
+
+	if ((l != expect) || (i != expect)) {
+		printf("FAIL vdev_lookup 0x%lx list %p index %p "
+				"expect %p\n", address, l, i, expect);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * the addresses of one mmio trap stream are hits spread over
+ * all the vdevs, which is the case the last_vdev cache of the
+ * vcpu misses
+ */
+static int bench_lookup(int nr)
+{
+	struct vdev *vdevs = calloc(nr, sizeof(struct vdev));
+	struct vdev_index *index = malloc(sizeof(struct vdev_index) +
+			nr * sizeof(struct vdev *));
+	unsigned long *addrs = malloc(NR_ADDRS * sizeof(unsigned long));
+	unsigned long start, list_ns, index_ns, base, hits = 0;
+	struct vdev *vdev;
+	LIST_HEAD(head);
+	int i, j, failed = 0;
+
+	if (!vdevs || !index || !addrs) {
+		printf("FAIL vdev_lookup no memory\n");
+		return 1;
+	}
+
+	index->nr = 0;
+	for (i = 0; i < nr; i++) {
+		vdevs[i].gvm_paddr = VDEV_BASE + i * VDEV_STRIDE;
+		vdevs[i].mem_size = VDEV_SIZE;
+	}
+
+	for (i = nr - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		base = vdevs[i].gvm_paddr;
+		vdevs[i].gvm_paddr = vdevs[j].gvm_paddr;
+		vdevs[j].gvm_paddr = base;
+	}
+
+	for (i = 0; i < nr; i++) {
+		list_add_tail(&head, &vdevs[i].list);
+		vdev_index_insert(index, &vdevs[i]);
+	}
+
+	for (i = 0; i < nr; i++) {
+		vdev = &vdevs[i];
+		failed += check_lookup(&head, index, vdev->gvm_paddr, vdev);
+		failed += check_lookup(&head, index,
+				vdev->gvm_paddr + VDEV_SIZE - 1, vdev);
+		failed += check_lookup(&head, index,
+				vdev->gvm_paddr + VDEV_SIZE, NULL);
+	}
+	failed += check_lookup(&head, index, VDEV_BASE - 1, NULL);
+
+	for (i = 0; i < NR_ADDRS; i++)
+		addrs[i] = VDEV_BASE + (rand() % nr) * VDEV_STRIDE +
+				(rand() % VDEV_SIZE);
+
+	start = now_ns();
+	for (i = 0; i < NR_LOOKUPS; i++)
+		hits += !!list_lookup(&head, addrs[i & (NR_ADDRS - 1)]);
+	list_ns = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < NR_LOOKUPS; i++)
+		hits += !!vdev_index_lookup(index, addrs[i & (NR_ADDRS - 1)]);
+	index_ns = now_ns() - start;
+
+	if (hits != 2UL * NR_LOOKUPS) {
+		printf("FAIL vdev_lookup %d vdevs %lu hits\n", nr, hits);
+		failed++;
+	}
+
+	printf("vdev_lookup %2d vdevs: list %5.1f ns, index %5.1f ns\n",
+			nr, (double)list_ns / NR_LOOKUPS,
+			(double)index_ns / NR_LOOKUPS);
+
+	free(addrs);
+	free(index);
+	free(vdevs);
+
+	return failed;
+}
+
+int main(void)
+{
+	int failed = 0;
+
+	srand(1);
+	failed += bench_lookup(2);
+	failed += bench_lookup(8);
+	failed += bench_lookup(64);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <minos/compiler.h>
+#include <common/vmcs.h>
+
+/*
+ * the hypervisor posts non-blocking traps to the vmcs of a
+ * vcpu and mvm handles them, the same protocol as
+ * __vcpu_trap() and handle_vcpu_events() with two threads:
+ * virq_fd is the virq sent for each trap and ack_fd is the
+ * ack hypercall which kicks the vcpu waiting for an entry.
+ * a depth of 1 is the single slot vmcs before the ring
+ */
+#define NR_TRAPS	(200000)
+
+#define mb()		__sync_synchronize()
+
+struct vmcs_bench {
+	struct vmcs vmcs;
+	int depth;
+	int virq_fd;
+	int ack_fd;
+	unsigned long wakeups;
+	unsigned long wrong;
+};
+
+static inline int vmcs_acked(struct vmcs *vmcs, uint64_t index)
+{
+	return ((int64_t)(vmcs->guest_index - index) >= 0);
+}
+
+static void vmcs_wait(struct vmcs_bench *b, uint64_t index)
+{
+	struct vmcs *vmcs = &b->vmcs;
+	eventfd_t value;
+
+	while (!vmcs_acked(vmcs, index)) {
+		vmcs->waiting = 1;
+		mb();
+		if (vmcs_acked(vmcs, index))
+			break;
+
+		eventfd_read(b->ack_fd, &value);
+	}
+
+	vmcs->waiting = 0;
+}
+
+static void *vmcs_post_thread(void *data)
+{
+	struct vmcs_bench *b = data;
+	struct vmcs *vmcs = &b->vmcs;
+	struct vmcs_entry *entry;
+	uint64_t index;
+	int i;
+
+	for (i = 0; i < NR_TRAPS; i++) {
+		vmcs_wait(b, vmcs->host_index - b->depth + 1);
+
+		index = vmcs->host_index;
+		entry = vmcs_entry(vmcs, index);
+		entry->trap_type = VMTRAP_TYPE_MMIO;
+		entry->trap_reason = VMTRAP_REASON_WRITE;
+		entry->trap_data = i;
+		entry->trap_ret = 0;
+		entry->trap_result = 0;
+
+		mb();
+		vmcs->host_index = index + 1;
+		mb();
+		eventfd_write(b->virq_fd, 1);
+	}
+
+	return NULL;
+}
+
+static void vmcs_handle_events(struct vmcs_bench *b)
+{
+	struct vmcs *vmcs = &b->vmcs;
+	struct vmcs_entry *entry;
+
+	while (vmcs->guest_index != vmcs->host_index) {
+		mb();
+		entry = vmcs_entry(vmcs, vmcs->guest_index);
+		if (entry->trap_data != vmcs->guest_index)
+			b->wrong++;
+		entry->trap_ret = 0;
+
+		mb();
+		vmcs->guest_index++;
+	}
+
+	mb();
+	if (vmcs->waiting)
+		eventfd_write(b->ack_fd, 1);
+}
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int bench_vmcs(int depth)
+{
+	static struct vmcs_bench bench;
+	struct vmcs_bench *b = &bench;
+	unsigned long start, ns;
+	pthread_t thread;
+	eventfd_t value;
+
+	*b = (struct vmcs_bench){ .depth = depth };
+	b->virq_fd = eventfd(0, 0);
+	b->ack_fd = eventfd(0, 0);
+	if ((b->virq_fd < 0) || (b->ack_fd < 0)) {
+		printf("FAIL vmcs_ring no eventfd\n");
+		return 1;
+	}
+
+	start = now_ns();
+	pthread_create(&thread, NULL, vmcs_post_thread, b);
+
+	while (b->vmcs.guest_index < NR_TRAPS) {
+		eventfd_read(b->virq_fd, &value);
+		b->wakeups++;
+		vmcs_handle_events(b);
+	}
+
+	pthread_join(thread, NULL);
+	ns = now_ns() - start;
+
+	close(b->virq_fd);
+	close(b->ack_fd);
+
+	printf("vmcs_ring depth %2d: %6.0f ns per trap, "
+			"%5.2f traps per wakeup\n", depth,
+			(double)ns / NR_TRAPS,
+			(double)NR_TRAPS / b->wakeups);
+
+	if (b->wrong) {
+		printf("FAIL vmcs_ring depth %d %lu traps out of order\n",
+				depth, b->wrong);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	int failed = 0;
+
+	failed += bench_vmcs(1);
+	failed += bench_vmcs(VMCS_RING_SIZE);
+
+	return failed ? 1 : 0;
+}
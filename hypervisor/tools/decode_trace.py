@@ -0,0 +1,130 @@
+import sys
+import struct
+
+# decode the trace file dumped by "mvm --trace <file>", the
+# layout is defined in include/common/trace.h
+
+HEADER = struct.Struct("<8sIIQ")
+RING = struct.Struct("<IIQ")
+ENTRY = struct.Struct("<QHHHHQQ")
+
+TRACE_NO_VM = 0xffff
+
+EVENTS = {
+    1: "vcpu_switch",
+    2: "guest_exit",
+    3: "guest_entry",
+    4: "virq_send",
+    5: "virq_inject",
+    6: "vmcs_post",
+    7: "vmcs_ack",
+    8: "timer",
+}
+
+EXCEPTION_CLASS = {
+    0x01: "wfi/wfe",
+    0x07: "fp",
+    0x16: "hvc",
+    0x17: "smc",
+    0x18: "sysreg",
+    0x20: "iabt",
+    0x24: "dabt",
+}
+
+TRAP_TYPE = {0: "mmio", 1: "common"}
+TRAP_REASON = {0: "read", 1: "write", 2: "config", 3: "reboot",
+               4: "shutdown", 5: "vm_suspend", 6: "vm_resumed",
+               7: "wdt_timeout", 8: "get_time"}
+
+
+def vcpu_name(vmid, vcpu_id):
+    if vmid == TRACE_NO_VM:
+        return "idle"
+    return "vm%d-vcpu%d" % (vmid, vcpu_id)
+
+
+def format_args(event, arg0, arg1):
+    if event == 1:
+        return "from %s" % vcpu_name(arg0, arg1)
+    if event == 2:
+        ec = (arg0 >> 26) & 0x3f
+        return "esr 0x%x (%s) elr 0x%x" % \
+            (arg0, EXCEPTION_CLASS.get(ec, "ec 0x%x" % ec), arg1)
+    if event == 3:
+        return ""
+    if event == 4:
+        return "virq %d%s" % (arg0, " already pending" if arg1 else "")
+    if event == 5:
+        return "virq %d lr %d" % (arg0, arg1)
+    if event == 6:
+        return "%s %s 0x%x" % (TRAP_TYPE.get(arg0 >> 16, arg0 >> 16),
+                               TRAP_REASON.get(arg0 & 0xffff,
+                                               arg0 & 0xffff), arg1)
+    if event == 7:
+        ret = arg1 - (1 << 64) if arg1 & (1 << 63) else arg1
+        return "index %d ret %d" % (arg0, ret)
+    if event == 8:
+        return "fn 0x%x expires %d" % (arg0, arg1)
+    return "0x%x 0x%x" % (arg0, arg1)
+
+
+def read_trace(path):
+    events = []
+    with open(path, "rb") as f:
+        data = f.read()
+
+    magic, version, nr_rings, freq = HEADER.unpack_from(data, 0)
+    if magic.rstrip(b"\0") != b"MVTRACE" or version != 1:
+        print("%s is not a trace file" % path)
+        exit(1)
+
+    offset = HEADER.size
+    for i in range(nr_rings):
+        cpu, nr, lost = RING.unpack_from(data, offset)
+        offset += RING.size
+        if lost:
+            print("cpu%d: %d events lost" % (cpu, lost))
+        for j in range(nr):
+            events.append((cpu,) + ENTRY.unpack_from(data, offset))
+            offset += ENTRY.size
+
+    events.sort(key=lambda e: e[1])
+    return freq, events
+
+
+if __name__ == "__main__":
+    argv = sys.argv
+    if len(argv) < 2:
+        print("usage: decode_trace.py <trace file>")
+        exit()
+
+    freq, events = read_trace(argv[1])
+    if not events:
+        exit()
+
+    counts = {}
+    sends = {}
+    start = events[0][1]
+    for cpu, ts, event, vmid, vcpu_id, rsv, arg0, arg1 in events:
+        name = EVENTS.get(event, "event%d" % event)
+        counts[name] = counts.get(name, 0) + 1
+        if event == 4:
+            # the virq already pending is coalesced without a kick
+            nr, pending = sends.get(cpu, (0, 0))
+            sends[cpu] = (nr + 1, pending + (1 if arg1 else 0))
+        print("%14.3f cpu%-2d %-16s %-12s %s" %
+              ((ts - start) * 1000000.0 / freq, cpu,
+               vcpu_name(vmid, vcpu_id), name,
+               format_args(event, arg0, arg1)))
+
+    print("")
+    for name in sorted(counts):
+        print("%-12s %d" % (name, counts[name]))
+
+    secs = float(events[-1][1] - start) / freq
+    if sends and secs > 0:
+        print("")
+        for cpu in sorted(sends):
+            nr, pending = sends[cpu]
+            print("cpu%-2d virq_send %d/s, %d coalesced" %
+                  (cpu, nr / secs, pending))
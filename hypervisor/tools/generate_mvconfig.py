@@ -23,6 +23,8 @@ default_config = {
     'CONFIG_LOG_LEVEL': ['3', 1],
     'CONFIG_MINOS_START_ADDRESS': ['0x0', 1],
     'CONFIG_BOOTMEM_SIZE': ['64K', 1],
+    'CONFIG_LLC_COLORS': ['16', 1],
+    'CONFIG_ZERO_POOL_BLOCKS': ['32', 1],
 }
 
 
@@ -18,6 +18,7 @@
 #include <minos/virq.h>
 #include <minos/of.h>
 #include <minos/virq_chip.h>
+#include <minos/trace.h>
 
 /*
  * The following cases are considered software programming
@@ -85,6 +86,7 @@ int vgic_irq_enter_to_guest(struct vcpu *vcpu, void *data)
 
 __do_send_virq:
 		virqchip_send_virq(vcpu, virq);
+		trace_event(TRACE_VIRQ_INJECT, vcpu, virq->vno, virq->id);
 		virq->state = VIRQ_STATE_PENDING;
 		virq_clear_pending(virq);
 		dsb();
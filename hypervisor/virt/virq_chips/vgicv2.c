@@ -545,6 +545,31 @@ static int gicv2_update_virq(struct vcpu *vcpu,
 	return 0;
 }
 
+/* the distributor state which is saved with the vm */
+struct vgicv2_state {
+	uint32_t gicd_ctlr;
+	uint32_t reserved;
+};
+
+static void vgicv2_save_state(struct vm *vm, void *buf)
+{
+	struct vgicv2_state *state = (struct vgicv2_state *)buf;
+	struct vgicv2_dev *dev = (struct vgicv2_dev *)vm->virq_chip->inc_pdata;
+
+	state->gicd_ctlr = dev->gicd_ctlr;
+	state->reserved = 0;
+}
+
+static int vgicv2_restore_state(struct vm *vm, void *buf)
+{
+	struct vgicv2_state *state = (struct vgicv2_state *)buf;
+	struct vgicv2_dev *dev = (struct vgicv2_dev *)vm->virq_chip->inc_pdata;
+
+	dev->gicd_ctlr = state->gicd_ctlr;
+
+	return 0;
+}
+
 static int vgicv2_init_virqchip(struct virq_chip *vc,
 		void *dev, unsigned long flags)
 {
@@ -561,6 +586,9 @@ static int vgicv2_init_virqchip(struct virq_chip *vc,
 	vc->vm0_virq_data = gic_vm0_virq_data;
 	vc->flags = flags;
 	vc->inc_pdata = dev;
+	vc->state_size = sizeof(struct vgicv2_state);
+	vc->save_state = vgicv2_save_state;
+	vc->restore_state = vgicv2_restore_state;
 
 	return 0;
 }
@@ -677,6 +705,7 @@ static void gicv2_state_resume(struct vcpu *vcpu, void *context)
 static int gicv2_vmodule_init(struct vmodule *vmodule)
 {
 	vmodule->context_size = sizeof(struct gicv2_context);
+	vmodule->dump_size = sizeof(struct gicv2_context);
 	vmodule->pdata = NULL;
 	vmodule->state_init = gicv2_state_init;
 	vmodule->state_save = gicv2_state_save;
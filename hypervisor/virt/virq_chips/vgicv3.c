@@ -46,6 +46,23 @@ struct vgicv3_info {
 	unsigned long gicv_size;
 };
 
+/*
+ * the registers of the gicd and the gicr which are not kept
+ * in the virq descs, saved with the vm
+ */
+struct vgicr_state {
+	uint32_t gicr_ctlr;
+	uint32_t gicr_ispender;
+	uint32_t gicr_enabler0;
+	uint32_t reserved;
+};
+
+struct vgicv3_state {
+	uint32_t gicd_ctlr;
+	uint32_t nr_gicr;
+	struct vgicr_state gicr[0];
+};
+
 static int gicv3_nr_lr = 0;
 static int gicv3_nr_pr = 0;
 static struct vgicv3_info vgicv3_info;
@@ -686,9 +703,67 @@ static int gicv3_get_virq_state(struct vcpu *vcpu, struct virq_desc *virq)
 	return ((int)value);
 }
 
+static void vgicv3_save_state(struct vm *vm, void *buf)
+{
+	int i;
+	struct vgic_gicr *gicr;
+	struct vgicv3_state *state = (struct vgicv3_state *)buf;
+	struct vgicv3_dev *dev = (struct vgicv3_dev *)vm->virq_chip->inc_pdata;
+
+	spin_lock(&dev->gicd.gicd_lock);
+	state->gicd_ctlr = dev->gicd.gicd_ctlr;
+	spin_unlock(&dev->gicd.gicd_lock);
+	state->nr_gicr = vm->vcpu_nr;
+
+	for (i = 0; i < vm->vcpu_nr; i++) {
+		gicr = dev->gicr[i];
+		spin_lock(&gicr->gicr_lock);
+		state->gicr[i].gicr_ctlr = gicr->gicr_ctlr;
+		state->gicr[i].gicr_ispender = gicr->gicr_ispender;
+		state->gicr[i].gicr_enabler0 = gicr->gicr_enabler0;
+		state->gicr[i].reserved = 0;
+		spin_unlock(&gicr->gicr_lock);
+	}
+}
+
+static int vgicv3_restore_state(struct vm *vm, void *buf)
+{
+	int i;
+	struct vgic_gicr *gicr;
+	struct vgicv3_state *state = (struct vgicv3_state *)buf;
+	struct vgicv3_dev *dev = (struct vgicv3_dev *)vm->virq_chip->inc_pdata;
+
+	if (state->nr_gicr != vm->vcpu_nr)
+		return -EINVAL;
+
+	spin_lock(&dev->gicd.gicd_lock);
+	dev->gicd.gicd_ctlr = state->gicd_ctlr;
+	spin_unlock(&dev->gicd.gicd_lock);
+
+	for (i = 0; i < vm->vcpu_nr; i++) {
+		gicr = dev->gicr[i];
+		spin_lock(&gicr->gicr_lock);
+		gicr->gicr_ctlr = state->gicr[i].gicr_ctlr;
+		gicr->gicr_ispender = state->gicr[i].gicr_ispender;
+		gicr->gicr_enabler0 = state->gicr[i].gicr_enabler0;
+		spin_unlock(&gicr->gicr_lock);
+	}
+
+	return 0;
+}
+
 static void vgicv3_init_virqchip(struct virq_chip *vc,
 		struct vgicv3_dev *dev, unsigned long flags)
 {
+	struct vm *vm = dev->vdev.vm;
+
+	vc->inc_pdata = dev;
+	vc->state_size = sizeof(struct vgicv3_state) +
+		vm->vcpu_nr * sizeof(struct vgicr_state);
+	vc->save_state = vgicv3_save_state;
+	vc->restore_state = vgicv3_restore_state;
+
+
 	if (flags & VIRQCHIP_F_HW_VIRT) {
 		vc->nr_lrs = gicv3_nr_lr;
 		vc->exit_from_guest = vgic_irq_exit_from_guest;
@@ -936,6 +1011,7 @@ static void gicv3_state_resume(struct vcpu *vcpu, void *context)
 static int gicv3_vmodule_init(struct vmodule *vmodule)
 {
 	vmodule->context_size = sizeof(struct gicv3_context);
+	vmodule->dump_size = sizeof(struct gicv3_context);
 	vmodule->pdata = NULL;
 	vmodule->state_init = gicv3_state_init;
 	vmodule->state_save = gicv3_state_save;
@@ -41,6 +41,7 @@ static int virtio_mmio_write(struct vdev *vdev, gp_regs *regs,
 	uint32_t tmp;
 	uint32_t value = *(uint32_t *)write_value;
 	void *iomem = vdev->iomem;
+	struct virtio_device *dev;
 	unsigned long offset = address - vdev->gvm_paddr;
 
 	switch (offset) {
@@ -95,9 +96,16 @@ static int virtio_mmio_write(struct vdev *vdev, gp_regs *regs,
 		break;
 	case VIRTIO_MMIO_QUEUE_NOTIFY:
 		/*
-		 * indicate a queue is ready, need send a
-		 * event to hvm ?
+		 * if mvm has bound a doorbell to this queue, ring
+		 * it directly, the backend of the queue is woken
+		 * up by the virq without going through the vmcs
 		 */
+		dev = vdev_to_virtio(vdev);
+		if ((value < VIRTIO_MAX_DOORBELLS) && dev->doorbells[value]) {
+			vdev_notify_hvm(vdev, dev->doorbells[value]);
+			break;
+		}
+
 		trap_mmio_write_nonblock(address, write_value);
 		break;
 	case VIRTIO_MMIO_STATUS:
@@ -144,9 +152,16 @@ static int virtio_mmio_write(struct vdev *vdev, gp_regs *regs,
 
 void release_virtio_dev(struct vm *vm, struct virtio_device *dev)
 {
+	int i;
+
 	if (!dev)
 		return;
 
+	for (i = 0; i < VIRTIO_MAX_DOORBELLS; i++) {
+		if (dev->doorbells[i])
+			release_hvm_virq(dev->doorbells[i]);
+	}
+
 	vdev_release(&dev->vdev);
 	free(dev);
 }
@@ -280,6 +295,51 @@ int virtio_mmio_init(struct vm *vm, size_t size,
 	return 0;
 }
 
+int virtio_mmio_doorbell(struct vm *vm, unsigned long gbase,
+		int queue, int bind)
+{
+	int virq;
+	struct vdev *vdev;
+	struct virtio_device *dev = NULL;
+
+	if (!vm || (queue < 0) || (queue >= VIRTIO_MAX_DOORBELLS))
+		return -EINVAL;
+
+	list_for_each_entry(vdev, &vm->vdev_list, list) {
+		if ((vdev->gvm_paddr == gbase) &&
+				(vdev->write == virtio_mmio_write)) {
+			dev = vdev_to_virtio(vdev);
+			break;
+		}
+	}
+
+	if (!dev)
+		return -ENOENT;
+
+	virq = dev->doorbells[queue];
+	if (!bind) {
+		/* fall back to the vmcs for this queue */
+		dev->doorbells[queue] = 0;
+		if (virq)
+			release_hvm_virq(virq);
+		return 0;
+	}
+
+	/* the queue may be re-inited by the guest, reuse the virq */
+	if (virq)
+		return virq;
+
+	virq = alloc_hvm_virq();
+	if (virq < 0)
+		return -ENOSPC;
+
+	dev->doorbells[queue] = virq;
+	pr_info("vm-%d virtio 0x%x queue-%d doorbell virq %d\n",
+			vm->vmid, gbase, queue, virq);
+
+	return virq;
+}
+
 int virtio_mmio_deinit(struct vm *vm)
 {
 	struct mm_struct *mm = &vm->mm;
@@ -17,6 +17,7 @@
 #define VM_FLAGS_NO_RAMDISK		(1 << 3)
 #define VM_FLAGS_NO_BOOTIMAGE		(1 << 4)
 #define VM_FLAGS_HAS_EARLYPRINTK	(1 << 5)
+#define VM_FLAGS_LAZY_MEM		(1 << 6)
 
 #define VM_FLAGS_SETUP_OF		(1 << 8)
 #define VM_FLAGS_SETUP_ACPI		(1 << 9)
@@ -36,8 +37,37 @@ struct vmtag {
 	unsigned long flags;
 	uint32_t vcpu_affinity[8];
 	uint64_t mmap_base;
+	uint64_t cache_colors;
 };
 
+/*
+ * the idle histogram of the vm memory, idle[0] is the memory
+ * accessed in the last pass, idle[i] is the memory idle for
+ * [2^(i-1), 2^i) passes, the last one is idle for longer, the
+ * size is in bytes
+ */
+#define VM_WSS_BUCKETS	8
+
+struct vm_wss_stat {
+	uint32_t interval;
+	uint32_t rate;
+	uint64_t passes;
+	uint64_t access_faults;
+	uint64_t scanned;
+	uint64_t mem_size;
+	uint64_t idle[VM_WSS_BUCKETS];
+};
+
+/*
+ * the state of each mem_block returned by IOCTL_VM_GET_MEM_MAP,
+ * a block which is not populated reads as zero, a reclaimed
+ * block can be read by IOCTL_VM_READ_BLOCK without faulting it
+ * in for the vm
+ */
+#define VM_BLOCK_NONE			(0)
+#define VM_BLOCK_MAPPED			(1)
+#define VM_BLOCK_RECLAIMED		(2)
+
 #define IOCTL_CREATE_VM			0xf000
 #define IOCTL_DESTROY_VM		0xf001
 #define IOCTL_RESTART_VM		0xf002
@@ -54,5 +84,24 @@ struct vmtag {
 #define IOCTL_VIRTIO_MMIO_DEINIT	0xf00e
 #define IOCTL_REQUEST_VIRQ		0xf00f
 #define IOCTL_CREATE_HOST_VDEV		0xf010
+#define IOCTL_VM_RELEASE_MEMORY		0xf011
+#define IOCTL_VM_POPULATE_MEMORY	0xf012
+#define IOCTL_VM_DIRTY_LOG		0xf013
+#define IOCTL_VM_GET_DIRTY_LOG		0xf014
+#define IOCTL_VM_PAUSE			0xf015
+#define IOCTL_VM_UNPAUSE		0xf016
+#define IOCTL_VM_SAVE_STATE		0xf017
+#define IOCTL_VM_RESTORE_STATE		0xf018
+#define IOCTL_VM_CLONE			0xf019
+#define IOCTL_VM_MEM_LIMIT		0xf01a
+#define IOCTL_VM_WSS_CONFIG		0xf01b
+#define IOCTL_VM_GET_WSS		0xf01c
+#define IOCTL_VM_DESTROY_STATE		0xf01d
+#define IOCTL_VM_VMCS_ACK		0xf01e
+#define IOCTL_VIRTIO_DOORBELL		0xf01f
+#define IOCTL_VM_MMIO_COALESCE		0xf022
+#define IOCTL_TRACE_CONFIG		0xf023
+#define IOCTL_VM_GET_MEM_MAP		0xf024
+#define IOCTL_VM_READ_BLOCK		0xf025
 
 #endif
@@ -0,0 +1,84 @@
+#ifndef __MINOS_TRACE_H__
+#define __MINOS_TRACE_H__
+
+#ifdef BUILD_HYPERVISOR
+#include <minos/types.h>
+#else
+#include <inttypes.h>
+#include <sys/types.h>
+#endif
+
+/*
+ * each pcpu has a trace ring in the hypervisor memory which
+ * is also mapped to the hvm. only the pcpu itself writes its
+ * ring, head is increased after the entry is visible, the
+ * reader copies the entries then reads head again to drop
+ * the ones which may be overwritten during the copy
+ */
+#define TRACE_RING_ENTRIES	(2048)
+#define TRACE_RING_MASK		(TRACE_RING_ENTRIES - 1)
+
+#define TRACE_VCPU_SWITCH	(1)
+#define TRACE_GUEST_EXIT	(2)
+#define TRACE_GUEST_ENTRY	(3)
+#define TRACE_VIRQ_SEND		(4)
+#define TRACE_VIRQ_INJECT	(5)
+#define TRACE_VMCS_POST		(6)
+#define TRACE_VMCS_ACK		(7)
+#define TRACE_TIMER		(8)
+
+/* vmid of the idle vcpu */
+#define TRACE_NO_VM		(0xffff)
+
+/*
+ * ts is the count of the arch counter, the meaning of the
+ * args depends on the event:
+ *
+ * vcpu switch  - vmid and vcpu id of the previous vcpu
+ * guest exit   - esr and elr of the guest
+ * virq send    - virq, 1 if it is already pending
+ * virq inject  - virq, the lr id
+ * vmcs post    - trap type << 16 | reason, trap data
+ * vmcs ack     - index of the trap, return value
+ * timer        - timer function, expires in ns
+ */
+struct trace_entry {
+	uint64_t ts;
+	uint16_t event;
+	uint16_t vmid;
+	uint16_t vcpu_id;
+	uint16_t reserved;
+	uint64_t arg0;
+	uint64_t arg1;
+};
+
+struct trace_ring {
+	volatile uint64_t head;
+	uint32_t cpu;
+	uint32_t nr_entries;
+	uint64_t freq;
+	uint64_t reserved[5];
+	struct trace_entry entry[TRACE_RING_ENTRIES];
+};
+
+/*
+ * the file written by the mvm trace dump, each ring is a
+ * trace_file_ring followed by nr entries in time order
+ */
+#define TRACE_FILE_MAGIC	"MVTRACE"
+#define TRACE_FILE_VERSION	(1)
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_rings;
+	uint64_t freq;
+};
+
+struct trace_file_ring {
+	uint32_t cpu;
+	uint32_t nr;
+	uint64_t lost;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef __MINOS_VMCS_H__
+#define __MINOS_VMCS_H__
+
+#ifdef BUILD_HYPERVISOR
+#include <minos/types.h>
+#else
+#include <inttypes.h>
+#include <sys/types.h>
+#endif
+
+/*
+ * each vcpu has a vmcs shared by the hypervisor and mvm,
+ * the traps of the vcpu are posted to the ring, host_index
+ * is increased by the hypervisor when a trap is posted and
+ * guest_index is increased by mvm when a trap is handled,
+ * so the non-blocking traps can be posted back to back.
+ * waiting is set when the vcpu is suspended to wait for
+ * the ack, then mvm need to wake it up by the ack hypercall
+ */
+#define VMCS_RING_SIZE		(16)
+#define VMCS_RING_MASK		(VMCS_RING_SIZE - 1)
+
+struct vmcs_entry {
+	volatile uint32_t trap_type;
+	volatile uint32_t trap_reason;
+	volatile int32_t  trap_ret;
+	volatile uint32_t reserved;
+	volatile unsigned long trap_data;
+	volatile unsigned long trap_result;
+};
+
+struct vmcs {
+	volatile uint32_t vcpu_id;
+	volatile uint32_t waiting;
+	volatile uint64_t host_index;
+	volatile uint64_t guest_index;
+	volatile uint32_t polling;
+	volatile uint32_t reserved;
+	struct vmcs_entry ring[VMCS_RING_SIZE];
+	volatile unsigned long data[0];
+} __align(1024);
+
+#define VMCS_DATA_SIZE	(1024 - 32 - \
+		VMCS_RING_SIZE * sizeof(struct vmcs_entry))
+
+#define vmcs_entry(vmcs, index)	(&(vmcs)->ring[(index) & VMCS_RING_MASK])
+
+/*
+ * the mmio writes to the ranges registered by mvm are not
+ * trapped, hypervisor appends them to this ring which is
+ * after the vmcs of all the vcpus, mvm handles them before
+ * the next trap of the vm
+ */
+#define MMIO_RING_SIZE		(128)
+#define MMIO_RING_MASK		(MMIO_RING_SIZE - 1)
+#define MMIO_COALESCE_RANGES	(8)
+
+struct mmio_ring_entry {
+	volatile uint64_t addr;
+	volatile uint64_t value;
+};
+
+struct mmio_ring {
+	volatile uint64_t first;
+	volatile uint64_t last;
+	struct mmio_ring_entry ring[MMIO_RING_SIZE];
+};
+
+#define vmcs_mmio_ring(base, nr) \
+	((struct mmio_ring *)((char *)(base) + (nr) * sizeof(struct vmcs)))
+
+enum vm_trap_type {
+	VMTRAP_TYPE_MMIO = 0,
+	VMTRAP_TYPE_COMMON,
+	VMTRAP_TYPE_UNKNOWN,
+};
+
+enum vm_trap_reason {
+	VMTRAP_REASON_READ = 0,
+	VMTRAP_REASON_WRITE,
+	VMTRAP_REASON_CONFIG,
+	VMTRAP_REASON_REBOOT,
+	VMTRAP_REASON_SHUTDOWN,
+	VMTRAP_REASON_VM_SUSPEND,
+	VMTRAP_REASON_VM_RESUMED,
+	VMTRAP_REASON_WDT_TIMEOUT,
+	VMTRAP_REASON_GET_TIME,
+	VMTRAP_REASON_UNKNOWN,
+};
+
+#endif
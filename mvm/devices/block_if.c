@@ -64,6 +64,13 @@
 #define BLOCKIF_NUMTHR	8
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
 
+/*
+ * With "overlay=<file>" the backing file is only read, the
+ * writes go to the overlay file in chunks, so the clones of
+ * a template vm can share one disk image.
+ */
+#define BLOCKIF_OVERLAY_CHUNK	4096
+
 /*
  * Debug printf
  */
@@ -122,6 +129,11 @@ struct blockif_ctxt {
 
 	/* write cache enable */
 	uint8_t			wce;
+
+	/* copy-on-write overlay, ofd is -1 if not used */
+	int			ofd;
+	uint8_t			*omap;
+	pthread_mutex_t		omtx;
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
@@ -143,12 +155,174 @@ blockif_flush_cache(struct blockif_ctxt *bc)
 	err = 0;
 	assert(bc != NULL);
 	if (!bc->wce) {
-		if (fsync(bc->fd))
+		if (fsync(bc->ofd >= 0 ? bc->ofd : bc->fd))
 			err = errno;
 	}
 	return err;
 }
 
+static inline int
+blockif_overlay_test(struct blockif_ctxt *bc, off_t chunk)
+{
+	return bc->omap[chunk / 8] & (1 << (chunk % 8));
+}
+
+static inline void
+blockif_overlay_set(struct blockif_ctxt *bc, off_t chunk)
+{
+	bc->omap[chunk / 8] |= 1 << (chunk % 8);
+}
+
+/*
+ * Copy between the iovecs of the request and a linear buffer,
+ * off is the offset from the start of the request.
+ */
+static void
+blockif_copy_iov(struct blockif_req *br, off_t off, uint8_t *buf,
+		 ssize_t len, int to_iov)
+{
+	ssize_t clen;
+	int i;
+
+	for (i = 0; i < br->iovcnt && len > 0; i++) {
+		if (off >= br->iov[i].iov_len) {
+			off -= br->iov[i].iov_len;
+			continue;
+		}
+		clen = MIN(len, br->iov[i].iov_len - off);
+		if (to_iov)
+			memcpy(br->iov[i].iov_base + off, buf, clen);
+		else
+			memcpy(buf, br->iov[i].iov_base + off, clen);
+		buf += clen;
+		len -= clen;
+		off = 0;
+	}
+}
+
+/*
+ * Read from the overlay the chunks which have been written and
+ * from the backing file the others, consecutive chunks with the
+ * same source are read together.
+ */
+static int
+blockif_overlay_read(struct blockif_ctxt *bc, off_t off, uint8_t *buf,
+		     ssize_t len)
+{
+	ssize_t clen;
+	off_t chunk, end;
+	int in_overlay;
+
+	while (len > 0) {
+		chunk = off / BLOCKIF_OVERLAY_CHUNK;
+		in_overlay = blockif_overlay_test(bc, chunk);
+		end = (chunk + 1) * BLOCKIF_OVERLAY_CHUNK;
+		while (end < off + len && blockif_overlay_test(bc,
+		    end / BLOCKIF_OVERLAY_CHUNK) == in_overlay)
+			end += BLOCKIF_OVERLAY_CHUNK;
+		clen = MIN(len, end - off);
+
+		if (in_overlay) {
+			if (pread(bc->ofd, buf, clen, off) < 0)
+				return errno;
+		} else if (pread(bc->fd, buf, clen,
+		    off + bc->sub_file_start_lba) < 0)
+			return errno;
+
+		buf += clen;
+		off += clen;
+		len -= clen;
+	}
+
+	return 0;
+}
+
+/*
+ * A chunk which is not in the overlay yet is filled from the
+ * backing file first if the write does not cover all of it.
+ */
+static int
+blockif_overlay_write(struct blockif_ctxt *bc, off_t off, uint8_t *buf,
+		      ssize_t len)
+{
+	uint8_t cbuf[BLOCKIF_OVERLAY_CHUNK];
+	ssize_t clen;
+	off_t chunk, coff;
+	int err = 0;
+
+	while (len > 0) {
+		chunk = off / BLOCKIF_OVERLAY_CHUNK;
+		coff = off % BLOCKIF_OVERLAY_CHUNK;
+		clen = MIN(len, BLOCKIF_OVERLAY_CHUNK - coff);
+
+		if (blockif_overlay_test(bc, chunk)) {
+			if (pwrite(bc->ofd, buf, clen, off) < 0)
+				return errno;
+			goto next;
+		}
+
+		pthread_mutex_lock(&bc->omtx);
+		if (blockif_overlay_test(bc, chunk) ||
+		    clen == BLOCKIF_OVERLAY_CHUNK) {
+			if (pwrite(bc->ofd, buf, clen, off) < 0)
+				err = errno;
+		} else {
+			memset(cbuf, 0, sizeof(cbuf));
+			if (pread(bc->fd, cbuf, sizeof(cbuf),
+			    off - coff + bc->sub_file_start_lba) < 0)
+				err = errno;
+			memcpy(cbuf + coff, buf, clen);
+			if (!err && pwrite(bc->ofd, cbuf, sizeof(cbuf),
+			    off - coff) < 0)
+				err = errno;
+		}
+		if (!err)
+			blockif_overlay_set(bc, chunk);
+		pthread_mutex_unlock(&bc->omtx);
+		if (err)
+			return err;
+next:
+		buf += clen;
+		off += clen;
+		len -= clen;
+	}
+
+	return 0;
+}
+
+static int
+blockif_overlay_proc(struct blockif_ctxt *bc, struct blockif_req *br,
+		     int write, uint8_t *buf)
+{
+	ssize_t len, done;
+	int err;
+
+	err = 0;
+	done = 0;
+	while (br->resid > 0) {
+		len = MIN(br->resid, MAXPHYS);
+		if (write) {
+			blockif_copy_iov(br, done, buf, len, 0);
+			err = blockif_overlay_write(bc, br->offset + done,
+			    buf, len);
+		} else {
+			err = blockif_overlay_read(bc, br->offset + done,
+			    buf, len);
+			if (!err)
+				blockif_copy_iov(br, done, buf, len, 1);
+		}
+		if (err)
+			break;
+		done += len;
+		br->resid -= len;
+	}
+
+	if (!err && write)
+		err = blockif_flush_cache(bc);
+
+	return err;
+}
+
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
@@ -242,6 +416,16 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 	int i, err;
 
 	br = be->req;
+	if (bc->ofd >= 0 && (be->op == BOP_READ || be->op == BOP_WRITE)) {
+		if (be->op == BOP_WRITE && bc->rdonly)
+			err = EROFS;
+		else
+			err = blockif_overlay_proc(bc, br,
+			    be->op == BOP_WRITE, buf);
+		be->status = BST_DONE;
+		(*br->callback)(br, err);
+		return;
+	}
 	if (br->iovcnt <= 1)
 		buf = NULL;
 	err = 0;
@@ -329,7 +513,7 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 
 		break;
 	case BOP_FLUSH:
-		if (fsync(bc->fd))
+		if (fsync(bc->ofd >= 0 ? bc->ofd : bc->fd))
 			err = errno;
 		break;
 	case BOP_DELETE:
@@ -368,7 +552,7 @@ blockif_thr(void *arg)
 	uint8_t *buf;
 
 	bc = arg;
-	if (bc->isgeom)
+	if (bc->isgeom || bc->ofd >= 0)
 		buf = malloc(MAXPHYS);
 	else
 		buf = NULL;
@@ -481,7 +665,7 @@ blockif_open(const char *optstr, const char *ident)
 {
 	char tname[MAXCOMLEN + 1];
 	/* char name[MAXPATHLEN]; */
-	char *nopt, *xopts, *cp;
+	char *nopt, *xopts, *cp, *opath;
 	struct blockif_ctxt *bc;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
@@ -499,6 +683,7 @@ blockif_open(const char *optstr, const char *ident)
 	fd = -1;
 	ssopt = 0;
 	ro = 0;
+	opath = NULL;
 	sub_file_assign = 0;
 
 	/* writethru is on by default */
@@ -523,6 +708,8 @@ blockif_open(const char *optstr, const char *ident)
 			writeback = 0;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strncmp(cp, "overlay=", 8))
+			opath = cp + 8;
 		else if (sscanf(cp, "sectorsize=%d/%d", &ssopt, &pssopt) == 2)
 			;
 		else if (sscanf(cp, "sectorsize=%d", &ssopt) == 1)
@@ -543,8 +730,9 @@ blockif_open(const char *optstr, const char *ident)
 	 * operation to emulate it.
 	 */
 
-	fd = open(nopt, ro ? O_RDONLY : O_RDWR);
-	if (fd < 0 && !ro) {
+	/* the backing file of an overlay is never written */
+	fd = open(nopt, (ro || opath) ? O_RDONLY : O_RDWR);
+	if (fd < 0 && !ro && !opath) {
 		/* Attempt a r/w fail with a r/o open */
 		fd = open(nopt, O_RDONLY);
 		ro = 1;
@@ -645,8 +833,8 @@ blockif_open(const char *optstr, const char *ident)
 		bc->sub_file_start_lba = sub_file_start_lba * sectsz;
 		size = sub_file_size * sectsz;
 		DPRINTF(("Validating sub file...\n"));
-		err_code = sub_file_validate(bc, fd, ro, bc->sub_file_start_lba,
-					     size);
+		err_code = sub_file_validate(bc, fd, ro || opath,
+					     bc->sub_file_start_lba, size);
 		if (err_code < 0) {
 			fprintf(stderr, "subfile range specified not valid!\n");
 			exit(1);
@@ -658,6 +846,24 @@ blockif_open(const char *optstr, const char *ident)
 		bc->sub_file_start_lba = 0;
 	}
 
+	bc->ofd = -1;
+	if (opath) {
+		bc->ofd = open(opath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (bc->ofd < 0) {
+			warn("Could not open overlay file: %s", opath);
+			free(bc);
+			goto err;
+		}
+		bc->omap = calloc(1, size / BLOCKIF_OVERLAY_CHUNK / 8 + 1);
+		if (!bc->omap || ftruncate(bc->ofd, size)) {
+			close(bc->ofd);
+			free(bc->omap);
+			free(bc);
+			goto err;
+		}
+		pthread_mutex_init(&bc->omtx, NULL);
+	}
+
 	bc->magic = BLOCKIF_SIG;
 	bc->fd = fd;
 	bc->isblk = S_ISBLK(sbuf.st_mode);
@@ -853,6 +1059,10 @@ blockif_close(struct blockif_ctxt *bc)
 	 */
 	bc->magic = 0;
 	close(bc->fd);
+	if (bc->ofd >= 0) {
+		close(bc->ofd);
+		free(bc->omap);
+	}
 	free(bc);
 
 	return 0;
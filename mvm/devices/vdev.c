@@ -57,6 +57,11 @@ void vdev_send_irq(struct vdev *vdev)
 	if (!vdev->gvm_irq)
 		return;
 
+	/*
+	 * the hypervisor does not kick the vcpu again if the
+	 * virq is still pending, so a burst of completions is
+	 * coalesced into one injection
+	 */
 	send_virq_to_vm(vdev->gvm_irq);
 }
 
@@ -35,12 +35,18 @@
 #include <virtio.h>
 #include <io.h>
 #include <barrier.h>
+#include <mevent.h>
+#include <sys/eventfd.h>
 
 static void *virtio_guest_iobase;
 static void *virtio_host_iobase;
 static size_t virtio_iomem_size;
 static size_t virtio_iomem_free;
 
+/* the virtio devices indexed by their slot in the iomem */
+static struct virtio_device **virtio_devs;
+static int virtio_nr_slots;
+
 static int hv_create_virtio_device(struct vm *vm,
 		void **gbase, void **hbase)
 {
@@ -111,6 +117,13 @@ int virtio_mmio_init(struct vm *vm, int nr_devs)
 	if (ret || !gbase || !hbase)
 		return ret;
 
+	virtio_nr_slots = size / VIRTIO_DEVICE_IOMEM_SIZE;
+	virtio_devs = calloc(virtio_nr_slots, sizeof(struct virtio_device *));
+	if (!virtio_devs) {
+		hv_virtio_mmio_deinit(vm);
+		return -ENOMEM;
+	}
+
 	virtio_guest_iobase = gbase;
 	virtio_host_iobase = hbase;
 	virtio_iomem_size = size;
@@ -123,11 +136,91 @@ int virtio_mmio_init(struct vm *vm, int nr_devs)
 
 int virtio_mmio_deinit(struct vm *vm)
 {
+	if (virtio_devs) {
+		free(virtio_devs);
+		virtio_devs = NULL;
+		virtio_nr_slots = 0;
+	}
+
 	vdev_unmap_iomem(virtio_host_iobase, virtio_iomem_size);
 
 	return hv_virtio_mmio_deinit(vm);
 }
 
+static int virtio_slot(void *addr)
+{
+	unsigned long base = (unsigned long)virtio_guest_iobase;
+
+	if (!virtio_devs || ((unsigned long)addr < base) ||
+			((unsigned long)addr >= base + virtio_iomem_size))
+		return -1;
+
+	return ((unsigned long)addr - base) / VIRTIO_DEVICE_IOMEM_SIZE;
+}
+
+static struct virtio_device *virtio_slot_device(unsigned long addr)
+{
+	int slot = virtio_slot((void *)addr);
+
+	return (slot < 0) ? NULL : virtio_devs[slot];
+}
+
+/*
+ * the virtio devices are allocated one by one in the virtio
+ * iomem, the device of the mmio trap is got by its slot
+ * directly
+ */
+struct vdev *virtio_mmio_vdev(unsigned long addr)
+{
+	struct virtio_device *dev = virtio_slot_device(addr);
+
+	return dev ? dev->vdev : NULL;
+}
+
+/*
+ * run the callback of the queue with its lock held, the notify
+ * is kept pending if the device is quiesced
+ */
+static void virtq_kick(struct virt_queue *vq)
+{
+	if (!vq->ready || !vq->callback)
+		return;
+
+	if (vq->paused)
+		vq->kicked = 1;
+	else
+		vq->callback(vq);
+}
+
+/*
+ * handle the queue notify of the device which only need the
+ * lock of the queue, other traps return -EAGAIN and need to
+ * be handled under vdev->lock
+ */
+int virtio_mmio_notify(struct vdev *vdev, int reason,
+		unsigned long addr, unsigned long *value)
+{
+	uint32_t index = (uint32_t)*value;
+	struct virt_queue *vq;
+	struct virtio_device *dev = virtio_slot_device(addr);
+
+	if (!dev || !(dev->flags & VIRTIO_DEV_F_VQ_LOCK) ||
+			(reason != VMTRAP_REASON_WRITE) ||
+			(addr - (unsigned long)vdev->guest_iomem !=
+			 VIRTIO_MMIO_QUEUE_NOTIFY))
+		return -EAGAIN;
+
+	if (index >= dev->nr_vq)
+		return -EINVAL;
+
+	vq = &dev->vqs[index];
+	pthread_mutex_lock(&vq->lock);
+	virtq_kick(vq);
+	pthread_mutex_unlock(&vq->lock);
+
+	return 0;
+}
+
 static inline int next_desc(struct vring_desc *desc)
 {
 	return (!(desc->flags & VRING_DESC_F_NEXT)) ? -1 : desc->next;
@@ -456,6 +549,91 @@ static int __virtio_vdev_init(struct vdev *vdev,
 	return 0;
 }
 
+static void virtq_doorbell_event(int fd, enum ev_type type, void *data)
+{
+	eventfd_t value;
+	struct virt_queue *vq = data;
+	pthread_mutex_t *lock = &vq->dev->vdev->lock;
+
+	eventfd_read(fd, &value);
+
+	/* the coalesced writes happened before this notify */
+	vm_handle_coalesced_mmio(vq->dev->vdev->vm);
+
+	/* same lock as the vmcs path, the queue may also be reset */
+	if (vq->dev->flags & VIRTIO_DEV_F_VQ_LOCK)
+		lock = &vq->lock;
+
+	pthread_mutex_lock(lock);
+	virtq_kick(vq);
+	pthread_mutex_unlock(lock);
+}
+
+/*
+ * let the hypervisor ring an eventfd when the guest notify
+ * this queue, the backend is woken up by the mevent thread
+ * directly without the vmcs round trip. if anything fails
+ * the queue notify still goes through the vmcs
+ */
+static void virtq_bind_doorbell(struct virt_queue *vq)
+{
+	int fd, irq;
+	uint64_t arg;
+	struct vdev *vdev = vq->dev->vdev;
+	unsigned long gbase = (unsigned long)vdev->guest_iomem;
+
+	if (vq->doorbell)
+		return;
+
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0)
+		return;
+
+	irq = vm_virtio_doorbell(vdev->vm, gbase, vq->vq_index, 1);
+	if (irq <= 0)
+		goto out;
+
+	arg = ((unsigned long)fd << 32) | irq;
+	if (ioctl(vdev->vm->vm_fd, IOCTL_REGISTER_VCPU, &arg))
+		goto unbind;
+
+	vq->doorbell = mevent_add(fd, EVF_READ, virtq_doorbell_event, vq);
+	if (!vq->doorbell) {
+		ioctl(vdev->vm->vm_fd, IOCTL_UNREGISTER_VCPU,
+				(unsigned long)irq);
+		goto unbind;
+	}
+
+	vq->doorbell_irq = irq;
+
+	return;
+
+unbind:
+	vm_virtio_doorbell(vdev->vm, gbase, vq->vq_index, 0);
+out:
+	pr_warn("%s queue-%d use vmcs for notify\n",
+			vdev->name, vq->vq_index);
+	close(fd);
+}
+
+static void virtq_unbind_doorbell(struct virt_queue *vq)
+{
+	struct vdev *vdev;
+
+	if (!vq->doorbell)
+		return;
+
+	vdev = vq->dev->vdev;
+	ioctl(vdev->vm->vm_fd, IOCTL_UNREGISTER_VCPU,
+			(unsigned long)vq->doorbell_irq);
+	mevent_delete_close(vq->doorbell);
+	vm_virtio_doorbell(vdev->vm, (unsigned long)vdev->guest_iomem,
+			vq->vq_index, 0);
+
+	vq->doorbell = NULL;
+	vq->doorbell_irq = 0;
+}
+
 static void inline virtq_reset(struct virt_queue *vq)
 {
 	vq->desc = NULL;
@@ -470,23 +648,55 @@ static void inline virtq_reset(struct virt_queue *vq)
 	vq->ready = 0;
 }
 
-int virtio_device_reset(struct virtio_device *dev)
+/*
+ * the callbacks of a VIRTIO_DEV_F_VQ_LOCK device only hold the
+ * lock of their queue, take all of them so the whole reset is
+ * not seen by the callbacks, the locks are taken in order
+ */
+void virtio_device_lock_vqs(struct virtio_device *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->nr_vq; i++)
+		pthread_mutex_lock(&dev->vqs[i].lock);
+}
+
+void virtio_device_unlock_vqs(struct virtio_device *dev)
+{
+	int i;
+
+	for (i = dev->nr_vq - 1; i >= 0; i--)
+		pthread_mutex_unlock(&dev->vqs[i].lock);
+}
+
+/* called with all the locks of the queues held */
+int __virtio_device_reset(struct virtio_device *dev)
 {
 	int i;
 
 	for (i = 0; i < dev->nr_vq; i++) {
 		if (dev->ops && dev->ops->vq_reset)
 			dev->ops->vq_reset(&dev->vqs[i]);
-
 		virtq_reset(&dev->vqs[i]);
 	}
 
 	return 0;
 }
 
+int virtio_device_reset(struct virtio_device *dev)
+{
+	int ret;
+
+	virtio_device_lock_vqs(dev);
+	ret = __virtio_device_reset(dev);
+	virtio_device_unlock_vqs(dev);
+
+	return ret;
+}
+
 void virtio_device_deinit(struct virtio_device *virt_dev)
 {
-	int i;
+	int i, slot;
 	struct virt_queue *vq;
 
 	for (i = 0; i < virt_dev->nr_vq; i++) {
@@ -494,12 +704,18 @@ void virtio_device_deinit(struct virtio_device *virt_dev)
 		if (virt_dev->ops && virt_dev->ops->vq_deinit)
 			virt_dev->ops->vq_deinit(vq);
 
+		virtq_unbind_doorbell(vq);
 		if (vq->iovec)
 			free(vq->iovec);
+		pthread_mutex_destroy(&vq->lock);
 	}
 
 	if (virt_dev->vqs)
 		free(virt_dev->vqs);
+
+	slot = virt_dev->vdev ? virtio_slot(virt_dev->vdev->guest_iomem) : -1;
+	if ((slot >= 0) && (virtio_devs[slot] == virt_dev))
+		virtio_devs[slot] = NULL;
 }
 
 int virtio_device_init(struct virtio_device *virt_dev, struct vdev *vdev,
@@ -551,6 +767,7 @@ int virtio_device_init(struct virtio_device *virt_dev, struct vdev *vdev,
 	/* alloc the iovec */
 	for (i = 0; i < queue_nr; i++) {
 		vq = &virt_dev->vqs[i];
+		pthread_mutex_init(&vq->lock, NULL);
 		vq->iovec = malloc(sizeof(struct iovec) * iov_size);
 		if (!vq->iovec) {
 			pr_err("failed to get memory for iovec %d\n", i);
@@ -560,6 +777,8 @@ int virtio_device_init(struct virtio_device *virt_dev, struct vdev *vdev,
 		vq->iovec_size = iov_size;
 	}
 
+	virtio_devs[virtio_slot(gbase)] = virt_dev;
+
 	return 0;
 
 release_virtio_dev:
@@ -567,6 +786,174 @@ release_virtio_dev:
 	return ret;
 }
 
+/*
+ * state of the virtio device for vm snapshot, the vring
+ * address is saved as gpa since the memory of the vm may
+ * be mapped to other address when restore
+ */
+struct virtq_state {
+	uint32_t ready;
+	uint32_t num;
+	uint64_t desc;
+	uint64_t avail;
+	uint64_t used;
+	uint16_t last_avail_idx;
+	uint16_t avail_idx;
+	uint16_t last_used_idx;
+	uint16_t used_flags;
+	uint16_t signalled_used;
+	uint16_t signalled_used_valid;
+	uint32_t reserved;
+};
+
+struct virtio_device_state {
+	uint64_t acked_features;
+	uint32_t nr_vq;
+	uint32_t iomem_size;
+	struct virtq_state vqs[0];
+};
+
+/*
+ * save the state of the virtio device to the buffer, if
+ * the buffer is NULL return the size it needed
+ */
+int virtio_device_save(struct virtio_device *dev, void *buf, size_t size)
+{
+	int i;
+	struct virt_queue *vq;
+	struct virtq_state *vs;
+	struct virtio_device_state *state = buf;
+	struct vdev *vdev = dev->vdev;
+	size_t need;
+
+	need = sizeof(struct virtio_device_state) +
+		dev->nr_vq * sizeof(struct virtq_state) + vdev->iomem_size;
+	if (!buf)
+		return need;
+
+	if (size < need)
+		return -ENOSPC;
+
+	state->acked_features = dev->acked_features;
+	state->nr_vq = dev->nr_vq;
+	state->iomem_size = vdev->iomem_size;
+
+	for (i = 0; i < dev->nr_vq; i++) {
+		vq = &dev->vqs[i];
+		vs = &state->vqs[i];
+		memset(vs, 0, sizeof(struct virtq_state));
+
+		vs->ready = vq->ready;
+		if (!vq->ready)
+			continue;
+
+		vs->num = vq->num;
+		vs->desc = hvm_va_to_gpa(vq->desc);
+		vs->avail = hvm_va_to_gpa(vq->avail);
+		vs->used = hvm_va_to_gpa(vq->used);
+		vs->last_avail_idx = vq->last_avail_idx;
+		vs->avail_idx = vq->avail_idx;
+		vs->last_used_idx = vq->last_used_idx;
+		vs->used_flags = vq->used_flags;
+		vs->signalled_used = vq->signalled_used;
+		vs->signalled_used_valid = vq->signalled_used_valid;
+	}
+
+	memcpy(&state->vqs[dev->nr_vq], vdev->iomem, vdev->iomem_size);
+
+	return need;
+}
+
+int virtio_device_restore(struct virtio_device *dev, void *buf, size_t size)
+{
+	int i, kick = 0;
+	struct virt_queue *vq;
+	struct virtq_state *vs;
+	struct virtio_device_state *state = buf;
+	struct vdev *vdev = dev->vdev;
+
+	if ((size < sizeof(struct virtio_device_state)) ||
+			(state->nr_vq != dev->nr_vq) ||
+			(state->iomem_size != vdev->iomem_size) ||
+			(size < virtio_device_save(dev, NULL, 0)))
+		return -EINVAL;
+
+	/* the registers and the config space of the device */
+	memcpy(vdev->iomem, &state->vqs[dev->nr_vq], vdev->iomem_size);
+	dev->acked_features = state->acked_features;
+	if (dev->acked_features && dev->ops && dev->ops->neg_features)
+		dev->ops->neg_features(dev);
+
+	for (i = 0; i < dev->nr_vq; i++) {
+		vq = &dev->vqs[i];
+		vs = &state->vqs[i];
+
+		virtq_reset(vq);
+		if (!vs->ready)
+			continue;
+
+		vq->vq_index = i;
+		vq->dev = dev;
+		vq->num = vs->num;
+		vq->desc = (struct vring_desc *)gpa_to_hvm_va(vs->desc);
+		vq->avail = (struct vring_avail *)gpa_to_hvm_va(vs->avail);
+		vq->used = (struct vring_used *)gpa_to_hvm_va(vs->used);
+		vq->last_avail_idx = vs->last_avail_idx;
+		vq->avail_idx = vs->avail_idx;
+		vq->last_used_idx = vs->last_used_idx;
+		vq->used_flags = vs->used_flags;
+		vq->signalled_used = vs->signalled_used;
+		vq->signalled_used_valid = vs->signalled_used_valid;
+		vq->ready = 1;
+
+		if (dev->ops && dev->ops->vq_init)
+			dev->ops->vq_init(vq);
+		virtq_bind_doorbell(vq);
+		kick = 1;
+
+		/*
+		 * the notify deferred by the quiesced device is not
+		 * in the state, it is handled when the device resumes
+		 */
+		vq->kicked = virtq_has_descs(vq);
+	}
+
+	wmb();
+
+	/*
+	 * the irq sent to the guest when taking the snapshot
+	 * may be lost, let the guest check the used ring again
+	 */
+	if (kick)
+		virtio_send_irq(dev, VIRTIO_MMIO_INT_VRING);
+
+	return 0;
+}
+
+/*
+ * stop the queue callbacks before the state of the device is
+ * saved, the callback which is running is waited by taking the
+ * lock of the queue. the caller holds vdev->lock, when resuming
+ * the notify received during the pause is handled
+ */
+void virtio_device_quiesce(struct virtio_device *dev, int pause)
+{
+	int i;
+	struct virt_queue *vq;
+
+	for (i = 0; i < dev->nr_vq; i++) {
+		vq = &dev->vqs[i];
+
+		pthread_mutex_lock(&vq->lock);
+		vq->paused = pause;
+		if (!pause && vq->kicked) {
+			vq->kicked = 0;
+			virtq_kick(vq);
+		}
+		pthread_mutex_unlock(&vq->lock);
+	}
+}
+
 static int virtio_status_event(struct virtio_device *dev, uint32_t arg)
 {
 	void *iomem = dev->vdev->iomem;
@@ -615,10 +1002,7 @@ static int virtio_queue_event(struct virtio_device *dev, uint32_t arg)
 		return -ENOENT;
 	}
 
-	if (queue->callback)
-		queue->callback(queue);
-	else
-		pr_err("no callback for this virt queue\n");
+	virtq_kick(queue);
 
 	return 0;
 }
@@ -636,6 +1020,7 @@ static int virtio_buffer_event(struct virtio_device *dev, uint32_t arg)
 	}
 
 	vq = &dev->vqs[arg];
+	pthread_mutex_lock(&vq->lock);
 	vq->vq_index = arg;
 	vq->dev = dev;
 	vq->num = ioread32(iomem + VIRTIO_MMIO_QUEUE_NUM);
@@ -668,6 +1053,9 @@ static int virtio_buffer_event(struct virtio_device *dev, uint32_t arg)
 
 	if (dev->ops && dev->ops->vq_init)
 		dev->ops->vq_init(vq);
+	pthread_mutex_unlock(&vq->lock);
+
+	virtq_bind_doorbell(vq);
 
 	return 0;
 }
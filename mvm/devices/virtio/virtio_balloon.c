@@ -0,0 +1,690 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <mvm.h>
+#include <virtio.h>
+#include <mevent.h>
+#include <compiler.h>
+
+#define VIRTIO_BALLOON_RINGSZ		64
+#define VIRTIO_BALLOON_IOVSZ		8
+#define VIRTIO_BALLOON_MAXQ		3
+
+#define VIRTIO_BALLOON_Q_INFLATE	0
+#define VIRTIO_BALLOON_Q_DEFLATE	1
+#define VIRTIO_BALLOON_Q_STATS		2
+
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST	0
+#define VIRTIO_BALLOON_F_STATS_VQ	1
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM	2
+
+#define VIRTIO_BALLOON_PFN_SHIFT	12
+#define VIRTIO_BALLOON_PAGES_IN_BLOCK	\
+	(MEM_BLOCK_SIZE >> VIRTIO_BALLOON_PFN_SHIFT)
+
+#define VIRTIO_BALLOON_S_SWAP_IN	0
+#define VIRTIO_BALLOON_S_SWAP_OUT	1
+#define VIRTIO_BALLOON_S_MAJFLT		2
+#define VIRTIO_BALLOON_S_MINFLT		3
+#define VIRTIO_BALLOON_S_MEMFREE	4
+#define VIRTIO_BALLOON_S_MEMTOT		5
+#define VIRTIO_BALLOON_S_AVAIL		6
+#define VIRTIO_BALLOON_S_CACHES		7
+#define VIRTIO_BALLOON_S_NR		8
+
+#define VIRTIO_BALLOON_STATS_PERIOD	5
+
+struct virtio_balloon_config {
+	uint32_t num_pages;
+	uint32_t actual;
+} __attribute__((packed));
+
+struct virtio_balloon_stat {
+	uint16_t tag;
+	uint64_t val;
+} __attribute__((packed));
+
+/*
+ * page_bitmap : the 4K guest pages which in the balloon
+ * block_pages : ballooned 4K pages count in each mem_block
+ * block_released : mem_block which released to hypervisor
+ */
+struct virtio_balloon {
+	struct virtio_device virtio_dev;
+	pthread_mutex_t mtx;
+	struct virtio_balloon_config *config;
+
+	unsigned long nr_pages;
+	unsigned long nr_blocks;
+	unsigned long *page_bitmap;
+	uint16_t *block_pages;
+	uint8_t *block_released;
+	unsigned long released_blocks;
+
+	uint64_t stats[VIRTIO_BALLOON_S_NR];
+	int stats_valid;
+	int stats_idx;
+	int stats_period;
+	char *stats_path;
+	pthread_t stats_tid;
+	int stats_exit;
+
+	int ctl_fd;
+	char *ctl_path;
+	struct mevent *ctl_evp;
+};
+
+#define virtio_dev_to_balloon(dev) \
+	(struct virtio_balloon *)container_of(dev, \
+			struct virtio_balloon, virtio_dev)
+
+#define BITS_PER_ULONG		(sizeof(unsigned long) * 8)
+
+static const char *virtio_balloon_stat_names[VIRTIO_BALLOON_S_NR] = {
+	[VIRTIO_BALLOON_S_SWAP_IN]	= "swap_in",
+	[VIRTIO_BALLOON_S_SWAP_OUT]	= "swap_out",
+	[VIRTIO_BALLOON_S_MAJFLT]	= "major_faults",
+	[VIRTIO_BALLOON_S_MINFLT]	= "minor_faults",
+	[VIRTIO_BALLOON_S_MEMFREE]	= "free_memory",
+	[VIRTIO_BALLOON_S_MEMTOT]	= "total_memory",
+	[VIRTIO_BALLOON_S_AVAIL]	= "available_memory",
+	[VIRTIO_BALLOON_S_CACHES]	= "disk_caches",
+};
+
+static inline int vb_test_and_set(unsigned long *map, unsigned long nr)
+{
+	unsigned long mask = 1UL << (nr % BITS_PER_ULONG);
+	unsigned long *p = map + nr / BITS_PER_ULONG;
+	int old = !!(*p & mask);
+
+	*p |= mask;
+	return old;
+}
+
+static inline int vb_test_and_clear(unsigned long *map, unsigned long nr)
+{
+	unsigned long mask = 1UL << (nr % BITS_PER_ULONG);
+	unsigned long *p = map + nr / BITS_PER_ULONG;
+	int old = !!(*p & mask);
+
+	*p &= ~mask;
+	return old;
+}
+
+static int hv_release_memory(struct vm *vm, unsigned long gpa, size_t size)
+{
+	uint64_t args[2] = {gpa, size};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_RELEASE_MEMORY, args);
+}
+
+static int hv_populate_memory(struct vm *vm, unsigned long gpa, size_t size)
+{
+	uint64_t args[2] = {gpa, size};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_POPULATE_MEMORY, args);
+}
+
+static void virtio_balloon_inflate_page(struct virtio_balloon *vb,
+		uint32_t pfn)
+{
+	struct vm *vm = vb->virtio_dev.vdev->vm;
+	unsigned long page, block;
+
+	page = pfn - (vm->mem_start >> VIRTIO_BALLOON_PFN_SHIFT);
+	if (page >= vb->nr_pages) {
+		pr_warn("vballoon: invalid pfn 0x%x\n", pfn);
+		return;
+	}
+
+	if (vb_test_and_set(vb->page_bitmap, page))
+		return;
+
+	/*
+	 * the hypervisor manage the memory as mem_block, only
+	 * when all the pages in a block are in the balloon the
+	 * block can be released
+	 */
+	block = page / VIRTIO_BALLOON_PAGES_IN_BLOCK;
+	vb->block_pages[block]++;
+	if (vb->block_pages[block] != VIRTIO_BALLOON_PAGES_IN_BLOCK)
+		return;
+
+	if (hv_release_memory(vm, vm->mem_start +
+			(block << MEM_BLOCK_SHIFT), MEM_BLOCK_SIZE) > 0) {
+		vb->block_released[block] = 1;
+		vb->released_blocks++;
+	}
+}
+
+static void virtio_balloon_deflate_page(struct virtio_balloon *vb,
+		uint32_t pfn)
+{
+	struct vm *vm = vb->virtio_dev.vdev->vm;
+	unsigned long page, block;
+
+	page = pfn - (vm->mem_start >> VIRTIO_BALLOON_PFN_SHIFT);
+	if (page >= vb->nr_pages) {
+		pr_warn("vballoon: invalid pfn 0x%x\n", pfn);
+		return;
+	}
+
+	if (!vb_test_and_clear(vb->page_bitmap, page))
+		return;
+
+	block = page / VIRTIO_BALLOON_PAGES_IN_BLOCK;
+	vb->block_pages[block]--;
+	if (!vb->block_released[block])
+		return;
+
+	/*
+	 * the guest will use this page after the deflate
+	 * request is acked, map the block back before that
+	 */
+	if (hv_populate_memory(vm, vm->mem_start +
+			(block << MEM_BLOCK_SHIFT), MEM_BLOCK_SIZE)) {
+		pr_err("vballoon: failed to populate block %ld\n", block);
+		return;
+	}
+
+	vb->block_released[block] = 0;
+	vb->released_blocks--;
+}
+
+static void virtio_balloon_notify(struct virt_queue *vq)
+{
+	int idx, i, j;
+	uint32_t *pfns;
+	unsigned int in, out;
+	struct virtio_balloon *vb;
+
+	vb = virtio_dev_to_balloon(vq->dev);
+	virtq_disable_notify(vq);
+
+	while (virtq_has_descs(vq)) {
+		idx = virtq_get_descs(vq, vq->iovec,
+				vq->iovec_size, &in, &out);
+		if (idx < 0)
+			return;
+
+		if (idx == vq->num) {
+			if (virtq_enable_notify(vq)) {
+				virtq_disable_notify(vq);
+				continue;
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&vb->mtx);
+		for (i = 0; i < out; i++) {
+			pfns = (uint32_t *)vq->iovec[i].iov_base;
+			for (j = 0; j < vq->iovec[i].iov_len / sizeof(uint32_t); j++) {
+				if (vq->vq_index == VIRTIO_BALLOON_Q_INFLATE)
+					virtio_balloon_inflate_page(vb, pfns[j]);
+				else
+					virtio_balloon_deflate_page(vb, pfns[j]);
+			}
+		}
+		pthread_mutex_unlock(&vb->mtx);
+
+		virtq_add_used_and_signal(vq, idx, 0);
+	}
+}
+
+static void virtio_balloon_dump_stats(struct virtio_balloon *vb)
+{
+	int i;
+	FILE *fp;
+
+	if (!vb->stats_path)
+		return;
+
+	fp = fopen(vb->stats_path, "w");
+	if (!fp) {
+		pr_warn("vballoon: can not open %s\n", vb->stats_path);
+		return;
+	}
+
+	for (i = 0; i < VIRTIO_BALLOON_S_NR; i++) {
+		if (vb->stats_valid & (1 << i))
+			fprintf(fp, "%s %" PRIu64 "\n",
+				virtio_balloon_stat_names[i], vb->stats[i]);
+	}
+
+	fprintf(fp, "target_pages %u\n", vb->config->num_pages);
+	fprintf(fp, "actual_pages %u\n", vb->config->actual);
+	fprintf(fp, "released_memory %lu\n",
+			vb->released_blocks * MEM_BLOCK_SIZE);
+	fclose(fp);
+}
+
+static void virtio_balloon_stats_notify(struct virt_queue *vq)
+{
+	int idx, i, nr;
+	unsigned int in, out;
+	struct virtio_balloon *vb;
+	struct virtio_balloon_stat *stat;
+
+	vb = virtio_dev_to_balloon(vq->dev);
+
+	while (virtq_has_descs(vq)) {
+		idx = virtq_get_descs(vq, vq->iovec,
+				vq->iovec_size, &in, &out);
+		if ((idx < 0) || (idx == vq->num))
+			return;
+
+		pthread_mutex_lock(&vb->mtx);
+
+		/* the previous buffer should never be held here */
+		if (vb->stats_idx >= 0)
+			virtq_add_used(vq, vb->stats_idx, 0);
+
+		stat = (struct virtio_balloon_stat *)vq->iovec[0].iov_base;
+		nr = vq->iovec[0].iov_len / sizeof(*stat);
+		for (i = 0; i < nr; i++) {
+			if (stat[i].tag >= VIRTIO_BALLOON_S_NR)
+				continue;
+
+			vb->stats[stat[i].tag] = stat[i].val;
+			vb->stats_valid |= (1 << stat[i].tag);
+		}
+
+		/*
+		 * hold the buffer, and it will be returned to the
+		 * guest when the next stats update is required
+		 */
+		vb->stats_idx = idx;
+		virtio_balloon_dump_stats(vb);
+		pthread_mutex_unlock(&vb->mtx);
+	}
+}
+
+static void *virtio_balloon_stats_thread(void *data)
+{
+	struct virt_queue *vq;
+	struct virtio_balloon *vb = (struct virtio_balloon *)data;
+
+	vq = &vb->virtio_dev.vqs[VIRTIO_BALLOON_Q_STATS];
+
+	while (!vb->stats_exit) {
+		sleep(vb->stats_period);
+
+		/* the queue is quiesced under its lock */
+		pthread_mutex_lock(&vq->lock);
+		pthread_mutex_lock(&vb->mtx);
+		if (vq->ready && !vq->paused && (vb->stats_idx >= 0)) {
+			virtq_add_used_and_signal(vq, vb->stats_idx, 0);
+			vb->stats_idx = -1;
+		}
+		pthread_mutex_unlock(&vb->mtx);
+		pthread_mutex_unlock(&vq->lock);
+	}
+
+	return NULL;
+}
+
+static void virtio_balloon_set_target(struct virtio_balloon *vb,
+		unsigned long size)
+{
+	unsigned long pages = size >> VIRTIO_BALLOON_PFN_SHIFT;
+
+	if (pages > vb->nr_pages)
+		pages = vb->nr_pages;
+
+	pr_info("vballoon: set the target to %ld pages\n", pages);
+
+	pthread_mutex_lock(&vb->mtx);
+	vb->config->num_pages = pages;
+	wmb();
+	virtio_send_irq(&vb->virtio_dev, VIRTIO_MMIO_INT_CONFIG);
+	pthread_mutex_unlock(&vb->mtx);
+}
+
+static void virtio_balloon_ctl_read(int fd, enum ev_type t, void *arg)
+{
+	int len;
+	char buf[32];
+	unsigned long size;
+	struct virtio_balloon *vb = (struct virtio_balloon *)arg;
+
+	/* the command is the size of the balloon in MB */
+	memset(buf, 0, sizeof(buf));
+	len = read(fd, buf, sizeof(buf) - 1);
+	if (len <= 0)
+		return;
+
+	size = strtoul(buf, NULL, 0);
+	virtio_balloon_set_target(vb, size << 20);
+}
+
+static int virtio_balloon_ctl_init(struct virtio_balloon *vb)
+{
+	if (!vb->ctl_path)
+		return 0;
+
+	unlink(vb->ctl_path);
+	if (mkfifo(vb->ctl_path, 0600)) {
+		pr_err("vballoon: create %s failed\n", vb->ctl_path);
+		return -errno;
+	}
+
+	/* open with O_RDWR to avoid EOF when the writer closed */
+	vb->ctl_fd = open(vb->ctl_path, O_RDWR | O_NONBLOCK);
+	if (vb->ctl_fd < 0) {
+		unlink(vb->ctl_path);
+		return -errno;
+	}
+
+	vb->ctl_evp = mevent_add(vb->ctl_fd, EVF_READ,
+			virtio_balloon_ctl_read, vb);
+	if (!vb->ctl_evp) {
+		close(vb->ctl_fd);
+		unlink(vb->ctl_path);
+		vb->ctl_fd = -1;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int vballoon_init_vq(struct virt_queue *vq)
+{
+	if (vq->vq_index == VIRTIO_BALLOON_Q_STATS)
+		vq->callback = virtio_balloon_stats_notify;
+	else
+		vq->callback = virtio_balloon_notify;
+
+	return 0;
+}
+
+static struct virtio_ops vballoon_ops = {
+	.vq_init = vballoon_init_vq,
+};
+
+/*
+ * virtio_balloon,[target=<MB>][,ctl=<fifo>][,stats=<file>][,period=<s>]
+ * target : the initial size of the balloon
+ * ctl : write the new balloon size in MB to this fifo
+ * stats : the guest memory statistics will dump to this file
+ * period : the period in second to update the statistics
+ */
+static int virtio_balloon_parse_opts(struct virtio_balloon *vb,
+		char *opts, unsigned long *target)
+{
+	char *opt, *value;
+
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		if (opt[0] == 0)
+			continue;
+
+		value = strchr(opt, '=');
+		if (!value) {
+			pr_err("vballoon: invalid option %s\n", opt);
+			return -EINVAL;
+		}
+		*value++ = 0;
+
+		if (!strcmp(opt, "target"))
+			*target = strtoul(value, NULL, 0) << 20;
+		else if (!strcmp(opt, "ctl"))
+			vb->ctl_path = strdup(value);
+		else if (!strcmp(opt, "stats"))
+			vb->stats_path = strdup(value);
+		else if (!strcmp(opt, "period"))
+			vb->stats_period = atoi(value);
+		else {
+			pr_err("vballoon: unknown option %s\n", opt);
+			return -EINVAL;
+		}
+	}
+
+	if (vb->stats_period <= 0)
+		vb->stats_period = VIRTIO_BALLOON_STATS_PERIOD;
+
+	return 0;
+}
+
+static void virtio_balloon_free(struct virtio_balloon *vb)
+{
+	if (vb->ctl_evp)
+		mevent_delete_close(vb->ctl_evp);
+	if (vb->ctl_path) {
+		unlink(vb->ctl_path);
+		free(vb->ctl_path);
+	}
+
+	free(vb->stats_path);
+	free(vb->page_bitmap);
+	free(vb->block_pages);
+	free(vb->block_released);
+	free(vb);
+}
+
+static int virtio_balloon_init(struct vdev *vdev, char *opts)
+{
+	int rc;
+	unsigned long target = 0;
+	struct virtio_balloon *vb;
+	struct vm *vm = vdev->vm;
+
+	vb = calloc(1, sizeof(struct virtio_balloon));
+	if (!vb)
+		return -ENOMEM;
+
+	vb->ctl_fd = -1;
+	vb->stats_idx = -1;
+	rc = virtio_balloon_parse_opts(vb, opts, &target);
+	if (rc)
+		goto out;
+
+	vb->nr_pages = vm->mem_size >> VIRTIO_BALLOON_PFN_SHIFT;
+	vb->nr_blocks = vm->mem_size >> MEM_BLOCK_SHIFT;
+	vb->page_bitmap = calloc(BALIGN(vb->nr_pages, BITS_PER_ULONG) /
+			BITS_PER_ULONG, sizeof(unsigned long));
+	vb->block_pages = calloc(vb->nr_blocks, sizeof(uint16_t));
+	vb->block_released = calloc(vb->nr_blocks, sizeof(uint8_t));
+	if (!vb->page_bitmap || !vb->block_pages || !vb->block_released) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	rc = virtio_device_init(&vb->virtio_dev, vdev,
+			VIRTIO_TYPE_BALLOON, VIRTIO_BALLOON_MAXQ,
+			VIRTIO_BALLOON_RINGSZ, VIRTIO_BALLOON_IOVSZ);
+	if (rc) {
+		pr_err("failed to init virtio balloon device\n");
+		goto out;
+	}
+
+	vdev_set_pdata(vdev, vb);
+	vb->virtio_dev.ops = &vballoon_ops;
+	vb->config = (struct virtio_balloon_config *)vb->virtio_dev.config;
+	vb->config->num_pages = target >> VIRTIO_BALLOON_PFN_SHIFT;
+	vb->config->actual = 0;
+	pthread_mutex_init(&vb->mtx, NULL);
+
+	virtio_set_feature(&vb->virtio_dev, VIRTIO_F_VERSION_1);
+	virtio_set_feature(&vb->virtio_dev, VIRTIO_BALLOON_F_MUST_TELL_HOST);
+	virtio_set_feature(&vb->virtio_dev, VIRTIO_BALLOON_F_STATS_VQ);
+	virtio_set_feature(&vb->virtio_dev, VIRTIO_BALLOON_F_DEFLATE_ON_OOM);
+
+	rc = virtio_balloon_ctl_init(vb);
+	if (rc)
+		goto release_virtio_dev;
+
+	rc = pthread_create(&vb->stats_tid, NULL,
+			virtio_balloon_stats_thread, vb);
+	if (rc) {
+		rc = -rc;
+		goto release_virtio_dev;
+	}
+	pthread_setname_np(vb->stats_tid, "vballoon-stats");
+
+	return 0;
+
+release_virtio_dev:
+	virtio_device_deinit(&vb->virtio_dev);
+out:
+	vdev_set_pdata(vdev, NULL);
+	virtio_balloon_free(vb);
+	return rc;
+}
+
+static void virtio_balloon_deinit(struct vdev *vdev)
+{
+	struct virtio_balloon *vb;
+
+	vb = (struct virtio_balloon *)vdev_get_pdata(vdev);
+	if (!vb)
+		return;
+
+	vb->stats_exit = 1;
+	pthread_join(vb->stats_tid, NULL);
+	virtio_device_deinit(&vb->virtio_dev);
+	virtio_balloon_free(vb);
+}
+
+static int virtio_balloon_reset(struct vdev *vdev)
+{
+	struct virtio_balloon *vb;
+	struct vm *vm = vdev->vm;
+	unsigned long i;
+
+	vb = (struct virtio_balloon *)vdev_get_pdata(vdev);
+	if (!vb)
+		return -EINVAL;
+
+	/*
+	 * the guest will forget the pages in the balloon
+	 * after reset, give all the memory back to it
+	 */
+	pthread_mutex_lock(&vb->mtx);
+	for (i = 0; i < vb->nr_blocks; i++) {
+		if (vb->block_released[i])
+			hv_populate_memory(vm, vm->mem_start +
+				(i << MEM_BLOCK_SHIFT), MEM_BLOCK_SIZE);
+	}
+
+	memset(vb->page_bitmap, 0, BALIGN(vb->nr_pages, BITS_PER_ULONG) /
+			BITS_PER_ULONG * sizeof(unsigned long));
+	memset(vb->block_pages, 0, vb->nr_blocks * sizeof(uint16_t));
+	memset(vb->block_released, 0, vb->nr_blocks);
+	vb->released_blocks = 0;
+	vb->stats_idx = -1;
+	vb->stats_valid = 0;
+	vb->config->actual = 0;
+	pthread_mutex_unlock(&vb->mtx);
+
+	return virtio_device_reset(&vb->virtio_dev);
+}
+
+static int virtio_balloon_event(struct vdev *vdev, int read,
+		unsigned long addr, unsigned long *value)
+{
+	unsigned long offset;
+	struct virtio_balloon *vb;
+
+	if (!vdev)
+		return -EINVAL;
+
+	vb = (struct virtio_balloon *)vdev_get_pdata(vdev);
+	if (!vb)
+		return -EINVAL;
+
+	/*
+	 * the guest will update the actual pages in the
+	 * balloon by writing the config space
+	 */
+	offset = addr - (unsigned long)vdev->guest_iomem;
+	if ((read == VMTRAP_REASON_WRITE) && (offset ==
+			VIRTIO_MMIO_CONFIG + offsetof(struct
+			virtio_balloon_config, actual))) {
+		vb->config->actual = (uint32_t)*value;
+		return 0;
+	}
+
+	return virtio_handle_mmio(&vb->virtio_dev, read, addr, value);
+}
+
+static int virtio_balloon_save(struct vdev *vdev, void *buf, size_t size)
+{
+	struct virtio_balloon *vb;
+
+	vb = (struct virtio_balloon *)vdev_get_pdata(vdev);
+	if (!vb)
+		return -EINVAL;
+
+	return virtio_device_save(&vb->virtio_dev, buf, size);
+}
+
+static int virtio_balloon_restore(struct vdev *vdev, void *buf, size_t size)
+{
+	struct virtio_balloon *vb;
+
+	vb = (struct virtio_balloon *)vdev_get_pdata(vdev);
+	if (!vb)
+		return -EINVAL;
+
+	return virtio_device_restore(&vb->virtio_dev, buf, size);
+}
+
+static void virtio_balloon_quiesce(struct vdev *vdev, int pause)
+{
+	struct virtio_balloon *vb;
+
+	vb = (struct virtio_balloon *)vdev_get_pdata(vdev);
+	if (vb)
+		virtio_device_quiesce(&vb->virtio_dev, pause);
+}
+
+struct vdev_ops virtio_balloon_ops = {
+	.name		= "virtio_balloon",
+	.init		= virtio_balloon_init,
+	.deinit		= virtio_balloon_deinit,
+	.reset		= virtio_balloon_reset,
+	.event		= virtio_balloon_event,
+	.save		= virtio_balloon_save,
+	.restore	= virtio_balloon_restore,
+	.quiesce	= virtio_balloon_quiesce,
+};
+
+DEFINE_VDEV_TYPE(virtio_balloon_ops);
@@ -111,6 +111,10 @@ struct virtio_blk {
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
 	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
 	uint8_t original_wce;
+
+	/* the requests not completed by the blockif yet */
+	int inflight;
+	pthread_cond_t idle;
 };
 
 #define virtio_dev_to_blk(dev) \
@@ -142,6 +146,17 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 */
 	pthread_mutex_lock(&blk->mtx);
 	virtq_add_used_and_signal(vq, io->idx, 1);
+	if (--blk->inflight == 0)
+		pthread_cond_broadcast(&blk->idle);
+	pthread_mutex_unlock(&blk->mtx);
+}
+
+/* wait the requests submitted to the blockif to complete */
+static void virtio_blk_drain(struct virtio_blk *blk)
+{
+	pthread_mutex_lock(&blk->mtx);
+	while (blk->inflight)
+		pthread_cond_wait(&blk->idle, &blk->mtx);
 	pthread_mutex_unlock(&blk->mtx);
 }
 
@@ -208,6 +223,10 @@ virtio_blk_proc(struct virtio_blk *blk,
 		 writeop ? "write" : "read/ident", iolen, i - 1,
 		 io->req.offset);
 
+	pthread_mutex_lock(&blk->mtx);
+	blk->inflight++;
+	pthread_mutex_unlock(&blk->mtx);
+
 	switch (type) {
 	case VBH_OP_READ:
 		err = blockif_read(blk->bc, &io->req);
@@ -328,6 +347,8 @@ virtio_blk_init(struct vdev *vdev, char *opts)
 		return rc;
 	}
 
+	/* the used ring is protected by blk->mtx */
+	blk->virtio_dev.flags |= VIRTIO_DEV_F_VQ_LOCK;
 	blk->bc = bctxt;
 	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
 		struct virtio_blk_ioreq *io = &blk->ios[i];
@@ -356,6 +377,7 @@ virtio_blk_init(struct vdev *vdev, char *opts)
 	if (rc)
 		pr_info("virtio_blk: pthread_mutex_init failed with "
 					"error %d!\n", rc);
+	pthread_cond_init(&blk->idle, NULL);
 
 	sprintf(blk->ident, "Minos--%02X%02X-%02X%02X-%02X%02X",
 			0, 1, 2, 3, 4, 5);
@@ -438,18 +460,64 @@ static int virtio_blk_reset(struct vdev *vdev)
 		return -EINVAL;
 
 	pr_info("virtio_blk: device reset requested !\n");
-	virtio_device_reset(&blk->virtio_dev);
+
+	/* the completion writes the used ring which is reset */
+	virtio_device_lock_vqs(&blk->virtio_dev);
+	virtio_blk_drain(blk);
+	__virtio_device_reset(&blk->virtio_dev);
+	virtio_device_unlock_vqs(&blk->virtio_dev);
 	blockif_set_wce(blk->bc, blk->original_wce);
 
 	return 0;
 }
 
+static int virtio_blk_save(struct vdev *vdev, void *buf, size_t size)
+{
+	struct virtio_blk *blk;
+
+	blk = (struct virtio_blk *)vdev_get_pdata(vdev);
+	if (!blk)
+		return -EINVAL;
+
+	return virtio_device_save(&blk->virtio_dev, buf, size);
+}
+
+static int virtio_blk_restore(struct vdev *vdev, void *buf, size_t size)
+{
+	struct virtio_blk *blk;
+
+	blk = (struct virtio_blk *)vdev_get_pdata(vdev);
+	if (!blk)
+		return -EINVAL;
+
+	return virtio_device_restore(&blk->virtio_dev, buf, size);
+}
+
+static void virtio_blk_quiesce(struct vdev *vdev, int pause)
+{
+	struct virtio_blk *blk;
+
+	blk = (struct virtio_blk *)vdev_get_pdata(vdev);
+	if (!blk)
+		return;
+
+	virtio_device_quiesce(&blk->virtio_dev, pause);
+	if (!pause)
+		return;
+
+	/* the submitted requests still write the guest memory */
+	virtio_blk_drain(blk);
+}
+
 struct vdev_ops virtio_blk_ops = {
 	.name		= "virtio_blk",
 	.init		= virtio_blk_init,
 	.deinit		= virtio_blk_deinit,
 	.reset		= virtio_blk_reset,
 	.event		= virtio_blk_event,
+	.save		= virtio_blk_save,
+	.restore	= virtio_blk_restore,
+	.quiesce	= virtio_blk_quiesce,
 };
 
 DEFINE_VDEV_TYPE(virtio_blk_ops);
@@ -415,26 +415,27 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 	struct virt_queue *vq;
 	struct iovec iov;
 	static char dummybuf[2048];
-	int len;
+	int len, closed = 0;
 	uint16_t idx;
 	unsigned int in, out;
 
 	port = be->port;
 	vq = virtio_console_port_to_vq(port, true);
 
-	if (!be->open || !port->rx_ready || !vq->ready) {
+	/* the rx queue is not touched while the console is quiesced */
+	pthread_mutex_lock(&vq->lock);
+
+	if (!be->open || !port->rx_ready || !vq->ready || vq->paused) {
 		len = read(be->fd, dummybuf, sizeof(dummybuf));
-		if (len == 0)
-			goto close;
-		return;
+		closed = (len == 0);
+		goto out;
 	}
 
 	if (!virtq_has_descs(vq)) {
 		len = read(be->fd, dummybuf, sizeof(dummybuf));
 		virtq_notify(vq);
-		if (len == 0)
-			goto close;
-		return;
+		closed = (len == 0);
+		goto out;
 	}
 
 	virtq_disable_notify(vq);
@@ -449,19 +450,22 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 			/* no data available */
 			if (len == -1 && errno == EAGAIN) {
 				virtq_enable_notify(vq);
-				return;
+				goto out;
 			}
 
 			/* any other errors */
-			goto close;
+			closed = 1;
+			goto out;
 		}
 
 		virtq_add_used_and_signal(vq, idx, len);
 	} while (virtq_has_descs(vq));
 
-	return;
+out:
+	pthread_mutex_unlock(&vq->lock);
+	if (!closed)
+		return;
 
-close:
 	virtio_console_reset_backend(be);
 	pr_warn("vtcon: be read failed and close! len = %d, errno = %d\n",
 		len, errno);
@@ -797,6 +801,11 @@ virtio_console_init(struct vdev *vdev, char *opts)
 	vdev_set_pdata(vdev, console);
 	console->virtio_dev.ops = &vcon_ops;
 
+	/* the early printk only writes the data, no need to wait */
+	if (vm_mmio_coalesce(vdev->vm,
+			(unsigned long)vdev->guest_iomem + 0x108, 4))
+		pr_warn("vtcon: coalesced mmio not supported\n");
+
 	/* set the feature of the virtio dev */
 	virtio_set_feature(&console->virtio_dev, VIRTIO_CONSOLE_F_SIZE);
 	virtio_set_feature(&console->virtio_dev, VIRTIO_F_VERSION_1);
@@ -986,6 +995,56 @@ static int virtio_console_setup(struct vdev *vdev, void *data, int os)
 	return 0;
 }
 
+static int virtio_console_save(struct vdev *vdev, void *buf, size_t size)
+{
+	struct virtio_console *vcon;
+
+	vcon = (struct virtio_console *)vdev_get_pdata(vdev);
+	if (!vcon)
+		return -EINVAL;
+
+	return virtio_device_save(&vcon->virtio_dev, buf, size);
+}
+
+static int virtio_console_restore(struct vdev *vdev, void *buf, size_t size)
+{
+	int i, ret;
+	struct virtio_console *vcon;
+	struct virtio_console_port *port;
+
+	vcon = (struct virtio_console *)vdev_get_pdata(vdev);
+	if (!vcon)
+		return -EINVAL;
+
+	ret = virtio_device_restore(&vcon->virtio_dev, buf, size);
+	if (ret)
+		return ret;
+
+	/*
+	 * the guest will not send the ready events again, the
+	 * state can be got from the queues which are set up
+	 */
+	port = &vcon->control_port;
+	if (vcon->virtio_dev.nr_vq > port->rxq)
+		vcon->ready = virtio_console_port_to_vq(port, false)->ready;
+
+	for (i = 0; i < vcon->nports; i++) {
+		port = &vcon->ports[i];
+		port->rx_ready = virtio_console_port_to_vq(port, false)->ready;
+	}
+
+	return 0;
+}
+
+static void virtio_console_quiesce(struct vdev *vdev, int pause)
+{
+	struct virtio_console *vcon;
+
+	vcon = (struct virtio_console *)vdev_get_pdata(vdev);
+	if (vcon)
+		virtio_device_quiesce(&vcon->virtio_dev, pause);
+}
+
 struct vdev_ops virtio_console_ops = {
 	.name 		= "virtio_console",
 	.init		= virtio_console_init,
@@ -993,6 +1052,9 @@ struct vdev_ops virtio_console_ops = {
 	.reset		= virtio_console_reset,
 	.setup		= virtio_console_setup,
 	.event		= virtio_console_event,
+	.save		= virtio_console_save,
+	.restore	= virtio_console_restore,
+	.quiesce	= virtio_console_quiesce,
 };
 
 DEFINE_VDEV_TYPE(virtio_console_ops);
@@ -123,6 +123,7 @@ struct virtio_net {
 
 	volatile int	resetting;	/* set and checked outside lock */
 	volatile int	closing;	/* stop the tx i/o thread */
+	volatile int	paused;		/* the vm state is being saved */
 
 	uint64_t	features;	/* negotiated features */
 
@@ -283,9 +284,10 @@ virtio_net_tap_rx(struct virtio_net *net)
 
 	/*
 	 * But, will be called when the rx ring hasn't yet
-	 * been set up or the guest is resetting the device.
+	 * been set up, the guest is resetting the device or
+	 * the state of the device is being saved.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!net->rx_ready || net->resetting || net->paused) {
 		/*
 		 * Drop the packet and try later.
 		 */
@@ -500,9 +502,10 @@ virtio_net_netmap_rx(struct virtio_net *net)
 
 	/*
 	 * But, will be called when the rx ring hasn't yet
-	 * been set up or the guest is resetting the device.
+	 * been set up, the guest is resetting the device or
+	 * the state of the device is being saved.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!net->rx_ready || net->resetting || net->paused) {
 		/*
 		 * Drop the packet and try later.
 		 */
@@ -691,11 +694,13 @@ virtio_net_tx_thread(void *param)
 
 	for (;;) {
 		/* note - tx mutex is locked here */
-		while (net->resetting || !virtq_has_descs(vq)) {
+		while (net->resetting || net->paused ||
+				!virtq_has_descs(vq)) {
 			virtq_enable_notify(vq);
 			/* memory barrier */
 			dsb(sy);
-			if (!net->resetting && virtq_has_descs(vq))
+			if (!net->resetting && !net->paused &&
+					virtq_has_descs(vq))
 				break;
 
 			net->tx_in_progress = 0;
@@ -911,6 +916,9 @@ static int virtio_net_init(struct vdev *vdev, char *opts)
 
 	vdev_set_pdata(vdev, net);
 	net->virtio_dev.ops = &vnet_ops;
+
+	/* the rx and tx queues are handled by their own threads */
+	net->virtio_dev.flags |= VIRTIO_DEV_F_VQ_LOCK;
 	net->config = (struct virtio_net_config *)net->virtio_dev.config;
 
 	/* init mutex attribute properly to avoid deadlock */
@@ -984,6 +992,21 @@ static int virtio_net_init(struct vdev *vdev, char *opts)
 		net->config->mac[5] = 0x55;
 	}
 
+	/*
+	 * each clone of a template need its own address, use a
+	 * locally administered one based on the pid of the mvm
+	 */
+	if (!mac_provided && vdev->vm->vm_config->clone_path[0]) {
+		pid_t pid = getpid();
+
+		net->config->mac[0] = 0x02;
+		net->config->mac[1] = 0x4d;
+		net->config->mac[2] = (pid >> 24) & 0xff;
+		net->config->mac[3] = (pid >> 16) & 0xff;
+		net->config->mac[4] = (pid >> 8) & 0xff;
+		net->config->mac[5] = pid & 0xff;
+	}
+
 	/* Link is up if we managed to open tap device or vale port. */
 	net->config->status = (opts == NULL || net->tapfd >= 0 ||
 			      net->nmd != NULL);
@@ -1078,11 +1101,13 @@ static int virtio_net_reset(struct vdev *vdev)
 	virtio_net_txwait(net);
 	virtio_net_rxwait(net);
 
+	/* the queue callbacks read the rx state under their lock */
+	virtio_device_lock_vqs(&net->virtio_dev);
 	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-
-	virtio_device_reset(&net->virtio_dev);
+	__virtio_device_reset(&net->virtio_dev);
+	virtio_device_unlock_vqs(&net->virtio_dev);
 
 	net->resetting = 0;
 	net->closing = 0;
@@ -1090,11 +1115,79 @@ static int virtio_net_reset(struct vdev *vdev)
 	return 0;
 }
 
+static int virtio_net_save(struct vdev *vdev, void *buf, size_t size)
+{
+	struct virtio_net *net;
+
+	net = (struct virtio_net *)vdev_get_pdata(vdev);
+	if (!net)
+		return -EINVAL;
+
+	return virtio_device_save(&net->virtio_dev, buf, size);
+}
+
+static int virtio_net_restore(struct vdev *vdev, void *buf, size_t size)
+{
+	int ret;
+	uint8_t mac[ETHER_ADDR_LEN];
+	struct virtio_net *net;
+
+	net = (struct virtio_net *)vdev_get_pdata(vdev);
+	if (!net)
+		return -EINVAL;
+
+	/* the address belongs to this device, not the saved one */
+	memcpy(mac, net->config->mac, ETHER_ADDR_LEN);
+
+	ret = virtio_device_restore(&net->virtio_dev, buf, size);
+	if (ret)
+		return ret;
+
+	if (memcmp(mac, net->config->mac, ETHER_ADDR_LEN)) {
+		memcpy(net->config->mac, mac, ETHER_ADDR_LEN);
+		virtio_send_irq(&net->virtio_dev, VIRTIO_MMIO_INT_CONFIG);
+	}
+
+	/* the rx queue may already be pinged before snapshot */
+	net->rx_ready = net->virtio_dev.vqs[VIRTIO_NET_RXQ].ready;
+
+	return 0;
+}
+
+static void virtio_net_quiesce(struct vdev *vdev, int pause)
+{
+	struct virtio_net *net;
+
+	net = (struct virtio_net *)vdev_get_pdata(vdev);
+	if (!net)
+		return;
+
+	if (pause) {
+		net->paused = 1;
+		virtio_net_txwait(net);
+		virtio_net_rxwait(net);
+		virtio_device_quiesce(&net->virtio_dev, 1);
+		return;
+	}
+
+	virtio_device_quiesce(&net->virtio_dev, 0);
+	net->paused = 0;
+
+	/* the tx queue may be filled during the pause */
+	pthread_mutex_lock(&net->tx_mtx);
+	if (net->tx_in_progress == 0)
+		pthread_cond_signal(&net->tx_cond);
+	pthread_mutex_unlock(&net->tx_mtx);
+}
+
 struct vdev_ops virtio_net_ops = {
 	.name		= "virtio_net",
 	.init		= virtio_net_init,
 	.deinit		= virtio_net_deinit,
 	.reset		= virtio_net_reset,
 	.event		= virtio_net_event,
+	.save		= virtio_net_save,
+	.restore	= virtio_net_restore,
+	.quiesce	= virtio_net_quiesce,
 };
 DEFINE_VDEV_TYPE(virtio_net_ops);
@@ -14,7 +14,7 @@
 #include <linux/netlink.h>
 
 #include <compiler.h>
-#include <vmcs.h>
+#include <common/vmcs.h>
 #include <barrier.h>
 #include <mvm_queue.h>
 #include <debug.h>
@@ -41,6 +41,11 @@
 
 #define VM_MAX_VCPUS			(8)
 
-#define VMCS_SIZE(nr)			BALIGN(nr * sizeof(struct vmcs), PAGE_SIZE)
+#define VMCS_SIZE(nr)			\
+	BALIGN(nr * sizeof(struct vmcs) + sizeof(struct mmio_ring), PAGE_SIZE)
+
+/* the event generated by mvm itself, handled in the main loop */
+#define MVM_EVENT_SNAPSHOT		(0x100)
+#define MVM_EVENT_MIGRATE		(0x101)
 
 #endif
@@ -16,6 +16,9 @@ struct vdev_ops {
 	int (*setup)(struct vdev *, void *data, int os);
 	int (*event)(struct vdev *, int,
 			unsigned long, unsigned long *);
+	int (*save)(struct vdev *, void *buf, size_t size);
+	int (*restore)(struct vdev *, void *buf, size_t size);
+	void (*quiesce)(struct vdev *, int pause);
 };
 
 #define VDEV_TYPE_PLATFORM	(0x0)
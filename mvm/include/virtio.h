@@ -103,6 +103,17 @@ struct virt_queue {
 	struct virtio_device *dev;
 	struct iovec *iovec;
 
+	/* queue notify sent by the hypervisor through a virq */
+	int doorbell_irq;
+	struct mevent *doorbell;
+
+	/* used instead of vdev->lock if VIRTIO_DEV_F_VQ_LOCK */
+	pthread_mutex_t lock;
+
+	/* the notify is deferred while the device is quiesced */
+	int paused;
+	int kicked;
+
 	void (*callback)(struct virt_queue *);
 };
 
@@ -118,10 +129,18 @@ struct virtio_ops {
 	void (*neg_features)(struct virtio_device *);
 };
 
+/*
+ * the queue callbacks of the device only need the lock of
+ * the queue, the queue notify does not take vdev->lock and
+ * the notify of different queues can be handled in parallel
+ */
+#define VIRTIO_DEV_F_VQ_LOCK	(1 << 0)
+
 struct virtio_device {
 	struct vdev *vdev;
 	struct virt_queue *vqs;
 	int nr_vq;
+	unsigned long flags;
 	uint64_t acked_features;
 	void *config;
 	struct virtio_ops *ops;
@@ -211,7 +230,13 @@ void virtq_add_used_and_signal_n(struct virt_queue *vq,
 				struct vring_used_elem *heads,
 				unsigned int count);
 
+void virtio_device_lock_vqs(struct virtio_device *dev);
+void virtio_device_unlock_vqs(struct virtio_device *dev);
+int __virtio_device_reset(struct virtio_device *dev);
 int virtio_device_reset(struct virtio_device *dev);
 void virtio_device_deinit(struct virtio_device *dev);
+int virtio_device_save(struct virtio_device *dev, void *buf, size_t size);
+int virtio_device_restore(struct virtio_device *dev, void *buf, size_t size);
+void virtio_device_quiesce(struct virtio_device *dev, int pause);
 
 #endif
@@ -26,8 +26,25 @@ struct vm_config {
 	char kernel_image[256];
 	char dtb_image[256];
 	char ramdisk_image[256];
+	char snapshot_path[256];
+	char restore_path[256];
+	char template_path[256];
+	char clone_path[256];
+	char migrate_path[256];
+	char incoming_path[256];
+	uint64_t mem_limit;
+	uint32_t wss_interval;
+	uint32_t wss_rate;
+	uint32_t vcpu_poll;
 };
 
+/* the vm is resumed from a snapshot, a template or migrated */
+static inline int vm_config_is_restore(struct vm_config *config)
+{
+	return (config->restore_path[0] || config->clone_path[0] ||
+			config->incoming_path[0]);
+}
+
 /*
  * vmid	 : vmid allocated by hypervisor
  * flags : some flags of this vm
@@ -72,6 +89,9 @@ extern struct vm *mvm_vm;
 #define gpa_to_hvm_va(gpa) \
 	(unsigned long)(mvm_vm->mmap + ((gpa) - mvm_vm->mem_start))
 
+#define hvm_va_to_gpa(va) \
+	((unsigned long)(va) - (unsigned long)mvm_vm->mmap + mvm_vm->mem_start)
+
 void *map_vm_memory(struct vm *vm);
 void *hvm_map_iomem(void *base, size_t size);
 
@@ -85,4 +105,168 @@ static inline int request_virq(unsigned long flags)
 	return ioctl(mvm_vm->vm_fd, IOCTL_REQUEST_VIRQ, flags);
 }
 
+static inline int vm_dirty_log(struct vm *vm, int enable)
+{
+	return ioctl(vm->vm_fd, IOCTL_VM_DIRTY_LOG, (long)enable);
+}
+
+/*
+ * get the dirty pages since last call and clear them, each
+ * bit in the bitmap is a 4K page from the mem_start of vm
+ */
+static inline int vm_get_dirty_log(struct vm *vm,
+		unsigned long *bitmap, size_t size)
+{
+	uint64_t args[2] = {(unsigned long)bitmap, size};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_GET_DIRTY_LOG, args);
+}
+
+/*
+ * get the VM_BLOCK_* state of each mem_block in a byte, the
+ * block which is not populated does not need to be read
+ */
+static inline int vm_get_mem_map(struct vm *vm, uint8_t *map, size_t size)
+{
+	uint64_t args[2] = {(unsigned long)map, size};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_GET_MEM_MAP, args);
+}
+
+/* copy a reclaimed mem_block out without faulting it in */
+static inline int vm_read_block(struct vm *vm,
+		unsigned long offset, void *buf)
+{
+	uint64_t args[2] = {vm->mem_start + offset, (unsigned long)buf};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_READ_BLOCK, args);
+}
+
+static inline int vm_pause(struct vm *vm)
+{
+	return ioctl(vm->vm_fd, IOCTL_VM_PAUSE, 0);
+}
+
+static inline int vm_unpause(struct vm *vm)
+{
+	return ioctl(vm->vm_fd, IOCTL_VM_UNPAUSE, 0);
+}
+
+/*
+ * save the state of a paused vm in hypervisor, return the
+ * size of the state, if the buf is NULL just return the
+ * size which is needed
+ */
+static inline int vm_save_state(struct vm *vm, void *buf, size_t size)
+{
+	uint64_t args[2] = {(unsigned long)buf, size};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_SAVE_STATE, args);
+}
+
+static inline int vm_restore_state(struct vm *vm, void *buf, size_t size)
+{
+	uint64_t args[2] = {(unsigned long)buf, size};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_RESTORE_STATE, args);
+}
+
+/*
+ * share the memory and copy the state of a paused template
+ * vm, return the number of mem_block shared with the vm
+ */
+static inline int vm_clone(struct vm *vm, int tmpl)
+{
+	return ioctl(vm->vm_fd, IOCTL_VM_CLONE, (long)tmpl);
+}
+
+/*
+ * the cold memory of the vm is compressed by hypervisor when
+ * the memory used by the vm is over the limit, 0 means no limit
+ */
+static inline int vm_set_mem_limit(struct vm *vm, uint64_t limit)
+{
+	return ioctl(vm->vm_fd, IOCTL_VM_MEM_LIMIT, (unsigned long)limit);
+}
+
+/*
+ * track the working set of the vm by the stage 2 access flag,
+ * interval is in ms and 0 disable it, rate is the max 2M
+ * blocks scanned in one second, 0 means the default
+ */
+static inline int vm_wss_config(struct vm *vm,
+		uint32_t interval, uint32_t rate)
+{
+	uint64_t args[2] = {interval, rate};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_WSS_CONFIG, args);
+}
+
+static inline int vm_get_wss(struct vm *vm, struct vm_wss_stat *stat)
+{
+	uint64_t args[2] = {(unsigned long)stat, sizeof(*stat)};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_GET_WSS, args);
+}
+
+/*
+ * bind a hvm virq to the queue notify of the virtio device at
+ * gbase, returns the virq, bind 0 gives the queue back to vmcs
+ */
+static inline int vm_virtio_doorbell(struct vm *vm,
+		unsigned long gbase, int queue, int bind)
+{
+	uint64_t args[3] = {gbase, queue, bind};
+
+	return ioctl(vm->vm_fd, IOCTL_VIRTIO_DOORBELL, args);
+}
+
+/*
+ * the writes to this range are appended to the mmio ring of
+ * the vmcs and handled later, only for the registers whose
+ * side effect does not need to be seen by the guest at once
+ */
+static inline int vm_mmio_coalesce(struct vm *vm,
+		unsigned long base, size_t size)
+{
+	uint64_t args[2] = {base, size};
+
+	return ioctl(vm->vm_fd, IOCTL_VM_MMIO_COALESCE, args);
+}
+
+/*
+ * enable or disable the hypervisor trace, returns the base and
+ * the size of the trace rings which can be mapped by the hvm
+ */
+static inline int vm_trace_config(struct vm *vm, int enable,
+		unsigned long *base, size_t *size)
+{
+	int ret;
+	uint64_t args[2] = {enable, 0};
+
+	ret = ioctl(vm->vm_fd, IOCTL_TRACE_CONFIG, args);
+	*base = args[0];
+	*size = args[1];
+
+	return ret;
+}
+
+void vm_handle_coalesced_mmio(struct vm *vm);
+int vm_snapshot(struct vm *vm, char *path);
+int vm_save_template(struct vm *vm, char *path);
+int vm_clone_template(struct vm *vm, char *path);
+int vm_snapshot_config(char *path, struct vmtag *vmtag);
+int vm_restore(struct vm *vm, char *path);
+uint8_t *vm_get_block_map(struct vm *vm);
+void *vm_alloc_block_buf(void);
+void vm_quiesce_vdevs(struct vm *vm, int pause);
+void *vm_save_vdevs(struct vm *vm, uint32_t *nr, uint64_t *size);
+int vm_restore_vdevs(struct vm *vm, void *buf, uint32_t nr, uint64_t size);
+
+int vm_migrate(struct vm *vm, char *path);
+int vm_migrate_listen(char *path, struct vmtag *vmtag);
+int vm_migrate_incoming(struct vm *vm);
+
+int mvm_trace(char *cmd);
+
 #endif
@@ -0,0 +1,977 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include <mvm.h>
+#include <vdev.h>
+
+/*
+ * pre-copy live migration between two mvm on the same host
+ *
+ * the source connect a control socket and send the config of
+ * the vm, when the target vm is created, the source connect
+ * MIGRATE_THREADS data sockets, the memory is sent by all the
+ * data sockets, the mem_blocks are divided between the threads
+ * so a page is always sent by the same socket and the newer
+ * content will not be overwritten by an older one
+ *
+ * the first round send all the memory, then only the pages
+ * which are dirty since last round, when the dirty pages are
+ * few enough the vm is paused and the left pages, the state
+ * of the hypervisor and the vdevs are sent
+ */
+#define MIGRATE_MAGIC		(0x4d47524d)
+#define MIGRATE_VERSION		(1)
+#define MIGRATE_THREADS		(4)
+#define MIGRATE_MAX_ROUNDS	(30)
+#define MIGRATE_MIN_DIRTY	(256)
+#define MIGRATE_BUF_SIZE	(256 * 1024)
+
+#define MIGRATE_REC_PAGE	(1)
+#define MIGRATE_REC_STATE	(2)
+#define MIGRATE_REC_VDEV	(3)
+#define MIGRATE_REC_END		(4)
+
+/*
+ * a compressed page has two bits for each 64 bit word, the
+ * word is zero, same as the previous word or followed in the
+ * literal list, the page is sent raw if it can not be smaller
+ */
+#define MIGRATE_PAGE_ZERO	(0)
+#define MIGRATE_PAGE_RAW	(1)
+#define MIGRATE_PAGE_WORD	(2)
+
+#define PAGE_SHIFT		(12)
+#define PAGES_IN_BLOCK		(MEM_BLOCK_SIZE >> PAGE_SHIFT)
+#define BITS_PER_LONG		(sizeof(unsigned long) * 8)
+#define BITS_TO_LONGS(nr)	(((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+#define PAGE_WORDS		(PAGE_SIZE / sizeof(uint64_t))
+#define PAGE_TAG_SIZE		(PAGE_WORDS / 4)
+#define PAGE_MAX_LITERAL	((PAGE_SIZE - PAGE_TAG_SIZE) / sizeof(uint64_t))
+
+#define WORD_ZERO		(0)
+#define WORD_SAME		(1)
+#define WORD_LITERAL		(2)
+
+struct migrate_header {
+	uint32_t magic;
+	uint32_t version;
+	char name[32];
+	char os_type[32];
+	uint32_t nr_vcpus;
+	uint32_t nr_threads;
+	uint64_t flags;
+	uint64_t mem_start;
+	uint64_t mem_size;
+	uint64_t entry;
+	uint64_t setup_data;
+};
+
+struct migrate_record {
+	uint32_t type;
+	uint32_t flags;
+	uint64_t offset;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+struct migrate_ctx;
+
+struct migrate_worker {
+	int fd;
+	int id;
+	int err;
+	pthread_t tid;
+	uint8_t *buf;
+	void *block;
+	size_t len;
+	uint64_t pages;
+	uint64_t bytes;
+	struct migrate_ctx *ctx;
+};
+
+struct migrate_ctx {
+	struct vm *vm;
+	int nr_blocks;
+	unsigned long *bitmap;
+	uint8_t *map;
+	uint8_t *received;
+	struct migrate_worker workers[MIGRATE_THREADS];
+};
+
+/* the sockets of the target which are opened before vm created */
+static int migrate_listen_fd = -1;
+static int migrate_ctrl_fd = -1;
+
+static unsigned long migrate_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int migrate_write(int fd, void *buf, size_t size)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write(fd, buf, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int migrate_read(int fd, void *buf, size_t size)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = read(fd, buf, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* the other side closed the socket */
+		if (ret == 0)
+			return -EPIPE;
+
+		buf += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int migrate_send_record(int fd, uint32_t type, uint32_t flags,
+		void *data, uint32_t size)
+{
+	int ret;
+	struct migrate_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.flags = flags;
+	rec.size = size;
+
+	ret = migrate_write(fd, &rec, sizeof(rec));
+	if (ret || !size)
+		return ret;
+
+	return migrate_write(fd, data, size);
+}
+
+static int migrate_recv_record(int fd, uint32_t type,
+		struct migrate_record *rec, void **data)
+{
+	int ret;
+
+	*data = NULL;
+	ret = migrate_read(fd, rec, sizeof(*rec));
+	if (ret)
+		return ret;
+
+	if (rec->type != type)
+		return -EPROTO;
+
+	if (rec->size == 0)
+		return 0;
+
+	*data = malloc(rec->size);
+	if (!*data)
+		return -ENOMEM;
+
+	ret = migrate_read(fd, *data, rec->size);
+	if (ret) {
+		free(*data);
+		*data = NULL;
+	}
+
+	return ret;
+}
+
+static int migrate_connect(char *path)
+{
+	int fd, ret;
+	struct sockaddr_un addr;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		ret = -errno;
+		pr_err("can not connect to %s\n", path);
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+static int migrate_encode_page(uint64_t *page, uint8_t *out, uint32_t *type)
+{
+	int i, nr = 0, tag;
+	uint8_t *tags = out;
+	uint64_t *literal = (uint64_t *)(out + PAGE_TAG_SIZE);
+
+	memset(tags, 0, PAGE_TAG_SIZE);
+
+	for (i = 0; i < PAGE_WORDS; i++) {
+		if (page[i] == 0)
+			continue;
+
+		if ((i > 0) && (page[i] == page[i - 1]))
+			tag = WORD_SAME;
+		else {
+			if (nr == PAGE_MAX_LITERAL) {
+				memcpy(out, page, PAGE_SIZE);
+				*type = MIGRATE_PAGE_RAW;
+				return PAGE_SIZE;
+			}
+
+			tag = WORD_LITERAL;
+			literal[nr++] = page[i];
+		}
+
+		tags[i / 4] |= tag << ((i % 4) * 2);
+	}
+
+	/* WORD_SAME is only used after a non-zero word */
+	if (nr == 0) {
+		*type = MIGRATE_PAGE_ZERO;
+		return 0;
+	}
+
+	*type = MIGRATE_PAGE_WORD;
+
+	return PAGE_TAG_SIZE + nr * sizeof(uint64_t);
+}
+
+static int migrate_decode_page(uint8_t *in, uint32_t size, uint64_t *page)
+{
+	int i, nr = 0, tag;
+	uint8_t *tags = in;
+	uint64_t *literal = (uint64_t *)(in + PAGE_TAG_SIZE);
+	int max = (size - PAGE_TAG_SIZE) / sizeof(uint64_t);
+
+	if ((size < PAGE_TAG_SIZE) || (size > PAGE_SIZE))
+		return -EINVAL;
+
+	for (i = 0; i < PAGE_WORDS; i++) {
+		tag = (tags[i / 4] >> ((i % 4) * 2)) & 0x3;
+		switch (tag) {
+		case WORD_ZERO:
+			page[i] = 0;
+			break;
+		case WORD_SAME:
+			page[i] = i ? page[i - 1] : 0;
+			break;
+		case WORD_LITERAL:
+			if (nr == max)
+				return -EINVAL;
+			page[i] = literal[nr++];
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int migrate_flush(struct migrate_worker *w)
+{
+	int ret;
+
+	if (w->len == 0)
+		return 0;
+
+	ret = migrate_write(w->fd, w->buf, w->len);
+	w->bytes += w->len;
+	w->len = 0;
+
+	return ret;
+}
+
+static int migrate_send_page(struct migrate_worker *w,
+		uint64_t offset, void *page)
+{
+	int ret, size;
+	uint32_t type;
+	struct migrate_record *rec;
+
+	if (w->len + sizeof(*rec) + PAGE_SIZE > MIGRATE_BUF_SIZE) {
+		ret = migrate_flush(w);
+		if (ret)
+			return ret;
+	}
+
+	rec = (struct migrate_record *)(w->buf + w->len);
+	size = migrate_encode_page(page, (uint8_t *)(rec + 1), &type);
+
+	rec->type = MIGRATE_REC_PAGE;
+	rec->flags = type;
+	rec->offset = offset;
+	rec->size = size;
+	rec->reserved = 0;
+	w->len += sizeof(*rec) + size;
+	w->pages++;
+
+	return 0;
+}
+
+/* send the dirty pages in the mem_blocks of this worker */
+static int migrate_send_pages(struct migrate_worker *w)
+{
+	int i, j, ret, first;
+	void *src;
+	uint64_t offset;
+	struct migrate_ctx *ctx = w->ctx;
+	unsigned long *bitmap = ctx->bitmap;
+
+	for (i = w->id; i < ctx->nr_blocks; i += MIGRATE_THREADS) {
+		offset = (uint64_t)i << MEM_BLOCK_SHIFT;
+		src = ctx->vm->mmap + offset;
+
+		/*
+		 * the first round does not fault in the block which
+		 * is not populated or compressed, the dirty log sets
+		 * all its pages when it is mapped later
+		 */
+		if (ctx->map && (ctx->map[i] == VM_BLOCK_NONE))
+			continue;
+
+		if (ctx->map && (ctx->map[i] == VM_BLOCK_RECLAIMED)) {
+			if (!w->block)
+				w->block = vm_alloc_block_buf();
+			if (w->block && !vm_read_block(ctx->vm,
+						offset, w->block))
+				src = w->block;
+		}
+
+		first = i * PAGES_IN_BLOCK;
+		for (j = first; j < first + PAGES_IN_BLOCK; j++) {
+			if (!(bitmap[j / BITS_PER_LONG] &
+					(1UL << (j % BITS_PER_LONG))))
+				continue;
+
+			ret = migrate_send_page(w, (uint64_t)j << PAGE_SHIFT,
+					src + ((j - first) << PAGE_SHIFT));
+			if (ret)
+				return ret;
+		}
+	}
+
+	return migrate_flush(w);
+}
+
+static void *migrate_send_thread(void *data)
+{
+	struct migrate_worker *w = (struct migrate_worker *)data;
+
+	w->err = migrate_send_pages(w);
+
+	return NULL;
+}
+
+/* let all the workers send the pages in the bitmap */
+static int migrate_send_round(struct migrate_ctx *ctx)
+{
+	int i, nr, ret = 0;
+
+	for (nr = 0; nr < MIGRATE_THREADS; nr++) {
+		ret = pthread_create(&ctx->workers[nr].tid, NULL,
+				migrate_send_thread, &ctx->workers[nr]);
+		if (ret) {
+			pr_err("create migrate thread failed\n");
+			ret = -ENOMEM;
+			break;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(ctx->workers[i].tid, NULL);
+		if (!ret && ctx->workers[i].err)
+			ret = ctx->workers[i].err;
+	}
+
+	return ret;
+}
+
+static int migrate_count_pages(unsigned long *bitmap, int nr)
+{
+	int i, count = 0;
+
+	for (i = 0; i < BITS_TO_LONGS(nr); i++)
+		count += __builtin_popcountl(bitmap[i]);
+
+	return count;
+}
+
+static int migrate_send_state(struct vm *vm, int fd)
+{
+	int ret;
+	uint32_t nr_vdev;
+	uint64_t size;
+	void *state, *vdevs;
+
+	ret = vm_save_state(vm, NULL, 0);
+	if (ret <= 0)
+		return ret ? ret : -EINVAL;
+
+	size = ret;
+	state = malloc(size);
+	if (!state)
+		return -ENOMEM;
+
+	ret = vm_save_state(vm, state, size);
+	if (ret < 0) {
+		free(state);
+		return ret;
+	}
+
+	ret = migrate_send_record(fd, MIGRATE_REC_STATE, 0, state, size);
+	free(state);
+	if (ret)
+		return ret;
+
+	vdevs = vm_save_vdevs(vm, &nr_vdev, &size);
+	if (!vdevs && nr_vdev)
+		return -ENOMEM;
+
+	ret = migrate_send_record(fd, MIGRATE_REC_VDEV, nr_vdev, vdevs, size);
+	free(vdevs);
+
+	return ret;
+}
+
+static void migrate_close_workers(struct migrate_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < MIGRATE_THREADS; i++) {
+		if (ctx->workers[i].fd >= 0)
+			close(ctx->workers[i].fd);
+		free(ctx->workers[i].buf);
+		free(ctx->workers[i].block);
+	}
+}
+
+static int migrate_open_workers(struct migrate_ctx *ctx, char *path)
+{
+	int i;
+	struct migrate_worker *w;
+
+	for (i = 0; i < MIGRATE_THREADS; i++)
+		ctx->workers[i].fd = -1;
+
+	for (i = 0; i < MIGRATE_THREADS; i++) {
+		w = &ctx->workers[i];
+		w->id = i;
+		w->ctx = ctx;
+		w->buf = malloc(MIGRATE_BUF_SIZE);
+		if (!w->buf)
+			return -ENOMEM;
+
+		w->fd = migrate_connect(path);
+		if (w->fd < 0)
+			return w->fd;
+	}
+
+	return 0;
+}
+
+/*
+ * migrate the vm to the mvm which is waiting on the path, the
+ * vm keeps running on this side if migration failed
+ */
+int vm_migrate(struct vm *vm, char *path)
+{
+	int i, ret, fd, status, round = 0, dirty, paused = 0;
+	int nr_pages = vm->mem_size >> PAGE_SHIFT;
+	size_t size = BITS_TO_LONGS(nr_pages) * sizeof(unsigned long);
+	unsigned long start, pause_start = 0, end;
+	uint64_t bytes = 0, pages = 0;
+	struct migrate_header hdr;
+	struct migrate_ctx ctx;
+
+	fd = migrate_connect(path);
+	if (fd < 0)
+		return fd;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.vm = vm;
+	ctx.nr_blocks = vm->mem_size >> MEM_BLOCK_SHIFT;
+	ctx.bitmap = malloc(size);
+	if (!ctx.bitmap) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	start = migrate_now_ms();
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = MIGRATE_MAGIC;
+	hdr.version = MIGRATE_VERSION;
+	strncpy(hdr.name, vm->name, 31);
+	strncpy(hdr.os_type, vm->os_type, 31);
+	hdr.nr_vcpus = vm->nr_vcpus;
+	hdr.nr_threads = MIGRATE_THREADS;
+	hdr.flags = vm->flags;
+	hdr.mem_start = vm->mem_start;
+	hdr.mem_size = vm->mem_size;
+	hdr.entry = vm->entry;
+	hdr.setup_data = vm->setup_data;
+
+	/* wait the target vm created */
+	ret = migrate_write(fd, &hdr, sizeof(hdr));
+	if (!ret)
+		ret = migrate_read(fd, &status, sizeof(status));
+	if (ret || status) {
+		pr_err("target of migration is not ready %d\n",
+				ret ? ret : status);
+		ret = ret ? ret : status;
+		goto free_bitmap;
+	}
+
+	ret = migrate_open_workers(&ctx, path);
+	if (ret)
+		goto close_workers;
+
+	ret = vm_dirty_log(vm, 1);
+	if (ret) {
+		pr_err("start dirty log of vm-%d failed %d\n", vm->vmid, ret);
+		goto close_workers;
+	}
+
+	/* all the populated memory is sent in the first round */
+	memset(ctx.bitmap, 0xff, size);
+	dirty = nr_pages;
+	ctx.map = vm_get_block_map(vm);
+	if (!ctx.map) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (;;) {
+		ret = migrate_send_round(&ctx);
+		free(ctx.map);
+		ctx.map = NULL;
+		if (ret)
+			goto out;
+
+		round++;
+		ret = vm_get_dirty_log(vm, ctx.bitmap, size);
+		if (ret)
+			goto out;
+
+		/*
+		 * stop the vm when the dirty pages are few enough
+		 * or the dirty rate is higher than the transfer
+		 */
+		i = migrate_count_pages(ctx.bitmap, nr_pages);
+		pr_debug("migrate round %d: %d pages dirty\n", round, i);
+		if ((i <= MIGRATE_MIN_DIRTY) || (round >= MIGRATE_MAX_ROUNDS) ||
+				((round > 1) && (i >= dirty)))
+			break;
+
+		dirty = i;
+	}
+
+	pause_start = migrate_now_ms();
+	ret = vm_pause(vm);
+	if (ret)
+		goto out;
+
+	/* no request of the backends completes after the last round */
+	vm_quiesce_vdevs(vm, 1);
+	paused = 1;
+
+	/* the pages written after the last round */
+	ret = vm_get_dirty_log(vm, ctx.bitmap, size);
+	if (ret)
+		goto out;
+
+	dirty = migrate_count_pages(ctx.bitmap, nr_pages);
+	ret = migrate_send_round(&ctx);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < MIGRATE_THREADS; i++) {
+		ret = migrate_send_record(ctx.workers[i].fd,
+				MIGRATE_REC_END, 0, NULL, 0);
+		if (ret)
+			goto out;
+	}
+
+	ret = migrate_send_state(vm, fd);
+	if (!ret)
+		ret = migrate_send_record(fd, MIGRATE_REC_END, 0, NULL, 0);
+	if (ret)
+		goto out;
+
+	/*
+	 * the target may already run the vm after the end record,
+	 * only resume here when it reports the failure explicitly
+	 */
+	ret = migrate_read(fd, &status, sizeof(status));
+	if (ret) {
+		pr_err("no status from the target, keep vm-%d paused\n",
+				vm->vmid);
+		paused = 0;
+	} else
+		ret = status;
+
+out:
+	end = migrate_now_ms();
+	vm_dirty_log(vm, 0);
+
+	if (ret && paused) {
+		vm_quiesce_vdevs(vm, 0);
+		vm_unpause(vm);
+	}
+
+	for (i = 0; i < MIGRATE_THREADS; i++) {
+		bytes += ctx.workers[i].bytes;
+		pages += ctx.workers[i].pages;
+	}
+
+	if (ret)
+		pr_err("migrate vm-%d to %s failed %d\n", vm->vmid, path, ret);
+	else
+		pr_info("migrate vm-%d to %s: %d rounds %ld pages %ldMB "
+			"sent %ldMB last round %d pages total %ldms "
+			"downtime %ldms\n", vm->vmid, path, round + 1,
+			(unsigned long)pages,
+			(unsigned long)(pages << PAGE_SHIFT) >> 20,
+			(unsigned long)bytes >> 20, dirty,
+			end - start, end - pause_start);
+
+close_workers:
+	migrate_close_workers(&ctx);
+free_bitmap:
+	free(ctx.bitmap);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * wait the source to connect and get the config of the vm, the
+ * vm will be created as the same as the source vm
+ */
+int vm_migrate_listen(char *path, struct vmtag *vmtag)
+{
+	int ret;
+	struct sockaddr_un addr;
+	struct migrate_header hdr;
+
+	migrate_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (migrate_listen_fd < 0)
+		return -errno;
+
+	unlink(path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if (bind(migrate_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(migrate_listen_fd, MIGRATE_THREADS + 1)) {
+		ret = -errno;
+		pr_err("can not listen on %s\n", path);
+		goto err;
+	}
+
+	pr_info("waiting for migration on %s\n", path);
+	migrate_ctrl_fd = accept(migrate_listen_fd, NULL, NULL);
+	if (migrate_ctrl_fd < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	ret = migrate_read(migrate_ctrl_fd, &hdr, sizeof(hdr));
+	if (ret)
+		goto err;
+
+	if ((hdr.magic != MIGRATE_MAGIC) || (hdr.version != MIGRATE_VERSION) ||
+			(hdr.nr_threads != MIGRATE_THREADS)) {
+		pr_err("unsupported migration stream\n");
+		ret = -EPROTO;
+		goto err;
+	}
+
+	strncpy(vmtag->name, hdr.name, VM_NAME_SIZE - 1);
+	strncpy(vmtag->os_type, hdr.os_type, VM_TYPE_SIZE - 1);
+	vmtag->nr_vcpu = hdr.nr_vcpus;
+	vmtag->mem_base = hdr.mem_start;
+	vmtag->mem_size = hdr.mem_size;
+	vmtag->entry = (void *)hdr.entry;
+	vmtag->setup_data = (void *)hdr.setup_data;
+	vmtag->flags = hdr.flags | (vmtag->flags & VM_FLAGS_LAZY_MEM);
+
+	return 0;
+
+err:
+	if (migrate_ctrl_fd >= 0)
+		close(migrate_ctrl_fd);
+	close(migrate_listen_fd);
+	migrate_ctrl_fd = migrate_listen_fd = -1;
+	return ret;
+}
+
+static int migrate_recv_page(struct migrate_worker *w,
+		struct migrate_record *rec)
+{
+	int ret;
+	struct vm *vm = w->ctx->vm;
+	void *page = vm->mmap + rec->offset;
+	uint8_t *received = &w->ctx->received[rec->offset >> PAGE_SHIFT];
+
+	if ((rec->offset & (PAGE_SIZE - 1)) ||
+			(rec->offset >= vm->mem_size) ||
+			(rec->size > PAGE_SIZE))
+		return -EINVAL;
+
+	ret = migrate_read(w->fd, w->buf, rec->size);
+	if (ret)
+		return ret;
+
+	switch (rec->flags) {
+	case MIGRATE_PAGE_ZERO:
+		/*
+		 * the memory of a lazy vm is cleared by hypervisor,
+		 * do not populate it if the page is never written
+		 */
+		if ((vm->flags & VM_FLAGS_LAZY_MEM) && !*received)
+			break;
+		memset(page, 0, PAGE_SIZE);
+		break;
+	case MIGRATE_PAGE_RAW:
+		if (rec->size != PAGE_SIZE)
+			return -EINVAL;
+		memcpy(page, w->buf, PAGE_SIZE);
+		break;
+	case MIGRATE_PAGE_WORD:
+		ret = migrate_decode_page(w->buf, rec->size, page);
+		if (ret)
+			return ret;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	*received = 1;
+	w->pages++;
+	w->bytes += sizeof(*rec) + rec->size;
+
+	return 0;
+}
+
+static void *migrate_recv_thread(void *data)
+{
+	struct migrate_record rec;
+	struct migrate_worker *w = (struct migrate_worker *)data;
+
+	for (;;) {
+		w->err = migrate_read(w->fd, &rec, sizeof(rec));
+		if (w->err)
+			break;
+
+		if (rec.type == MIGRATE_REC_END)
+			break;
+
+		if (rec.type != MIGRATE_REC_PAGE) {
+			w->err = -EPROTO;
+			break;
+		}
+
+		w->err = migrate_recv_page(w, &rec);
+		if (w->err)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * receive the memory and the state from the source, then
+ * resume the vm, the result is sent back to the source
+ */
+int vm_migrate_incoming(struct vm *vm)
+{
+	int i, ret, status = 0, nr = 0;
+	void *state = NULL, *vdevs = NULL;
+	struct migrate_record srec, vrec, rec;
+	struct migrate_ctx ctx;
+	struct migrate_worker *w;
+	uint64_t bytes = 0, pages = 0;
+	unsigned long start, end;
+	void *tmp;
+
+	start = migrate_now_ms();
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.vm = vm;
+	ctx.received = calloc(1, vm->mem_size >> PAGE_SHIFT);
+	if (!ctx.received) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* the vm is created, let the source start to send */
+	ret = migrate_write(migrate_ctrl_fd, &status, sizeof(status));
+	if (ret)
+		goto out;
+
+	for (nr = 0; nr < MIGRATE_THREADS; nr++) {
+		w = &ctx.workers[nr];
+		w->ctx = &ctx;
+		w->buf = malloc(PAGE_SIZE);
+		if (!w->buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		w->fd = accept(migrate_listen_fd, NULL, NULL);
+		if (w->fd < 0) {
+			free(w->buf);
+			ret = -errno;
+			goto out;
+		}
+
+		ret = pthread_create(&w->tid, NULL, migrate_recv_thread, w);
+		if (ret) {
+			close(w->fd);
+			free(w->buf);
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* the state is sent after the vm paused on the source */
+	ret = migrate_recv_record(migrate_ctrl_fd, MIGRATE_REC_STATE,
+			&srec, &state);
+	if (!ret)
+		ret = migrate_recv_record(migrate_ctrl_fd, MIGRATE_REC_VDEV,
+				&vrec, &vdevs);
+	if (!ret)
+		ret = migrate_recv_record(migrate_ctrl_fd, MIGRATE_REC_END,
+				&rec, &tmp);
+
+out:
+	/* the receive threads exit when the source send the end */
+	for (i = 0; i < nr; i++) {
+		w = &ctx.workers[i];
+		if (ret)
+			shutdown(w->fd, SHUT_RDWR);
+		pthread_join(w->tid, NULL);
+		if (!ret && w->err)
+			ret = w->err;
+
+		bytes += w->bytes;
+		pages += w->pages;
+		close(w->fd);
+		free(w->buf);
+	}
+
+	if (!ret) {
+		ret = vm_restore_state(vm, state, srec.size);
+		if (ret)
+			pr_err("restore vm-%d state failed %d\n",
+					vm->vmid, ret);
+	}
+
+	if (!ret)
+		ret = vm_restore_vdevs(vm, vdevs, vrec.flags, vrec.size);
+
+	/*
+	 * the source only resumes when it gets a failure status,
+	 * so the vm is started here once the status is sent even
+	 * if the source may not receive it
+	 */
+	status = ret;
+	if (migrate_write(migrate_ctrl_fd, &status, sizeof(status)))
+		pr_warn("send the status of migration failed\n");
+
+	if (!ret)
+		ret = vm_unpause(vm);
+
+	end = migrate_now_ms();
+
+	if (ret)
+		pr_err("migrate vm-%d failed %d\n", vm->vmid, ret);
+	else
+		pr_info("migrate vm-%d done: %ld pages %ldMB received "
+			"in %ldms\n", vm->vmid, (unsigned long)pages,
+			(unsigned long)bytes >> 20, end - start);
+
+	free(state);
+	free(vdevs);
+	free(ctx.received);
+	close(migrate_ctrl_fd);
+	close(migrate_listen_fd);
+	migrate_ctrl_fd = migrate_listen_fd = -1;
+
+	return ret;
+}
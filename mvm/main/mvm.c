@@ -74,6 +74,9 @@ int vm_shutdown(struct vm *vm);
 
 extern int virtio_mmio_init(struct vm *vm, int nr_devs);
 extern int virtio_mmio_deinit(struct vm *vm);
+extern struct vdev *virtio_mmio_vdev(unsigned long addr);
+extern int virtio_mmio_notify(struct vdev *vdev, int reason,
+		unsigned long addr, unsigned long *value);
 
 void *map_vm_memory(struct vm *vm)
 {
@@ -98,10 +101,20 @@ void *map_vm_memory(struct vm *vm)
 	return addr;
 }
 
+static unsigned long mvm_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int create_new_vm(struct vm *vm)
 {
 	int fd, vmid = -1;
 	struct vmtag info;
+	unsigned long start;
 
 	strcpy(info.name, vm->name);
 	strcpy(info.os_type, vm->os_type);
@@ -113,6 +126,7 @@ static int create_new_vm(struct vm *vm)
 	info.mmap_base = 0;
 	info.flags = vm->flags;
 	info.vmid = vm->vmid;
+	info.cache_colors = vm->vm_config->vmtag.cache_colors;
 
 	fd = open("/dev/mvm/mvm0", O_RDWR | O_NONBLOCK);
 	if (fd < 0) {
@@ -130,30 +144,44 @@ static int create_new_vm(struct vm *vm)
 	pr_info("        -mem_base  : 0x%lx\n", info.mem_base);
 	pr_info("        -entry      : 0x%p\n", info.entry);
 	pr_info("        -setup_data : 0x%p\n", info.setup_data);
+	pr_info("        -colors     : 0x%"PRIx64"\n", info.cache_colors);
 
+	start = mvm_now_us();
 	vmid = ioctl(fd, IOCTL_CREATE_VM, &info);
 	if (vmid <= 0) {
 		perror("vmid");
 		return vmid;
 	}
 
+	pr_info("vm-%d created in %luus\n", vmid, mvm_now_us() - start);
+
 	vm->hvm_paddr = info.mmap_base;
 	close(fd);
 
 	return vmid;
 }
 
+/*
+ * the hypervisor only stops the vm and reserves its vmid
+ * here, the memory is released by the idle pcpus later
+ */
 static int release_vm(int vmid)
 {
-	int fd, ret;
+	int fd, ret, pending;
+	unsigned long start;
 
 	fd = open("/dev/mvm/mvm0", O_RDWR);
 	if (fd < 0)
 		return -ENODEV;
 
+	start = mvm_now_us();
 	ret = ioctl(fd, IOCTL_DESTROY_VM, vmid);
+	pending = ioctl(fd, IOCTL_VM_DESTROY_STATE, vmid);
 	close(fd);
 
+	pr_info("vm-%d destroyed in %luus%s\n", vmid, mvm_now_us() - start,
+			(pending == 1) ? ", memory released later" : "");
+
 	return ret;
 }
 
@@ -283,6 +311,19 @@ void print_usage(void)
 	fprintf(stderr, "    --gicv3                    (using the gicv3 interrupt controller)\n");
 	fprintf(stderr, "    --gicv4                    (using the gicv4 interrupt controller)\n");
 	fprintf(stderr, "    --earlyprintk              (enable the earlyprintk based on virtio-console)\n");
+	fprintf(stderr, "    --lazy_mem                 (allocate the vm memory when it is first touched)\n");
+	fprintf(stderr, "    --mem_limit <size>         (compress the cold memory when the vm use more than size)\n");
+	fprintf(stderr, "    --snapshot <file>          (save the vm to the file when receive SIGUSR1)\n");
+	fprintf(stderr, "    --restore <file>           (restore the vm from the snapshot file)\n");
+	fprintf(stderr, "    --template <file>          (pause the vm as a template when receive SIGUSR1)\n");
+	fprintf(stderr, "    --clone <file>             (clone the vm from the template file)\n");
+	fprintf(stderr, "    --migrate <socket>         (migrate the vm to the socket when receive SIGUSR2)\n");
+	fprintf(stderr, "    --incoming <socket>        (wait the vm migrated from the socket)\n");
+	fprintf(stderr, "    --wss <ms>[,<rate>]        (track the working set every ms, scan rate blocks/s)\n");
+	fprintf(stderr, "    --stats <vmid>             (show the working set of a running vm)\n");
+	fprintf(stderr, "    --cache_colors <mask>      (only use the memory of these llc colors)\n");
+	fprintf(stderr, "    --vcpu_poll <us>           (poll the vmcs, wait for the virq after us idle)\n");
+	fprintf(stderr, "    --trace <on|off|file>      (enable the hypervisor trace or stop and dump it to file)\n");
 	fprintf(stderr, "\n");
 	exit(EXIT_FAILURE);
 }
@@ -353,6 +394,25 @@ static int create_and_init_vm(struct vm *vm)
 	if (!vm->mmap)
 		return -EAGAIN;
 
+	if (vm->vm_config->mem_limit) {
+		ret = vm_set_mem_limit(vm, vm->vm_config->mem_limit);
+		if (ret)
+			pr_warn("set memory limit of vm-%d failed %d\n",
+					vm->vmid, ret);
+	}
+
+	if (vm->vm_config->wss_interval) {
+		ret = vm_wss_config(vm, vm->vm_config->wss_interval,
+				vm->vm_config->wss_rate);
+		if (ret)
+			pr_warn("enable working set tracking of vm-%d failed %d\n",
+					vm->vmid, ret);
+	}
+
+	/* the memory will be loaded from the snapshot, template or source */
+	if (vm_config_is_restore(vm->vm_config))
+		return 0;
+
 	/* load the image into the vm memory */
 	ret = vm->os->load_image(vm);
 	if (ret)
@@ -430,31 +490,54 @@ static void vmcs_ack(struct vmcs *vmcs)
 	if (vmcs->guest_index == vmcs->host_index)
 		return;
 
+	/* the result need to be visible before the index */
+	wmb();
 	vmcs->guest_index++;
 	wmb();
 }
 
-static int vcpu_handle_mmio(struct vm *vm, int trap_reason,
-		unsigned long trap_data, unsigned long *trap_result)
+static struct vdev *vdev_find(struct vm *vm, unsigned long addr)
 {
-	int ret = -EIO;
 	struct vdev *vdev;
-	unsigned long base, size;
+	unsigned long base;
 
 	list_for_each_entry(vdev, &vm->vdev_list, list) {
 		base = (unsigned long)vdev->guest_iomem;
-		size = vdev->iomem_size;
-		if ((trap_data >= base) && (trap_data < base + size)) {
-			pthread_mutex_lock(&vdev->lock);
-			ret = vdev->ops->event(vdev, trap_reason,
-					trap_data, trap_result);
-			pthread_mutex_unlock(&vdev->lock);
+		if ((addr >= base) && (addr < base + vdev->iomem_size))
+			return vdev;
+	}
+
+	return NULL;
+}
 
+static int vcpu_handle_mmio(struct vm *vm, int trap_reason,
+		unsigned long trap_data, unsigned long *trap_result)
+{
+	int ret;
+	struct vdev *vdev;
+
+	/*
+	 * the queue notify of some virtio devices only need the
+	 * lock of the queue, other traps are handled under the
+	 * lock of the vdev
+	 */
+	vdev = virtio_mmio_vdev(trap_data);
+	if (vdev) {
+		ret = virtio_mmio_notify(vdev, trap_reason,
+				trap_data, trap_result);
+		if (ret != -EAGAIN)
 			return ret;
-		}
+	} else {
+		vdev = vdev_find(vm, trap_data);
+		if (!vdev)
+			return -ENODEV;
 	}
 
-	return -ENODEV;
+	pthread_mutex_lock(&vdev->lock);
+	ret = vdev->ops->event(vdev, trap_reason, trap_data, trap_result);
+	pthread_mutex_unlock(&vdev->lock);
+
+	return ret;
 }
 
 static int vcpu_handle_common_trap(struct vm *vm, int trap_reason,
@@ -484,13 +567,49 @@ static int vcpu_handle_common_trap(struct vm *vm, int trap_reason,
 	return 0;
 }
 
+static pthread_mutex_t mmio_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * handle the mmio writes coalesced by the hypervisor. the
+ * vcpu only coalesces a write when all its traps are acked,
+ * so the writes need to be handled before the next trap
+ */
+void vm_handle_coalesced_mmio(struct vm *vm)
+{
+	unsigned long value;
+	struct mmio_ring *ring;
+	struct mmio_ring_entry *entry;
+
+	if (!vm->vmcs)
+		return;
+
+	ring = vmcs_mmio_ring(vm->vmcs, vm->nr_vcpus);
+	if (ring->first == ring->last)
+		return;
+
+	pthread_mutex_lock(&mmio_ring_lock);
+	while (ring->first != ring->last) {
+		rmb();
+		entry = &ring->ring[ring->first & MMIO_RING_MASK];
+		value = entry->value;
+		vcpu_handle_mmio(vm, VMTRAP_REASON_WRITE,
+				entry->addr, &value);
+
+		/* hypervisor checks first after it updates last */
+		ring->first++;
+		mb();
+	}
+	pthread_mutex_unlock(&mmio_ring_lock);
+}
+
 static void handle_vcpu_event(struct vmcs *vmcs)
 {
-	int ret;
-	uint32_t trap_type = vmcs->trap_type;
-	uint32_t trap_reason = vmcs->trap_reason;
-	unsigned long trap_data = vmcs->trap_data;
-	unsigned long trap_result = vmcs->trap_result;
+	int ret = 0;
+	struct vmcs_entry *entry = vmcs_entry(vmcs, vmcs->guest_index);
+	uint32_t trap_type = entry->trap_type;
+	uint32_t trap_reason = entry->trap_reason;
+	unsigned long trap_data = entry->trap_data;
+	unsigned long trap_result = entry->trap_result;
 
 	switch (trap_type) {
 	case VMTRAP_TYPE_COMMON:
@@ -507,12 +626,64 @@ static void handle_vcpu_event(struct vmcs *vmcs)
 		break;
 	}
 
-	vmcs->trap_ret = ret;
-	vmcs->trap_result = trap_result;
+	entry->trap_ret = ret;
+	entry->trap_result = trap_result;
 
 	vmcs_ack(vmcs);
 }
 
+/*
+ * handle all the traps posted to the ring, the non-blocking
+ * traps may be posted back to back before mvm is waked up.
+ * the vcpu waiting for the ack is suspended by hypervisor
+ * and need to be waked up
+ */
+static void handle_vcpu_events(struct vm *vm, struct vmcs *vmcs)
+{
+	while (1) {
+		vm_handle_coalesced_mmio(vm);
+		if (vmcs->guest_index == vmcs->host_index)
+			break;
+
+		rmb();
+		handle_vcpu_event(vmcs);
+	}
+
+	mb();
+	if (vmcs->waiting)
+		ioctl(vm->vm_fd, IOCTL_VM_VMCS_ACK,
+				(unsigned long)vmcs->vcpu_id);
+}
+
+/*
+ * spin on the ring of the vmcs instead of waiting for the
+ * virq, the hypervisor does not send the virq while polling
+ * is set. go back to the eventfd if no trap is posted in
+ * poll_us
+ */
+static void vcpu_poll_events(struct vm *vm,
+		struct vmcs *vmcs, unsigned long poll_us)
+{
+	unsigned long deadline = mvm_now_us() + poll_us;
+
+	vmcs->polling = 1;
+	mb();
+
+	while (1) {
+		if (vmcs->guest_index != vmcs->host_index) {
+			handle_vcpu_events(vm, vmcs);
+			deadline = mvm_now_us() + poll_us;
+		} else if (mvm_now_us() >= deadline) {
+			break;
+		}
+	}
+
+	/* the trap posted before polling is cleared has no virq */
+	vmcs->polling = 0;
+	mb();
+	handle_vcpu_events(vm, vmcs);
+}
+
 void *vm_vcpu_thread(void *data)
 {
 	int ret;
@@ -548,6 +719,9 @@ void *vm_vcpu_thread(void *data)
 		return NULL;
 
 	while (1) {
+		if (vm->vm_config->vcpu_poll)
+			vcpu_poll_events(vm, vmcs, vm->vm_config->vcpu_poll);
+
 		ret = epoll_wait(epfd, &ep_events, 1, -1);
 		if (ret <= 0) {
 			pr_err("epoll failed for vcpu\n");
@@ -555,10 +729,7 @@ void *vm_vcpu_thread(void *data)
 		}
 
 		eventfd_read(eventfd, &value);
-		if (value > 1)
-			pr_err("invaild vmcs state\n");
-
-		handle_vcpu_event(vmcs);
+		handle_vcpu_events(vm, vmcs);
 	}
 
 	return NULL;
@@ -649,6 +820,17 @@ static void handle_vm_event(struct vm *vm, struct mvm_node *node)
 	case VMTRAP_REASON_SHUTDOWN:
 		__vm_shutdown(vm);
 		break;
+	case MVM_EVENT_SNAPSHOT:
+		if (vm->vm_config->template_path[0])
+			vm_save_template(vm, vm->vm_config->template_path);
+		else
+			vm_snapshot(vm, vm->vm_config->snapshot_path);
+		break;
+	case MVM_EVENT_MIGRATE:
+		/* the vm is running on the target now */
+		if (!vm_migrate(vm, vm->vm_config->migrate_path))
+			__vm_shutdown(vm);
+		break;
 	default:
 		pr_err("unsupport vm event %d\n", node->type);
 		break;
@@ -657,6 +839,36 @@ static void handle_vm_event(struct vm *vm, struct mvm_node *node)
 	mvm_queue_free(node);
 }
 
+/*
+ * SIGUSR1 and SIGUSR2 are blocked in all the threads, receive
+ * them here and let the main loop to take the snapshot, save
+ * the vm as a template or migrate the vm
+ */
+static void *vm_signal_thread(void *data)
+{
+	int sig;
+	sigset_t set;
+	struct vm *vm = (struct vm *)data;
+
+	prctl(PR_SET_NAME, "mvm-signal");
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+
+	for (;;) {
+		if (sigwait(&set, &sig))
+			continue;
+
+		if ((sig == SIGUSR1) && (vm->vm_config->snapshot_path[0] ||
+				vm->vm_config->template_path[0]))
+			mvm_queue_push(&vm->queue, MVM_EVENT_SNAPSHOT, NULL, 0);
+		else if ((sig == SIGUSR2) && vm->vm_config->migrate_path[0])
+			mvm_queue_push(&vm->queue, MVM_EVENT_MIGRATE, NULL, 0);
+	}
+
+	return NULL;
+}
+
 static int mvm_main_loop(void)
 {
 	int ret, i, irq;
@@ -716,8 +928,26 @@ static int mvm_main_loop(void)
 		return ret;
 	}
 
-	/* now start the vm */
-	ret = ioctl(vm->vm_fd, IOCTL_POWER_UP_VM, NULL);
+	if (vm->vm_config->snapshot_path[0] ||
+			vm->vm_config->template_path[0] ||
+			vm->vm_config->migrate_path[0]) {
+		ret = pthread_create(&vcpu_thread, NULL,
+				vm_signal_thread, (void *)vm);
+		if (ret) {
+			pr_err("create signal thread failed\n");
+			return ret;
+		}
+	}
+
+	/* now start the vm or resume it from the snapshot */
+	if (vm->vm_config->restore_path[0])
+		ret = vm_restore(vm, vm->vm_config->restore_path);
+	else if (vm->vm_config->clone_path[0])
+		ret = vm_clone_template(vm, vm->vm_config->clone_path);
+	else if (vm->vm_config->incoming_path[0])
+		ret = vm_migrate_incoming(vm);
+	else
+		ret = ioctl(vm->vm_fd, IOCTL_POWER_UP_VM, NULL);
 	if (ret)
 		return ret;
 
@@ -775,6 +1005,7 @@ static int mvm_open_images(struct vm *vm, struct vm_config *config)
 static int mvm_main(struct vm_config *config)
 {
 	int ret;
+	sigset_t set;
 	struct vm *vm;
 	struct vm_os *os;
 	struct vmtag *vmtag = &config->vmtag;
@@ -782,6 +1013,15 @@ static int mvm_main(struct vm_config *config)
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 
+	/* block SIGUSR1 and SIGUSR2 before any thread is created */
+	if (config->snapshot_path[0] || config->template_path[0] ||
+			config->migrate_path[0]) {
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR1);
+		sigaddset(&set, SIGUSR2);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+	}
+
 	mvm_vm = vm = (struct vm *)calloc(1, sizeof(struct vm));
 	if (!vm)
 		return -ENOMEM;
@@ -804,16 +1044,19 @@ static int mvm_main(struct vm_config *config)
 	init_list(&vm->vdev_list);
 	vm->vm_config = config;
 
-	ret = mvm_open_images(vm, config);
-	if (ret) {
-		free(vm);
-		return ret;
-	}
+	/* the vm is restored from snapshot, no need the images */
+	if (!vm_config_is_restore(config)) {
+		ret = mvm_open_images(vm, config);
+		if (ret) {
+			free(vm);
+			return ret;
+		}
 
-	ret = os->early_init(vm);
-	if (ret) {
-		pr_err("os early init faild %d\n", ret);
-		goto release_vm;
+		ret = os->early_init(vm);
+		if (ret) {
+			pr_err("os early init faild %d\n", ret);
+			goto release_vm;
+		}
 	}
 
 	if (vm->entry == 0)
@@ -838,9 +1081,11 @@ static int mvm_main(struct vm_config *config)
 	if (ret)
 		goto release_vm;
 
-	ret = mvm_vm->os->setup_vm_env(vm, config->cmdline);
-	if (ret)
-		return ret;
+	if (!vm_config_is_restore(config)) {
+		ret = mvm_vm->os->setup_vm_env(vm, config->cmdline);
+		if (ret)
+			return ret;
+	}
 
 	ret = vm_create_host_vdev(vm);
 	if (ret)
@@ -857,6 +1102,55 @@ release_vm:
 	return ret;
 }
 
+/*
+ * print the idle histogram of a running vm, the memory used
+ * in the last n passes is the working set of n * interval
+ */
+static int mvm_show_stats(int vmid)
+{
+	int i, ret;
+	char path[32];
+	struct vm vm;
+	struct vm_wss_stat stat;
+	uint64_t wss = 0;
+
+	memset(&vm, 0, sizeof(struct vm));
+	sprintf(path, "/dev/mvm/mvm%d", vmid);
+	vm.vm_fd = open(path, O_RDWR);
+	if (vm.vm_fd < 0) {
+		perror(path);
+		return -EIO;
+	}
+
+	ret = vm_get_wss(&vm, &stat);
+	close(vm.vm_fd);
+	if (ret) {
+		pr_err("get working set of vm-%d failed %d\n", vmid, ret);
+		return ret;
+	}
+
+	printf("vm-%d memory %"PRIu64"MB interval %ums rate %u blocks/s\n",
+			vmid, stat.mem_size >> 20, stat.interval, stat.rate);
+	printf("    passes %"PRIu64" scanned %"PRIu64" access faults %"PRIu64"\n",
+			stat.passes, stat.scanned, stat.access_faults);
+	printf("    %-16s %10s %10s\n", "idle passes", "idle MB", "wss MB");
+
+	for (i = 0; i < VM_WSS_BUCKETS; i++) {
+		wss += stat.idle[i];
+		if (i == 0)
+			printf("    %-16s", "0");
+		else if (i == VM_WSS_BUCKETS - 1)
+			printf("    >=%-14d", 1 << (i - 1));
+		else
+			printf("    %d-%-14d", 1 << (i - 1), (1 << i) - 1);
+
+		printf(" %10"PRIu64" %10"PRIu64"\n",
+				stat.idle[i] >> 20, wss >> 20);
+	}
+
+	return 0;
+}
+
 static struct option options[] = {
 	{"vcpu_number", required_argument, NULL, 'c'},
 	{"mem_size",	required_argument, NULL, 'm'},
@@ -870,6 +1164,19 @@ static struct option options[] = {
 	{"gicv2",	no_argument,	   NULL, '1'},
 	{"gicv4",	no_argument,	   NULL, '2'},
 	{"earlyprintk",	no_argument,	   NULL, '3'},
+	{"lazy_mem",	no_argument,	   NULL, '4'},
+	{"mem_limit",	required_argument, NULL, 'L'},
+	{"snapshot",	required_argument, NULL, '5'},
+	{"restore",	required_argument, NULL, '6'},
+	{"template",	required_argument, NULL, '7'},
+	{"clone",	required_argument, NULL, '8'},
+	{"migrate",	required_argument, NULL, '9'},
+	{"incoming",	required_argument, NULL, 'I'},
+	{"wss",		required_argument, NULL, 'W'},
+	{"stats",	required_argument, NULL, 'T'},
+	{"cache_colors", required_argument, NULL, 'O'},
+	{"vcpu_poll",	required_argument, NULL, 'P'},
+	{"trace",	required_argument, NULL, 'X'},
 	{"help",	no_argument,	   NULL, 'h'},
 	{NULL,		0,		   NULL,  0}
 };
@@ -930,7 +1237,8 @@ static int add_device_info(struct device_info *dinfo, char *name, int type)
 static int check_vm_config(struct vm_config *config)
 {
 	/* default will use bootimage as the vm image */
-	if (config->bootimage_path[0] == 0) {
+	if ((config->bootimage_path[0] == 0) &&
+			!vm_config_is_restore(config)) {
 		config->vmtag.flags |= VM_FLAGS_NO_BOOTIMAGE;
 		if ((config->kernel_image[0] == 0) ||
 				config->dtb_image[0] == 0) {
@@ -977,7 +1285,7 @@ int main(int argc, char **argv)
 	int run_as_daemon = 0;
 	struct vmtag *vmtag;
 	struct device_info *device_info;
-	static char *optstr = "K:R:S:c:C:m:i:s:n:D:V:t:b:rv?hd0123";
+	static char *optstr = "K:R:S:c:C:m:i:s:n:D:V:t:b:rv?hd012345:6:7:8:9:I:L:W:T:O:P:X:";
 
 	global_config = calloc(1, sizeof(struct vm_config));
 	if (!global_config)
@@ -997,6 +1305,12 @@ int main(int argc, char **argv)
 			if (ret)
 				print_usage();
 			break;
+		case 'L':
+			ret = parse_vm_memsize(optarg,
+					&global_config->mem_limit);
+			if (ret)
+				print_usage();
+			break;
 		case 'i':
 			if (strlen(optarg) > 255) {
 				pr_err("invaild boot_image path %s\n", optarg);
@@ -1061,6 +1375,80 @@ int main(int argc, char **argv)
 		case '3':
 			vmtag->flags |= VM_FLAGS_HAS_EARLYPRINTK;
 			break;
+		case '4':
+			vmtag->flags |= VM_FLAGS_LAZY_MEM;
+			break;
+		case '5':
+			if (strlen(optarg) > 255) {
+				pr_err("snapshot path is too long\n");
+				ret = -EINVAL;
+				goto exit;
+			}
+			strcpy(global_config->snapshot_path, optarg);
+			break;
+		case '6':
+			if (strlen(optarg) > 255) {
+				pr_err("restore path is too long\n");
+				ret = -EINVAL;
+				goto exit;
+			}
+			strcpy(global_config->restore_path, optarg);
+			break;
+		case '7':
+			if (strlen(optarg) > 255) {
+				pr_err("template path is too long\n");
+				ret = -EINVAL;
+				goto exit;
+			}
+			strcpy(global_config->template_path, optarg);
+			break;
+		case '8':
+			if (strlen(optarg) > 255) {
+				pr_err("clone path is too long\n");
+				ret = -EINVAL;
+				goto exit;
+			}
+			strcpy(global_config->clone_path, optarg);
+			break;
+		case '9':
+			if (strlen(optarg) > 107) {
+				pr_err("migrate socket path is too long\n");
+				ret = -EINVAL;
+				goto exit;
+			}
+			strcpy(global_config->migrate_path, optarg);
+			break;
+		case 'I':
+			if (strlen(optarg) > 107) {
+				pr_err("incoming socket path is too long\n");
+				ret = -EINVAL;
+				goto exit;
+			}
+			strcpy(global_config->incoming_path, optarg);
+			break;
+		case 'W':
+			ret = sscanf(optarg, "%u,%u",
+					&global_config->wss_interval,
+					&global_config->wss_rate);
+			if (ret < 1)
+				print_usage();
+			break;
+		case 'T':
+			ret = mvm_show_stats(atoi(optarg));
+			goto exit;
+		case 'X':
+			ret = mvm_trace(optarg);
+			goto exit;
+		case 'O':
+			vmtag->cache_colors = strtoull(optarg, NULL, 0);
+			if (!vmtag->cache_colors)
+				print_usage();
+			break;
+		case 'P':
+			global_config->vcpu_poll = atoi(optarg);
+			if (!global_config->vcpu_poll)
+				print_usage();
+			break;
 		case '2':
 			global_config->gic_type = 2;
 			break;
@@ -1103,6 +1491,28 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (global_config->restore_path[0]) {
+		ret = vm_snapshot_config(global_config->restore_path, vmtag);
+		if (ret)
+			goto exit;
+	}
+
+	/* the clone only get the memory when it write to it */
+	if (global_config->clone_path[0]) {
+		ret = vm_snapshot_config(global_config->clone_path, vmtag);
+		if (ret)
+			goto exit;
+
+		vmtag->flags |= VM_FLAGS_LAZY_MEM;
+	}
+
+	/* the vm is created as the same as the source vm */
+	if (global_config->incoming_path[0]) {
+		ret = vm_migrate_listen(global_config->incoming_path, vmtag);
+		if (ret)
+			goto exit;
+	}
+
 	ret = check_vm_config(global_config);
 	if (ret)
 		goto exit;
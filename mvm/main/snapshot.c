@@ -0,0 +1,725 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <mvm.h>
+#include <vdev.h>
+
+/*
+ * layout of the snapshot file, the memory is page aligned
+ * so it can be mapped directly when restore, the block
+ * which is all zero is not written and left as a hole
+ *
+ * | header | hypervisor state | vdev state | bitmap | memory |
+ *
+ * a template file only has the header and the vdev state, the
+ * memory and the hypervisor state are taken from the template
+ * vm which is kept paused in the hypervisor
+ */
+#define SNAPSHOT_MAGIC		(0x4d564d53)
+#define SNAPSHOT_VERSION	(1)
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	char name[32];
+	char os_type[32];
+	uint32_t nr_vcpus;
+	uint32_t nr_vdev;
+	uint64_t flags;
+	uint64_t mem_start;
+	uint64_t mem_size;
+	uint64_t entry;
+	uint64_t setup_data;
+	uint64_t state_offset;
+	uint64_t state_size;
+	uint64_t vdev_offset;
+	uint64_t vdev_size;
+	uint64_t bitmap_offset;
+	uint64_t mem_offset;
+	int32_t template_vmid;
+	uint32_t reserved;
+};
+
+struct snapshot_vdev {
+	char name[32];
+	uint32_t size;
+	uint32_t reserved;
+};
+
+static unsigned long snapshot_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int mem_block_is_zero(void *addr)
+{
+	int i;
+	uint64_t *p = (uint64_t *)addr;
+
+	for (i = 0; i < MEM_BLOCK_SIZE / sizeof(uint64_t); i++) {
+		if (p[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * get the state of the mem_blocks from the hypervisor, all the
+ * blocks are read through the mmap if it can not tell
+ */
+uint8_t *vm_get_block_map(struct vm *vm)
+{
+	int count = vm->mem_size >> MEM_BLOCK_SHIFT;
+	uint8_t *map;
+
+	map = malloc(count);
+	if (!map)
+		return NULL;
+
+	if (vm_get_mem_map(vm, map, count))
+		memset(map, VM_BLOCK_MAPPED, count);
+
+	return map;
+}
+
+/*
+ * the buffer for the reclaimed block, the hypervisor copies
+ * to it so it must be populated before
+ */
+void *vm_alloc_block_buf(void)
+{
+	void *buf = malloc(MEM_BLOCK_SIZE);
+
+	if (buf)
+		memset(buf, 0, MEM_BLOCK_SIZE);
+
+	return buf;
+}
+
+static int snapshot_write(int fd, void *buf, size_t size, off_t offset)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = pwrite(fd, buf, size, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * stop the backends of the vdevs from touching the guest memory
+ * and the queues before the state of the vm is saved, pause = 0
+ * resumes them and handles the notify received in the pause
+ */
+void vm_quiesce_vdevs(struct vm *vm, int pause)
+{
+	struct vdev *vdev;
+
+	list_for_each_entry(vdev, &vm->vdev_list, list) {
+		if (!vdev->ops->quiesce)
+			continue;
+
+		pthread_mutex_lock(&vdev->lock);
+		vdev->ops->quiesce(vdev, pause);
+		pthread_mutex_unlock(&vdev->lock);
+	}
+}
+
+/*
+ * the vdev state is saved in the order of the vdev_list,
+ * the restored vm must be created with the same devices
+ */
+void *vm_save_vdevs(struct vm *vm, uint32_t *nr, uint64_t *size)
+{
+	int ret;
+	struct vdev *vdev;
+	struct snapshot_vdev *rec;
+	size_t total = 0, len;
+	void *buf = NULL, *tmp;
+
+	*nr = 0;
+	list_for_each_entry(vdev, &vm->vdev_list, list) {
+		if (!vdev->ops->save)
+			continue;
+
+		pthread_mutex_lock(&vdev->lock);
+		len = vdev->ops->save(vdev, NULL, 0);
+		tmp = realloc(buf, total + sizeof(*rec) + len);
+		if (!tmp) {
+			pthread_mutex_unlock(&vdev->lock);
+			goto err;
+		}
+
+		buf = tmp;
+		rec = (struct snapshot_vdev *)(buf + total);
+		memset(rec, 0, sizeof(*rec));
+		strncpy(rec->name, vdev->name, 31);
+		rec->size = len;
+
+		ret = vdev->ops->save(vdev, rec + 1, len);
+		pthread_mutex_unlock(&vdev->lock);
+		if (ret < 0)
+			goto err;
+
+		total += sizeof(*rec) + len;
+		(*nr)++;
+	}
+
+	*size = total;
+	return buf;
+
+err:
+	pr_err("save the state of vdev %s failed\n", vdev->name);
+	free(buf);
+	return NULL;
+}
+
+int vm_restore_vdevs(struct vm *vm, void *buf,
+		uint32_t nr, uint64_t size)
+{
+	int ret;
+	struct vdev *vdev;
+	struct snapshot_vdev *rec;
+	void *end = buf + size;
+
+	list_for_each_entry(vdev, &vm->vdev_list, list) {
+		if (!vdev->ops->restore)
+			continue;
+
+		rec = (struct snapshot_vdev *)buf;
+		if ((nr == 0) || ((void *)(rec + 1) > end) ||
+				((void *)(rec + 1) + rec->size > end) ||
+				strncmp(rec->name, vdev->name, 32)) {
+			pr_err("vdev %s does not match the snapshot\n",
+					vdev->name);
+			return -EINVAL;
+		}
+
+		pthread_mutex_lock(&vdev->lock);
+		ret = vdev->ops->restore(vdev, rec + 1, rec->size);
+		pthread_mutex_unlock(&vdev->lock);
+		if (ret) {
+			pr_err("restore vdev %s failed\n", vdev->name);
+			return ret;
+		}
+
+		buf = (void *)(rec + 1) + rec->size;
+		nr--;
+	}
+
+	/* the notify pending in the saved queues */
+	vm_quiesce_vdevs(vm, 0);
+
+	return 0;
+}
+
+int vm_snapshot(struct vm *vm, char *path)
+{
+	int fd, ret, i, count, nr_zero = 0;
+	struct snapshot_header hdr;
+	void *state = NULL, *vdevs = NULL, *block = NULL, *addr;
+	uint8_t *bitmap = NULL, *map = NULL;
+	unsigned long start, end;
+	uint64_t offset;
+
+	if (!path || path[0] == 0)
+		return -EINVAL;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		pr_err("can not open snapshot file %s\n", path);
+		return -errno;
+	}
+
+	start = snapshot_now_ms();
+	ret = vm_pause(vm);
+	if (ret) {
+		pr_err("pause vm-%d failed %d\n", vm->vmid, ret);
+		close(fd);
+		return ret;
+	}
+
+	/*
+	 * the backends may still complete the requests to the
+	 * guest memory and the queues, stop them before saving
+	 */
+	vm_quiesce_vdevs(vm, 1);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	strncpy(hdr.name, vm->name, 31);
+	strncpy(hdr.os_type, vm->os_type, 31);
+	hdr.nr_vcpus = vm->nr_vcpus;
+	hdr.flags = vm->flags;
+	hdr.mem_start = vm->mem_start;
+	hdr.mem_size = vm->mem_size;
+	hdr.entry = vm->entry;
+	hdr.setup_data = vm->setup_data;
+	hdr.template_vmid = -1;
+
+	/* the state of the vcpus and vmodules in hypervisor */
+	ret = vm_save_state(vm, NULL, 0);
+	if (ret <= 0)
+		goto out;
+
+	hdr.state_size = ret;
+	state = malloc(hdr.state_size);
+	if (!state) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = vm_save_state(vm, state, hdr.state_size);
+	if (ret < 0)
+		goto out;
+
+	vdevs = vm_save_vdevs(vm, &hdr.nr_vdev, &hdr.vdev_size);
+	if (!vdevs && hdr.nr_vdev) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	count = vm->mem_size >> MEM_BLOCK_SHIFT;
+	bitmap = calloc(1, BALIGN(count, 8) / 8);
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	hdr.state_offset = sizeof(hdr);
+	hdr.vdev_offset = hdr.state_offset + hdr.state_size;
+	hdr.bitmap_offset = hdr.vdev_offset + hdr.vdev_size;
+	hdr.mem_offset = BALIGN(hdr.bitmap_offset +
+			BALIGN(count, 8) / 8, PAGE_SIZE);
+
+	/*
+	 * stream the guest memory, the zero block is skipped, the
+	 * block which is not populated or is compressed is not
+	 * faulted in by reading it through the mmap
+	 */
+	map = vm_get_block_map(vm);
+	if (!map) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		offset = (uint64_t)i << MEM_BLOCK_SHIFT;
+		addr = vm->mmap + offset;
+
+		if (map[i] == VM_BLOCK_NONE) {
+			nr_zero++;
+			continue;
+		}
+
+		if (map[i] == VM_BLOCK_RECLAIMED) {
+			if (!block)
+				block = vm_alloc_block_buf();
+
+			/* it may be faulted in after the map is got */
+			if (block && !vm_read_block(vm, offset, block))
+				addr = block;
+		}
+
+		if (mem_block_is_zero(addr)) {
+			nr_zero++;
+			continue;
+		}
+
+		bitmap[i / 8] |= 1 << (i % 8);
+		ret = snapshot_write(fd, addr, MEM_BLOCK_SIZE,
+				hdr.mem_offset + offset);
+		if (ret)
+			goto out;
+	}
+
+	ret = snapshot_write(fd, &hdr, sizeof(hdr), 0);
+	ret |= snapshot_write(fd, state, hdr.state_size, hdr.state_offset);
+	ret |= snapshot_write(fd, vdevs, hdr.vdev_size, hdr.vdev_offset);
+	ret |= snapshot_write(fd, bitmap, BALIGN(count, 8) / 8,
+			hdr.bitmap_offset);
+	if (ret)
+		goto out;
+
+	ret = ftruncate(fd, hdr.mem_offset + vm->mem_size);
+	if (ret)
+		ret = -errno;
+	else
+		fsync(fd);
+
+out:
+	vm_quiesce_vdevs(vm, 0);
+	vm_unpause(vm);
+	end = snapshot_now_ms();
+
+	if (ret < 0)
+		pr_err("snapshot vm-%d failed %d\n", vm->vmid, ret);
+	else
+		pr_info("snapshot vm-%d to %s: %ldMB memory %ldMB zero "
+			"paused %ldms\n", vm->vmid, path,
+			vm->mem_size >> 20,
+			((unsigned long)nr_zero << MEM_BLOCK_SHIFT) >> 20,
+			end - start);
+
+	free(block);
+	free(map);
+	free(bitmap);
+	free(vdevs);
+	free(state);
+	close(fd);
+
+	return ret < 0 ? ret : 0;
+}
+
+static int snapshot_read_header(int fd, struct snapshot_header *hdr)
+{
+	if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+		return -EIO;
+
+	if ((hdr->magic != SNAPSHOT_MAGIC) ||
+			(hdr->version != SNAPSHOT_VERSION)) {
+		pr_err("invaild snapshot file\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * get the config of the vm from the snapshot, the vm will be
+ * created as the same as the vm when the snapshot is taken
+ */
+int vm_snapshot_config(char *path, struct vmtag *vmtag)
+{
+	int fd, ret;
+	struct snapshot_header hdr;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("can not open snapshot file %s\n", path);
+		return -ENOENT;
+	}
+
+	ret = snapshot_read_header(fd, &hdr);
+	close(fd);
+	if (ret)
+		return ret;
+
+	strncpy(vmtag->name, hdr.name, VM_NAME_SIZE - 1);
+	strncpy(vmtag->os_type, hdr.os_type, VM_TYPE_SIZE - 1);
+	vmtag->nr_vcpu = hdr.nr_vcpus;
+	vmtag->mem_base = hdr.mem_start;
+	vmtag->mem_size = hdr.mem_size;
+	vmtag->entry = (void *)hdr.entry;
+	vmtag->setup_data = (void *)hdr.setup_data;
+	vmtag->flags = hdr.flags | (vmtag->flags & VM_FLAGS_LAZY_MEM);
+
+	return 0;
+}
+
+/*
+ * restore the vm from the snapshot, the vm is created but
+ * not powered up, the image is mapped and only the non-zero
+ * blocks are copied, for a lazy vm the zero blocks will be
+ * populated by the hypervisor when the guest touch them
+ */
+int vm_restore(struct vm *vm, char *path)
+{
+	int fd, ret, i, count, nr_loaded = 0;
+	struct snapshot_header hdr;
+	void *image = (void *)-1, *state = NULL;
+	uint8_t *bitmap;
+	unsigned long start, loaded, end;
+	uint64_t offset;
+	size_t size = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("can not open snapshot file %s\n", path);
+		return -ENOENT;
+	}
+
+	start = snapshot_now_ms();
+	ret = snapshot_read_header(fd, &hdr);
+	if (ret)
+		goto out;
+
+	if ((hdr.template_vmid >= 0) ||
+			(hdr.mem_size != vm->mem_size) ||
+			(hdr.mem_start != vm->mem_start) ||
+			(hdr.nr_vcpus != vm->nr_vcpus)) {
+		pr_err("snapshot does not match vm-%d\n", vm->vmid);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	size = hdr.mem_offset + hdr.mem_size;
+	image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image == (void *)-1) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	madvise(image + hdr.mem_offset, hdr.mem_size, MADV_SEQUENTIAL);
+	bitmap = (uint8_t *)(image + hdr.bitmap_offset);
+	count = hdr.mem_size >> MEM_BLOCK_SHIFT;
+
+	for (i = 0; i < count; i++) {
+		offset = (uint64_t)i << MEM_BLOCK_SHIFT;
+		if (bitmap[i / 8] & (1 << (i % 8))) {
+			memcpy(vm->mmap + offset,
+				image + hdr.mem_offset + offset,
+				MEM_BLOCK_SIZE);
+			nr_loaded++;
+		} else if (!(vm->flags & VM_FLAGS_LAZY_MEM)) {
+			/* the memory of a normal vm is not cleared */
+			memset(vm->mmap + offset, 0, MEM_BLOCK_SIZE);
+		}
+	}
+
+	loaded = snapshot_now_ms();
+
+	/* the hypervisor needs a buffer which it can map */
+	state = malloc(hdr.state_size);
+	if (!state) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	memcpy(state, image + hdr.state_offset, hdr.state_size);
+	ret = vm_restore_state(vm, state, hdr.state_size);
+	if (ret) {
+		pr_err("restore vm-%d state failed %d\n", vm->vmid, ret);
+		goto out;
+	}
+
+	ret = vm_restore_vdevs(vm, image + hdr.vdev_offset,
+			hdr.nr_vdev, hdr.vdev_size);
+	if (ret)
+		goto out;
+
+	ret = vm_unpause(vm);
+	end = snapshot_now_ms();
+
+	pr_info("restore vm-%d from %s: %ldMB memory %ldMB loaded "
+		"load %ldms total %ldms\n", vm->vmid, path,
+		vm->mem_size >> 20,
+		((unsigned long)nr_loaded << MEM_BLOCK_SHIFT) >> 20,
+		loaded - start, end - start);
+
+out:
+	free(state);
+	if (image != (void *)-1)
+		munmap(image, size);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * pause the vm and save the state of its vdevs, the vm will
+ * be kept paused as a template, the clones share its memory
+ * and get the state of the vcpus from the hypervisor
+ */
+int vm_save_template(struct vm *vm, char *path)
+{
+	int fd, ret;
+	struct snapshot_header hdr;
+	void *vdevs = NULL;
+	unsigned long start;
+
+	if (!path || path[0] == 0)
+		return -EINVAL;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		pr_err("can not open template file %s\n", path);
+		return -errno;
+	}
+
+	start = snapshot_now_ms();
+	ret = vm_pause(vm);
+	if (ret) {
+		pr_err("pause vm-%d failed %d\n", vm->vmid, ret);
+		close(fd);
+		return ret;
+	}
+
+	/* the template keeps its backends stopped as the vcpus */
+	vm_quiesce_vdevs(vm, 1);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	strncpy(hdr.name, vm->name, 31);
+	strncpy(hdr.os_type, vm->os_type, 31);
+	hdr.nr_vcpus = vm->nr_vcpus;
+	hdr.flags = vm->flags;
+	hdr.mem_start = vm->mem_start;
+	hdr.mem_size = vm->mem_size;
+	hdr.entry = vm->entry;
+	hdr.setup_data = vm->setup_data;
+	hdr.template_vmid = vm->vmid;
+
+	vdevs = vm_save_vdevs(vm, &hdr.nr_vdev, &hdr.vdev_size);
+	if (!vdevs && hdr.nr_vdev) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	hdr.vdev_offset = sizeof(hdr);
+	ret = snapshot_write(fd, &hdr, sizeof(hdr), 0);
+	ret |= snapshot_write(fd, vdevs, hdr.vdev_size, hdr.vdev_offset);
+	if (!ret)
+		fsync(fd);
+
+out:
+	if (ret < 0) {
+		pr_err("save template vm-%d failed %d\n", vm->vmid, ret);
+		vm_quiesce_vdevs(vm, 0);
+		vm_unpause(vm);
+	} else
+		pr_info("vm-%d saved as template to %s in %ldms\n",
+			vm->vmid, path, snapshot_now_ms() - start);
+
+	free(vdevs);
+	close(fd);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * create the vm from a paused template, the memory of the
+ * template is mapped read only to the vm by the hypervisor
+ * and copied when written, the vdevs are created from the
+ * command line of this vm so they have their own backends
+ */
+int vm_clone_template(struct vm *vm, char *path)
+{
+	int fd, ret, nr;
+	struct snapshot_header hdr;
+	void *vdevs = NULL;
+	unsigned long start, cloned, end;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("can not open template file %s\n", path);
+		return -ENOENT;
+	}
+
+	start = snapshot_now_ms();
+	ret = snapshot_read_header(fd, &hdr);
+	if (ret)
+		goto out;
+
+	if ((hdr.template_vmid < 0) ||
+			(hdr.mem_size != vm->mem_size) ||
+			(hdr.mem_start != vm->mem_start) ||
+			(hdr.nr_vcpus != vm->nr_vcpus)) {
+		pr_err("template does not match vm-%d\n", vm->vmid);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	vdevs = malloc(hdr.vdev_size);
+	if (!vdevs && hdr.vdev_size) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (pread(fd, vdevs, hdr.vdev_size, hdr.vdev_offset) !=
+			hdr.vdev_size) {
+		ret = -EIO;
+		goto out;
+	}
+
+	nr = vm_clone(vm, hdr.template_vmid);
+	if (nr < 0) {
+		pr_err("clone vm-%d from vm-%d failed %d\n",
+				vm->vmid, hdr.template_vmid, nr);
+		ret = nr;
+		goto out;
+	}
+
+	cloned = snapshot_now_ms();
+
+	ret = vm_restore_vdevs(vm, vdevs, hdr.nr_vdev, hdr.vdev_size);
+	if (ret)
+		goto out;
+
+	ret = vm_unpause(vm);
+	end = snapshot_now_ms();
+
+	pr_info("clone vm-%d from vm-%d: %ldMB memory %ldMB shared "
+		"clone %ldms total %ldms\n", vm->vmid, hdr.template_vmid,
+		vm->mem_size >> 20,
+		((unsigned long)nr << MEM_BLOCK_SHIFT) >> 20,
+		cloned - start, end - start);
+
+out:
+	free(vdevs);
+	close(fd);
+
+	return ret;
+}
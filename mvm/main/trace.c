@@ -0,0 +1,197 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <mvm.h>
+#include <common/trace.h>
+
+/*
+ * mvm --trace on|off|<file>
+ *
+ * on and off enable or disable the trace of the hypervisor,
+ * other argument is the file to dump the trace rings to, the
+ * trace is stopped before the dump so the events in the rings
+ * are the last ones before the dump, the file is decoded by
+ * hypervisor/tools/decode_trace.py
+ */
+
+static int trace_write(int fd, void *buf, size_t size)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write(fd, buf, size);
+		if (ret <= 0)
+			return -EIO;
+		buf += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * copy the valid entries of the ring in time order, the
+ * hypervisor may still write the ring if the trace is
+ * enabled again, the entries overwritten during the copy
+ * are dropped
+ */
+static int trace_dump_ring(int fd, struct trace_ring *ring,
+		struct trace_entry *buf)
+{
+	uint64_t head, start, valid, i;
+	struct trace_file_ring fr;
+
+	head = ring->head;
+	rmb();
+
+	start = head > TRACE_RING_ENTRIES ? head - TRACE_RING_ENTRIES : 0;
+	for (i = start; i < head; i++)
+		buf[i - start] = ring->entry[i & TRACE_RING_MASK];
+
+	rmb();
+	valid = ring->head;
+	valid = valid >= TRACE_RING_ENTRIES ?
+		valid - TRACE_RING_ENTRIES + 1 : 0;
+	if (valid < start)
+		valid = start;
+	if (valid > head)
+		valid = head;
+
+	fr.cpu = ring->cpu;
+	fr.nr = head - valid;
+	fr.lost = valid;
+
+	if (trace_write(fd, &fr, sizeof(struct trace_file_ring)))
+		return -EIO;
+
+	return trace_write(fd, buf + (valid - start),
+			fr.nr * sizeof(struct trace_entry));
+}
+
+static int trace_dump(struct trace_ring *rings, int nr, char *path)
+{
+	int i, fd, ret = 0;
+	struct trace_entry *buf;
+	struct trace_file_header header;
+
+	buf = malloc(TRACE_RING_ENTRIES * sizeof(struct trace_entry));
+	if (!buf)
+		return -ENOMEM;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		free(buf);
+		return -EIO;
+	}
+
+	memset(&header, 0, sizeof(struct trace_file_header));
+	strcpy(header.magic, TRACE_FILE_MAGIC);
+	header.version = TRACE_FILE_VERSION;
+	header.freq = rings[0].freq;
+	for (i = 0; i < nr; i++) {
+		if (rings[i].head)
+			header.nr_rings++;
+	}
+
+	ret = trace_write(fd, &header, sizeof(struct trace_file_header));
+	for (i = 0; (i < nr) && !ret; i++) {
+		if (!rings[i].head)
+			continue;
+
+		ret = trace_dump_ring(fd, &rings[i], buf);
+		pr_info("cpu-%d %"PRIu64" events\n", i, rings[i].head);
+	}
+
+	close(fd);
+	free(buf);
+
+	return ret;
+}
+
+int mvm_trace(char *cmd)
+{
+	int ret, enable = 0;
+	size_t size;
+	unsigned long base;
+	struct vm vm;
+	struct trace_ring *rings;
+
+	memset(&vm, 0, sizeof(struct vm));
+	vm.vm_fd = open("/dev/mvm/mvm0", O_RDWR);
+	if (vm.vm_fd < 0) {
+		perror("/dev/mvm/mvm0");
+		return -EIO;
+	}
+
+	if (!strcmp(cmd, "on"))
+		enable = 1;
+
+	ret = vm_trace_config(&vm, enable, &base, &size);
+	close(vm.vm_fd);
+	if (ret) {
+		pr_err("config the hypervisor trace failed %d\n", ret);
+		return ret;
+	}
+
+	if (!strcmp(cmd, "on") || !strcmp(cmd, "off"))
+		return 0;
+
+	if (!base || !size) {
+		pr_err("the trace has not been enabled\n");
+		return -ENOENT;
+	}
+
+	rings = hvm_map_iomem((void *)base, size);
+	if (rings == (void *)-1) {
+		pr_err("map the trace rings failed\n");
+		return -ENOMEM;
+	}
+
+	ret = trace_dump(rings, size / sizeof(struct trace_ring), cmd);
+	munmap(rings, size);
+
+	return ret;
+}